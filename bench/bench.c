@@ -0,0 +1,425 @@
+/*
+ *  Microbenchmarks of string_pool.c, hash_table.c, hash_set.c and lex.c.
+ *
+ *      make bench
+ *      build/bench [-r REPS] [-f FILTER] [-d DATA_DIR] [-o OUT.json]
+ *                  [-b BASELINE.json] [-t PERCENT]
+ *
+ *  Each benchmark is repeated REPS times after a warm-up, the median, min,
+ *  mean and standard deviation of ns/op are reported, with bytes/op where
+ *  it means something, on stderr.  The results are written as JSON to
+ *  OUT.json or stdout (one benchmark per line, so it's easy to diff), and
+ *  compared with a previous one when -b is given: a median more than
+ *  PERCENT (or twice the relative deviation, if larger) slower counts as a
+ *  regression, and the exit status is 2 if there is any.
+ *
+ *  bench/baseline.json is a run on the machine the numbers in the commit
+ *  log come from, compare with one of your own machine:
+ *
+ *      make bench BENCH_FLAGS="-o old.json"
+ *      ... change something ...
+ *      make bench BENCH_FLAGS="-b old.json"
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define BENCH_MAX      64
+#define DEFAULT_REPS   11
+#define DEFAULT_DATA   "tests/string_pool/data"
+#define DEFAULT_THRESH 5.0
+
+typedef struct {
+    char name[64];
+    size_t ops;
+    double median, min, mean, stddev; /* ns/op */
+    double bytes;
+} bench_result;
+
+volatile uint64_t bench_sink;
+
+static bench_result g_result[BENCH_MAX];
+static int g_result_count;
+static int g_reps = DEFAULT_REPS;
+static const char *g_filter;
+static const char *g_data = DEFAULT_DATA;
+static uint64_t g_rand = 0x9e3779b97f4a7c15ull;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void bench_run(bench *b)
+{
+    int i;
+    double t, sum = 0, var = 0, ns[256];
+    bench_result *r;
+    int reps = g_reps < 256 ? g_reps : 256;
+
+    if (g_filter != NULL && strstr(b->name, g_filter) == NULL)
+        return;
+    if (g_result_count == BENCH_MAX) {
+        fprintf(stderr, "bench: too many benchmarks, %s skipped\n", b->name);
+        return;
+    }
+
+    for (i = -1; i < reps; i++) { /* -1 is the warm-up */
+        if (b->setup != NULL)
+            b->setup(b);
+        t = now_ns();
+        b->run(b);
+        t = now_ns() - t;
+        if (b->teardown != NULL)
+            b->teardown(b);
+        if (i >= 0)
+            ns[i] = t / (double)(b->ops != 0 ? b->ops : 1);
+    }
+
+    for (i = 0; i < reps; i++)
+        sum += ns[i];
+    for (i = 0; i < reps; i++)
+        var += (ns[i] - sum / reps) * (ns[i] - sum / reps);
+    qsort(ns, (size_t)reps, sizeof(ns[0]), cmp_double);
+
+    r = &g_result[g_result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", b->name);
+    r->ops = b->ops;
+    r->median = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+    r->min = ns[0];
+    r->mean = sum / reps;
+    r->stddev = reps > 1 ? sqrt(var / (reps - 1)) : 0;
+    r->bytes = b->bytes;
+
+    fprintf(stderr, "%-32s %10.2f ns/op  +-%5.1f%%  %8.2f B/op  (%zu ops)\n",
+            r->name, r->median, 100 * r->stddev / r->mean, r->bytes, r->ops);
+}
+
+/* xorshift64*, the same sequence on every run */
+uint64_t bench_rand(void)
+{
+    g_rand ^= g_rand >> 12;
+    g_rand ^= g_rand << 25;
+    g_rand ^= g_rand >> 27;
+    return g_rand * 0x2545f4914f6cdd1dull;
+}
+
+/* A random identifier of 3 to `max` - 1 characters (mostly short ones, like
+ * in C), '\0'-terminated.  Returns its length. */
+unsigned int bench_ident(char *buf, unsigned int max)
+{
+    static const char head[] = "abcdefghijklmnopqrstuvwxyz_"
+                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    static const char tail[] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+    unsigned int i, len;
+    uint64_t r = bench_rand();
+
+    len = 3 + (unsigned int)(r % 8) + (unsigned int)((r >> 8) % 8) *
+          (unsigned int)((r >> 16) % 3);
+    if (len >= max)
+        len = max - 1;
+    buf[0] = head[(r >> 24) % (sizeof(head) - 1)];
+    for (i = 1; i < len; i++) {
+        if (i % 8 == 0)
+            r = bench_rand();
+        buf[i] = tail[(r >> (i % 8 * 8)) % (sizeof(tail) - 1)];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Every identifier (one per line) of the *.txt files of the data directory,
+ * in order, loaded once */
+char **bench_corpus(unsigned int *count, unsigned int **lens)
+{
+    static char **words;
+    static unsigned int *wlens, nword, cap;
+    DIR *dir;
+    FILE *file;
+    struct dirent *de;
+    char buf[256], **names = NULL;
+    size_t len, nname = 0, i;
+
+    if (words != NULL)
+        goto done;
+
+    dir = opendir(g_data);
+    if (dir == NULL) {
+        fprintf(stderr, "bench: %s: %s\n", g_data, strerror(errno));
+        exit(1);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        len = strlen(de->d_name);
+        if (len < 4 || strcmp(de->d_name + len - 4, ".txt") != 0)
+            continue;
+        names = realloc(names, (nname + 1) * sizeof(*names));
+        if (names == NULL || (names[nname] = malloc(strlen(g_data) + len + 2))
+            == NULL) {
+            perror("bench");
+            exit(1);
+        }
+        sprintf(names[nname++], "%s/%s", g_data, de->d_name);
+    }
+    closedir(dir);
+    qsort(names, nname, sizeof(*names), cmp_name);
+
+    for (i = 0; i < nname; i++) {
+        file = fopen(names[i], "r");
+        if (file == NULL) {
+            fprintf(stderr, "bench: %s: %s\n", names[i], strerror(errno));
+            exit(1);
+        }
+        while (fgets(buf, sizeof(buf), file)) {
+            len = strcspn(buf, "\r\n");
+            if (len == 0)
+                continue;
+            if (nword == cap) {
+                cap = cap ? cap * 2 : 4096;
+                words = realloc(words, cap * sizeof(*words));
+                wlens = realloc(wlens, cap * sizeof(*wlens));
+                if (words == NULL || wlens == NULL) {
+                    perror("bench");
+                    exit(1);
+                }
+            }
+            words[nword] = strndup(buf, len);
+            wlens[nword++] = (unsigned int)len;
+        }
+        fclose(file);
+        free(names[i]);
+    }
+    free(names);
+
+    if (nword == 0) {
+        fprintf(stderr, "bench: no identifier in %s/*.txt\n", g_data);
+        exit(1);
+    }
+
+done:
+    *count = nword;
+    if (lens != NULL)
+        *lens = wlens;
+    return words;
+}
+
+static char g_vocab[4096][32];
+
+/* The product of two uniform indexes, the first identifiers are the most
+ * frequent ones */
+static const char *vocab(void)
+{
+    uint64_t r = bench_rand();
+    return g_vocab[(r % 4096) * ((r >> 32) % 4096) / 4096];
+}
+
+/* About `size` bytes of C-like code, from a vocabulary of identifiers used
+ * with a skewed frequency, ending with "\n\0" */
+char *bench_source(size_t size, size_t *len)
+{
+    char *src, *p;
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 0; i < 4096; i++)
+        bench_ident(g_vocab[i], sizeof(g_vocab[i]));
+
+    src = malloc(size + 512);
+    if (src == NULL) {
+        perror("bench");
+        exit(1);
+    }
+    p = src;
+    while (n < size) {
+        switch (bench_rand() % 8) {
+        case 0:
+            n += (size_t)sprintf(p + n, "#define %s(x, y) ((x) * (y) + %u)\n",
+                                 vocab(), (unsigned int)(bench_rand() % 1000));
+            break;
+        case 1:
+            n += (size_t)sprintf(p + n, "static int %s = 0x%x + %s * 3.5e2;"
+                                 " /* %s */\n", vocab(),
+                                 (unsigned int)bench_rand(), vocab(), vocab());
+            break;
+        case 2:
+            n += (size_t)sprintf(p + n, "    if (%s->%s >= %s && %s[%u] != 'x')"
+                                 " {\n", vocab(), vocab(), vocab(), vocab(),
+                                 (unsigned int)(bench_rand() % 64));
+            break;
+        case 3:
+            n += (size_t)sprintf(p + n, "        %s = \"%s %%d\\n\";\n    }\n",
+                                 vocab(), vocab());
+            break;
+        case 4:
+            n += (size_t)sprintf(p + n, "    %s(%s, %s, %s++); // %s\n",
+                                 vocab(), vocab(), vocab(), vocab(), vocab());
+            break;
+        default:
+            n += (size_t)sprintf(p + n, "    %s += %s << %u | %s;\n",
+                                 vocab(), vocab(),
+                                 (unsigned int)(bench_rand() % 32), vocab());
+            break;
+        }
+    }
+    p[n] = '\0';
+    *len = n;
+    return src;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void write_json(FILE *fp)
+{
+    int i;
+    bench_result *r;
+
+    fprintf(fp, "{\n  \"reps\": %d,\n  \"benchmarks\": [\n", g_reps);
+    for (i = 0; i < g_result_count; i++) {
+        r = &g_result[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"ops\": %zu, \"median_ns\": %.3f, "
+                "\"min_ns\": %.3f, \"mean_ns\": %.3f, \"stddev_ns\": %.3f, "
+                "\"bytes_per_op\": %.3f}%s\n", r->name, r->ops, r->median,
+                r->min, r->mean, r->stddev, r->bytes,
+                i + 1 < g_result_count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+/* Only reads what write_json() writes: one benchmark per line */
+static int compare(const char *path, double thresh)
+{
+    FILE *fp;
+    char line[1024], name[64], *p;
+    double base, delta, noise;
+    int i, slower = 0;
+    bench_result *r;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(stderr, "\n%-32s %10s %10s %8s\n", "vs baseline", "ns/op",
+            "base", "delta");
+    while (fgets(line, sizeof(line), fp)) {
+        if ((p = strstr(line, "\"name\": \"")) == NULL ||
+            sscanf(p + 9, "%63[^\"]", name) != 1 ||
+            (p = strstr(line, "\"median_ns\": ")) == NULL ||
+            sscanf(p + 13, "%lf", &base) != 1 || base <= 0)
+            continue;
+        for (i = 0; i < g_result_count; i++) {
+            r = &g_result[i];
+            if (strcmp(r->name, name) != 0)
+                continue;
+            delta = 100 * (r->median - base) / base;
+            noise = 200 * r->stddev / r->mean;
+            if (noise < thresh)
+                noise = thresh;
+            fprintf(stderr, "%-32s %10.2f %10.2f %+7.1f%% %s\n", name,
+                    r->median, base, delta,
+                    delta > noise ? "slower" : delta < -noise ? "faster" : "");
+            slower += delta > noise;
+        }
+    }
+    fclose(fp);
+    return slower;
+}
+
+static void usage(int exit_code)
+{
+    puts("Usage:");
+    puts("  bench [-r REPS] [-f FILTER] [-d DATA_DIR] [-o OUT.json]");
+    puts("        [-b BASELINE.json] [-t PERCENT]");
+    puts("");
+    puts("Options:");
+    puts("  -r REPS         Repetitions of each benchmark (default 11)");
+    puts("  -f FILTER       Only run the benchmarks whose name has FILTER");
+    puts("  -d DATA_DIR     Where the *.txt identifier lists are");
+    puts("                  (default " DEFAULT_DATA ")");
+    puts("  -o OUT.json     Write the results into OUT.json, not stdout");
+    puts("  -b BASELINE     Compare with the results in BASELINE");
+    puts("  -t PERCENT      Slowdown counted as a regression (default 5)");
+    exit(exit_code);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, slower = 0;
+    FILE *fp;
+    double thresh = DEFAULT_THRESH;
+    const char *out = NULL, *baseline = NULL;
+
+    while ((opt = getopt(argc, argv, "b:d:f:ho:r:t:")) != EOF) {
+        switch (opt) {
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'd':
+            g_data = optarg;
+            break;
+        case 'f':
+            g_filter = optarg;
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'r':
+            g_reps = atoi(optarg);
+            if (g_reps < 1)
+                usage(1);
+            break;
+        case 't':
+            thresh = atof(optarg);
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    bench_string_pool();
+    bench_hash_table();
+    bench_hash_set();
+    bench_lex();
+
+    if (out != NULL) {
+        fp = fopen(out, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "bench: %s: %s\n", out, strerror(errno));
+            return 1;
+        }
+        write_json(fp);
+        fclose(fp);
+    } else {
+        write_json(stdout);
+    }
+
+    if (baseline != NULL && (slower = compare(baseline, thresh)) < 0)
+        return 1;
+    return slower > 0 ? 2 : 0;
+}
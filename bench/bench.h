@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A benchmark: `run` is timed, `setup` and `teardown` (may be NULL) are not,
+ * they're called around each repetition.  `run` does `ops` operations, it
+ * may set `ops` itself when it only knows it afterwards.  `bytes` is the
+ * memory used per operation, 0 if it means nothing for this one. */
+typedef struct bench {
+    const char *name;
+    void (*setup)(struct bench *);
+    void (*run)(struct bench *);
+    void (*teardown)(struct bench *);
+    size_t ops;
+    double bytes;
+} bench;
+
+/* bench.c */
+void bench_run(bench *b);
+uint64_t bench_rand(void);
+unsigned int bench_ident(char *buf, unsigned int max);
+char **bench_corpus(unsigned int *count, unsigned int **lens);
+char *bench_source(size_t size, size_t *len);
+extern volatile uint64_t bench_sink; /* keeps results alive */
+
+/* one per module */
+void bench_string_pool(void);
+void bench_hash_table(void);
+void bench_hash_set(void);
+void bench_lex(void);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "hash_set.h"
+
+#define NMEM 100000
+
+static string_ref g_mem[NMEM * 2]; /* the second half is never inserted */
+static hset_t g_a, g_b, g_dst;
+
+static void empty(bench *b)
+{
+    (void)b;
+    hset_setup(&g_a, 16);
+}
+
+static void insert(bench *b)
+{
+    for (unsigned int i = 0; i < NMEM; i++)
+        hset_set(&g_a, g_mem[i]);
+    b->ops = NMEM;
+}
+
+static void filled(bench *b)
+{
+    empty(b);
+    insert(b);
+}
+
+/* Memory per member, a string_ref per slot */
+static void cleanup(bench *b)
+{
+    b->bytes = (double)g_a.capacity * sizeof(string_ref) / g_a.count;
+    hset_cleanup(&g_a);
+}
+
+static void find_hit(bench *b)
+{
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < NMEM; i++)
+        sum += (uint64_t)hset_find(&g_a, g_mem[i]);
+    bench_sink = sum;
+    b->ops = NMEM;
+}
+
+static void find_miss(bench *b)
+{
+    uint64_t sum = 0;
+
+    for (unsigned int i = NMEM; i < NMEM * 2; i++)
+        sum += (uint64_t)hset_find(&g_a, g_mem[i]);
+    bench_sink = sum;
+    b->ops = NMEM;
+}
+
+/* A sliding window, tombstones pile up */
+static void churn(bench *b)
+{
+    for (unsigned int i = 0; i < NMEM; i++) {
+        hset_remove(&g_a, g_mem[i]);
+        hset_set(&g_a, g_mem[NMEM + i]);
+    }
+    b->ops = NMEM * 2;
+}
+
+/* Two sets of NMEM members, half of them in both */
+static void pair(bench *b)
+{
+    (void)b;
+    hset_setup(&g_a, 16);
+    hset_setup(&g_b, 16);
+    for (unsigned int i = 0; i < NMEM; i++) {
+        hset_set(&g_a, g_mem[i]);
+        hset_set(&g_b, g_mem[NMEM / 2 + i]);
+    }
+}
+
+static void pair_cleanup(bench *b)
+{
+    b->bytes = 0;
+    hset_cleanup(&g_a);
+    hset_cleanup(&g_b);
+    hset_cleanup(&g_dst);
+}
+
+static void set_union(bench *b)
+{
+    hset_union_copy(&g_dst, &g_a, &g_b);
+    bench_sink = g_dst.count;
+    b->ops = NMEM * 2;
+}
+
+static void set_intersection(bench *b)
+{
+    hset_intersection_copy(&g_dst, &g_a, &g_b);
+    bench_sink = g_dst.count;
+    b->ops = NMEM * 2;
+}
+
+void bench_hash_set(void)
+{
+    char buf[32];
+    bench b[] = {
+        {"hash_set/insert", empty, insert, cleanup, 0, 0},
+        {"hash_set/find_hit", filled, find_hit, cleanup, 0, 0},
+        {"hash_set/find_miss", filled, find_miss, cleanup, 0, 0},
+        {"hash_set/churn", filled, churn, cleanup, 0, 0},
+        {"hash_set/union", pair, set_union, pair_cleanup, 0, 0},
+        {"hash_set/intersection", pair, set_intersection, pair_cleanup, 0, 0},
+    };
+
+    string_pool_setup();
+    for (unsigned int i = 0; i < NMEM * 2; i++) {
+        int len = snprintf(buf, sizeof(buf), "mem_%u_%x", i,
+                           (unsigned int)bench_rand());
+        g_mem[i] = string_ref_newlen(buf, (unsigned int)len);
+    }
+
+    for (size_t i = 0; i < sizeof(b) / sizeof(b[0]); i++)
+        bench_run(&b[i]);
+
+    string_pool_cleanup();
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "hash_table.h"
+
+#define NKEY 100000
+
+static string_ref g_key[NKEY * 2]; /* the second half is never inserted */
+static ht_t g_ht;
+static unsigned char g_incremental;
+
+static void empty(bench *b)
+{
+    (void)b;
+    hash_table_setup(&g_ht, 16);
+    hash_table_incremental(&g_ht, g_incremental);
+}
+
+static void insert(bench *b)
+{
+    for (unsigned int i = 0; i < NKEY; i++)
+        hash_table_insert(&g_ht, g_key[i], &g_key[i]);
+    b->ops = NKEY;
+}
+
+static void filled(bench *b)
+{
+    empty(b);
+    insert(b);
+}
+
+/* Memory per entry: a control byte, a key and a value per slot */
+static void cleanup(bench *b)
+{
+    size_t slots = g_ht.cur.capacity + g_ht.old.capacity;
+
+    b->bytes = (double)slots * (1 + sizeof(string_ref) + sizeof(void *)) /
+               g_ht.count;
+    hash_table_cleanup(&g_ht);
+}
+
+static void lookup_hit(bench *b)
+{
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < NKEY; i++)
+        sum += hash_table_lookup(&g_ht, g_key[i]) != NULL;
+    bench_sink = sum;
+    b->ops = NKEY;
+}
+
+static void lookup_miss(bench *b)
+{
+    uint64_t sum = 0;
+
+    for (unsigned int i = NKEY; i < NKEY * 2; i++)
+        sum += hash_table_lookup(&g_ht, g_key[i]) != NULL;
+    bench_sink = sum;
+    b->ops = NKEY;
+}
+
+/* A sliding window: remove the oldest key, insert a new one */
+static void churn(bench *b)
+{
+    for (unsigned int i = 0; i < NKEY; i++) {
+        hash_table_remove(&g_ht, g_key[i]);
+        hash_table_insert(&g_ht, g_key[NKEY + i], &g_key[i]);
+    }
+    b->ops = NKEY * 2;
+}
+
+void bench_hash_table(void)
+{
+    char buf[32];
+    bench b[] = {
+        {"hash_table/insert", empty, insert, cleanup, 0, 0},
+        {"hash_table/lookup_hit", filled, lookup_hit, cleanup, 0, 0},
+        {"hash_table/lookup_miss", filled, lookup_miss, cleanup, 0, 0},
+        {"hash_table/churn", filled, churn, cleanup, 0, 0},
+    };
+    bench inc = {"hash_table/insert_incremental", empty, insert, cleanup, 0, 0};
+
+    string_pool_setup();
+    for (unsigned int i = 0; i < NKEY * 2; i++) {
+        int len = snprintf(buf, sizeof(buf), "key_%u_%x", i,
+                           (unsigned int)bench_rand());
+        g_key[i] = string_ref_newlen(buf, (unsigned int)len);
+    }
+
+    for (size_t i = 0; i < sizeof(b) / sizeof(b[0]); i++)
+        bench_run(&b[i]);
+    g_incremental = 1;
+    bench_run(&inc);
+    g_incremental = 0;
+
+    string_pool_cleanup();
+}
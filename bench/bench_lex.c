@@ -0,0 +1,68 @@
+#include "cpp.h" /* first, it sets the feature macros */
+#include "bench.h"
+
+#define SOURCE_SIZE (8u << 20)
+
+static char *g_source, *g_idents;
+static size_t g_source_len, g_idents_len;
+static cpp_token_array g_ts;
+
+static void pretokenize(bench *b, const char *src, size_t len)
+{
+    cpp_token_array_setup(&g_ts, len / 4 + 16);
+    if (cpp_lex_pretokenize((const uchar *)src, 0, &g_ts) != 0) {
+        fputs("bench: lexing error\n", stderr);
+        exit(1);
+    }
+    b->ops = g_ts.n;
+    b->bytes = (double)len / g_ts.n; /* of input */
+    cpp_token_array_cleanup(&g_ts);
+}
+
+static void lex_source(bench *b)
+{
+    pretokenize(b, g_source, g_source_len);
+}
+
+static void lex_idents(bench *b)
+{
+    pretokenize(b, g_idents, g_idents_len);
+}
+
+void bench_lex(void)
+{
+    char **word;
+    unsigned int i, count, *len;
+    size_t n = 0;
+    bench b[] = {
+        {"lex/synthetic", NULL, lex_source, NULL, 0, 0},
+        {"lex/corpus", NULL, lex_idents, NULL, 0, 0},
+    };
+
+    string_pool_setup();
+    g_source = bench_source(SOURCE_SIZE, &g_source_len);
+
+    /* the identifiers of the data sets, one per line */
+    word = bench_corpus(&count, &len);
+    for (i = 0; i < count; i++)
+        n += len[i] + 1;
+    g_idents = malloc(n + 1);
+    if (g_idents == NULL) {
+        perror("bench");
+        exit(1);
+    }
+    for (i = 0, n = 0; i < count; i++) {
+        memcpy(g_idents + n, word[i], len[i]);
+        n += len[i];
+        g_idents[n++] = '\n';
+    }
+    g_idents[n] = '\0';
+    g_idents_len = n;
+
+    for (i = 0; i < sizeof(b) / sizeof(b[0]); i++)
+        bench_run(&b[i]);
+
+    free(g_idents);
+    free(g_source);
+    string_pool_cleanup();
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "string_pool.h"
+
+#define NSYNTH 200000 /* synthetic identifiers, mostly unique */
+#define NTU    2000 /* identifiers of one overlay */
+
+static char **g_word;
+static unsigned int *g_len, g_count;
+static char (*g_synth)[32];
+static unsigned int g_synth_len[NSYNTH];
+static string_ref *g_ref;
+static string_pool_stats g_before;
+
+static void fresh(bench *b)
+{
+    (void)b;
+    string_pool_cleanup();
+    string_pool_setup();
+    string_pool_stat(&g_before);
+}
+
+/* Memory per new string */
+static void grown(bench *b)
+{
+    string_pool_stats st;
+
+    string_pool_stat(&st);
+    b->bytes = st.base_count == g_before.base_count ? 0 :
+               (double)(st.base_bytes - g_before.base_bytes) /
+               (st.base_count - g_before.base_count);
+}
+
+static void intern_corpus(bench *b)
+{
+    for (unsigned int i = 0; i < g_count; i++)
+        g_ref[i] = string_ref_newlen(g_word[i], g_len[i]);
+    b->ops = g_count;
+}
+
+static void intern_synth(bench *b)
+{
+    for (unsigned int i = 0; i < NSYNTH; i++)
+        string_ref_newlen(g_synth[i], g_synth_len[i]);
+    b->ops = NSYNTH;
+}
+
+static void filled(bench *b)
+{
+    fresh(b);
+    intern_corpus(b);
+}
+
+static void ptr_len(bench *b)
+{
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < g_count; i++)
+        sum += string_ref_len(g_ref[i]) + *string_ref_ptr(g_ref[i]);
+    bench_sink = sum;
+    b->ops = g_count;
+}
+
+/* What a TU of NTU local identifiers costs, see string_pool_overlay_drop() */
+static void overlay_tu(bench *b)
+{
+    string_pool_overlay_begin();
+    for (unsigned int i = 0; i < NTU; i++)
+        string_ref_newlen(g_synth[i], g_synth_len[i]);
+    string_pool_overlay_drop();
+    b->ops = NTU;
+}
+
+void bench_string_pool(void)
+{
+    bench b[] = {
+        {"string_pool/intern_corpus", fresh, intern_corpus, grown, 0, 0},
+        {"string_pool/intern_synthetic", fresh, intern_synth, grown, 0, 0},
+        {"string_pool/lookup_hit", filled, intern_corpus, NULL, 0, 0},
+        {"string_pool/ptr_len", filled, ptr_len, NULL, 0, 0},
+        {"string_pool/overlay_tu", fresh, overlay_tu, NULL, 0, 0},
+    };
+
+    g_word = bench_corpus(&g_count, &g_len);
+    g_ref = malloc(g_count * sizeof(*g_ref));
+    g_synth = malloc(NSYNTH * sizeof(*g_synth));
+    if (g_ref == NULL || g_synth == NULL) {
+        perror("bench");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < NSYNTH; i++)
+        g_synth_len[i] = bench_ident(g_synth[i], sizeof(g_synth[i]));
+
+    for (size_t i = 0; i < sizeof(b) / sizeof(b[0]); i++)
+        bench_run(&b[i]);
+
+    string_pool_cleanup();
+    free(g_synth);
+    free(g_ref);
+}
@@ -0,0 +1,755 @@
+/*
+ *  End-to-end benchmark of the whole preprocessor, against gcc -E.
+ *
+ *      make e2e
+ *      build/e2e [-n REPS] [-w WORKLOAD] [-d DIR] [-c CPP] [-g GCC] [-s]
+ *                [-o OUT.json]
+ *
+ *  The workloads are generated into DIR (build/workloads by default), one
+ *  directory each with a main.c.  Each one is preprocessed REPS times by
+ *  `cpp main.c` (cpp_next_token()), `cpp -E main.c` (cpp_print()) and
+ *  `gcc -E main.c`, and the median wall time is reported as MB/s of input
+ *  (the bytes of every file gcc -H says it read, re-inclusions counted) and
+ *  tokens/s (the count of `cpp main.c`, for the three of them), with the
+ *  peak RSS.
+ *  With -s, one more run is made under ptrace() to count system calls,
+ *  of every process (gcc -E runs cc1).
+ *
+ *  stderr of each run goes to DIR/WORKLOAD/TOOL.err.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_REPS 5
+#define DEFAULT_DIR  "build/workloads"
+#define DEFAULT_CPP  "build/cpp"
+#define DEFAULT_GCC  "gcc"
+#define MAX_REPS     64
+
+typedef struct {
+    const char *name;
+    void (*gen)(const char *dir);
+    int huge; /* only run if asked for by -w, and not by gcc */
+} workload;
+
+typedef struct {
+    const char *tool;
+    int status; /* of the last run, as from wait() */
+    double ms; /* median */
+    long maxrss; /* KiB */
+    long syscalls; /* -1 if not counted */
+} result;
+
+static int g_reps = DEFAULT_REPS;
+static int g_trace;
+static const char *g_cpp = DEFAULT_CPP;
+static const char *g_gcc = DEFAULT_GCC;
+static char g_gcc_include[1024];
+static uint64_t g_rand = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rnd(void)
+{
+    g_rand ^= g_rand >> 12;
+    g_rand ^= g_rand << 25;
+    g_rand ^= g_rand >> 27;
+    return g_rand * 0x2545f4914f6cdd1dull;
+}
+
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fputs("e2e: ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+static FILE *create(const char *dir, const char *fmt, ...)
+{
+    FILE *fp;
+    va_list ap;
+    char name[256], path[1024];
+
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        die("%s: %s", path, strerror(errno));
+    return fp;
+}
+
+/* --- workloads ---------------------------------------------------------- */
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Every header of /usr/include that both cpp and gcc -E take on their own */
+static void gen_usr_include(const char *dir)
+{
+    DIR *d;
+    FILE *fp;
+    struct dirent *de;
+    char cmd[4096], path[1024], **names = NULL;
+    size_t i, len, n = 0, used = 0;
+
+    d = opendir("/usr/include");
+    if (d == NULL)
+        die("/usr/include: %s", strerror(errno));
+    while ((de = readdir(d)) != NULL) {
+        len = strlen(de->d_name);
+        if (len < 3 || strcmp(de->d_name + len - 2, ".h") != 0)
+            continue;
+        names = realloc(names, (n + 1) * sizeof(*names));
+        if (names == NULL || (names[n++] = strdup(de->d_name)) == NULL)
+            die("%s", strerror(errno));
+    }
+    closedir(d);
+    qsort(names, n, sizeof(*names), cmp_name);
+
+    snprintf(path, sizeof(path), "%s/one.c", dir);
+    fp = create(dir, "main.c");
+    for (i = 0; i < n; i++) {
+        FILE *one = create(dir, "one.c");
+        fprintf(one, "#include <%s>\n", names[i]);
+        fclose(one);
+        snprintf(cmd, sizeof(cmd), "%s -E -o /dev/null %s 2>/dev/null && "
+                 "%s -E -I %s %s >/dev/null 2>&1", g_gcc, path, g_cpp,
+                 g_gcc_include, path);
+        if (system(cmd) == 0) {
+            fprintf(fp, "#include <%s>\n", names[i]);
+            used++;
+        }
+        free(names[i]);
+    }
+    free(names);
+    fclose(fp);
+    remove(path);
+    fprintf(stderr, "e2e: %zu of the %zu headers of /usr/include\n", used, n);
+}
+
+/* Chains of headers, each one including the next */
+#define CHAIN_COUNT 4
+#define CHAIN_DEPTH 128
+
+static void gen_include_chain(const char *dir)
+{
+    int c, i, j;
+    FILE *fp;
+
+    for (c = 0; c < CHAIN_COUNT; c++) {
+        for (i = 0; i < CHAIN_DEPTH; i++) {
+            fp = create(dir, "chain_%d_%d.h", c, i);
+            fprintf(fp, "#define CHAIN_%d_%d(x) ((x) + %d)\n", c, i, i);
+            for (j = 0; j < 20; j++)
+                fprintf(fp, "extern int chain_%d_%d_%d(int a, long b);\n",
+                        c, i, j);
+            if (i + 1 < CHAIN_DEPTH)
+                fprintf(fp, "#include \"chain_%d_%d.h\"\n", c, i + 1);
+            fprintf(fp, "static int chain_%d_%d = CHAIN_%d_%d(%d);\n",
+                    c, i, c, i, c);
+            fclose(fp);
+        }
+    }
+
+    fp = create(dir, "main.c");
+    for (c = 0; c < CHAIN_COUNT; c++)
+        fprintf(fp, "#include \"chain_%d_0.h\"\n", c);
+    fclose(fp);
+}
+
+/* Guarded headers that include each other at random, each one those of
+ * the next layer, to keep the nesting below gcc's 200 */
+#define GUARD_COUNT  400
+#define GUARD_LAYERS 8
+#define GUARD_EDGES  8
+
+static void gen_guard_tree(const char *dir)
+{
+    int i, j, per_layer = GUARD_COUNT / GUARD_LAYERS;
+    FILE *fp;
+
+    for (i = 0; i < GUARD_COUNT; i++) {
+        int next = (i / per_layer + 1) * per_layer;
+
+        fp = create(dir, "g_%d.h", i);
+        fprintf(fp, "/* header %d */\n#ifndef G_%d_H\n#define G_%d_H\n\n",
+                i, i, i);
+        for (j = 0; next < GUARD_COUNT && j < GUARD_EDGES; j++)
+            fprintf(fp, "#include \"g_%d.h\"\n",
+                    next + (int)(rnd() % per_layer));
+        for (j = 0; j < 30; j++)
+            fprintf(fp, "struct g_%d_%d { int a; char *b[%d]; };\n", i, j,
+                    j + 1);
+        fprintf(fp, "\n#endif /* G_%d_H */\n", i);
+        fclose(fp);
+    }
+
+    fp = create(dir, "main.c");
+    for (i = 0; i < GUARD_COUNT; i++)
+        fprintf(fp, "#include \"g_%d.h\"\n", i);
+    fclose(fp);
+}
+
+/* An X-macro table, included again for every definition of X */
+#define XMACRO_ROWS 2000
+#define XMACRO_USES 40
+
+static void gen_xmacro(const char *dir)
+{
+    int i;
+    FILE *fp;
+
+    fp = create(dir, "table.def");
+    for (i = 0; i < XMACRO_ROWS; i++)
+        fprintf(fp, "X(entry_%d, %d, \"entry %d\")\n", i, i, i);
+    fclose(fp);
+
+    fp = create(dir, "main.c");
+    for (i = 0; i < XMACRO_USES; i++) {
+        switch (i % 4) {
+        case 0:
+            fprintf(fp, "enum e%d {\n#define X(a, b, c) a##_%d = b,\n", i, i);
+            break;
+        case 1:
+            fprintf(fp, "const char *s%d[] = {\n#define X(a, b, c) c,\n", i);
+            break;
+        case 2:
+            fprintf(fp, "int v%d[] = {\n#define X(a, b, c) (b) * %d + 1,\n",
+                    i, i);
+            break;
+        default:
+            fprintf(fp, "void f%d(void) {\n#define X(a, b, c) "
+                    "case b: return #a;\n", i);
+            break;
+        }
+        fprintf(fp, "#include \"table.def\"\n#undef X\n};\n");
+    }
+    fclose(fp);
+}
+
+/* Boost.PP style repetition, two dimensions, with pasting arithmetic */
+#define PP_MAX 256
+
+static void gen_pp_meta(const char *dir)
+{
+    int i, d;
+    FILE *fp;
+
+    fp = create(dir, "pp.h");
+    fprintf(fp, "#define PP_CAT(a, b) PP_CAT_I(a, b)\n"
+                "#define PP_CAT_I(a, b) a ## b\n");
+    for (i = 0; i < PP_MAX; i++)
+        fprintf(fp, "#define PP_INC_%d %d\n", i, i + 1);
+    for (d = 1; d <= 2; d++) {
+        fprintf(fp, "#define PP_REPEAT%d(n, m, d) "
+                "PP_CAT(PP_REPEAT%d_, n)(m, d)\n", d, d);
+        fprintf(fp, "#define PP_REPEAT%d_0(m, d)\n", d);
+        for (i = 1; i <= PP_MAX; i++)
+            fprintf(fp, "#define PP_REPEAT%d_%d(m, d) "
+                    "PP_REPEAT%d_%d(m, d) m(%d, d)\n", d, i, d, i - 1, i - 1);
+    }
+    fclose(fp);
+
+    fp = create(dir, "main.c");
+    fprintf(fp, "#include \"pp.h\"\n"
+                "#define CELL(j, i) + PP_CAT(PP_INC_, j) * i\n");
+    for (i = 0; i < 8; i++) {
+        fprintf(fp, "#define ROW%d(i, d) int PP_CAT(row%d_, i) = 0 "
+                "PP_REPEAT2(64, CELL, i);\n", i, i);
+        fprintf(fp, "PP_REPEAT1(%d, ROW%d, ~)\n", PP_MAX, i);
+    }
+    fclose(fp);
+}
+
+/* Long #if expressions, in #if/#elif/#else chains nested in groups that
+ * are always taken, for every one of them to be evaluated */
+#define IF_MACROS 256
+#define IF_BLOCKS 2000
+#define IF_TERMS  24
+#define IF_DEPTH  16
+
+static void gen_if_giant(const char *dir)
+{
+    int i, j, depth = 0;
+    FILE *fp;
+
+    fp = create(dir, "main.c");
+    for (i = 0; i < IF_MACROS; i++)
+        fprintf(fp, "#define A_%d %d\n", i, (int)(rnd() % 1000));
+
+    for (i = 0; i < IF_BLOCKS; i++) {
+        if (depth < IF_DEPTH && rnd() % 2) {
+            fprintf(fp, "#if defined(A_%d) && A_%d >= 0\n", i % IF_MACROS,
+                    i % IF_MACROS);
+            depth++;
+        }
+        fprintf(fp, "#if ");
+        for (j = 0; j < IF_TERMS; j++) {
+            unsigned int a = (unsigned int)(rnd() % IF_MACROS);
+            unsigned int b = (unsigned int)(rnd() % (IF_MACROS * 2));
+            fprintf(fp, "%s(A_%u * %d + %s%u > %d || !defined(A_%u))",
+                    j == 0 ? "" : j % 3 ? " && \\\n    " : " || ",
+                    a, j + 1, b < IF_MACROS ? "A_" : "", b,
+                    (int)(rnd() % 2000), b);
+        }
+        fprintf(fp, "\nint yes_%d;\n#elif A_%d %% 3 == 1\nint elif_%d;\n"
+                    "#else\nint no_%d;\n#endif\n", i, i % IF_MACROS, i, i);
+        for (; depth > 0 && rnd() % 4 == 0; depth--)
+            fprintf(fp, "#endif\n");
+    }
+    for (; depth > 0; depth--)
+        fprintf(fp, "#endif\n");
+    fclose(fp);
+}
+
+/* Pasting and stringizing in every line */
+#define PASTE_LINES 20000
+
+static void gen_paste(const char *dir)
+{
+    int i;
+    FILE *fp;
+
+    fp = create(dir, "main.c");
+    fprintf(fp, "#define CAT(a, b) CAT_I(a, b)\n"
+                "#define CAT_I(a, b) a ## b\n"
+                "#define CAT3(a, b, c) a ## b ## c\n"
+                "#define STR(x) #x\n"
+                "#define XSTR(x) STR(x)\n"
+                "#define ID(p, n) CAT3(p, _, n)\n"
+                "#define DECL(p, n) int ID(p, n) = CAT(0x, n); "
+                "const char *CAT(s_, ID(p, n)) = XSTR(ID(p, n));\n");
+    for (i = 0; i < PASTE_LINES; i++)
+        fprintf(fp, "DECL(%c%c, %x)\n", 'a' + (int)(rnd() % 26),
+                'a' + (int)(rnd() % 26), i);
+    fclose(fp);
+}
+
+/* A header of more than 4GiB, mapped and streamed through, with a line
+ * of 256MiB and then comments: __LINE__ must still be right after it and
+ * in the header that follows it */
+#define HUGE_LINE  (256L << 20)
+#define HUGE_UNIT  (1L << 20)
+#define HUGE_UNITS 4352 /* 4.25GiB */
+
+static void gen_huge(const char *dir)
+{
+    FILE *fp;
+    char *unit;
+    long i, n = 0, lines;
+    const char *item = "0x0123456789abcdef,";
+    const char *fill = " * filler, only there to be skipped over, for "
+                       "its bytes ...... \n";
+
+    fp = create(dir, "huge.h");
+    fprintf(fp, "/* more than 4GiB */\nint huge_long[] = {");
+    for (i = 0; i < HUGE_LINE / (long)strlen(item); i++)
+        fputs(item, fp);
+    fprintf(fp, "};\n#if __LINE__ != 3\n#error \"__LINE__ after a long "
+                "line\"\n#endif\n");
+    lines = 5;
+
+    unit = malloc(HUGE_UNIT);
+    if (unit == NULL)
+        die("%s", strerror(errno));
+    memcpy(unit, "/*\n", 3);
+    for (i = 3; i + 64 <= HUGE_UNIT - 3; i += 64)
+        memcpy(unit + i, fill, 64);
+    memset(unit + i, ' ', (size_t)(HUGE_UNIT - 3 - i));
+    memcpy(unit + HUGE_UNIT - 3, "*/\n", 3);
+    for (i = 0; i < HUGE_UNIT; i++)
+        n += unit[i] == '\n';
+    lines += n * HUGE_UNITS;
+    for (i = 0; i < HUGE_UNITS; i++)
+        if (fwrite(unit, 1, HUGE_UNIT, fp) != HUGE_UNIT)
+            die("huge.h: %s", strerror(errno));
+    free(unit);
+    fprintf(fp, "int huge_end = __LINE__;\n#if __LINE__ != %ld\n"
+                "#error \"__LINE__ past 4GiB\"\n#endif\n", lines + 2);
+    if (fclose(fp) != 0)
+        die("huge.h: %s", strerror(errno));
+
+    fp = create(dir, "tail.h");
+    fprintf(fp, "int tail = __LINE__;\n#if __LINE__ != 2\n"
+                "#error \"__LINE__ after huge.h\"\n#endif\n");
+    fclose(fp);
+
+    fp = create(dir, "main.c");
+    fprintf(fp, "#include \"huge.h\"\n#include \"tail.h\"\n"
+                "#if __LINE__ != 3\n#error \"__LINE__ of main.c\"\n"
+                "#endif\n");
+    fclose(fp);
+}
+
+static const workload g_workload[] = {
+    {"usr_include", gen_usr_include, 0},
+    {"include_chain", gen_include_chain, 0},
+    {"guard_tree", gen_guard_tree, 0},
+    {"xmacro", gen_xmacro, 0},
+    {"pp_meta", gen_pp_meta, 0},
+    {"if_giant", gen_if_giant, 0},
+    {"paste", gen_paste, 0},
+    {"huge", gen_huge, 1},
+};
+
+/* --- running ------------------------------------------------------------ */
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static void redirect(int fd, const char *path, int flags)
+{
+    int f = open(path, flags, 0644);
+
+    if (f == -1 || dup2(f, fd) == -1)
+        _exit(127);
+    close(f);
+}
+
+/* Follow every process and thread, count the syscall-stops: one at the
+ * entry and one at the exit of each call */
+static long trace(pid_t pid, int *status)
+{
+    int st, sig;
+    long stops = 0;
+    pid_t w;
+
+    if (waitpid(pid, &st, 0) != pid || !WIFSTOPPED(st))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, 0,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+           PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+    while ((w = waitpid(-1, &st, __WALL)) > 0) {
+        if (!WIFSTOPPED(st)) {
+            if (w == pid)
+                *status = st;
+            continue;
+        }
+        sig = WSTOPSIG(st);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP || (st >> 16) != 0) {
+            sig = 0; /* exec, new tracee or ptrace event */
+        }
+        ptrace(PTRACE_SYSCALL, w, 0, sig);
+    }
+    return (stops + 1) / 2;
+}
+
+/* Run `argv` with its stdout to `out` and stderr to `err`.  Returns the
+ * wall time in ms, fills `ru` and `status`, and counts the syscalls into
+ * `syscalls` if it's not NULL. */
+static double run(char *const argv[], const char *out, const char *err,
+                  struct rusage *ru, int *status, long *syscalls)
+{
+    pid_t pid;
+    double t = now_ms();
+
+    pid = fork();
+    if (pid == -1)
+        die("fork: %s", strerror(errno));
+    if (pid == 0) {
+        redirect(STDOUT_FILENO, out, O_WRONLY | O_CREAT | O_TRUNC);
+        redirect(STDERR_FILENO, err, O_WRONLY | O_CREAT | O_TRUNC);
+        if (syscalls != NULL) {
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+            raise(SIGSTOP);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    if (syscalls != NULL) {
+        *syscalls = trace(pid, status);
+        memset(ru, 0, sizeof(*ru));
+    } else if (wait4(pid, status, 0, ru) != pid) {
+        die("wait4: %s", strerror(errno));
+    }
+    return now_ms() - t;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(result *r, char *const argv[], const char *out,
+                    const char *err)
+{
+    int i;
+    double ms[MAX_REPS];
+    struct rusage ru;
+
+    r->maxrss = 0;
+    for (i = 0; i < g_reps; i++) {
+        ms[i] = run(argv, out, err, &ru, &r->status, NULL);
+        if (ru.ru_maxrss > r->maxrss)
+            r->maxrss = ru.ru_maxrss;
+        if (!WIFEXITED(r->status) || WEXITSTATUS(r->status) != 0)
+            break;
+    }
+    if (i < g_reps) { /* failed, the time means nothing */
+        r->ms = 0;
+        r->syscalls = -1;
+        return;
+    }
+    qsort(ms, (size_t)g_reps, sizeof(ms[0]), cmp_double);
+    r->ms = g_reps % 2 ? ms[g_reps / 2] :
+            (ms[g_reps / 2 - 1] + ms[g_reps / 2]) / 2;
+
+    r->syscalls = -1;
+    if (g_trace)
+        run(argv, out, err, &ru, &i, &r->syscalls);
+}
+
+/* Bytes of the files of `wdir`, for what gcc doesn't run */
+static long dir_bytes(const char *wdir)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat sb;
+    char path[2048];
+    long bytes = 0;
+
+    d = opendir(wdir);
+    if (d == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", wdir, de->d_name);
+        if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode) &&
+            strstr(de->d_name, ".err") == NULL &&
+            strcmp(de->d_name, "tokens.txt") != 0)
+            bytes += (long)sb.st_size;
+    }
+    closedir(d);
+    return bytes;
+}
+
+/* Bytes of main.c and of every file gcc -H lists */
+static long input_bytes(const char *main_c)
+{
+    FILE *fp;
+    char cmd[2048], line[4096], *p;
+    struct stat sb;
+    long bytes = 0;
+
+    if (stat(main_c, &sb) == 0)
+        bytes = (long)sb.st_size;
+    snprintf(cmd, sizeof(cmd), "%s -E -H -o /dev/null %s 2>&1", g_gcc,
+             main_c);
+    fp = popen(cmd, "r");
+    if (fp == NULL)
+        return bytes;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] != '.')
+            continue;
+        for (p = line; *p == '.'; p++)
+            ;
+        p[strcspn(p, "\n")] = '\0';
+        if (*p == ' ' && stat(p + 1, &sb) == 0)
+            bytes += (long)sb.st_size;
+    }
+    pclose(fp);
+    return bytes;
+}
+
+/* "total tokens: N" from `cpp main.c` */
+static unsigned long read_tokens(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    unsigned long n = 0;
+
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        sscanf(line, "total tokens: %lu", &n);
+    fclose(fp);
+    return n;
+}
+
+static void report(FILE *json, const char *name, const result *r,
+                   long bytes, unsigned long tokens, int *first)
+{
+    int ok = WIFEXITED(r->status) && WEXITSTATUS(r->status) == 0;
+    double mbs = ok ? bytes / 1e3 / r->ms : 0;
+    double mts = ok ? tokens / 1e3 / r->ms : 0;
+
+    if (ok)
+        printf("%-14s %-10s %9.2f %9.2f %9.2f %8ld %10ld\n", name, r->tool,
+               r->ms, mbs, mts, r->maxrss, r->syscalls);
+    else
+        printf("%-14s %-10s   failed (status %d), see its .err\n", name,
+               r->tool, WIFEXITED(r->status) ? WEXITSTATUS(r->status) : -1);
+
+    if (json != NULL) {
+        fprintf(json, "%s    {\"workload\": \"%s\", \"tool\": \"%s\", "
+                "\"ok\": %s, \"bytes\": %ld, \"tokens\": %lu, \"ms\": %.3f, "
+                "\"mb_per_s\": %.3f, \"mtokens_per_s\": %.3f, "
+                "\"maxrss_kib\": %ld, \"syscalls\": %ld}", *first ? "" : ",\n",
+                name, r->tool, ok ? "true" : "false", bytes, tokens, r->ms,
+                mbs, mts, r->maxrss, r->syscalls);
+        *first = 0;
+    }
+}
+
+static void usage(int exit_code)
+{
+    puts("Usage:");
+    puts("  e2e [-n REPS] [-w WORKLOAD] [-d DIR] [-c CPP] [-g GCC] [-s]");
+    puts("      [-o OUT.json]");
+    puts("");
+    puts("Options:");
+    puts("  -n REPS         Runs of each tool on each workload (default 5)");
+    puts("  -w WORKLOAD     Only this one: usr_include, include_chain,");
+    puts("                  guard_tree, xmacro, pp_meta, if_giant, paste,");
+    puts("                  or huge (4.5GiB, only this way, without gcc)");
+    puts("  -d DIR          Where the workloads go (default " DEFAULT_DIR ")");
+    puts("  -c CPP          The cpp to measure (default " DEFAULT_CPP ")");
+    puts("  -g GCC          The gcc to compare with (default " DEFAULT_GCC ")");
+    puts("  -s              Count the system calls, with ptrace()");
+    puts("  -o OUT.json     Also write the results into OUT.json");
+    exit(exit_code);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, first = 1;
+    size_t i, j;
+    FILE *json = NULL, *fp;
+    long bytes;
+    unsigned long tokens;
+    result r[3];
+    const char *only = NULL, *dir = DEFAULT_DIR, *out = NULL;
+    char wdir[1024], main_c[1100], tok[1100], err[1100];
+
+    while ((opt = getopt(argc, argv, "c:d:g:hn:o:sw:")) != EOF) {
+        switch (opt) {
+        case 'c':
+            g_cpp = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'g':
+            g_gcc = optarg;
+            break;
+        case 'n':
+            g_reps = atoi(optarg);
+            if (g_reps < 1 || g_reps > MAX_REPS)
+                usage(1);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 's':
+            g_trace = 1;
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        case 'h':
+            usage(0);
+            break;
+        default:
+            usage(1);
+            break;
+        }
+    }
+
+    /* cpp doesn't know where gcc keeps <stddef.h> and the like */
+    snprintf(wdir, sizeof(wdir), "%s -print-file-name=include", g_gcc);
+    fp = popen(wdir, "r");
+    if (fp == NULL || fgets(g_gcc_include, sizeof(g_gcc_include), fp) == NULL)
+        die("unable to run %s", g_gcc);
+    g_gcc_include[strcspn(g_gcc_include, "\n")] = '\0';
+    pclose(fp);
+
+    if (out != NULL && (json = fopen(out, "w")) == NULL)
+        die("%s: %s", out, strerror(errno));
+    if (json != NULL)
+        fprintf(json, "{\n  \"reps\": %d,\n  \"results\": [\n", g_reps);
+
+    printf("%-14s %-10s %9s %9s %9s %8s %10s\n", "workload", "tool", "ms",
+           "MB/s", "Mtok/s", "RSS KiB", "syscalls");
+
+    for (i = 0; i < sizeof(g_workload) / sizeof(g_workload[0]); i++) {
+        const workload *w = &g_workload[i];
+        size_t ntool = w->huge ? 2 : 3;
+
+        if (only != NULL ? strcmp(only, w->name) != 0 : w->huge)
+            continue;
+
+        snprintf(wdir, sizeof(wdir), "%s/%s", dir, w->name);
+        snprintf(main_c, sizeof(main_c), "%s/main.c", wdir);
+        snprintf(tok, sizeof(tok), "%s/tokens.txt", wdir);
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+            die("%s: %s", dir, strerror(errno));
+        if (mkdir(wdir, 0755) == -1 && errno != EEXIST)
+            die("%s: %s", wdir, strerror(errno));
+        fprintf(stderr, "e2e: generating %s\n", w->name);
+        w->gen(wdir);
+        bytes = w->huge ? dir_bytes(wdir) : input_bytes(main_c);
+
+        {
+            char *run_argv[] = {(char *)g_cpp, "-I", g_gcc_include, main_c,
+                                NULL};
+            char *print_argv[] = {(char *)g_cpp, "-E", "-I", g_gcc_include,
+                                  main_c, NULL};
+            char *gcc_argv[] = {(char *)g_gcc, "-E", main_c, NULL};
+            char *const *argvs[] = {run_argv, print_argv, gcc_argv};
+            const char *tools[] = {"cpp", "cpp_print", "gcc -E"};
+
+            for (j = 0; j < ntool; j++) {
+                r[j].tool = tools[j];
+                snprintf(err, sizeof(err), "%s/%s.err", wdir,
+                         j == 0 ? "cpp" : j == 1 ? "cpp_print" : "gcc");
+                measure(&r[j], argvs[j], j == 0 ? tok : "/dev/null", err);
+            }
+        }
+
+        tokens = read_tokens(tok);
+        for (j = 0; j < ntool; j++)
+            report(json, w->name, &r[j], bytes, tokens, &first);
+        if (ntool == 3 && r[1].ms > 0 && r[2].ms > 0)
+            printf("%-14s %-10s %9.2fx (%ld bytes, %lu tokens)\n", w->name,
+                   "vs gcc -E", r[2].ms / r[1].ms, bytes, tokens);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    return 0;
+}
@@ -0,0 +1,363 @@
+#include "cpp.h"
+
+/* Binary token stream, -B.
+ *
+ * What a parser needs from the preprocessor, to be mmap()-ed by it rather
+ * than lexed again:
+ *
+ *     cpp_bin_header
+ *     cpp_bin_token   x ntoken, ends with TK_eof
+ *     heap            spelling of the literals
+ *     cpp_bin_ident   x nident
+ *     cpp_bin_line    x nline
+ *     cpp_bin_file    x nfile
+ *     names           of the identifiers and the files, '\0'-terminated
+ *     cpp_bin_footer  where all of them are
+ *
+ * Every part starts 8-aligned.  The tokens are written as they come, the
+ * rest is kept until cpp_binary_finish(), so it's one pass and the output
+ * may be a pipe.  A token is 8 bytes: its kind with keywords told apart,
+ * its flags and a value, the index of the identifier (keywords included)
+ * or the offset of the literal in the heap, where it's spliced, after its
+ * length as a uint32_t and before a '\0'.  Where a token is is in the line
+ * table, which has an entry whenever the file or the line changes. */
+
+static FILE *g_fp;
+static int g_err;
+static uint64_t g_off; /* bytes written */
+static cpp_bin_token g_batch[CPP_BINARY_BATCH];
+static uint g_nbatch;
+static uint64_t g_ntoken;
+
+static uchar *g_heap;
+static size_t g_heap_size, g_heap_cap;
+
+static string_ref *g_ident;
+static size_t g_nident, g_ident_cap;
+static uint32_t *g_index[2]; /* +1, 0 if it's not in `g_ident`, per layer */
+static size_t g_index_cap[2];
+
+static cpp_bin_line *g_line;
+static size_t g_nline, g_line_cap;
+static uint g_nfile;
+static cpp_loc g_loc; /* of the last token, on line `g_lineno` */
+static uint g_lineno;
+
+static const uchar g_pad[8];
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size)
+{
+    size_t n = *cap != 0 ? *cap : 256;
+
+    while (n < need)
+        n *= 2;
+    p = cpp_mem_realloc(CPP_MEM_TOKEN, p, n * size);
+    *cap = n;
+    return p;
+}
+
+static void bin_write(const void *p, size_t len)
+{
+    if (len > 0 && fwrite(p, 1, len, g_fp) != len && g_err == 0)
+        g_err = errno != 0 ? errno : EIO;
+    g_off += len;
+}
+
+static void bin_align(void)
+{
+    bin_write(g_pad, (size_t)(-g_off & 7));
+}
+
+static void bin_flush(void)
+{
+    bin_write(g_batch, g_nbatch * sizeof(*g_batch));
+    g_nbatch = 0;
+}
+
+static uint32_t bin_ident(string_ref ref)
+{
+    uint layer = (ref & STRING_REF_OVERLAY) != 0;
+    size_t old, i = ref & ~STRING_REF_OVERLAY;
+
+    if (i >= g_index_cap[layer]) {
+        old = g_index_cap[layer];
+        g_index[layer] = grow(g_index[layer], &g_index_cap[layer], i + 1,
+                              sizeof(uint32_t));
+        memset(g_index[layer] + old, 0,
+               (g_index_cap[layer] - old) * sizeof(uint32_t));
+    }
+    if (g_index[layer][i] != 0)
+        return g_index[layer][i] - 1;
+
+    if (g_nident == g_ident_cap)
+        g_ident = grow(g_ident, &g_ident_cap, g_nident + 1, sizeof(*g_ident));
+    g_ident[g_nident] = ref;
+    g_index[layer][i] = (uint32_t)++g_nident;
+    return (uint32_t)(g_nident - 1);
+}
+
+static uint32_t bin_literal(const cpp_token *tk)
+{
+    uint32_t len, off = (uint32_t)g_heap_size;
+    size_t need = g_heap_size + sizeof(len) + tk->length + 4;
+
+    if (need > UINT32_MAX)
+        cpp_error(NULL, NULL, "too many literals for a binary token stream");
+    if (need > g_heap_cap)
+        g_heap = grow(g_heap, &g_heap_cap, need, 1);
+
+    len = cpp_token_splice(tk, g_heap + off + sizeof(len), tk->length);
+    memcpy(g_heap + off, &len, sizeof(len));
+    g_heap_size = off + sizeof(len) + len;
+    do /* '\0' and the next one 4-aligned */
+        g_heap[g_heap_size++] = 0;
+    while (g_heap_size & 3);
+    return off;
+}
+
+/* Append `ref` to the names, returns its offset */
+static uint32_t bin_name(uchar **names, size_t *size, size_t *cap,
+                         string_ref ref)
+{
+    size_t off = *size, len = string_ref_len(ref) + 1;
+
+    if (off + len > *cap)
+        *names = grow(*names, cap, off + len, 1);
+    memcpy(*names + off, string_ref_ptr(ref), len);
+    *size = off + len;
+    return (uint32_t)off;
+}
+
+/* ---- interface ---------------------------------------------------------- */
+
+void cpp_binary_setup(FILE *fp)
+{
+    cpp_bin_header h;
+
+    g_fp = fp;
+    g_err = 0;
+    g_off = 0;
+    g_nbatch = 0;
+    g_ntoken = 0;
+    g_heap_size = g_nident = g_nline = 0;
+    g_nfile = 0;
+    g_loc = CPP_LOC_NONE;
+    g_lineno = 0;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CPP_BINARY_MAGIC, sizeof(h.magic));
+    h.version = CPP_BINARY_VERSION;
+    h.byteorder = 0x01020304;
+    bin_write(&h, sizeof(h));
+}
+
+void cpp_binary_token(const cpp_token *tk)
+{
+    cpp_bin_token *bt;
+    cpp_bin_line *l;
+
+    if (unlikely(g_ntoken == UINT32_MAX))
+        cpp_error(NULL, NULL, "too many tokens for a binary token stream");
+
+    if (tk->loc != g_loc) { /* most tokens of an expansion share it */
+        g_loc = tk->loc;
+        g_lineno = cpp_loc_line(tk->loc);
+    }
+    if (g_nline == 0 || g_line[g_nline - 1].lineno != g_lineno ||
+        g_line[g_nline - 1].fileno != tk->fileno) {
+        if (g_nline == g_line_cap)
+            g_line = grow(g_line, &g_line_cap, g_nline + 1, sizeof(*g_line));
+        l = &g_line[g_nline++];
+        l->token = (uint32_t)g_ntoken;
+        l->fileno = tk->fileno;
+        l->lineno = g_lineno;
+        if (tk->fileno >= g_nfile)
+            g_nfile = tk->fileno + 1U;
+    }
+
+    bt = &g_batch[g_nbatch];
+    bt->kind = cpp_token_keyword(tk);
+    bt->flags = (uchar)tk->flags;
+    bt->reserved = 0;
+    switch (tk->kind) {
+    case TK_identifier:
+        bt->value = bin_ident(tk->p.ref);
+        break;
+    case TK_integer_const:
+    case TK_float_const:
+    case TK_char_const:
+    case TK_string:
+    case TK_number:
+        bt->value = bin_literal(tk);
+        break;
+    default:
+        bt->value = 0;
+        break;
+    }
+
+    g_ntoken++;
+    if (++g_nbatch == CPP_BINARY_BATCH)
+        bin_flush();
+}
+
+/* Write the tables and the footer after the last token (TK_eof).
+ * Returns -1 with errno if a write failed, now or before. */
+int cpp_binary_finish(void)
+{
+    uint i;
+    size_t n, names_size = 0, names_cap = 0;
+    uchar *names = NULL;
+    cpp_bin_ident id;
+    cpp_bin_file bf;
+    cpp_file *file;
+    cpp_bin_footer ft;
+
+    memset(&ft, 0, sizeof(ft));
+    bin_flush();
+    ft.token_off = sizeof(cpp_bin_header);
+    ft.ntoken = g_ntoken;
+
+    bin_align();
+    ft.heap_off = g_off;
+    ft.heap_size = g_heap_size;
+    bin_write(g_heap, g_heap_size);
+
+    bin_align();
+    ft.ident_off = g_off;
+    ft.nident = g_nident;
+    for (n = 0; n < g_nident; n++) {
+        id.length = (uint32_t)string_ref_len(g_ident[n]);
+        id.offset = bin_name(&names, &names_size, &names_cap, g_ident[n]);
+        bin_write(&id, sizeof(id));
+    }
+
+    bin_align();
+    ft.line_off = g_off;
+    ft.nline = g_nline;
+    bin_write(g_line, g_nline * sizeof(*g_line));
+
+    bin_align();
+    ft.file_off = g_off;
+    ft.nfile = g_nfile;
+    for (i = 0; i < g_nfile; i++) {
+        file = cpp_file_no((ushort)i);
+        bf.name = bin_name(&names, &names_size, &names_cap,
+                           file != NULL ? file->name : SR_NONE);
+        bf.path = bin_name(&names, &names_size, &names_cap,
+                           file != NULL ? file->path : SR_NONE);
+        bin_write(&bf, sizeof(bf));
+    }
+
+    bin_align();
+    ft.names_off = g_off;
+    ft.names_size = names_size;
+    bin_write(names, names_size);
+    cpp_mem_free(names);
+
+    bin_align();
+    memcpy(ft.magic, CPP_BINARY_MAGIC, sizeof(ft.magic));
+    bin_write(&ft, sizeof(ft));
+    if (fflush(g_fp) != 0 && g_err == 0)
+        g_err = errno;
+
+    if (g_err != 0) {
+        errno = g_err;
+        return -1;
+    }
+    return 0;
+}
+
+void cpp_binary_cleanup(void)
+{
+    cpp_mem_free(g_heap); g_heap = NULL;
+    cpp_mem_free(g_ident); g_ident = NULL;
+    cpp_mem_free(g_index[0]); g_index[0] = NULL;
+    cpp_mem_free(g_index[1]); g_index[1] = NULL;
+    cpp_mem_free(g_line); g_line = NULL;
+    g_heap_cap = g_ident_cap = g_line_cap = 0;
+    g_index_cap[0] = g_index_cap[1] = 0;
+}
+
+/* Map the binary token stream at `path` and check it, returns -1 with
+ * errno (EINVAL if it isn't one) on failure */
+int cpp_binary_map(const char *path, cpp_binary_view *v)
+{
+    int fd;
+    struct stat sb;
+    const uchar *p;
+    const cpp_bin_header *h;
+    cpp_bin_footer ft;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)sb.st_size < sizeof(*h) + sizeof(ft)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    h = (const cpp_bin_header *)p;
+    memcpy(&ft, p + sb.st_size - sizeof(ft), sizeof(ft));
+#define FITS(off, n, size) \
+    ((off) <= (uint64_t)sb.st_size && \
+     (n) <= ((uint64_t)sb.st_size - (off)) / (size))
+    if (memcmp(h->magic, CPP_BINARY_MAGIC, sizeof(h->magic)) != 0 ||
+        memcmp(ft.magic, CPP_BINARY_MAGIC, sizeof(ft.magic)) != 0 ||
+        h->version != CPP_BINARY_VERSION || h->byteorder != 0x01020304 ||
+        !FITS(ft.token_off, ft.ntoken, sizeof(cpp_bin_token)) ||
+        !FITS(ft.heap_off, ft.heap_size, 1) ||
+        !FITS(ft.ident_off, ft.nident, sizeof(cpp_bin_ident)) ||
+        !FITS(ft.line_off, ft.nline, sizeof(cpp_bin_line)) ||
+        !FITS(ft.file_off, ft.nfile, sizeof(cpp_bin_file)) ||
+        !FITS(ft.names_off, ft.names_size, 1)) {
+        munmap((void *)p, (size_t)sb.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+#undef FITS
+
+    v->map = p;
+    v->size = (size_t)sb.st_size;
+    v->tokens = (const cpp_bin_token *)(p + ft.token_off);
+    v->ntoken = ft.ntoken;
+    v->heap = p + ft.heap_off;
+    v->idents = (const cpp_bin_ident *)(p + ft.ident_off);
+    v->nident = ft.nident;
+    v->lines = (const cpp_bin_line *)(p + ft.line_off);
+    v->nline = ft.nline;
+    v->files = (const cpp_bin_file *)(p + ft.file_off);
+    v->nfile = ft.nfile;
+    v->names = (const char *)p + ft.names_off;
+    return 0;
+}
+
+void cpp_binary_unmap(cpp_binary_view *v)
+{
+    munmap((void *)v->map, v->size);
+    v->map = NULL;
+}
+
+/* Where the `i`th token is */
+const cpp_bin_line *cpp_binary_line(const cpp_binary_view *v, uint64_t i)
+{
+    size_t lo = 0, hi = v->nline, mid;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (v->lines[mid].token <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return v->nline != 0 ? &v->lines[lo] : NULL;
+}
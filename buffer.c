@@ -2,7 +2,7 @@
 
 void cpp_buffer_setup(cpp_buffer *buf, uint cap)
 {
-    uchar *data = mmap(NULL, CPP_BUFFER_MAX, PROT_READ|PROT_WRITE,
+    uchar *data = mmap(NULL, cap, PROT_READ|PROT_WRITE,
                        MAP_PRIVATE|MAP_ANON, -1, 0);
     if (unlikely(data == MAP_FAILED))
         cpp_error(NULL, NULL, "cpp_buffer fails to allocate %u bytes", cap);
@@ -15,6 +15,7 @@ void cpp_buffer_setup(cpp_buffer *buf, uint cap)
 void cpp_buffer_cleanup(cpp_buffer *buf)
 {
     if (buf->data != NULL) {
+        cpp_mem_account(CPP_MEM_SCRATCH, -(ssize_t)buf->len);
         munmap(buf->data, buf->cap);
         buf->data = NULL;
         buf->len = buf->cap = 0;
@@ -27,6 +28,7 @@ void cpp_buffer_clear(cpp_buffer *buf)
         return;
 
     memset(buf->data, 0, buf->len);
+    cpp_mem_account(CPP_MEM_SCRATCH, -(ssize_t)buf->len);
     buf->len = 0;
 }
 
@@ -40,6 +42,7 @@ const uchar *cpp_buffer_append_ch(cpp_buffer *buf, uchar ch)
         r = buf->data + buf->len;
 
     buf->data[buf->len++] = ch;
+    cpp_mem_account(CPP_MEM_SCRATCH, 1);
     return r;
 }
 
@@ -56,6 +59,7 @@ const uchar *cpp_buffer_append(cpp_buffer *buf, const uchar *p, uint psize)
 
     memcpy(buf->data + buf->len, p, psize);
     buf->len += psize;
+    cpp_mem_account(CPP_MEM_SCRATCH, (ssize_t)psize);
     return r;
 }
 
@@ -13,13 +13,16 @@
  */
 #include "cpp.h"
 
+HT_TYPED(macro_table, cpp_macro) /* ctx->macro and ctx->guarded_file */
+
 static void cpp_preprocess(cpp_context *ctx, cpp_token *tk);
-static void cpp_stream_push(cpp_context *ctx, cpp_file *file);
+static void cpp_stream_push(cpp_context *ctx, cpp_file *file, uint64_t since);
 static void cpp_stream_pop(cpp_context *ctx);
 static void builtin_macro_setup(cpp_context *ctx);
 static void predefined_macro_setup(cpp_context *ctx);
 static void macro_stack_pop(cpp_context *ctx);
 static void macro_stack_cleanup(cpp_context *ctx);
+static void arg_stream_pop(cpp_context *ctx);
 static void arg_stream_cleanup(cpp_context *ctx);
 static void cond_stack_cleanup(cpp_context *ctx);
 static void macro_free(void *p);
@@ -33,78 +36,32 @@ static void do_undef(cpp_context *ctx, cpp_token *tk);
 
 /* ------------------------------------------------------------------------ */
 
-static string_ref g_if,
-                  g_ifdef,
-                  g_ifndef,
-                  g_elif,
-                  g_else,
-                  g_define,
-                  g_include,
-                  g_endif,
-                  g_undef,
-                  g_line,
-                  g_pragma,
-                  g_error;
-
-static string_ref g__VA_ARGS__,
-                  g__FILE__,
-                  g__LINE__,
-                  g__DATE__,
-                  g__TIME__,
-                  g__BASE_FILE__,
-                  g__TIMESTAMP__,
-                  g_defined;
-
+/* Shared by the contexts of a run, only appended to before one is forked */
 static char *g_include_search_path[CPP_SEARCHPATH_MAX];
 static int g_include_search_path_count;
-static cond_expr g_cond_expr[CPP_CONDEXPR_MAX];
-static int g_cond_expr_count;
-static macro_stack_cache g_ms_cache;
-static arg_stream_cache g_as_cache;
 
 /* ------------------------------------------------------------------------ */
 
-void cpp_context_setup(cpp_context *ctx)
+static void *table_alloc(size_t size)
 {
-    string_pool_setup();
-    cpp_file_setup();
-
-    g_if = LITREF("if");
-    g_ifdef = LITREF("ifdef");
-    g_ifndef = LITREF("ifndef");
-    g_elif = LITREF("elif");
-    g_else = LITREF("else");
-    g_endif = LITREF("endif");
-    g_include = LITREF("include");
-    g_define = LITREF("define");
-    g_undef = LITREF("undef");
-    g_line = LITREF("line");
-    g_pragma = LITREF("pragma");
-    g_error = LITREF("error");
-
-    g__VA_ARGS__ = LITREF("__VA_ARGS__");
-    g__FILE__ = LITREF("__FILE__");
-    g__LINE__ = LITREF("__LINE__");
-    g__BASE_FILE__ = LITREF("__BASE_FILE__");
-    g__TIMESTAMP__ = LITREF("__TIMESTAMP__");
-    g__DATE__ = LITREF("__DATE__");
-    g__TIME__ = LITREF("__TIME__");
-    g_defined = LITREF("defined");
-
-    memset(ctx, 0, sizeof(cpp_context));
+    return cpp_mem_alloc(CPP_MEM_TABLE, size);
+}
 
+/* What a context has of its own, the rest is shared by the contexts forked
+ * from it, see cpp_context_fork() */
+static void context_setup(cpp_context *ctx)
+{
     cpp_buffer_setup(&ctx->buf, CPP_BUFFER_MAX);
+    cpp_loc_register(ctx->buf.data, ctx->buf.cap);
+    cpp_spelling_heap_setup(&ctx->spell, CPP_MEM_MACRO);
 
-    cpp_search_path_append(ctx, "/usr/include");
-    cpp_search_path_append(ctx, "/usr/local/include");
-    cpp_search_path_append(ctx, "/usr/include/x86_64-linux-gnu");
-
-    hash_table_setup(&ctx->cached_file, 16);
     hash_table_setup(&ctx->guarded_file, 32);
     hash_table_setup(&ctx->macro, 1024);
 
     cpp_token_array_setup(&ctx->temp, 4);
     cpp_token_array_setup(&ctx->line, 8);
+    ctx->cexpr = cpp_mem_calloc(CPP_MEM_SCRATCH, CPP_CONDEXPR_MAX,
+                                sizeof(cond_expr));
 
     cpp_lex_setup(ctx);
 
@@ -112,18 +69,64 @@ void cpp_context_setup(cpp_context *ctx)
     predefined_macro_setup(ctx);
 }
 
+void cpp_context_setup(cpp_context *ctx)
+{
+    cpp_context_setup2(ctx, NULL);
+}
+
+/* Like cpp_context_setup(), with every block of `ctx` and of the contexts
+ * forked from it from `a`, NULL for malloc() */
+void cpp_context_setup2(cpp_context *ctx, const cpp_allocator *a)
+{
+    memset(ctx, 0, sizeof(cpp_context));
+    cpp_mem_setup(&ctx->mem, a, NULL);
+
+    hash_table_allocator(table_alloc, cpp_mem_free);
+    string_pool_setup();
+    cpp_file_setup();
+
+    cpp_search_path_append(ctx, "/usr/include");
+    cpp_search_path_append(ctx, "/usr/local/include");
+    cpp_search_path_append(ctx, "/usr/include/x86_64-linux-gnu");
+
+    context_setup(ctx);
+}
+
+/* A context for another thread than that of `root`, to preprocess other
+ * translation units at the same time.  What `root` keeps from one unit to
+ * the next (see cpp_context_reset()) is shared rather than copied: the
+ * files, the string pool and the search path.  -D and -U are the caller's.
+ * It's set up on the thread that uses it, after cpp_file_share(), and
+ * cleaned up before `root`.  What it allocates counts for `root` too. */
+void cpp_context_fork(cpp_context *ctx, cpp_context *root)
+{
+    memset(ctx, 0, sizeof(cpp_context));
+    ctx->flags = root->flags | CPP_CONTEXT_FORKED;
+    cpp_mem_setup(&ctx->mem, NULL, &root->mem);
+    context_setup(ctx);
+}
+
 void cpp_context_cleanup(cpp_context *ctx)
 {
     int i;
+    uchar forked = HAS_FLAG(ctx->flags, CPP_CONTEXT_FORKED);
 
-    string_pool_cleanup();
-    cpp_file_cleanup();
+    if (!forked) {
+        cpp_pipeline_cleanup();
+        cpp_prefetch_cleanup();
+    }
     cpp_lex_cleanup(ctx);
 
+    /* the trace still names the files of the streams left by an error */
     while (ctx->stream != NULL) {
         cond_stack_cleanup(ctx);
         cpp_stream_pop(ctx);
     }
+    if (!forked) {
+        cpp_time_trace_finish();
+        string_pool_cleanup();
+        cpp_file_cleanup();
+    }
 
     arg_stream_cleanup(ctx);
     macro_stack_cleanup(ctx);
@@ -131,21 +134,66 @@ void cpp_context_cleanup(cpp_context *ctx)
 
     cpp_token_array_cleanup(&ctx->line);
     cpp_token_array_cleanup(&ctx->temp);
-    cpp_token_array_cleanup(&ctx->ts);
+    cpp_token_store_cleanup(&ctx->ts);
+    cpp_spelling_heap_cleanup(&ctx->spell);
 
-    hash_table_cleanup(&ctx->cached_file);
     hash_table_cleanup(&ctx->guarded_file);
     hash_table_cleanup_with_free(&ctx->macro, macro_free);
+    cpp_mem_free(ctx->cexpr);
 
-    for (i = 0; i < g_include_search_path_count; i++) {
-        free(g_include_search_path[i]);
+    for (i = 0; !forked && i < g_include_search_path_count; i++) {
+        cpp_mem_free(g_include_search_path[i]);
         g_include_search_path[i] = NULL;
     }
 
-    g_include_search_path_count = 0;
+    if (!forked)
+        g_include_search_path_count = 0;
+    cpp_mem_cleanup(&ctx->mem);
     memset(ctx, 0, sizeof(cpp_context));
 }
 
+/* Forget the translation unit that was preprocessed, for another one: the
+ * macros are back to the builtin and predefined ones (-D and -U are up to
+ * the caller), and guards are learned again as they're not defined anymore.
+ * What's kept is what doesn't depend on the macros: the files read, their
+ * pretokens and line tables, where each #include led (see cpp_file_find()),
+ * the string pool and the search path.  The peaks and the allocations of
+ * the unit are counted again, see cpp_mem_unit_stat(). */
+void cpp_context_reset(cpp_context *ctx)
+{
+    /* A caught cpp_error() didn't leave the phases it was in */
+    CPP_TIMER_LEAVE(CPP_PHASE_OTHER);
+
+    if (!HAS_FLAG(ctx->flags, CPP_CONTEXT_FORKED))
+        cpp_pipeline_cleanup();
+
+    while (ctx->stream != NULL) { /* stopped before TK_eof */
+        cond_stack_cleanup(ctx);
+        cpp_stream_pop(ctx);
+    }
+    while (ctx->argstream != NULL)
+        arg_stream_pop(ctx);
+    while (ctx->file_macro != NULL)
+        macro_stack_pop(ctx);
+
+    cpp_token_array_clear(&ctx->line);
+    cpp_token_array_clear(&ctx->temp);
+    cpp_token_store_cleanup(&ctx->ts);
+    cpp_spelling_heap_cleanup(&ctx->spell);
+
+    hash_table_clear(&ctx->guarded_file);
+    hash_table_cleanup_with_free(&ctx->macro, macro_free);
+    hash_table_setup(&ctx->macro, 1024);
+
+    /* -D, __DATE__ and what was pasted */
+    cpp_buffer_clear(&ctx->buf);
+    ctx->ppdate = ctx->pptime = NULL;
+    cpp_mem_unit_reset(ctx);
+
+    builtin_macro_setup(ctx);
+    predefined_macro_setup(ctx);
+}
+
 void cpp_search_path_append(cpp_context *ctx, const char *dirpath)
 {
     char *path;
@@ -153,67 +201,140 @@ void cpp_search_path_append(cpp_context *ctx, const char *dirpath)
     if (g_include_search_path_count == CPP_SEARCHPATH_MAX)
         cpp_error(ctx, NULL, "too many #include search paths");
 
-    path = strdup(dirpath);
-    assert(path);
+    path = cpp_mem_strdup(CPP_MEM_SCRATCH, dirpath);
     g_include_search_path[g_include_search_path_count] = path;
     g_include_search_path_count++;
 }
 
-void cpp_run(cpp_context *ctx, cpp_file *file)
+/* The `i`th directory of the search path, NULL past the last one */
+const char *cpp_search_path(int i)
 {
-    cpp_token tk;
+    return i < g_include_search_path_count ? g_include_search_path[i] : NULL;
+}
 
-    cpp_token_array_setup(&ctx->ts, 8192);
-    cpp_stream_push(ctx, file);
+/* Start preprocessing `file`, cpp_next_token() gives its tokens */
+void cpp_start(cpp_context *ctx, cpp_file *file)
+{
+    cpp_stream_push(ctx, file, 0);
+    cpp_pipeline_lex(ctx->stream);
+}
 
-    while (1) {
-        cpp_preprocess(ctx, &tk);
-        if (tk.kind == TK_eof)
-            break;
-        cpp_token_array_append(&ctx->ts, &tk);
+/* The next token of what cpp_start() began, returns 0 once it's TK_eof,
+ * again and again.  Nothing is kept, so the memory used doesn't grow with
+ * the number of tokens, but a token is valid until cpp_context_cleanup():
+ * what's pasted or stringified is spelled into cpp_context::buf. */
+int cpp_next_token(cpp_context *ctx, cpp_token *tk)
+{
+    if (unlikely(ctx->stream == NULL)) {
+        memset(tk, 0, sizeof(*tk));
+        tk->kind = TK_eof;
+        return 0;
     }
 
-    cpp_token_array_append(&ctx->ts, &tk); /* TK_eof */
+    cpp_preprocess(ctx, tk);
+    return tk->kind != TK_eof;
+}
+
+/* Every token of `file` into cpp_context::ts, ending with TK_eof */
+void cpp_run(cpp_context *ctx, cpp_file *file)
+{
+    cpp_token tk;
+
+    cpp_token_store_setup(&ctx->ts);
+    ctx->ts.copy = HAS_FLAG(ctx->flags, CPP_CONTEXT_EVICT);
+    ctx->ts.buf = ctx->buf.data;
+    ctx->ts.bufsize = ctx->buf.cap;
+    cpp_start(ctx, file);
+    while (cpp_next_token(ctx, &tk))
+        cpp_token_store_append(&ctx->ts, &tk);
+
+    cpp_token_store_append(&ctx->ts, &tk); /* TK_eof */
 }
 
 void cpp_print(cpp_context *ctx, cpp_file *file, FILE *fp)
 {
+    int ret;
+    uchar ph;
     cpp_token tk;
-    uchar first = 1;
-    cpp_stream_push(ctx, file);
+    cpp_output out;
+    cpp_start(ctx, file);
+
+    /* the output thread would still use what's evicted */
+    if (!HAS_FLAG(ctx->flags, CPP_CONTEXT_EVICT) && cpp_pipeline_output(fp)) {
+        do {
+            cpp_next_token(ctx, &tk);
+            ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+            cpp_pipeline_print(&tk);
+            CPP_TIMER_LEAVE(ph);
+        } while (tk.kind != TK_eof);
+        ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+        ret = cpp_pipeline_finish();
+        CPP_TIMER_LEAVE(ph);
+        if (ret < 0)
+            cpp_error(ctx, NULL, "unable to write output: %s", strerror(errno));
+        return;
+    }
 
-    while (1) {
-        cpp_preprocess(ctx, &tk);
-        if (tk.kind == TK_eof)
-            break;
-        if (AT_BOL(&tk) && !first)
-            fputc('\n', fp);
-        cpp_token_print(fp, &tk);
-        first = 0;
+    cpp_output_setup(&out, fp);
+    ctx->out = &out;
+    while (cpp_next_token(ctx, &tk)) {
+        ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+        cpp_output_token(&out, &tk);
+        CPP_TIMER_LEAVE(ph);
     }
 
-    if (!first)
-        fputc('\n', fp);
+    ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+    ret = cpp_output_finish(&out);
+    CPP_TIMER_LEAVE(ph);
+    ctx->out = NULL;
+    cpp_output_cleanup(&out);
+    if (ret < 0)
+        cpp_error(ctx, NULL, "unable to write output: %s", strerror(errno));
+}
+
+/* Like cpp_print(), as a binary token stream */
+void cpp_print_binary(cpp_context *ctx, cpp_file *file, FILE *fp)
+{
+    int ret;
+    uchar ph;
+    cpp_token tk;
+    cpp_start(ctx, file);
+
+    cpp_binary_setup(fp);
+    do {
+        cpp_next_token(ctx, &tk);
+        ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+        cpp_binary_token(&tk);
+        CPP_TIMER_LEAVE(ph);
+    } while (tk.kind != TK_eof);
+
+    ph = CPP_TIMER_ENTER(CPP_PHASE_OUTPUT);
+    ret = cpp_binary_finish();
+    CPP_TIMER_LEAVE(ph);
+    cpp_binary_cleanup();
+    if (ret < 0)
+        cpp_error(ctx, NULL, "unable to write output: %s", strerror(errno));
 }
 
 void cpp_dump_token(cpp_context *ctx, FILE *fp)
 {
-    uint i, len;
-    cpp_token *tk;
+    size_t i;
+    uint len;
+    cpp_token t, *tk = &t;
     uchar buf[1024];
     uchar at_bof, at_bol, has_spc;
     const char *tk_kind, *p, *file;
 
-    if (unlikely(ctx->ts.max == 0))
+    if (unlikely(ctx->ts.nchunk == 0))
         cpp_error(ctx, NULL, "please call cpp_run first before calling "
                              "cpp_dump_token");
 
     for (i = 0; i < ctx->ts.n; i++) {
-        tk = &ctx->ts.tokens[i];
+        cpp_token_store_get(&ctx->ts, i, tk);
         at_bof = HAS_FLAG(tk->flags, CPP_TOKEN_BOF);
         at_bol = HAS_FLAG(tk->flags, CPP_TOKEN_BOL);
         has_spc = HAS_FLAG(tk->flags, CPP_TOKEN_SPACE);
-        tk_kind = cpp_token_kind(tk->kind);
+        tk_kind = cpp_token_kind(cpp_token_keyword(tk));
         file = string_ref_ptr(cpp_file_no(tk->fileno)->name);
         len = tk->length;
         if (tk->kind == TK_identifier) {
@@ -228,17 +349,17 @@ void cpp_dump_token(cpp_context *ctx, FILE *fp)
                      has_spc ? 'S' : 's',
                      tk_kind,
                      len, p,
-                     file, tk->lineno);
+                     file, cpp_loc_line(tk->loc));
     }
 
-    puts("\nToken flags:");
-    puts("  'F' -- Beginning of file");
-    puts("  'f' -- Not beginning of file");
-    puts("  'L' -- Beginning of line");
-    puts("  'l' -- Not beginning of line");
-    puts("  'S' -- Token followed by whitespace");
-    puts("  's' -- Token not followed by whitespace");
-    printf("Token count: %u\n", ctx->ts.n);
+    fputs("\nToken flags:\n"
+          "  'F' -- Beginning of file\n"
+          "  'f' -- Not beginning of file\n"
+          "  'L' -- Beginning of line\n"
+          "  'l' -- Not beginning of line\n"
+          "  'S' -- Token followed by whitespace\n"
+          "  's' -- Token not followed by whitespace\n", fp);
+    fprintf(fp, "Token count: %zu\n", ctx->ts.n);
 }
 
 void cpp_macro_define(cpp_context *ctx, const char *in)
@@ -266,10 +387,15 @@ void cpp_macro_define(cpp_context *ctx, const char *in)
     cpp_buffer_append(&ctx->buf, (const uchar *)"\n\0", 2);
 
     s.flags = 0;
-    s.lineno = 1;
+    s.at = cpp_loc_of(sp, NULL); /* line 1 */
     s.pplineno_loc = s.pplineno_val = 0;
     s.fname = s.ppfname = string_ref_ptr(f->name);
     s.p = sp;
+    s.wlimit = NULL;
+    s.tok = s.resync = NULL;
+    s.piped = 0;
+    s.ntoken = s.nskipped = 0;
+    s.tbegin = 0;
     s.file = f;
     s.prev = NULL;
     s.cond = NULL;
@@ -290,10 +416,15 @@ void cpp_macro_undefine(cpp_context *ctx, const char *in)
     cpp_buffer_append(&ctx->buf, (const uchar *)"\n\0", 2);
 
     s.flags = 0;
-    s.lineno = 1;
+    s.at = cpp_loc_of(sp, NULL); /* line 1 */
     s.pplineno_loc = s.pplineno_val = 0;
     s.fname = s.ppfname = string_ref_ptr(f->name);
     s.p = sp;
+    s.wlimit = NULL;
+    s.tok = s.resync = NULL;
+    s.piped = 0;
+    s.ntoken = s.nskipped = 0;
+    s.tbegin = 0;
     s.file = f;
     s.prev = NULL;
     s.cond = NULL;
@@ -311,11 +442,12 @@ void cpp_macro_undefine(cpp_context *ctx, const char *in)
  * Can read token from the result of a macro expansion. */
 static void cpp_next(cpp_context *ctx, cpp_token *tk)
 {
+    uchar ph;
     macro_stack *ms;
 
     /* Backtrack */
     if (unlikely(ctx->temp.n != 0)) {
-        uint i;
+        size_t i;
         *tk = ctx->temp.tokens[0];
         for (i = 1; i < ctx->temp.n; i++)
             ctx->temp.tokens[i - 1] = ctx->temp.tokens[i];
@@ -348,7 +480,10 @@ static void cpp_next(cpp_context *ctx, cpp_token *tk)
             macro_stack_pop(ctx);
             ms = ctx->file_macro;
         }
+        ph = CPP_TIMER_ENTER(CPP_PHASE_LEX);
         cpp_lex_scan(ctx->stream, tk);
+        ctx->stream->ntoken++;
+        CPP_TIMER_LEAVE(ph);
     }
 }
 
@@ -361,31 +496,67 @@ static void cpp_next_nonl(cpp_context *ctx, cpp_token *tk)
 
 /* ---- diagnostic -------------------------------------------------------- */
 
+static _Thread_local jmp_buf *t_recover; /* see cpp_error_catch() */
+
+/* From now on, a fatal error on this thread longjmp()-s to `jb` instead of
+ * exiting, NULL to exit again.  The message goes to cpp_context::err then.
+ * What was left half done is up to cpp_context_reset(), some memory may be
+ * lost with it. */
+void cpp_error_catch(jmp_buf *jb)
+{
+    t_recover = jb;
+}
+
+/* Where a fatal error is reported */
+FILE *cpp_error_file(cpp_context *ctx)
+{
+    if (t_recover != NULL && ctx != NULL && ctx->err != NULL)
+        return ctx->err;
+    return stderr;
+}
+
+/* After a fatal error is reported */
+void cpp_error_exit(cpp_context *ctx)
+{
+    /* What was printed so far is kept, like the pipeline does */
+    if (ctx != NULL && ctx->out != NULL) { /* cpp_print()'s, on its stack */
+        cpp_output_flush(ctx->out);
+        cpp_output_cleanup(ctx->out);
+        ctx->out = NULL;
+    }
+    if (t_recover != NULL)
+        longjmp(*t_recover, 1);
+    if (ctx != NULL) /* NULL from where there's no context, e.g. mem.c */
+        cpp_context_cleanup(ctx);
+    exit(1);
+}
+
 void cpp_error(cpp_context *ctx, cpp_token *tk, const char *s, ...)
 {
     va_list ap;
+    FILE *fp = cpp_error_file(ctx);
     va_start(ap, s);
-    if (ctx->stream != NULL && tk != NULL)
-        fprintf(stderr, "\x1b[1;29m%s:%u:\x1b[0m ", ctx->stream->ppfname,
-                                                    get_lineno_tok(ctx, tk));
-    fprintf(stderr, "\x1b[1;31merror:\x1b[0m ");
-    vfprintf(stderr, s, ap);
-    fputc('\n', stderr);
+    if (ctx != NULL && ctx->stream != NULL && tk != NULL)
+        fprintf(fp, "\x1b[1;29m%s:%u:\x1b[0m ", ctx->stream->ppfname,
+                                                get_lineno_tok(ctx, tk));
+    fprintf(fp, "\x1b[1;31merror:\x1b[0m ");
+    vfprintf(fp, s, ap);
+    fputc('\n', fp);
     va_end(ap);
-    cpp_context_cleanup(ctx);
-    exit(1);
+    cpp_error_exit(ctx);
 }
 
 void cpp_warn(cpp_context *ctx, cpp_token *tk, const char *s, ...)
 {
     va_list ap;
+    FILE *fp = ctx != NULL && ctx->err != NULL ? ctx->err : stderr;
     va_start(ap, s);
-    if (ctx->stream != NULL && tk != NULL)
-        fprintf(stderr, "\x1b[1;29m%s:%u:\x1b[0m ", ctx->stream->ppfname,
-                                                    get_lineno_tok(ctx, tk));
-    fprintf(stderr, "\x1b[1;35mwarning:\x1b[0m ");
-    vfprintf(stderr, s, ap);
-    fputc('\n', stderr);
+    if (ctx != NULL && ctx->stream != NULL && tk != NULL)
+        fprintf(fp, "\x1b[1;29m%s:%u:\x1b[0m ", ctx->stream->ppfname,
+                                                get_lineno_tok(ctx, tk));
+    fprintf(fp, "\x1b[1;35mwarning:\x1b[0m ");
+    vfprintf(fp, s, ap);
+    fputc('\n', fp);
     va_end(ap);
 }
 
@@ -458,7 +629,7 @@ static void do_line(cpp_context *ctx, cpp_token *tk)
         cpp_error(ctx, tok, "stray token after #line");
 
 done:
-    ctx->stream->pplineno_loc = tok->lineno;
+    ctx->stream->pplineno_loc = cpp_loc_line(tok->loc);
     ctx->stream->pplineno_val = val;
     ctx->stream->ppfname = (const char *)cpp_buffer_append(&ctx->buf, fname,
                                                            len);
@@ -468,21 +639,43 @@ static uint get_lineno_tok(cpp_context *ctx, cpp_token *tk)
 {
     uint lineno, lndelta;
 
-    lndelta = tk->lineno - ctx->stream->pplineno_loc;
+    lndelta = cpp_loc_line(tk->loc) - ctx->stream->pplineno_loc;
     lineno = ctx->stream->pplineno_val + lndelta;
     return ctx->stream->pplineno_val ? lineno - 1 : lineno;
 }
 
 /* ---- #include stuff ---------------------------------------------------- */
 
-static void cpp_stream_push(cpp_context *ctx, cpp_file *file)
+/* `since` is when the #include of `file` started, for -ftime-trace */
+static void cpp_stream_push(cpp_context *ctx, cpp_file *file, uint64_t since)
 {
-    cpp_stream *s = malloc(sizeof(cpp_stream));
-    assert(s);
+    cpp_stream *s;
+
+    if (HAS_FLAG(CPP_FILE_FLAGS(file), CPP_FILE_EVICTED) &&
+        cpp_file_reload(file) != 0)
+        cpp_error(ctx, NULL, "unable to read '%s' again: %s",
+                  string_ref_ptr(file->name), strerror(errno));
+
+    s = cpp_mem_alloc(CPP_MEM_SCRATCH, sizeof(cpp_stream));
+    /* the first of the contexts that share `file` to get here */
+    if (!HAS_FLAG(CPP_FILE_FLAGS(file), CPP_FILE_SCANNED) &&
+        !HAS_FLAG(__atomic_fetch_or(&file->flags, CPP_FILE_SCANNED,
+                                    __ATOMIC_RELAXED), CPP_FILE_SCANNED))
+        cpp_prefetch_scan(file);
     s->flags = CPP_TOKEN_BOL | CPP_TOKEN_BOF;
     s->pplineno_loc = s->pplineno_val = 0;
-    s->lineno = 1;
+    s->at = CPP_LOC_NONE;
     s->p = file->data;
+    s->wlimit = HAS_FLAG(CPP_FILE_FLAGS(file), CPP_FILE_MAPPED) ? file->data
+                                                                : NULL;
+    s->tok = file->tokens;
+    s->resync = NULL;
+    s->piped = 0;
+    s->ntoken = s->nskipped = 0;
+    s->tbegin = 0;
+    if (unlikely(cpp_time_trace_on))
+        s->tbegin = cpp_time_trace_begin(file, ctx->stream ?
+                                         ctx->stream->file : NULL, since);
     s->fname = s->ppfname = string_ref_ptr(file->name);
     s->file = file;
     s->cond = NULL;
@@ -494,11 +687,33 @@ static void cpp_stream_pop(cpp_context *ctx)
 {
     if (ctx->stream != NULL) {
         cpp_stream *prev = ctx->stream->prev;
-        free(ctx->stream);
+        if (unlikely(cpp_time_trace_on))
+            cpp_time_trace_end(ctx->stream->file, ctx->stream->tbegin,
+                               ctx->stream->ntoken, ctx->stream->nskipped);
+        cpp_mem_free(ctx->stream);
         ctx->stream = prev;
     }
 }
 
+/* With CPP_CONTEXT_EVICT, the data of a header goes once it's popped, so
+ * what's resident is what the #include stack holds rather than all that was
+ * read.  Nothing else points into it by then: the macros it defined have
+ * their own spellings, see copy_macro_body(), the output is flushed and
+ * cpp_run() copied the spellings of its tokens. */
+static void evict_file(cpp_context *ctx, cpp_file *file)
+{
+    cpp_stream *s;
+
+    for (s = ctx->stream; s != NULL; s = s->prev)
+        if (s->file == file) /* still lexed, it #include-d itself */
+            return;
+
+    if (ctx->out != NULL) /* an error is reported by cpp_output_finish() */
+        cpp_output_flush(ctx->out);
+    cpp_prefetch_forget(file->data);
+    cpp_file_evict(file, ctx->ts.copy);
+}
+
 /* Merge tokens into `buf` until `end_kind` */
 static uint join_tokens(cpp_token *tk, cpp_token **end, uchar end_kind,
                         uchar *buf, uint bufsz)
@@ -518,46 +733,65 @@ static uint join_tokens(cpp_token *tk, cpp_token **end, uchar end_kind,
     return off;
 }
 
-static string_ref search_include_path(const char *name, const char *cwd,
-                                      struct stat *sb)
+/* Resolve `name` into `buf` (PATH_MAX + 1 bytes), returns 0 on success.
+ * It doesn't touch the string pool, so it's also used by prefetch.c workers. */
+int cpp_include_resolve(const char *name, const char *cwd, char *buf,
+                        struct stat *sb)
 {
     int i;
-    char buf[PATH_MAX + 1];
-    string_ref pathref = 0;
     const char *search_path;
 
     if (name[0] != '/') {
         if (cwd != NULL) { /* #include "..." */
-            snprintf(buf, sizeof(buf), "%s/%s", cwd, name);
+            snprintf(buf, PATH_MAX + 1, "%s/%s", cwd, name);
             if (stat(buf, sb) == -1) {
                 if (errno != ENOENT)
-                    goto done;
+                    return -1;
                 /* else fallthrough and try to #include <...> */
             } else {
-                pathref = string_ref_new(buf);
-                goto done;
+                return 0;
             }
         }
         /* #include <...> */
         for (i = 0; i < g_include_search_path_count; i++) {
             search_path = g_include_search_path[i];
-            snprintf(buf, sizeof(buf), "%s/%s", search_path, name);
+            snprintf(buf, PATH_MAX + 1, "%s/%s", search_path, name);
             if (stat(buf, sb) == -1) {
                 if (errno != ENOENT)
-                    goto done;
+                    return -1;
             } else {
-                pathref = string_ref_new(buf);
-                goto done;
+                return 0;
             }
         }
         errno = ENOENT;
     } else {
-        if (stat(name, sb) != -1)
-            pathref = string_ref_new(buf);
+        snprintf(buf, PATH_MAX + 1, "%s", name);
+        if (stat(buf, sb) != -1)
+            return 0;
     }
 
-done:
-    return pathref;
+    return -1;
+}
+
+static string_ref search_include_path(const char *name, const char *cwd,
+                                      struct stat *sb)
+{
+    char buf[PATH_MAX + 1];
+
+    if (cpp_include_resolve(name, cwd, buf, sb) != 0)
+        return 0;
+    return string_ref_new_keep(buf);
+}
+
+/* The key of `name` for cpp_file_resolved(), as prefetch.c keys its jobs */
+static string_ref include_key(const char *name, const char *cwd)
+{
+    int len;
+    char key[2 * PATH_MAX + 2];
+
+    len = snprintf(key, sizeof(key), "%s\t%s", cwd != NULL ? cwd : "", name);
+    return string_ref_newlen_keep(key,
+                                  (uint)MIN((size_t)len, sizeof(key) - 1));
 }
 
 static const char *do_include2(cpp_context *ctx, cpp_token *tk, uchar *buf,
@@ -598,13 +832,16 @@ static const char *do_include2(cpp_context *ctx, cpp_token *tk, uchar *buf,
 static void do_include(cpp_context *ctx, cpp_token *tk)
 {
     uint len;
+    uchar ph;
+    uint64_t since;
     cpp_macro *m;
-    cpp_file *file;
+    cpp_file *file, *found;
     cpp_token pathtk;
     uchar is_sys = 0;
     struct stat sb = {0};
+    cpp_prefetched pf = {0};
     uchar buf[PATH_MAX + 1];
-    string_ref pathref, nameref;
+    string_ref pathref, nameref, keyref;
     const char *cwd = NULL, *name = (const char *)buf;
 
     cpp_next(ctx, tk);
@@ -634,34 +871,72 @@ static void do_include(cpp_context *ctx, cpp_token *tk)
     else if (len == 0)
         cpp_error(ctx, &pathtk, "empty filename");
 
-    pathref = search_include_path(name, cwd, &sb);
-    if (pathref == 0)
-        cpp_error(ctx, &pathtk, "unable to open '%s': %s", name,
-                  strerror(errno));
+    ph = CPP_TIMER_ENTER(CPP_PHASE_INCLUDE);
+    since = unlikely(cpp_time_trace_on) ? cpp_timer_now() : 0;
+    keyref = include_key(name, cwd);
+    found = cpp_file_resolved(keyref);
+    if (found != NULL) { /* what the guard check below compares */
+        pathref = found->path;
+        sb.st_size = (off_t)found->size;
+        sb.st_dev = found->devid;
+        sb.st_ino = found->inode;
+        sb.st_mtim = found->mtime;
+    } else if (cpp_prefetch_take(name, cwd, &pf)) {
+        if (pf.path == NULL)
+            cpp_error(ctx, &pathtk, "unable to open '%s': %s", name,
+                      strerror(pf.err));
+        pathref = string_ref_new_keep(pf.path);
+        sb = pf.sb;
+    } else {
+        pathref = search_include_path(name, cwd, &sb);
+        if (pathref == 0)
+            cpp_error(ctx, &pathtk, "unable to open '%s': %s", name,
+                      strerror(errno));
+    }
 
     if (is_sys)
         name = string_ref_ptr(pathref);
 
-    m = hash_table_lookup(&ctx->guarded_file, pathref);
+    m = macro_table_lookup(&ctx->guarded_file, pathref);
     if (m != NULL && HAS_FLAG(m->flags, CPP_MACRO_GUARD)) {
         file = cpp_file_no(m->fileno);
-        if (file != NULL &&
-            (uint)sb.st_size == file->size &&
-            (uint)sb.st_dev == file->devid &&
-            (uint)sb.st_ino == file->inode)
+        if (file != NULL && cpp_file_same(file, &sb)) {
+            cpp_file_resolve(keyref, file);
+            cpp_mem_free(pf.data);
+            cpp_mem_free(pf.tokens);
+            if (unlikely(cpp_time_trace_on))
+                cpp_time_trace_guard(file, ctx->stream->file, since);
+            CPP_TIMER_LEAVE(ph);
             return;
+        }
     }
 
-    file = hash_table_lookup(&ctx->cached_file, pathref);
+    file = found;
+    if (file == NULL) /* no more cpp_file_open2() for another path to it */
+        file = cpp_file_find(pathref);
     if (file == NULL) {
-        nameref = string_ref_new(name);
-        file = cpp_file_open2(pathref, nameref, &sb);
+        nameref = string_ref_new_keep(name);
+        if (pf.data != NULL) {
+            file = cpp_file_adopt(pathref, nameref, &sb, pf.data, pf.size,
+                                  pf.tokens);
+            pf.data = NULL;
+            pf.tokens = NULL;
+        } else {
+            file = cpp_file_open2(pathref, nameref, &sb);
+        }
         if (file == NULL)
             cpp_error(ctx, &pathtk, "unable to open '%s': %s", name,
                       strerror(errno));
     }
+    if (is_sys && !HAS_FLAG(CPP_FILE_FLAGS(file), CPP_FILE_SYSTEM))
+        __atomic_or_fetch(&file->flags, CPP_FILE_SYSTEM, __ATOMIC_RELAXED);
+    if (found == NULL)
+        cpp_file_resolve(keyref, file);
 
-    cpp_stream_push(ctx, file);
+    cpp_mem_free(pf.data);
+    cpp_mem_free(pf.tokens);
+    cpp_stream_push(ctx, file, since);
+    CPP_TIMER_LEAVE(ph);
     return;
 
 include_error:
@@ -672,8 +947,7 @@ include_error:
 
 static void cond_stack_push(cpp_context *ctx, cpp_token tk)
 {
-    cond_stack *cs = malloc(sizeof(cond_stack));
-    assert(cs);
+    cond_stack *cs = cpp_mem_alloc(CPP_MEM_SCRATCH, sizeof(cond_stack));
     cs->flags = 0;
     cs->guard_name = 0;
     cs->token = tk;
@@ -685,7 +959,7 @@ static void cond_stack_pop(cpp_context *ctx)
 {
     if (ctx->stream->cond != NULL) {
         cond_stack *prev = ctx->stream->cond->prev;
-        free(ctx->stream->cond);
+        cpp_mem_free(ctx->stream->cond);
         ctx->stream->cond = prev;
     }
 }
@@ -694,7 +968,7 @@ static void cond_stack_cleanup(cpp_context *ctx)
 {
     while (ctx->stream->cond != NULL) {
         cond_stack *prev = ctx->stream->cond->prev;
-        free(ctx->stream->cond);
+        cpp_mem_free(ctx->stream->cond);
         ctx->stream->cond = prev;
     }
 }
@@ -723,6 +997,8 @@ static void cond_stack_skip(cpp_context *ctx, cpp_token *tk)
     int nested = 0;
     cpp_token hash;
     string_ref dkind;
+    size_t ntoken = ctx->stream->ntoken;
+    uchar ph = CPP_TIMER_ENTER(CPP_PHASE_COND);
 
     while (tk->kind != TK_eof) {
         if (AT_BOL(tk) && tk->kind == '#') {
@@ -736,15 +1012,17 @@ static void cond_stack_skip(cpp_context *ctx, cpp_token *tk)
                 continue;
             }
             dkind = tk->p.ref;
-            if (nested == 0 && (dkind == g_else || dkind == g_elif ||
-                                dkind == g_endif)) {
+            if (nested == 0 && (dkind == SR_else || dkind == SR_elif ||
+                                dkind == SR_endif)) {
                 cpp_token_array_append(&ctx->temp, &hash);
                 cpp_token_array_append(&ctx->temp, tk);
+                ctx->stream->nskipped += ctx->stream->ntoken - ntoken;
+                CPP_TIMER_LEAVE(ph);
                 return;
-            } else if (dkind == g_if || dkind == g_ifdef ||
-                       dkind == g_ifndef) {
+            } else if (dkind == SR_if || dkind == SR_ifdef ||
+                       dkind == SR_ifndef) {
                 nested++;
-            } else if (dkind == g_endif) {
+            } else if (dkind == SR_endif) {
                 nested--;
             }
         }
@@ -753,25 +1031,27 @@ static void cond_stack_skip(cpp_context *ctx, cpp_token *tk)
 
     if (nested)
         cpp_error(ctx, tk, "unterminated conditional directive");
+    ctx->stream->nskipped += ctx->stream->ntoken - ntoken;
+    CPP_TIMER_LEAVE(ph);
 }
 
 static cond_expr *cond_expr_new(cpp_context *ctx, cpp_token tk)
 {
     cond_expr *ce;
 
-    if (unlikely(g_cond_expr_count == CPP_CONDEXPR_MAX))
+    if (unlikely(ctx->ncexpr == CPP_CONDEXPR_MAX))
         cpp_error(ctx, &tk, "too many ast nodes in a #if/#elif expression");
 
-    ce = &g_cond_expr[g_cond_expr_count];
-    g_cond_expr_count++;
+    ce = &ctx->cexpr[ctx->ncexpr];
+    ctx->ncexpr++;
     return ce;
 }
 
-static void cond_expr_clear(void)
+static void cond_expr_clear(cpp_context *ctx)
 {
-    if (g_cond_expr_count > 0) {
-        memset(g_cond_expr, 0, g_cond_expr_count * sizeof(cond_expr));
-        g_cond_expr_count = 0;
+    if (ctx->ncexpr > 0) {
+        memset(ctx->cexpr, 0, ctx->ncexpr * sizeof(cond_expr));
+        ctx->ncexpr = 0;
     }
 }
 
@@ -1231,6 +1511,7 @@ static uchar cond_expr_eval(cpp_context *ctx, cpp_token *tk)
     cond_expr *ce;
     cond_expr_value v;
     cpp_token *end, *tok;
+    uchar ph = CPP_TIMER_ENTER(CPP_PHASE_COND);
 
     tok = expand_line(ctx, tk, /* is_expr = */ 1);
     ce = cond_expr_parse(ctx, tok, &end, 0);
@@ -1240,7 +1521,8 @@ static uchar cond_expr_eval(cpp_context *ctx, cpp_token *tk)
         cpp_error(ctx, end, "stray token after #if/#elif");
 
     v = cond_expr_eval2(ctx, ce);
-    cond_expr_clear();
+    cond_expr_clear(ctx);
+    CPP_TIMER_LEAVE(ph);
     return (!v.is_unsigned && v.v.s) || v.v.u;
 }
 
@@ -1273,7 +1555,7 @@ static void do_ifdef(cpp_context *ctx, cpp_token *tk)
         cpp_error(ctx, tk, "no macro name given in #ifdef");
 
     name = tk->p.ref;
-    included = hash_table_lookup(&ctx->macro, name) != NULL;
+    included = macro_table_lookup(&ctx->macro, name) != NULL;
     cond_stack_push(ctx, ifdeftk);
 
     cpp_next(ctx, tk);
@@ -1302,7 +1584,7 @@ static void do_ifndef(cpp_context *ctx, cpp_token *tk, cpp_token hash)
         cpp_error(ctx, tk, "no macro name given in #ifndef");
 
     name = tk->p.ref;
-    included = hash_table_lookup(&ctx->macro, name) == NULL;
+    included = macro_table_lookup(&ctx->macro, name) == NULL;
     cond_stack_push(ctx, ifndeftk);
 
     cpp_next(ctx, tk);
@@ -1328,7 +1610,7 @@ static void do_ifndef(cpp_context *ctx, cpp_token *tk, cpp_token hash)
             goto putback;
         }
         dkind = tk->p.ref;
-        if (dkind != g_define) {
+        if (dkind != SR_define) {
             cpp_token_array_append(&ctx->temp, &hash);
             goto putback;
         }
@@ -1427,11 +1709,11 @@ static void do_endif(cpp_context *ctx, cpp_token *tk)
         guard_name = ctx->stream->cond->guard_name;
         if (ctx->stream->cond->prev == NULL
             && HAS_FLAG(ctx->stream->cond->flags, CPP_COND_GUARD)) {
-            m = hash_table_lookup(&ctx->macro, guard_name);
+            m = macro_table_lookup(&ctx->macro, guard_name);
             if (m != NULL) {
                 pathref = ctx->stream->file->path;
                 m->flags |= CPP_MACRO_GUARD;
-                hash_table_insert(&ctx->guarded_file, pathref, m);
+                macro_table_insert(&ctx->guarded_file, pathref, m);
             }
         }
     }
@@ -1444,7 +1726,7 @@ static void do_endif(cpp_context *ctx, cpp_token *tk)
 
 #define ADD_BUILTIN(name) do {                              \
         m = macro_new(name, CPP_MACRO_BUILTIN, 0, dummy);   \
-        hash_table_insert(&ctx->macro, name, m);            \
+        macro_table_insert(&ctx->macro, name, m);            \
     } while (0)
 
 #define ADD_PREDEF(p) cpp_macro_define(ctx, p)
@@ -1457,13 +1739,13 @@ static void builtin_macro_setup(cpp_context *ctx)
 {
     cpp_macro *m;
 
-    ADD_BUILTIN(g__FILE__);
-    ADD_BUILTIN(g__LINE__);
-    ADD_BUILTIN(g__BASE_FILE__);
-    ADD_BUILTIN(g__TIMESTAMP__);
-    ADD_BUILTIN(g__DATE__);
-    ADD_BUILTIN(g__TIME__);
-    ADD_BUILTIN(g_defined);
+    ADD_BUILTIN(SR___FILE__);
+    ADD_BUILTIN(SR___LINE__);
+    ADD_BUILTIN(SR___BASE_FILE__);
+    ADD_BUILTIN(SR___TIMESTAMP__);
+    ADD_BUILTIN(SR___DATE__);
+    ADD_BUILTIN(SR___TIME__);
+    ADD_BUILTIN(SR_defined);
 }
 
 static void predefined_macro_setup(cpp_context *ctx)
@@ -1506,14 +1788,12 @@ static void macro_stack_push(cpp_context *ctx, string_ref name)
 {
     macro_stack *ms;
 
-    if (g_ms_cache.head != NULL) {
-        ms = g_ms_cache.head;
-        g_ms_cache.head = ms->prev;
+    if (ctx->ms_cache.head != NULL) {
+        ms = ctx->ms_cache.head;
+        ctx->ms_cache.head = ms->prev;
         cpp_token_array_clear(&ms->tok);
     } else {
-        ms = malloc(sizeof(macro_stack));
-        if (unlikely(ms == NULL))
-            cpp_error(ctx, NULL, "macro_stack fails to allocate memory");
+        ms = cpp_mem_alloc(CPP_MEM_MACRO, sizeof(macro_stack));
         cpp_token_array_setup(&ms->tok, 8);
     }
 
@@ -1545,11 +1825,11 @@ static void macro_stack_pop(cpp_context *ctx)
 
     if (next_cache != NULL) {
         next_cache->prev = NULL;
-        if (g_ms_cache.head == NULL)
-            g_ms_cache.head = next_cache;
+        if (ctx->ms_cache.head == NULL)
+            ctx->ms_cache.head = next_cache;
         else
-            g_ms_cache.tail->prev = next_cache;
-        g_ms_cache.tail = next_cache;
+            ctx->ms_cache.tail->prev = next_cache;
+        ctx->ms_cache.tail = next_cache;
     }
 }
 
@@ -1557,13 +1837,11 @@ static void macro_stack_cleanup(cpp_context *ctx)
 {
     macro_stack *prev;
 
-    (void)ctx;
-
-    while (g_ms_cache.head != NULL) {
-        prev = g_ms_cache.head->prev;
-        cpp_token_array_cleanup(&g_ms_cache.head->tok);
-        free(g_ms_cache.head);
-        g_ms_cache.head = prev;
+    while (ctx->ms_cache.head != NULL) {
+        prev = ctx->ms_cache.head->prev;
+        cpp_token_array_cleanup(&ctx->ms_cache.head->tok);
+        cpp_mem_free(ctx->ms_cache.head);
+        ctx->ms_cache.head = prev;
     }
 }
 
@@ -1571,13 +1849,11 @@ static void arg_stream_push(cpp_context *ctx, cpp_macro_arg *arg)
 {
     arg_stream *args;
 
-    if (g_as_cache.head != NULL) {
-        args = g_as_cache.head;
-        g_as_cache.head = args->prev;
+    if (ctx->as_cache.head != NULL) {
+        args = ctx->as_cache.head;
+        ctx->as_cache.head = args->prev;
     } else {
-        args = malloc(sizeof(arg_stream));
-        if (unlikely(args == NULL))
-            cpp_error(ctx, NULL, "arg_stream fails to allocate memory");
+        args = cpp_mem_alloc(CPP_MEM_MACRO, sizeof(arg_stream));
     }
 
     args->p = arg->body.tokens;
@@ -1599,11 +1875,11 @@ static void arg_stream_pop(cpp_context *ctx)
             ms = ctx->argstream->macro;
         }
         ctx->argstream->prev = NULL;
-        if (g_as_cache.head == NULL)
-            g_as_cache.head = ctx->argstream;
+        if (ctx->as_cache.head == NULL)
+            ctx->as_cache.head = ctx->argstream;
         else
-            g_as_cache.tail->prev = ctx->argstream;
-        g_as_cache.tail = ctx->argstream;
+            ctx->as_cache.tail->prev = ctx->argstream;
+        ctx->as_cache.tail = ctx->argstream;
         ctx->argstream = prev;
     }
 }
@@ -1612,20 +1888,17 @@ static void arg_stream_cleanup(cpp_context *ctx)
 {
     arg_stream *prev;
 
-    (void)ctx;
-
-    while (g_as_cache.head != NULL) {
-        prev = g_as_cache.head->prev;
-        free(g_as_cache.head);
-        g_as_cache.head = prev;
+    while (ctx->as_cache.head != NULL) {
+        prev = ctx->as_cache.head->prev;
+        cpp_mem_free(ctx->as_cache.head);
+        ctx->as_cache.head = prev;
     }
 }
 
 static cpp_macro *macro_new(string_ref name, uchar flags, ushort fileno,
                             cpp_token_array body)
 {
-    cpp_macro *m = calloc(1, sizeof(cpp_macro));
-    assert(m);
+    cpp_macro *m = cpp_mem_calloc(CPP_MEM_MACRO, 1, sizeof(cpp_macro));
     m->name = name;
     m->fileno = fileno;
     m->flags = flags;
@@ -1637,17 +1910,16 @@ static void macro_free(void *p)
 {
     cpp_macro *m = (cpp_macro *)p;
     if (m->param != NULL)
-        free(m->param);
+        cpp_mem_free(m->param);
     if (m->body.tokens != NULL)
         cpp_token_array_cleanup(&m->body);
-    free(m);
+    cpp_mem_free(m);
 }
 
 static cpp_macro_arg *macro_arg_new(string_ref param)
 {
-    cpp_macro_arg *arg = malloc(sizeof(cpp_macro_arg));
-    assert(arg);
-    arg->flags = param == g__VA_ARGS__ ? CPP_MACRO_VA_ARG : 0;
+    cpp_macro_arg *arg = cpp_mem_alloc(CPP_MEM_MACRO, sizeof(cpp_macro_arg));
+    arg->flags = param == SR_VA_ARGS ? CPP_MACRO_VA_ARG : 0;
     arg->param = param;
     cpp_token_array_setup(&arg->body, 4);
     return arg;
@@ -1657,7 +1929,7 @@ static void macro_arg_free(void *p)
 {
     cpp_macro_arg *arg = (cpp_macro_arg *)p;
     cpp_token_array_cleanup(&arg->body);
-    free(arg);
+    cpp_mem_free(arg);
 }
 
 static uchar find_param(string_ref *param, uint n_param, cpp_token *tk)
@@ -1693,20 +1965,20 @@ static void parse_macro_body(cpp_context *ctx, cpp_token *tk,
             cpp_token_array_append(body, tk); /* append # */
             cpp_next(ctx, tk);
             if (!find_param(param, n_param, tk)) {
-                free(param);
+                cpp_mem_free(param);
                 cpp_token_array_cleanup(body);
                 cpp_error(ctx, tk, "%s", e1);
             }
         } else if (tk->kind == TK_paste) {
             if (body->n == 0) {
-                free(param);
+                cpp_mem_free(param);
                 cpp_token_array_cleanup(body);
                 cpp_error(ctx, tk, "%s", e2);
             }
             cpp_token_array_append(body, tk); /* append ## */
             cpp_next(ctx, tk);
             if (tk->kind == '\n' || tk->kind == TK_eof) {
-                free(param);
+                cpp_mem_free(param);
                 cpp_token_array_cleanup(body);
                 cpp_error(ctx, tk, "%s", e3);
             }
@@ -1733,33 +2005,26 @@ static uint parse_macro_param(cpp_context *ctx, cpp_token *tk,
     while (tk->kind != ')') {
         if (!first) {
             if (tk->kind != ',') {
-                free(p);
+                cpp_mem_free(p);
                 cpp_error(ctx, tk, "expected ',' or ')'");
             }
             cpp_next(ctx, tk);
         }
         if (n == cap) {
-            if (cap != 0) {
-                cap *= 2;
-                p = realloc(p, cap * sizeof(string_ref));
-                assert(p);
-            } else {
-                cap = 4;
-                p = malloc(cap * sizeof(string_ref));
-                assert(p);
-            }
+            cap = cap != 0 ? cap * 2 : 4;
+            p = cpp_mem_realloc(CPP_MEM_MACRO, p, cap * sizeof(string_ref));
         }
         if (tk->kind == TK_elipsis) {
-            p[n++] = g__VA_ARGS__;
+            p[n++] = SR_VA_ARGS;
             cpp_next(ctx, tk);
             if (tk->kind != ')') {
-                free(p);
+                cpp_mem_free(p);
                 cpp_error(ctx, tk, "expected ')'");
             }
             break;
         }
         if (tk->kind != TK_identifier) {
-            free(p);
+            cpp_mem_free(p);
             cpp_error(ctx, tk, "expected parameter name");
         }
         p[n++] = tk->p.ref;
@@ -1784,7 +2049,7 @@ static void parse_macro_arg(cpp_context *ctx, string_ref param, ht_t *args,
     while (1) {
         if (paren == 0 && tk->kind == ')') {
             break;
-        } else if (paren == 0 && param != g__VA_ARGS__ && tk->kind == ',') {
+        } else if (paren == 0 && param != SR_VA_ARGS && tk->kind == ',') {
             break;
         } else if (tk->kind == TK_eof) {
             hash_table_cleanup_with_free(args, macro_arg_free);
@@ -1823,7 +2088,7 @@ static void collect_args(cpp_context *ctx, cpp_macro *m, cpp_token *tk,
     while (i < n_param) {
         if (!first) {
             if (tk->kind != ',') {
-                if (param[i] == g__VA_ARGS__ && tk->kind == ')') {
+                if (param[i] == SR_VA_ARGS && tk->kind == ')') {
                     empty_va_arg = 1;
                     break;
                 }
@@ -1838,11 +2103,11 @@ static void collect_args(cpp_context *ctx, cpp_macro *m, cpp_token *tk,
     }
 
     if (empty_va_arg) {
-        cpp_macro_arg *arg = macro_arg_new(g__VA_ARGS__);
+        cpp_macro_arg *arg = macro_arg_new(SR_VA_ARGS);
         tk->kind = TK_eof; tk->length = 0;
         cpp_token_array_append(&arg->body, tk);
         tk->kind = ')'; tk->length = 1;
-        hash_table_insert(args, g__VA_ARGS__, arg);
+        hash_table_insert(args, SR_VA_ARGS, arg);
     } else if (tk->kind != ')') {
         hash_table_cleanup_with_free(args, macro_arg_free);
         cpp_error(ctx, tk, "too many arguments for macro '%s'",
@@ -1866,19 +2131,19 @@ static void expand_builtin(cpp_context *ctx, string_ref name,
     string_ref defined_op;
     uchar dt = 0, paren = 0, defined_res;
 
-    if (name == g__FILE__) {
+    if (name == SR___FILE__) {
         len = snprintf(buf, sizeof(buf), "\"%s\"", ctx->stream->ppfname);
         macro_tk->kind = TK_string;
-    } else if (name == g__LINE__) {
+    } else if (name == SR___LINE__) {
         len = snprintf(buf, sizeof(buf), "%u", get_lineno_tok(ctx, macro_tk));
         macro_tk->kind = TK_number;
-    } else if (name == g__BASE_FILE__) {
+    } else if (name == SR___BASE_FILE__) {
         cpp_stream *s = ctx->stream;
         while (s->prev)
             s = s->prev;
         len = snprintf(buf, sizeof(buf), "\"%s\"", s->fname);
         macro_tk->kind = TK_string;
-    } else if (name == g__TIMESTAMP__) {
+    } else if (name == SR___TIMESTAMP__) {
         if (stat(ctx->stream->fname, &sb) != 0) {
             snprintf(buf, sizeof(buf), "\"??? ??? ?? ??:??:?? ????\"");
         } else {
@@ -1888,7 +2153,7 @@ static void expand_builtin(cpp_context *ctx, string_ref name,
         }
         len = 26;
         macro_tk->kind = TK_string;
-    } else if (name == g__DATE__) {
+    } else if (name == SR___DATE__) {
         if (ctx->ppdate == NULL) {
             now = time(NULL);
             tm = localtime(&now);
@@ -1904,7 +2169,7 @@ static void expand_builtin(cpp_context *ctx, string_ref name,
         dt = 1;
         macro_tk->p.ptr = ctx->ppdate;
         macro_tk->kind = TK_string;
-    } else if (name == g__TIME__) {
+    } else if (name == SR___TIME__) {
         if (ctx->pptime == NULL) {
             now = time(NULL);
             tm = localtime(&now);
@@ -1920,7 +2185,7 @@ static void expand_builtin(cpp_context *ctx, string_ref name,
         dt = 1;
         macro_tk->p.ptr = ctx->pptime;
         macro_tk->kind = TK_string;
-    } else if (name == g_defined) {
+    } else if (name == SR_defined) {
         if (!is_expr)
             return;
         cpp_next(ctx, macro_tk);
@@ -1939,8 +2204,8 @@ static void expand_builtin(cpp_context *ctx, string_ref name,
          *      OK
          *      #endif
          * will print 'OK' and this is incorrect. */
-        defined_res = (defined_op != g_defined) &&
-                      (hash_table_lookup(&ctx->macro, defined_op) != NULL);
+        defined_res = (defined_op != SR_defined) &&
+                      (macro_table_lookup(&ctx->macro, defined_op) != NULL);
         if (paren) {
             cpp_next(ctx, macro_tk);
             if (macro_tk->kind != ')')
@@ -1984,7 +2249,7 @@ static cpp_token *expand_line(cpp_context *ctx, cpp_token *tk, uchar is_expr)
 }
 
 static void stringize(cpp_context *ctx, cpp_token_array *os, cpp_token *arg_tk,
-                      cpp_token_array *_is)
+                      cpp_token_array *_is, cpp_token *macro_tk)
 {
     uint i, len;
     cpp_token tmp;
@@ -2013,13 +2278,16 @@ static void stringize(cpp_context *ctx, cpp_token_array *os, cpp_token *arg_tk,
     cpp_buffer_append_ch(&ctx->buf, '"');
 
     stream.flags = arg_tk->flags & CPP_TOKEN_SPACE;
-    stream.lineno = ctx->stream->lineno;
+    stream.at = macro_tk->loc;
     stream.pplineno_loc = ctx->stream->pplineno_loc;
     stream.pplineno_val = ctx->stream->pplineno_val;
     stream.fname = ctx->stream->fname;
     stream.ppfname = ctx->stream->ppfname;
     stream.file = ctx->stream->file;
     stream.p = p;
+    stream.wlimit = NULL;
+    stream.tok = stream.resync = NULL;
+    stream.piped = 0;
     stream.cond = NULL;
     stream.prev = NULL;
 
@@ -2041,12 +2309,15 @@ static void paste(cpp_context *ctx, cpp_token_array *os, cpp_token *rhs,
     n = snprintf(buf3, 2048, "%.*s%.*s", len, buf, len2, buf2);
 
     stream.flags = lhs->flags & CPP_TOKEN_SPACE;
-    stream.lineno = ctx->stream->lineno;
+    stream.at = macro_tk->loc;
     stream.pplineno_loc = ctx->stream->pplineno_loc;
     stream.pplineno_val = ctx->stream->pplineno_val;
     stream.fname = ctx->stream->fname;
     stream.ppfname = ctx->stream->ppfname;
     stream.p = cpp_buffer_append(&ctx->buf, (const uchar *)buf3, n + 1);
+    stream.wlimit = NULL;
+    stream.tok = stream.resync = NULL;
+    stream.piped = 0;
     stream.file = ctx->stream->file;
     stream.cond = NULL;
     stream.prev = NULL;
@@ -2121,7 +2392,7 @@ static void subst(cpp_context *ctx, cpp_macro *m, cpp_token *macro_tk,
 
     while (is->kind != TK_eom) {
         if (is->kind == '#' && args != NULL) {
-            stringize(ctx, os, is, &find_arg(args, is + 1)->body);
+            stringize(ctx, os, is, &find_arg(args, is + 1)->body, macro_tk);
             is += 2;
             continue;
         }
@@ -2186,7 +2457,7 @@ static void subst(cpp_context *ctx, cpp_macro *m, cpp_token *macro_tk,
             is->flags |= CPP_TOKEN_NOEXPAND;
 
         /* Remaining token from the replacement list. */
-        is->lineno = macro_tk->lineno;
+        is->loc = macro_tk->loc;
         cpp_token_array_append(os, is++);
     }
 
@@ -2197,21 +2468,26 @@ static uchar expand(cpp_context *ctx, cpp_token *tk, uchar is_expr)
 {
     cpp_macro *m;
     string_ref name = tk->p.ref;
+    uchar ph;
 
     if (HAS_FLAG(tk->flags, CPP_TOKEN_NOEXPAND))
         return 0;
 
-    m = hash_table_lookup(&ctx->macro, name);
+    m = macro_table_lookup(&ctx->macro, name);
     if (m == NULL)
         return 0;
 
+    ph = CPP_TIMER_ENTER(CPP_PHASE_MACRO);
+
     if (HAS_FLAG(m->flags, CPP_MACRO_BUILTIN)) {
         expand_builtin(ctx, name, tk, is_expr);
+        CPP_TIMER_LEAVE(ph);
         return 0; /* Special; No rescanning needed */
     }
 
     if (is_active_macro(ctx, name)) {
         tk->flags |= CPP_TOKEN_NOEXPAND;
+        CPP_TIMER_LEAVE(ph);
         return 0;
     }
 
@@ -2224,6 +2500,7 @@ static uchar expand(cpp_context *ctx, cpp_token *tk, uchar is_expr)
         if (tk->kind != '(') {
             cpp_token_array_append(&ctx->temp, tk);
             *tk = macro_tk;
+            CPP_TIMER_LEAVE(ph);
             return 0;
         }
         collect_args(ctx, m, tk, &args);
@@ -2239,13 +2516,14 @@ static uchar expand(cpp_context *ctx, cpp_token *tk, uchar is_expr)
 
     ms->p = ms->tok.tokens;
     ms->tok.tokens[0].flags |= macro_tk.flags;
-    ms->tok.tokens[0].lineno = macro_tk.lineno;
+    ms->tok.tokens[0].loc = macro_tk.loc;
+    CPP_TIMER_LEAVE(ph);
     return 1;
 }
 
 static uchar macro_equal(cpp_macro *old_m, cpp_macro *new_m)
 {
-    uint i;
+    size_t i;
     cpp_token *tk1, *tk2;
     uchar type1 = HAS_FLAG(old_m->flags, CPP_MACRO_FUNC);
     uchar type2 = HAS_FLAG(new_m->flags, CPP_MACRO_FUNC);
@@ -2275,6 +2553,23 @@ static uchar macro_equal(cpp_macro *old_m, cpp_macro *new_m)
     return 1;
 }
 
+/* Spell the body into cpp_context::spell, unless it's in a file that is
+ * never evicted */
+static void copy_macro_body(cpp_context *ctx, cpp_token_array *body)
+{
+    size_t i;
+    cpp_token *tk;
+
+    if (ctx->stream->prev == NULL) /* the main file or -D */
+        return;
+
+    for (i = 0; i < body->n; i++) {
+        tk = &body->tokens[i];
+        if (tk->kind != TK_identifier && tk->kind != TK_eom)
+            tk->p.ptr = cpp_spelling_copy(&ctx->spell, tk->p.ptr, tk->length);
+    }
+}
+
 static void do_define(cpp_context *ctx, cpp_token *tk)
 {
     cpp_file *file;
@@ -2289,12 +2584,12 @@ static void do_define(cpp_context *ctx, cpp_token *tk)
         cpp_error(ctx, tk, "no macro name given in #define");
 
     name = tk->p.ref;
-    if (name == g_defined)
+    if (name == SR_defined)
         cpp_error(ctx, tk, "'defined' cannot be used as a macro name");
-    else if (name == g__VA_ARGS__)
+    else if (name == SR_VA_ARGS)
         cpp_warn(ctx, tk, "__VA_ARGS__ used as a macro name has no effect");
 
-    old_m = hash_table_lookup(&ctx->macro, name);
+    old_m = macro_table_lookup(&ctx->macro, name);
     cpp_next(ctx, tk);
 
     if (tk->kind == '(' && !PREV_SPACE(tk)) {
@@ -2304,6 +2599,8 @@ static void do_define(cpp_context *ctx, cpp_token *tk)
 
     parse_macro_body(ctx, tk, &body, param, n_param, flags);
     body.tokens[0].flags &= ~CPP_TOKEN_SPACE;
+    if (HAS_FLAG(ctx->flags, CPP_CONTEXT_EVICT))
+        copy_macro_body(ctx, &body);
 
     if (unlikely(old_m != NULL)) {
         /* Slow... */
@@ -2313,20 +2610,20 @@ static void do_define(cpp_context *ctx, cpp_token *tk)
         tmp.n_param = n_param;
         if (macro_equal(old_m, &tmp)) {
             cpp_token_array_cleanup(&body);
-            free(param);
+            cpp_mem_free(param);
             return;
         }
         if (HAS_FLAG(old_m->flags, CPP_MACRO_GUARD)) {
             cpp_warn(ctx, tk, "'%s' already defined as header guard macro",
                               string_ref_ptr(name));
             file = cpp_file_no(old_m->fileno);
-            hash_table_remove(&ctx->guarded_file, file->path);
+            macro_table_remove(&ctx->guarded_file, file->path);
         } else {
             cpp_warn(ctx, tk, "'%s' redefined", string_ref_ptr(name));
         }
         if (HAS_FLAG(flags, CPP_MACRO_FUNC)) {
             if (HAS_FLAG(old_m->flags, CPP_MACRO_FUNC))
-                free(old_m->param);
+                cpp_mem_free(old_m->param);
             old_m->param = param;
             old_m->n_param = n_param;
         }
@@ -2340,7 +2637,7 @@ static void do_define(cpp_context *ctx, cpp_token *tk)
             m->param = param;
             m->n_param = n_param;
         }
-        hash_table_insert(&ctx->macro, name, m);
+        macro_table_insert(&ctx->macro, name, m);
     }
 }
 
@@ -2354,17 +2651,17 @@ static void do_undef(cpp_context *ctx, cpp_token *tk)
         cpp_error(ctx, tk, "no macro name given in #undef");
 
     name = tk->p.ref;
-    if (name >= g__VA_ARGS__ && name <= g_defined) {
-        if (name == g_defined)
+    if (name >= SR_VA_ARGS && name <= SR_defined) {
+        if (name == SR_defined)
             cpp_error(ctx, tk, "'defined' cannot be used as a macro name");
-        else if (name == g__VA_ARGS__)
+        else if (name == SR_VA_ARGS)
             cpp_warn(ctx, tk, "__VA_ARGS__ used as a macro name has no effect");
         else
             cpp_warn(ctx, tk, "undefining builtin macro '%s'",
                               string_ref_ptr(name));
     }
 
-    m = hash_table_remove(&ctx->macro, name);
+    m = macro_table_remove(&ctx->macro, name);
     if (m != NULL) {
         if (HAS_FLAG(m->flags, CPP_MACRO_GUARD))
             cpp_warn(ctx, tk, "undefining header guard macro '%s'",
@@ -2391,13 +2688,104 @@ static uchar is_hash(cpp_context *ctx, cpp_token *tk)
     return AT_BOL(tk) && tk->kind == '#' && ctx->file_macro == NULL;
 }
 
+/* Run the directive after the '#' in `tk` */
+static void do_directive(cpp_context *ctx, cpp_token *tk)
+{
+    cpp_token hash;
+    string_ref dkind;
+
+    hash = *tk;
+    cpp_next(ctx, tk);
+
+    if (tk->kind == '\n') /* null directive */
+        return;
+    else if (tk->kind != TK_identifier)
+        cpp_error(ctx, tk, "preprocessing directive requires an identifier");
+
+    dkind = tk->p.ref;
+
+    /* #if */
+    if (dkind == SR_if) {
+        do_if(ctx, tk);
+        return;
+    }
+
+    /* #ifdef */
+    if (dkind == SR_ifdef) {
+        do_ifdef(ctx, tk);
+        return;
+    }
+
+    /* #ifndef, hash is used to detect header guard */
+    if (dkind == SR_ifndef) {
+        do_ifndef(ctx, tk, hash);
+        return;
+    }
+
+    /* #elif */
+    if (dkind == SR_elif) {
+        do_elif(ctx, tk);
+        return;
+    }
+
+    /* #else */
+    if (dkind == SR_else) {
+        do_else(ctx, tk);
+        return;
+    }
+
+    /* #endif */
+    if (dkind == SR_endif) {
+        do_endif(ctx, tk);
+        return;
+    }
+
+    /* #define */
+    if (dkind == SR_define) {
+        do_define(ctx, tk);
+        return;
+    }
+
+    /* #undef */
+    if (dkind == SR_undef) {
+        do_undef(ctx, tk);
+        return;
+    }
+
+    /* #include */
+    if (dkind == SR_include) {
+        do_include(ctx, tk);
+        return;
+    }
+
+    /* #line */
+    if (dkind == SR_line) {
+        do_line(ctx, tk);
+        return;
+    }
+
+    /* #error */
+    if (dkind == SR_error) {
+        do_error(ctx, tk);
+        return;
+    }
+
+    /* #pragma, not yet implemented */
+    if (dkind == SR_pragma) {
+        skip_line(ctx, tk);
+        return;
+    }
+
+    cpp_error(ctx, tk, "unknown directive '%s'", string_ref_ptr(dkind));
+}
+
 /* Advance next token and run the preprocessor and do macro expansion if
  * necessary. */
 static void cpp_preprocess(cpp_context *ctx, cpp_token *tk)
 {
+    uchar ph;
     cpp_token hash;
     cpp_file *file;
-    string_ref pathref, dkind;
 
     while (1) {
         cpp_next(ctx, tk);
@@ -2407,15 +2795,11 @@ static void cpp_preprocess(cpp_context *ctx, cpp_token *tk)
                 cpp_error(ctx, &hash, "unterminated %s", cond_stack_name(ctx));
             }
             file = ctx->stream->file;
-            pathref = file->path;
-            if (!hash_table_lookup(&ctx->guarded_file, pathref)) {
-                /* Cache the file, no more cpp_file_open2() if the file is
-                 * #included multiple times. */
-                hash_table_insert(&ctx->cached_file, pathref, file);
-            }
             cpp_stream_pop(ctx);
             if (ctx->stream == NULL)
                 return; /* No more input left. */
+            if (HAS_FLAG(ctx->flags, CPP_CONTEXT_EVICT))
+                evict_file(ctx, file);
             continue;
         } else if (tk->kind == '\n') {
             continue;
@@ -2426,88 +2810,8 @@ static void cpp_preprocess(cpp_context *ctx, cpp_token *tk)
         else if (!is_hash(ctx, tk))
             return;
 
-        hash = *tk;
-        cpp_next(ctx, tk);
-
-        if (tk->kind == '\n') /* null directive */
-            continue;
-        else if (tk->kind != TK_identifier)
-            cpp_error(ctx, tk, "preprocessing directive requires an identifier");
-
-        dkind = tk->p.ref;
-
-        /* #if */
-        if (dkind == g_if) {
-            do_if(ctx, tk);
-            continue;
-        }
-
-        /* #ifdef */
-        if (dkind == g_ifdef) {
-            do_ifdef(ctx, tk);
-            continue;
-        }
-
-        /* #ifndef, hash is used to detect header guard */
-        if (dkind == g_ifndef) {
-            do_ifndef(ctx, tk, hash);
-            continue;
-        }
-
-        /* #elif */
-        if (dkind == g_elif) {
-            do_elif(ctx, tk);
-            continue;
-        }
-
-        /* #else */
-        if (dkind == g_else) {
-            do_else(ctx, tk);
-            continue;
-        }
-
-        /* #endif */
-        if (dkind == g_endif) {
-            do_endif(ctx, tk);
-            continue;
-        }
-
-        /* #define */
-        if (dkind == g_define) {
-            do_define(ctx, tk);
-            continue;
-        }
-
-        /* #undef */
-        if (dkind == g_undef) {
-            do_undef(ctx, tk);
-            continue;
-        }
-
-        /* #include */
-        if (dkind == g_include) {
-            do_include(ctx, tk);
-            continue;
-        }
-
-        /* #line */
-        if (dkind == g_line) {
-            do_line(ctx, tk);
-            continue;
-        }
-
-        /* #error */
-        if (dkind == g_error) {
-            do_error(ctx, tk);
-            continue;
-        }
-
-        /* #pragma, not yet implemented */
-        if (dkind == g_pragma) {
-            skip_line(ctx, tk);
-            continue;
-        }
-
-        cpp_error(ctx, tk, "unknown directive '%s'", string_ref_ptr(dkind));
+        ph = CPP_TIMER_ENTER(CPP_PHASE_DIRECTIVE);
+        do_directive(ctx, tk);
+        CPP_TIMER_LEAVE(ph);
     }
 }
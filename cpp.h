@@ -2,10 +2,12 @@
 #define CPP_H
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANON, MADV_* */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,6 +17,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include "ctype.h"
@@ -31,6 +34,15 @@
 #define PREV_SPACE(_t) (HAS_FLAG((_t)->flags, CPP_TOKEN_SPACE))
 #define LITREF(x)      string_ref_newlen((x), sizeof((x)) - 1)
 
+/* A phase of -ftime-report, costs a predicted branch when it's disabled:
+ *     uchar ph = CPP_TIMER_ENTER(CPP_PHASE_LEX);
+ *     ...
+ *     CPP_TIMER_LEAVE(ph); */
+#define CPP_TIMER_ENTER(p) (unlikely(cpp_timer_on) ? cpp_timer_enter(p) : 0)
+#define CPP_TIMER_LEAVE(p) do { \
+        if (unlikely(cpp_timer_on)) cpp_timer_leave(p); \
+    } while (0)
+
 #if defined(__GNUC__) || defined(__clang__)
 #define likely(x)      (__builtin_expect(!!(x), 1))
 #define unlikely(x)    (__builtin_expect(!!(x), 0))
@@ -46,6 +58,7 @@ typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned long ulong;
+typedef uint64_t cpp_loc; /* see cpp_loc_of() */
 typedef unsigned int tkchar;
 
 
@@ -53,9 +66,82 @@ typedef unsigned int tkchar;
 
 /* flags for cpp_file */
 #define CPP_FILE_NONL        1 /* no newline at end of file */
+#define CPP_FILE_MAPPED      2 /* data is mmap()-ed, see cpp_file_slide() */
+#define CPP_FILE_PIPE        4 /* data arrives incrementally, see cpp_file_refill() */
+#define CPP_FILE_SCANNED     8 /* handed to cpp_prefetch_scan() */
+#define CPP_FILE_SYSTEM      16 /* #include <>-d, its identifiers outlive the overlay */
+#define CPP_FILE_EVICTED     32 /* data is freed, see cpp_file_evict() */
+#define CPP_FILE_FORGOTTEN   64 /* its slot is free, see cpp_file_forget() */
+/* the contexts of -j share a cpp_file and set CPP_FILE_SCANNED and
+ * CPP_FILE_SYSTEM with __atomic_or_fetch(), read its flags with this */
+#define CPP_FILE_FLAGS(f)    __atomic_load_n(&(f)->flags, __ATOMIC_RELAXED)
 /* limits for cpp_file */
-#define CPP_FILE_MAX_USED    1024 /* it's still too big */
-#define CPP_FILE_MAX_SIZE    (1U << 31) /* 2GiB */
+#define CPP_FILE_MAX_USED    8192 /* for all the translation units of a run */
+#define CPP_FILE_MAX_SIZE    (1UL << 31) /* 2GiB, bigger files are mmap()-ed */
+#define CPP_FILE_WINDOW      (1UL << 26) /* 64MiB, resident part of mapped file */
+#define CPP_FILE_PIPE_MAX    (1UL << 34) /* 16GiB, address space reserved for a pipe */
+#define CPP_FILE_PIPE_CHUNK  (1UL << 16) /* 64KiB, per read() from a pipe */
+#define CPP_FILE_LINE_SCAN   (1UL << 16) /* 64KiB, newlines found at a time */
+#define CPP_FILE_LINE_BLOCK  (1UL << 14) /* 16KiB, of a mapped file's lines */
+
+/* location space, see cpp_loc_of() */
+#define CPP_LOC_NONE         0
+#define CPP_LOC_SHIFT        40 /* 1TiB, bits of offset in a file or buffer */
+#define CPP_LOC_MAX_BUFFER   (CPP_JOBS_MAX + 8) /* that aren't files */
+
+/* limits for prefetch.c */
+#define CPP_PREFETCH_THREAD     2 /* default number of workers */
+#define CPP_PREFETCH_MAX_THREAD 16
+#define CPP_PREFETCH_BATCH      32 /* files per io_uring submission */
+#define CPP_PREFETCH_BUCKET     1024
+#define CPP_PREFETCH_MAX_ENTRY  8192
+#define CPP_PREFETCH_MAX_BYTES  (1UL << 28) /* 256MiB, read but not taken yet */
+
+/* limits for jobs.c */
+#define CPP_JOBS_MAX            32 /* threads of -j, a cpp_context::buf each */
+
+/* limits for server.c */
+#define CPP_SERVER_MAX_REQUEST  (1U << 20) /* bytes of cwd and argv */
+#define CPP_SERVER_MAX_ARGS     4096
+#define CPP_SERVER_BACKLOG      16
+#define CPP_SERVER_TIMEOUT      5000 /* ms to receive a request or answer it */
+
+/* limits for pipeline.c */
+#define CPP_PIPELINE_RING       4096 /* tokens, a power of 2 */
+#define CPP_PIPELINE_BATCH      512 /* tokens before waking up a consumer */
+#define CPP_PIPELINE_SPIN       256 /* polls before sleeping on a ring */
+
+/* binary token stream, see binary.c */
+#define CPP_BINARY_MAGIC     "CPPTOKS\0"
+#define CPP_BINARY_VERSION   1
+#define CPP_BINARY_BATCH     4096 /* tokens per fwrite() */
+
+/* limits for output.c */
+#define CPP_OUTPUT_IOV       1024 /* per writev(), IOV_MAX */
+#define CPP_OUTPUT_BUF       (1UL << 16) /* 64KiB, for formatted tokens */
+#define CPP_OUTPUT_RUN       64 /* a shorter run of a file is copied */
+
+/* phases for timer.c, see -ftime-report */
+#define CPP_PHASE_LEX        0
+#define CPP_PHASE_DIRECTIVE  1 /* what a directive doesn't spend elsewhere */
+#define CPP_PHASE_INCLUDE    2 /* resolution, guard check */
+#define CPP_PHASE_FILE       3 /* open(), read(), mmap() */
+#define CPP_PHASE_MACRO      4
+#define CPP_PHASE_COND       5 /* #if evaluation, skipping groups */
+#define CPP_PHASE_OUTPUT     6
+#define CPP_PHASE_OTHER      7
+#define CPP_PHASE_MAX        8
+
+/* subsystems for mem.c, see -fmem-report */
+#define CPP_MEM_FILE         0 /* file data, prefetch.c bookkeeping */
+#define CPP_MEM_POOL         1 /* string_pool.c, counted by string_pool_stat() */
+#define CPP_MEM_MACRO        2 /* macros, their arguments and expansions */
+#define CPP_MEM_TOKEN        3 /* token arrays and rings */
+#define CPP_MEM_TABLE        4 /* hash_table.c */
+#define CPP_MEM_SCRATCH      5 /* streams, #if stacks, cpp_context::buf... */
+#define CPP_MEM_MAX          6
+/* limits for mem.c */
+#define CPP_MEM_SLACK        (1L << 16) /* 64KiB, counted by a thread alone */
 
 /* flags for cpp_token */
 #define CPP_TOKEN_BOF       1 /* token is at beginning of file */
@@ -64,6 +150,12 @@ typedef unsigned int tkchar;
 #define CPP_TOKEN_ESCNL     8 /* there is "\\\n" in the token */
 #define CPP_TOKEN_FLNUM    16 /* token is floating constant */
 #define CPP_TOKEN_SPACE    32 /* token is followed by whitespace */
+/* flags for cpp_packed_token, on top of those */
+#define CPP_PACKED_FAR     64 /* loc is kept aside */
+#define CPP_PACKED_BUF    128 /* spelled in cpp_context::buf */
+/* limits for cpp_token_store */
+#define CPP_TOKEN_CHUNK    4096 /* tokens, 64KiB */
+#define CPP_SPELLING_CHUNK (1UL << 16) /* 64KiB, of cpp_spelling_heap */
 
 /* flags for cond_stack */
 #define CPP_COND_SKIP       1 /* we are looking for #elif/#else/#endif */
@@ -79,6 +171,10 @@ typedef unsigned int tkchar;
 /* limits for cpp_macro */
 #define CPP_MACRO_MAX       16384 /* per translation unit */
 
+/* flags for cpp_context */
+#define CPP_CONTEXT_EVICT   1 /* free a header when done, see evict_file() */
+#define CPP_CONTEXT_FORKED  2 /* see cpp_context_fork() */
+
 /* limits for cpp_context::buf */
 #define CPP_BUFFER_MAX     (1U << 24) /* 16MiB */
 
@@ -165,35 +261,191 @@ enum _cpp_token_kind {
 
 /* ---- structs and unions ------------------------------------------------- */
 
+typedef struct {
+    uchar kind;
+    uchar flags;
+    ushort fileno;
+    uint length;
+    cpp_loc loc; /* see cpp_loc_line() */
+    union {
+        string_ref ref; /* for TK_identifier */
+        const uchar *ptr; /* for the rest */
+    } p;
+} cpp_token;
+
 typedef struct {
     uchar flags;
     ushort no;
-    uint size;
+    size_t size;
+    size_t released; /* bytes given back to the kernel, if CPP_FILE_MAPPED */
+    size_t visible; /* bytes the lexer may see, if CPP_FILE_PIPE */
+    int fd; /* still reading from it, if CPP_FILE_PIPE */
+    uchar saved; /* byte under the '\0' at `visible` */
     uint inode, devid;
+    struct timespec mtime;
     string_ref name;
     string_ref path;
     string_ref dirpath;
+    cpp_loc loc; /* of data[0] */
     uchar *data;
+    cpp_token *tokens; /* pretokenized by prefetch.c, ends with TK_eof */
 } cpp_file;
 
 typedef struct {
-    uchar kind;
-    ushort flags;
-    ushort fileno;
-    uint lineno;
-    uint length;
-    union {
-        string_ref ref; /* for TK_identifier */
-        const uchar *ptr; /* for the rest */
-    } p;
-} cpp_token;
+    const char *path; /* resolved, NULL if it failed with `err` */
+    struct stat sb;
+    uchar *data; /* NULL if it wasn't read, laid out for cpp_file_adopt() */
+    size_t size;
+    cpp_token *tokens; /* NULL if it wasn't pretokenized */
+    int err;
+} cpp_prefetched;
+
+/* Binary token stream, see binary.c, in native byte order */
+typedef struct {
+    char magic[8]; /* CPP_BINARY_MAGIC */
+    uint32_t version;
+    uint32_t byteorder; /* 0x01020304 as it's written */
+} cpp_bin_header;
+
+typedef struct {
+    uchar kind; /* keywords are told apart from identifiers */
+    uchar flags; /* CPP_TOKEN_* */
+    ushort reserved;
+    uint32_t value; /* cpp_bin_ident index, heap offset of a literal */
+} cpp_bin_token;
 
 typedef struct {
-    uint n;
-    uint max;
+    uint32_t offset; /* in names */
+    uint32_t length;
+} cpp_bin_ident;
+
+typedef struct {
+    uint32_t token; /* first one on the line */
+    uint32_t fileno; /* cpp_bin_file index */
+    uint32_t lineno;
+} cpp_bin_line;
+
+typedef struct {
+    uint32_t name; /* offsets in names */
+    uint32_t path;
+} cpp_bin_file;
+
+typedef struct {
+    uint64_t token_off, ntoken;
+    uint64_t heap_off, heap_size;
+    uint64_t ident_off, nident;
+    uint64_t line_off, nline;
+    uint64_t file_off, nfile;
+    uint64_t names_off, names_size;
+    char magic[8];
+} cpp_bin_footer;
+
+/* A binary token stream mapped by cpp_binary_map() */
+typedef struct {
+    const uchar *map;
+    size_t size;
+    const cpp_bin_token *tokens;
+    uint64_t ntoken;
+    const uchar *heap;
+    const cpp_bin_ident *idents;
+    uint64_t nident;
+    const cpp_bin_line *lines;
+    uint64_t nline;
+    const cpp_bin_file *files;
+    uint64_t nfile;
+    const char *names;
+} cpp_binary_view;
+
+/* -E output, see output.c.
+ * [`run`, `end`) are the bytes of a file that are output so far, bytes of
+ * `buf` from `mark` on aren't in `iov` yet. */
+typedef struct {
+    FILE *fp;
+    int fd; /* of `fp`, -1 to fwrite() to it */
+    int err; /* of the first failed write */
+    uchar first; /* nothing output yet */
+    int niov;
+    size_t used, mark;
+    const uchar *run, *end, *limit;
+    uchar *buf;
+    struct iovec iov[CPP_OUTPUT_IOV];
+} cpp_output;
+
+typedef struct {
+    size_t n;
+    size_t max;
     cpp_token *tokens;
 } cpp_token_array;
 
+/* A cpp_token in 16 bytes instead of 24, see cpp_token_store */
+typedef struct {
+    uint32_t loc; /* offset in `fileno`, index of `locs` if CPP_PACKED_FAR */
+    uint32_t spelling; /* offset + 1 in `fileno`, offset in `buf` if
+                        * CPP_PACKED_BUF, 0 for an identifier or if aside */
+    uint32_t payload; /* string_ref of an identifier, length, spelling index */
+    ushort fileno;
+    uchar kind;
+    uchar flags; /* CPP_TOKEN_*, CPP_PACKED_* */
+} cpp_packed_token;
+
+/* Spelling of a token out of the location space, e.g. from -D */
+typedef struct {
+    const uchar *ptr;
+    uint length;
+} cpp_spelling;
+
+/* Copies of spellings, packed in chunks that are only freed all at once */
+typedef struct {
+    uchar kind; /* CPP_MEM_* */
+    size_t used; /* of the last chunk */
+    size_t nchunk, maxchunk;
+    uchar **chunks;
+} cpp_spelling_heap;
+
+/* Tokens in chunks of CPP_TOKEN_CHUNK that never move, for as many as a
+ * translation unit has */
+typedef struct {
+    size_t n;
+    size_t nchunk, maxchunk;
+    cpp_packed_token **chunks;
+    size_t nspell, nspellchunk, maxspellchunk;
+    cpp_spelling **spells; /* in chunks too */
+    size_t nloc, nlocchunk, maxlocchunk;
+    cpp_loc **locs; /* that aren't in the token's file, in chunks too */
+    const uchar *buf; /* cpp_context::buf */
+    size_t bufsize;
+    uchar copy; /* spellings go into `heap`, the files may be evicted */
+    cpp_spelling_heap heap;
+} cpp_token_store;
+
+/* Where cpp_mem_alloc() gets memory from, `size` includes its header.
+ * `kind` is the subsystem (CPP_MEM_*), NULL may be returned for a budget. */
+typedef struct {
+    void *(*alloc)(void *arg, size_t size, uchar kind);
+    void *(*resize)(void *arg, void *p, size_t old, size_t size, uchar kind);
+    void (*release)(void *arg, void *p, size_t size, uchar kind);
+    void *arg;
+} cpp_allocator;
+
+typedef struct {
+    size_t current[CPP_MEM_MAX];
+    size_t peak[CPP_MEM_MAX];
+    size_t count[CPP_MEM_MAX]; /* allocations so far, strings for the pool */
+    size_t total;
+    size_t total_peak; /* sum of the peaks */
+} cpp_mem_stats;
+
+/* The allocator of a cpp_context and what was allocated with it, see mem.c */
+typedef struct cpp_mem {
+    const cpp_allocator *allocator;
+    struct cpp_mem *parent; /* of a fork, counts what it allocates too */
+    size_t current[CPP_MEM_MAX];
+    size_t peak[CPP_MEM_MAX];
+    size_t count[CPP_MEM_MAX];
+    size_t unit_peak[CPP_MEM_MAX]; /* since cpp_mem_unit_reset() */
+    size_t unit_count[CPP_MEM_MAX];
+} cpp_mem;
+
 typedef struct {
     uchar flags;
     ushort fileno;
@@ -271,12 +523,19 @@ typedef struct cpp_buffer {
 
 typedef struct cpp_stream {
     uchar flags;
-    uint lineno;
-    uint pplineno_loc;
+    cpp_loc at; /* of every token if set, else where they are in `file` */
+    uint pplineno_loc; /* line of the #line */
     uint pplineno_val;
     const char *fname;
     const char *ppfname;
     const uchar *p;
+    const uchar *wlimit; /* slide the window of a mapped file at this point */
+    cpp_token *tok; /* next of cpp_file::tokens, NULL if lexing `p` */
+    cpp_token *resync; /* where to look for `tok` again after a <header> */
+    uchar piped; /* tokens come from the lexer thread, see pipeline.c */
+    size_t ntoken; /* lexed so far */
+    size_t nskipped; /* of `ntoken`, in skipped groups */
+    uint64_t tbegin; /* pushed at, for -ftime-trace */
     cpp_file *file;
     cond_stack *cond;
     struct cpp_stream *prev; /* #include may modify this */
@@ -303,33 +562,55 @@ typedef struct {
  * `file_macro` is where all macros expanded in a translation unit.
  * `argstream` is a fake stream that's used when expanding a macro argument.
  * `macro` is where all macros in a translation unit defined.
- * `cached_file` is used to store cpp_file that's not guarded either by header
- *               guard or #pragma once, so we can avoid reading the same file.
- *               a guarded file is cached separately in `guarded_file`.
+ * `guarded_file` is a file whose guard is defined, by path.  the files
+ *                themselves are shared, see cpp_file_find().
  * `buf` is a fixed-size big buffer, used to store temporary token pointer.
+ * `spell` is where macro bodies are spelled if headers are evicted.
+ * `cexpr` is where a #if expression is parsed, `ncexpr` nodes of it.
+ * `ms_cache` and `as_cache` are macro_stack and arg_stream to reuse.
+ * `out` is the output of cpp_print(), flushed before a header is evicted.
+ * `err` is where warnings go, stderr if NULL.  errors are fatal, on
+ *       stderr, unless they're caught, see cpp_error_catch().
  * `ppdate` is the cached value of __DATE__ macro.
  * `pptime` is the cached value of __TIME__ macro.
+ * `mem` is where its blocks come from and how much it uses, see mem.c.
  */
 typedef struct {
     uchar flags;
-    cpp_token_array ts;
+    cpp_token_store ts;
     cpp_token_array temp;
     cpp_token_array line;
     cpp_stream *stream;
     macro_stack *file_macro;
     arg_stream *argstream;
     ht_t macro;
-    ht_t cached_file;
     ht_t guarded_file;
     cpp_buffer buf;
+    cpp_spelling_heap spell;
+    cond_expr *cexpr;
+    int ncexpr;
+    macro_stack_cache ms_cache;
+    arg_stream_cache as_cache;
+    cpp_output *out;
+    FILE *err;
     const uchar *ppdate;
     const uchar *pptime;
+    cpp_mem mem;
     /* add more... */
 } cpp_context;
 
 
 /* ---- function declarations ---------------------------------------------- */
 
+/* binary.c */
+void cpp_binary_setup(FILE *fp);
+void cpp_binary_token(const cpp_token *tk);
+int cpp_binary_finish(void);
+void cpp_binary_cleanup(void);
+int cpp_binary_map(const char *path, cpp_binary_view *v);
+void cpp_binary_unmap(cpp_binary_view *v);
+const cpp_bin_line *cpp_binary_line(const cpp_binary_view *v, uint64_t i);
+
 /* buffer.c */
 void cpp_buffer_setup(cpp_buffer *buf, uint cap);
 void cpp_buffer_cleanup(cpp_buffer *buf);
@@ -339,36 +620,152 @@ const uchar *cpp_buffer_append_ch(cpp_buffer *buf, uchar ch);
 
 /* cpp.c */
 void cpp_context_setup(cpp_context *ctx);
+void cpp_context_setup2(cpp_context *ctx, const cpp_allocator *a);
 void cpp_context_cleanup(cpp_context *ctx);
+void cpp_context_reset(cpp_context *ctx);
+void cpp_context_fork(cpp_context *ctx, cpp_context *root);
+void cpp_start(cpp_context *ctx, cpp_file *file);
+int cpp_next_token(cpp_context *ctx, cpp_token *tk);
 void cpp_run(cpp_context *ctx, cpp_file *file);
 void cpp_print(cpp_context *ctx, cpp_file *file, FILE *fp);
+void cpp_print_binary(cpp_context *ctx, cpp_file *file, FILE *fp);
 void cpp_dump_token(cpp_context *ctx, FILE *fp);
 void cpp_error(cpp_context *ctx, cpp_token *tk, const char *s, ...);
 void cpp_warn(cpp_context *ctx, cpp_token *tk, const char *s, ...);
+void cpp_error_catch(jmp_buf *jb);
+FILE *cpp_error_file(cpp_context *ctx);
+void cpp_error_exit(cpp_context *ctx);
 void cpp_macro_define(cpp_context *ctx, const char *in);
 void cpp_macro_undefine(cpp_context *ctx, const char *in);
 void cpp_search_path_append(cpp_context *ctx, const char *dirpath);
+const char *cpp_search_path(int i);
+int cpp_include_resolve(const char *name, const char *cwd, char *buf,
+                        struct stat *sb);
 
 /* file.c */
 void cpp_file_setup(void);
 void cpp_file_cleanup(void);
+void cpp_file_stream(uchar enable);
+const uchar *cpp_file_slide(cpp_file *file, const uchar *p);
+int cpp_file_refill(cpp_file *file);
 cpp_file *cpp_file_open(const char *path, const char *name);
 cpp_file *cpp_file_open2(string_ref path, string_ref name, struct stat *sb);
+cpp_file *cpp_file_adopt(string_ref path, string_ref name, struct stat *sb,
+                         uchar *data, size_t len, cpp_token *tokens);
 cpp_file *cpp_file_no(ushort no);
+void cpp_file_share(void);
+cpp_file *cpp_file_find(string_ref path);
+cpp_file *cpp_file_resolved(string_ref key);
+void cpp_file_resolve(string_ref key, cpp_file *file);
+cpp_loc cpp_loc_register(const uchar *data, size_t size);
+cpp_loc cpp_loc_of(const uchar *p, const cpp_file *file);
+const uchar *cpp_loc_ptr(cpp_loc loc);
+uint cpp_loc_line(cpp_loc loc);
+void cpp_file_evict(cpp_file *file, uchar keep_lines);
+int cpp_file_reload(cpp_file *file);
+int cpp_file_same(const cpp_file *file, const struct stat *sb);
+void cpp_file_forget(cpp_file *file);
+
+/* jobs.c */
+typedef int (*cpp_job_fn)(cpp_context *ctx, int i, FILE *out, FILE *err,
+                          void *arg);
+int cpp_jobs_run(cpp_context *root, int njob, int n, cpp_job_fn run,
+                 void *arg, FILE *out);
+
+/* server.c */
+typedef int (*cpp_serve_fn)(cpp_context *ctx, int argc, char **argv,
+                            const char *cwd, FILE *out, FILE *err, void *arg);
+int cpp_server_run(cpp_context *ctx, const char *path, cpp_serve_fn serve,
+                   void *arg);
+int cpp_server_request(const char *path, int argc, char **argv);
 
 /* lex.c */
 void cpp_lex_setup(cpp_context *ctx);
 void cpp_lex_cleanup(cpp_context *ctx);
 void cpp_lex_string(cpp_stream *s, cpp_token *tk, tkchar q);
 void cpp_lex_scan(cpp_stream *s, cpp_token *tk);
+int cpp_lex_raw(cpp_stream *s, int (*emit)(void *, const cpp_token *),
+                void *arg);
+int cpp_lex_pretokenize(const uchar *data, uchar flags, cpp_token_array *ts);
+
+/* mem.c */
+void cpp_mem_setup(cpp_mem *m, const cpp_allocator *a, cpp_mem *parent);
+void cpp_mem_cleanup(cpp_mem *m);
+void cpp_mem_enter(cpp_mem *m);
+cpp_mem *cpp_mem_current(void);
+void *cpp_mem_alloc(uchar kind, size_t size);
+void *cpp_mem_calloc(uchar kind, size_t n, size_t size);
+void *cpp_mem_realloc(uchar kind, void *p, size_t size);
+char *cpp_mem_strdup(uchar kind, const char *s);
+void cpp_mem_free(void *p);
+void cpp_mem_account(uchar kind, ssize_t delta);
+void cpp_mem_stat(const cpp_context *ctx, cpp_mem_stats *st);
+void cpp_mem_unit_stat(const cpp_context *ctx, cpp_mem_stats *st);
+void cpp_mem_unit_reset(cpp_context *ctx);
+void cpp_mem_report(FILE *fp, const cpp_mem_stats *st);
+
+/* output.c */
+void cpp_output_setup(cpp_output *out, FILE *fp);
+void cpp_output_cleanup(cpp_output *out);
+void cpp_output_token(cpp_output *out, const cpp_token *tk);
+void cpp_output_spelled(cpp_output *out, const cpp_token *tk, const uchar *p,
+                        uint len);
+int cpp_output_flush(cpp_output *out);
+int cpp_output_finish(cpp_output *out);
+
+/* pipeline.c */
+void cpp_pipeline_enable(uchar enable);
+void cpp_pipeline_lex(cpp_stream *s);
+int cpp_pipeline_next(cpp_stream *s, cpp_token *tk);
+void cpp_pipeline_detach(cpp_stream *s);
+void cpp_pipeline_resync(cpp_stream *s, const cpp_token *tk);
+int cpp_pipeline_output(FILE *fp);
+void cpp_pipeline_print(const cpp_token *tk);
+int cpp_pipeline_finish(void);
+int cpp_pipeline_produce(cpp_context *ctx);
+int cpp_pipeline_pull(cpp_token *tk);
+void cpp_pipeline_cleanup(void);
+
+/* prefetch.c */
+void cpp_prefetch_setup(int nthread, const char *trace);
+void cpp_prefetch_scan(cpp_file *file);
+void cpp_prefetch_forget(const uchar *data);
+int cpp_prefetch_take(const char *name, const char *cwd, cpp_prefetched *pf);
+void cpp_prefetch_cleanup(void);
+
+/* timer.c */
+extern uchar cpp_timer_on;
+void cpp_timer_setup(const char *json);
+uchar cpp_timer_enter(uchar phase);
+void cpp_timer_leave(uchar phase);
+uint64_t cpp_timer_now(void);
+void cpp_timer_report(void);
+extern uchar cpp_time_trace_on;
+int cpp_time_trace_setup(const char *path);
+uint64_t cpp_time_trace_begin(const cpp_file *file, const cpp_file *parent,
+                              uint64_t since);
+void cpp_time_trace_end(const cpp_file *file, uint64_t begin, size_t ntoken,
+                        size_t nskipped);
+void cpp_time_trace_guard(const cpp_file *file, const cpp_file *parent,
+                          uint64_t since);
+void cpp_time_trace_finish(void);
 
 /* token.c */
 const char *cpp_token_kind(uchar kind);
+uchar cpp_token_keyword(const cpp_token *tk);
 uint cpp_token_splice(const cpp_token *tk, uchar *buf, uint bufsz);
 void cpp_token_print(FILE *fp, const cpp_token *tk);
 void cpp_token_unpp(const cpp_token *tk);
 uchar cpp_token_equal(const cpp_token *tk1, const cpp_token *tk2);
-void cpp_token_array_setup(cpp_token_array *ts, uint max);
+void cpp_token_store_setup(cpp_token_store *st);
+void cpp_token_store_cleanup(cpp_token_store *st);
+void cpp_token_store_append(cpp_token_store *st, const cpp_token *tk);
+void cpp_token_store_get(const cpp_token_store *st, size_t i, cpp_token *tk);
+void cpp_spelling_heap_setup(cpp_spelling_heap *h, uchar kind);
+void cpp_spelling_heap_cleanup(cpp_spelling_heap *h);
+const uchar *cpp_spelling_copy(cpp_spelling_heap *h, const uchar *p,
+                               uint len);
+void cpp_token_array_setup(cpp_token_array *ts, size_t max);
 void cpp_token_array_clear(cpp_token_array *ts);
 void cpp_token_array_append(cpp_token_array *ts, const cpp_token *tk);
 void cpp_token_array_move(cpp_token_array *dts, cpp_token_array *sts);
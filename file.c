@@ -1,7 +1,52 @@
 #include "cpp.h"
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+/* A buffer in the location space, see cpp_loc_register() */
+typedef struct {
+    const uchar *data;
+    size_t size;
+} loc_buffer;
+
+/* Newlines of a file, as far as it was scanned, see cpp_loc_line().  A
+ * read file has the offset of each.  A mapped file or a pipe may not fit
+ * that, it has how many come before every CPP_FILE_LINE_BLOCK bytes. */
+typedef struct {
+    uint *nl;
+    uint n, max;
+    uint hint; /* index of the last line found */
+    uint64_t *block;
+    size_t nblock, maxblock;
+    size_t at; /* last offset found in a block, on line `atline` */
+    uint atline;
+    size_t scanned;
+} line_table;
+
+HT_TYPED(file_table, cpp_file) /* g_by_path and g_by_include */
+
+/* Files, buffers and line tables are only appended to, under `g_lock`, and
+ * their counts are published with a release store, so they're read without
+ * it.  Before cpp_file_share() everything happens on the main thread. */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static uchar g_shared; /* see cpp_file_share() */
 static cpp_file g_files[CPP_FILE_MAX_USED];
 static int g_file_count = 1; /* 0 is reserved */
+static ushort g_free[CPP_FILE_MAX_USED]; /* slots of forgotten files */
+static int g_nfree;
+static uchar g_file_stream; /* mmap() every file, not only the big ones */
+static loc_buffer g_buffers[CPP_LOC_MAX_BUFFER];
+static uint g_buffer_count;
+static line_table g_lines[CPP_FILE_MAX_USED];
+static ht_t g_by_path; /* every file but a pipe */
+static ht_t g_by_include; /* see cpp_file_resolve() */
+
+static void lines_scan(line_table *t, const uchar *data, size_t end);
+
+/* see line_table, their lines are found under `g_lock` once shared */
+#define LINE_BLOCKS(f) \
+    ((CPP_FILE_FLAGS(f) & (CPP_FILE_MAPPED | CPP_FILE_PIPE)) != 0)
 
 void cpp_file_setup(void)
 {
@@ -9,63 +54,157 @@ void cpp_file_setup(void)
     f->name = LITREF("<temp-buffer>");
     f->path = f->name;
     f->dirpath = LITREF(".");
+    f->loc = CPP_LOC_NONE;
+    g_buffer_count = 0;
+    g_shared = 0;
+    hash_table_setup(&g_by_path, 64);
+    hash_table_setup(&g_by_include, 64);
+}
+
+/* Give back the data of a file, as file_open() got it */
+static void file_release(uchar *data, size_t size, uchar flags)
+{
+    if (HAS_FLAG(flags, CPP_FILE_PIPE)) {
+        munmap(data, CPP_FILE_PIPE_MAX);
+        cpp_mem_account(CPP_MEM_FILE, -(ssize_t)size);
+    } else if (HAS_FLAG(flags, CPP_FILE_MAPPED)) {
+        munmap(data, ALIGN(size + 2, (size_t)sysconf(_SC_PAGESIZE)));
+        cpp_mem_account(CPP_MEM_FILE, -(ssize_t)size);
+    } else {
+        cpp_mem_free(data);
+    }
+}
+
+/* Free what `f` has but its slot */
+static void file_free(cpp_file *f)
+{
+    if (HAS_FLAG(f->flags, CPP_FILE_PIPE) && f->fd > 0)
+        close(f->fd);
+    if (f->data != NULL) /* not evicted */
+        file_release(f->data, f->size, f->flags);
+    cpp_mem_free(f->tokens);
+    cpp_mem_free(g_lines[f->no].nl);
+    cpp_mem_free(g_lines[f->no].block);
+    memset(&g_lines[f->no], 0, sizeof(g_lines[f->no]));
+    f->fd = -1;
+    f->data = NULL;
+    f->tokens = NULL;
 }
 
 void cpp_file_cleanup(void)
 {
     int i;
 
-    for (i = 1; i < g_file_count; i++) {
-        cpp_file *f = &g_files[i];
-        free(f->data);
+    for (i = 1; i < g_file_count; i++)
+        file_free(&g_files[i]);
+    hash_table_cleanup(&g_by_path);
+    hash_table_cleanup(&g_by_include);
+}
+
+/* From now on, the files may be opened and their lines asked for by several
+ * threads at the same time, each with a context of cpp_context_fork().
+ * There's no going back, and no cpp_file_evict() anymore. */
+void cpp_file_share(void)
+{
+    int i;
+    cpp_file *f;
+
+    for (i = 1; i < g_file_count; i++) { /* see cpp_loc_line() */
+        f = &g_files[i];
+        if (g_lines[i].scanned > 0 && f->data != NULL && !LINE_BLOCKS(f))
+            lines_scan(&g_lines[i], f->data, f->size + 1);
     }
+    g_shared = 1;
 }
 
-cpp_file *cpp_file_open(const char *path, const char *name)
+/* The file already read at `path`, NULL if none */
+cpp_file *cpp_file_find(string_ref path)
 {
-    return cpp_file_open2(string_ref_new(path), string_ref_new(name), NULL);
+    cpp_file *file;
+
+    pthread_mutex_lock(&g_lock);
+    file = file_table_lookup(&g_by_path, path);
+    pthread_mutex_unlock(&g_lock);
+    return file;
 }
 
-cpp_file *cpp_file_open2(string_ref _path, string_ref name, struct stat *sb)
+/* Where an #include led, by `key` ("dir\tname", "\tname" for <name>), so a
+ * file isn't looked for twice, even in another translation unit */
+cpp_file *cpp_file_resolved(string_ref key)
 {
-    uchar flags;
-    struct stat sb2;
-    int fd, saved_errno;
-    uint filesize, psize;
-    ssize_t byte_read, byte_max, offset;
-    const char *p, *path = string_ref_ptr(_path);
+    cpp_file *file;
 
-    if (g_file_count == CPP_FILE_MAX_USED) {
-        errno = ENFILE;
+    pthread_mutex_lock(&g_lock);
+    file = file_table_lookup(&g_by_include, key);
+    pthread_mutex_unlock(&g_lock);
+    return file;
+}
+
+void cpp_file_resolve(string_ref key, cpp_file *file)
+{
+    pthread_mutex_lock(&g_lock);
+    file_table_insert(&g_by_include, key, file);
+    pthread_mutex_unlock(&g_lock);
+}
+
+void cpp_file_stream(uchar enable)
+{
+    g_file_stream = enable;
+}
+
+/* Map the whole pages of the file, read-only, then the rest of it is read
+ * into anonymous zeroed memory with at least 2 more bytes for the '\n' and
+ * '\0' that the lexer expects.  So nothing is ever written to a file-backed
+ * page, that MADV_DONTNEED would throw away.  Only a window of the file is
+ * kept resident while it's being lexed, see cpp_file_slide().
+ * Tokens may still point anywhere into the mapping (e.g. in a macro body),
+ * released pages are simply faulted back in from the page cache. */
+static uchar *file_map(int fd, size_t filesize)
+{
+    uchar *data, *p;
+    ssize_t n;
+    size_t pgsz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapsize = ALIGN(filesize + 2, pgsz);
+    size_t off = filesize & ~(pgsz - 1); /* where the tail starts */
+
+    data = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON,
+                -1, 0);
+    if (data == MAP_FAILED)
         return NULL;
-    }
 
-    if (sb == NULL) {
-        sb = &sb2;
-        if (stat(path, sb) != 0)
+    if (off > 0) {
+        p = mmap(data, off, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0);
+        if (p == MAP_FAILED) {
+            munmap(data, mapsize);
             return NULL;
+        }
+        madvise(data, MIN(off, CPP_FILE_WINDOW), MADV_WILLNEED);
     }
 
-    filesize = sb->st_size;
-    if (filesize > CPP_FILE_MAX_SIZE) {
-        errno = EFBIG;
-        return NULL;
-    } else if (!S_ISREG(sb->st_mode)) {
-        errno = S_ISDIR(sb->st_mode) ? EISDIR : EINVAL;
-        return NULL;
+    while (off < filesize) { /* it may have shrunk, zeroes then */
+        n = pread(fd, data + off, filesize - off, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            munmap(data, mapsize);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        off += (size_t)n;
     }
 
-    fd = open(path, O_RDONLY);
-    if (fd == -1)
-        return NULL;
+    cpp_mem_account(CPP_MEM_FILE, (ssize_t)filesize);
+    return data;
+}
 
-    uint allocsize = ALIGN(filesize + 4, 8); /* 4 bytes padding */
-    uchar *data = malloc(allocsize);
-    if (data == NULL) {
-        close(fd);
-        errno = ENOMEM;
-        return NULL;
-    }
+static uchar *file_read(int fd, size_t filesize, struct stat *sb,
+                        ssize_t *outsize)
+{
+    int saved_errno;
+    ssize_t byte_read, byte_max, offset;
+    size_t allocsize = ALIGN(filesize + 4, 8); /* 4 bytes padding */
+    uchar *data = cpp_mem_alloc(CPP_MEM_FILE, allocsize);
 
     /* We are going to read() in block, so tell the kernel that the pattern
      * used for read()-ing will be sequential.
@@ -74,7 +213,6 @@ cpp_file *cpp_file_open2(string_ref _path, string_ref name, struct stat *sb)
     posix_fadvise(fd, 0, sb->st_size, POSIX_FADV_SEQUENTIAL);
     errno = saved_errno;
 
-    flags = 0;
     byte_read = 0, offset = 0;
     byte_max = (ssize_t)filesize;
 
@@ -85,42 +223,672 @@ cpp_file *cpp_file_open2(string_ref _path, string_ref name, struct stat *sb)
         offset += byte_read;
     }
 
-    close(fd);
+    *outsize = offset;
+    return data;
+}
 
-    if (offset > 0 && data[offset - 1] != '\n') {
+/* A pipe has no size up front, so reserve a big range of address space and
+ * let the kernel back it lazily.  The data never moves, tokens can point into
+ * it like into any other file. */
+static uchar *pipe_reserve(void)
+{
+    uchar *data = mmap(NULL, CPP_FILE_PIPE_MAX, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+/* Called by the lexer when it reached the '\0' at `visible`.
+ * Read from the pipe until at least one more complete line arrived, a line
+ * ending with "\\\n" is not complete as the next one continues it.  So a
+ * token never spans the '\0' and only a block comment can cross it.
+ * Returns 1 if there is more to lex, 0 at the end of input, -1 if the input
+ * doesn't fit in CPP_FILE_PIPE_MAX. */
+int cpp_file_refill(cpp_file *file)
+{
+    uchar ph;
+    ssize_t n;
+    size_t i, old = file->visible;
+    uchar *data = file->data;
+
+    if (file->fd == -1)
+        return 0;
+
+    data[file->visible] = file->saved;
+
+    while (1) {
+        if (file->size + CPP_FILE_PIPE_CHUNK + 2 > CPP_FILE_PIPE_MAX)
+            return -1;
+        ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+        n = read(file->fd, data + file->size, CPP_FILE_PIPE_CHUNK);
+        CPP_TIMER_LEAVE(ph);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        file->size += (size_t)n;
+        cpp_mem_account(CPP_MEM_FILE, n);
+        for (i = file->size; i > file->visible; i--) {
+            if (data[i - 1] == '\n' && (i < 2 || data[i - 2] != '\\'))
+                break;
+        }
+        if (i > file->visible) {
+            file->visible = i;
+            file->saved = data[i];
+            data[i] = 0;
+            return 1;
+        }
+    }
+
+    /* End of input, everything is visible now */
+    if (file->fd > 0)
+        close(file->fd);
+    file->fd = -1;
+    file->visible = file->size;
+    file->saved = 0;
+
+    if (file->size > 0 && data[file->size - 1] != '\n') {
+        file->flags |= CPP_FILE_NONL;
+        data[file->size] = '\n';
+        data[file->size + 1] = 0;
+        file->visible++;
+    } else {
+        data[file->size] = 0;
+    }
+
+    return file->visible > old;
+}
+
+/* Called by the lexer once it passed the `wlimit` of its stream, at a token
+ * or a newline, so a long line doesn't keep all of itself resident.
+ * Give back the file-backed pages behind `p` and ask the kernel to read
+ * ahead, returns the next point where the window should slide. */
+const uchar *cpp_file_slide(cpp_file *file, const uchar *p)
+{
+    size_t off, end, step = CPP_FILE_WINDOW / 2;
+    size_t pgsz = (size_t)sysconf(_SC_PAGESIZE);
+    uchar ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+
+    off = (size_t)(p - file->data);
+    end = MIN(off, file->size) & ~(pgsz - 1); /* not the tail, see file_map() */
+    if (end > file->released && !g_shared) { /* maybe lexed by another */
+        madvise(file->data + file->released, end - file->released,
+                MADV_DONTNEED);
+        file->released = end;
+    }
+
+    if (off < file->size)
+        madvise(file->data + end, MIN(CPP_FILE_WINDOW, file->size - end),
+                MADV_WILLNEED);
+
+    CPP_TIMER_LEAVE(ph);
+    return p + step;
+}
+
+/* End `data` the way the lexer expects, returns `flags` updated */
+static uchar file_terminate(uchar *data, size_t len, uchar flags)
+{
+    if (HAS_FLAG(flags, CPP_FILE_PIPE)) {
+        data[0] = 0; /* nothing is visible until the lexer asks for it */
+    } else if (len > 0 && data[len - 1] != '\n') {
         flags |= CPP_FILE_NONL; /* For diagnostic */
-        data[offset] = '\n';
-        data[offset + 1] = 0;
+        data[len] = '\n';
+        data[len + 1] = 0;
     } else {
-        data[offset] = 0;
+        data[len] = 0;
+    }
+    return flags;
+}
+
+/* Register the file read at `_path`, it takes `data` and `tokens` even if it
+ * fails.  If another thread registered the same path meanwhile, that file
+ * is returned instead. */
+static cpp_file *file_new(string_ref _path, string_ref name, struct stat *sb,
+                          uchar *data, size_t len, uchar flags, int fd,
+                          cpp_token *tokens)
+{
+    cpp_file *file;
+    string_ref dirpath;
+    const char *p, *path = string_ref_ptr(_path);
+
+    flags = file_terminate(data, len, flags);
+
+    p = strrchr(path, '/');
+    if (p != NULL)
+        dirpath = string_ref_newlen_keep(path, (uint)(p - path));
+    else
+        dirpath = string_ref_newlen_keep(".", 1);
+
+    pthread_mutex_lock(&g_lock);
+    file = NULL;
+    if (!HAS_FLAG(flags, CPP_FILE_PIPE) && g_shared)
+        file = file_table_lookup(&g_by_path, _path);
+    if (file != NULL || (g_file_count == CPP_FILE_MAX_USED && g_nfree == 0)) {
+        pthread_mutex_unlock(&g_lock);
+        if (fd > 0)
+            close(fd);
+        file_release(data, len, flags);
+        cpp_mem_free(tokens);
+        if (file == NULL)
+            errno = ENFILE;
+        return file;
     }
 
-    cpp_file *file = &g_files[g_file_count];
-    file->no = g_file_count++;
+    if (g_nfree > 0) { /* see cpp_file_forget() */
+        file = &g_files[g_free[--g_nfree]];
+    } else {
+        file = &g_files[g_file_count];
+        file->no = (ushort)g_file_count;
+    }
     file->flags = flags;
-    file->size = filesize;
+    file->size = HAS_FLAG(flags, CPP_FILE_PIPE) ? 0 : (size_t)sb->st_size;
+    file->released = 0;
+    file->visible = len;
+    file->fd = fd;
+    file->saved = 0;
     file->inode = (uint)sb->st_ino;
     file->devid = (uint)sb->st_dev;
+    file->mtime = sb->st_mtim;
     file->data = data;
+    file->tokens = tokens;
     file->name = name;
     file->path = _path;
+    file->dirpath = dirpath;
+    file->loc = (cpp_loc)file->no << CPP_LOC_SHIFT;
+    if (!HAS_FLAG(flags, CPP_FILE_PIPE))
+        file_table_insert(&g_by_path, _path, file);
+    if (file->no == g_file_count)
+        __atomic_store_n(&g_file_count, g_file_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_lock);
 
-    p = strrchr(path, '/');
-    if (p != NULL) {
-        psize = (unsigned int)(p - path);
-        file->dirpath = string_ref_newlen(path, psize);
+    errno = 0;
+    return file;
+}
+
+cpp_file *cpp_file_open(const char *path, const char *name)
+{
+    return cpp_file_open2(string_ref_new_keep(path), string_ref_new_keep(name),
+                          NULL);
+}
+
+static cpp_file *file_open(string_ref _path, string_ref name, struct stat *sb)
+{
+    uchar flags;
+    uchar *data;
+    struct stat sb2;
+    int fd;
+    size_t filesize;
+    ssize_t offset;
+    const char *path = string_ref_ptr(_path);
+
+    /* checked again by file_new() */
+    if (__atomic_load_n(&g_file_count, __ATOMIC_RELAXED) == CPP_FILE_MAX_USED &&
+        __atomic_load_n(&g_nfree, __ATOMIC_RELAXED) == 0) {
+        errno = ENFILE;
+        return NULL;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        sb = &sb2;
+        if (fstat(STDIN_FILENO, sb) != 0)
+            return NULL;
+        fd = STDIN_FILENO;
     } else {
-        file->dirpath = LITREF(".");
+        if (sb == NULL) {
+            sb = &sb2;
+            if (stat(path, sb) != 0)
+                return NULL;
+        }
+        fd = -1;
     }
 
-    errno = 0;
+    filesize = (size_t)sb->st_size;
+    if (S_ISDIR(sb->st_mode)) {
+        errno = EISDIR;
+        return NULL;
+    } else if (!S_ISREG(sb->st_mode) && !S_ISFIFO(sb->st_mode) &&
+               !(fd == STDIN_FILENO && (S_ISCHR(sb->st_mode) ||
+                                        S_ISSOCK(sb->st_mode)))) {
+        errno = EINVAL;
+        return NULL;
+    } else if (filesize >> CPP_LOC_SHIFT != 0) { /* a pipe stops before */
+        errno = EFBIG;
+        return NULL;
+    }
+
+    if (fd == -1) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1)
+            return NULL;
+    }
+
+    flags = 0;
+    offset = 0;
+    if (!S_ISREG(sb->st_mode)) {
+        data = pipe_reserve();
+        filesize = 0;
+        flags |= CPP_FILE_PIPE;
+    } else if (g_file_stream || filesize > CPP_FILE_MAX_SIZE) {
+        data = file_map(fd, filesize);
+        offset = (ssize_t)filesize;
+        flags |= CPP_FILE_MAPPED;
+    } else {
+        data = file_read(fd, filesize, sb, &offset);
+    }
+
+    if (fd != STDIN_FILENO && (data == NULL || !HAS_FLAG(flags, CPP_FILE_PIPE)))
+        close(fd);
+
+    if (data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return file_new(_path, name, sb, data, (size_t)offset, flags,
+                    HAS_FLAG(flags, CPP_FILE_PIPE) ? fd : -1, NULL);
+}
+
+cpp_file *cpp_file_open2(string_ref _path, string_ref name, struct stat *sb)
+{
+    cpp_file *file;
+    uchar ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+
+    file = file_open(_path, name, sb);
+    CPP_TIMER_LEAVE(ph);
     return file;
 }
 
+/* Register a file whose data was already read by someone else, e.g. by a
+ * prefetch.c worker.  `data` must have the layout file_read() gives, and
+ * `tokens` (if any) must come from cpp_lex_pretokenize() on it, with the
+ * flags it's given afterwards. */
+cpp_file *cpp_file_adopt(string_ref path, string_ref name, struct stat *sb,
+                         uchar *data, size_t len, cpp_token *tokens)
+{
+    return file_new(path, name, sb, data, len, CPP_FILE_SCANNED, -1, tokens);
+}
+
 cpp_file *cpp_file_no(ushort no)
 {
-    if (no < g_file_count)
+    if (no < __atomic_load_n(&g_file_count, __ATOMIC_ACQUIRE))
         return &g_files[no];
     errno = EINVAL;
     return NULL;
 }
+
+/* Free the data of `file`, nothing may point into it anymore, with its
+ * tokens.  The rest of it stays, so a header guard still applies, and
+ * cpp_file_reload() reads it again if it's #include-d again.  Its lines are
+ * all found first if `keep_lines`, else cpp_loc_line() only knows those
+ * that were asked for so far.  A pipe can't be read again, it's kept.  So
+ * is a mapped file if `keep_lines`, its lines are counted in its data, and
+ * what was lexed of it is given back already, see cpp_file_slide(). */
+void cpp_file_evict(cpp_file *file, uchar keep_lines)
+{
+    uchar ph;
+
+    if (file->data == NULL || HAS_FLAG(file->flags, CPP_FILE_PIPE) ||
+        (keep_lines && HAS_FLAG(file->flags, CPP_FILE_MAPPED)))
+        return;
+
+    ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+    if (keep_lines)
+        lines_scan(&g_lines[file->no], file->data, file->visible + 1);
+
+    file_release(file->data, file->size, file->flags);
+    cpp_mem_free(file->tokens);
+
+    file->data = NULL;
+    file->tokens = NULL;
+    file->released = 0;
+    file->flags |= CPP_FILE_EVICTED;
+    CPP_TIMER_LEAVE(ph);
+}
+
+/* `file` changed on disk, it's no longer found by its path, and the next
+ * #include of it reads it again, see cpp_file_find().  Where every #include
+ * led is forgotten too (the only thing if `file` is NULL), as a file that
+ * appeared or went away may change it.  Its data, tokens and lines are
+ * freed, and its slot (so its locations) goes to a file read later: nothing
+ * may point into it anymore once the context is reset.  Its name and path
+ * stay until then. */
+void cpp_file_forget(cpp_file *file)
+{
+    uchar ph;
+
+    pthread_mutex_lock(&g_lock);
+    if (file != NULL && file_table_lookup(&g_by_path, file->path) == file)
+        file_table_remove(&g_by_path, file->path);
+    hash_table_clear(&g_by_include);
+    pthread_mutex_unlock(&g_lock);
+    if (file == NULL || HAS_FLAG(file->flags, CPP_FILE_FORGOTTEN))
+        return;
+
+    ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+    file_free(file);
+    pthread_mutex_lock(&g_lock);
+    file->flags |= CPP_FILE_FORGOTTEN | CPP_FILE_EVICTED;
+    g_free[g_nfree++] = file->no;
+    pthread_mutex_unlock(&g_lock);
+    CPP_TIMER_LEAVE(ph);
+}
+
+/* Whether `sb` is still the file `file` was read from.  An edit in place
+ * keeps the size and the inode, but not the mtime. */
+int cpp_file_same(const cpp_file *file, const struct stat *sb)
+{
+    return (size_t)sb->st_size == file->size &&
+           (uint)sb->st_ino == file->inode &&
+           (uint)sb->st_dev == file->devid &&
+           sb->st_mtim.tv_sec == file->mtime.tv_sec &&
+           sb->st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+/* Read an evicted `file` again, at another address but with the same
+ * locations.  Returns -1 with errno, ESTALE if it's not the same file. */
+int cpp_file_reload(cpp_file *file)
+{
+    int fd;
+    uchar *data;
+    ssize_t len;
+    struct stat sb;
+    uchar ph = CPP_TIMER_ENTER(CPP_PHASE_FILE);
+
+    fd = open(string_ref_ptr(file->path), O_RDONLY);
+    if (fd == -1)
+        goto fail;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        goto fail;
+    }
+    if (!cpp_file_same(file, &sb)) {
+        close(fd);
+        errno = ESTALE;
+        goto fail;
+    }
+
+    if (HAS_FLAG(file->flags, CPP_FILE_MAPPED)) {
+        data = file_map(fd, file->size);
+        len = (ssize_t)file->size;
+        if (data == NULL)
+            errno = ENOMEM;
+    } else {
+        data = file_read(fd, file->size, &sb, &len);
+        if ((size_t)len != file->visible) { /* it changed while it's read */
+            cpp_mem_free(data);
+            data = NULL;
+            errno = ESTALE;
+        }
+    }
+    close(fd);
+    if (data == NULL)
+        goto fail;
+
+    file_terminate(data, (size_t)len, file->flags);
+    file->data = data;
+    file->flags &= (uchar)~CPP_FILE_EVICTED;
+    CPP_TIMER_LEAVE(ph);
+    return 0;
+
+fail:
+    CPP_TIMER_LEAVE(ph);
+    return -1;
+}
+
+/* ---- location space ----------------------------------------------------- */
+
+/* A location is the range it's in, over CPP_LOC_SHIFT bits of offset in it.
+ * File `no` is range `no`, the buffers come after CPP_FILE_MAX_USED, so
+ * nothing is reserved (a pipe has as much as it grows to) and nothing is
+ * searched.  CPP_LOC_NONE is in file 0, which has no data. */
+#define LOC_RANGE(loc)  ((uint)((loc) >> CPP_LOC_SHIFT))
+#define LOC_OFFSET(loc) ((size_t)((loc) & (((cpp_loc)1 << CPP_LOC_SHIFT) - 1)))
+
+/* A buffer other than a file, e.g. cpp_context::buf, into the location
+ * space, it must not move until cpp_file_cleanup().  Returns its first
+ * location, CPP_LOC_NONE if there's no room left. */
+cpp_loc cpp_loc_register(const uchar *data, size_t size)
+{
+    cpp_loc loc = CPP_LOC_NONE;
+
+    pthread_mutex_lock(&g_lock);
+    if (g_buffer_count < CPP_LOC_MAX_BUFFER) {
+        g_buffers[g_buffer_count].data = data;
+        g_buffers[g_buffer_count].size = size;
+        loc = (cpp_loc)(CPP_FILE_MAX_USED + g_buffer_count) << CPP_LOC_SHIFT;
+        __atomic_store_n(&g_buffer_count, g_buffer_count + 1,
+                         __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return loc;
+}
+
+/* Location of `p`, if it's in `file` (which may be NULL) or in a registered
+ * buffer, CPP_LOC_NONE otherwise */
+cpp_loc cpp_loc_of(const uchar *p, const cpp_file *file)
+{
+    uint i, n;
+    const loc_buffer *b;
+
+    if (file != NULL && file->data != NULL && p >= file->data &&
+        p <= file->data + file->visible)
+        return file->loc + (cpp_loc)(p - file->data);
+
+    n = __atomic_load_n(&g_buffer_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+        b = &g_buffers[i];
+        if (p >= b->data && p < b->data + b->size)
+            return ((cpp_loc)(CPP_FILE_MAX_USED + i) << CPP_LOC_SHIFT) +
+                   (cpp_loc)(p - b->data);
+    }
+    return CPP_LOC_NONE;
+}
+
+const uchar *cpp_loc_ptr(cpp_loc loc)
+{
+    uint r = LOC_RANGE(loc);
+    const uchar *data;
+
+    if (r >= CPP_FILE_MAX_USED) {
+        r -= CPP_FILE_MAX_USED;
+        if (r >= __atomic_load_n(&g_buffer_count, __ATOMIC_ACQUIRE))
+            return NULL;
+        return g_buffers[r].data + LOC_OFFSET(loc);
+    }
+    if (r >= (uint)__atomic_load_n(&g_file_count, __ATOMIC_ACQUIRE))
+        return NULL;
+    data = g_files[r].data; /* NULL for file 0 */
+    return data != NULL ? data + LOC_OFFSET(loc) : NULL;
+}
+
+static void lines_add(line_table *t, size_t off)
+{
+    if (t->n == t->max) {
+        t->max = t->max != 0 ? t->max * 2 : 1024;
+        t->nl = cpp_mem_realloc(CPP_MEM_FILE, t->nl, t->max * sizeof(uint));
+    }
+    t->nl[t->n++] = (uint)off;
+}
+
+/* Add the newlines of data[t->scanned, end) */
+static void lines_scan(line_table *t, const uchar *data, size_t end)
+{
+    size_t i = t->scanned;
+
+    if (end <= i)
+        return;
+#ifdef __SSE2__
+    uint bits;
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= end; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        bits = (uint)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (bits != 0) {
+            lines_add(t, i + (uint)__builtin_ctz(bits));
+            bits &= bits - 1;
+        }
+    }
+#endif
+    for (; i < end; i++)
+        if (data[i] == '\n')
+            lines_add(t, i);
+    __atomic_store_n(&t->scanned, end, __ATOMIC_RELEASE);
+}
+
+/* Newlines in [p, end) */
+static size_t lines_count(const uchar *p, const uchar *end)
+{
+    size_t n = 0;
+#ifdef __SSE2__
+    const uchar *stop;
+    __m128i acc;
+    const __m128i nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+
+    while (end - p >= 16) { /* 255 at most per byte of `acc` */
+        stop = p + MIN((size_t)(end - p) & ~(size_t)15, 255 * 16);
+        for (acc = zero; p < stop; p += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(
+                      _mm_loadu_si128((const __m128i *)p), nl));
+        acc = _mm_sad_epu8(acc, zero);
+        n += (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_extract_epi16(acc, 4);
+    }
+#endif
+    for (; p < end; p++)
+        n += *p == '\n';
+    return n;
+}
+
+/* Give back data[from, to) of a mapped `f` if the lexer did already, after
+ * its lines are counted, see cpp_file_slide() */
+static void lines_release(const cpp_file *f, size_t from, size_t to)
+{
+    size_t pgsz = (size_t)sysconf(_SC_PAGESIZE);
+
+    from &= ~(pgsz - 1);
+    to = MIN(to, f->released) & ~(pgsz - 1);
+    if (to > from)
+        madvise(f->data + from, to - from, MADV_DONTNEED);
+}
+
+/* Count the newlines of the whole blocks of `f` in [t->scanned, end) */
+static void lines_scan_blocks(const cpp_file *f, line_table *t, size_t end)
+{
+    size_t pos, from;
+    uint64_t n;
+    uchar release = HAS_FLAG(CPP_FILE_FLAGS(f), CPP_FILE_MAPPED) && !g_shared;
+
+    if (t->nblock == 0) {
+        t->block = cpp_mem_alloc(CPP_MEM_FILE, 64 * sizeof(uint64_t));
+        t->block[0] = 0;
+        t->nblock = 1, t->maxblock = 64;
+    }
+    pos = from = (t->nblock - 1) * CPP_FILE_LINE_BLOCK;
+    n = t->block[t->nblock - 1];
+    for (; pos + CPP_FILE_LINE_BLOCK <= end; pos += CPP_FILE_LINE_BLOCK) {
+        n += lines_count(f->data + pos, f->data + pos + CPP_FILE_LINE_BLOCK);
+        if (t->nblock == t->maxblock) {
+            t->maxblock *= 2;
+            t->block = cpp_mem_realloc(CPP_MEM_FILE, t->block,
+                                       t->maxblock * sizeof(uint64_t));
+        }
+        t->block[t->nblock++] = n;
+        if (release && pos + CPP_FILE_LINE_BLOCK - from >= CPP_FILE_WINDOW) {
+            lines_release(f, from, pos + CPP_FILE_LINE_BLOCK);
+            from = pos + CPP_FILE_LINE_BLOCK;
+        }
+    }
+    t->scanned = end;
+    if (release)
+        lines_release(f, from, pos);
+}
+
+/* cpp_loc_line() of a mapped file or a pipe, from the start of the block
+ * of `off` or from the last one found */
+static uint lines_find_block(const cpp_file *f, line_table *t, size_t off)
+{
+    size_t at;
+    uint line = 0;
+
+    if (g_shared)
+        pthread_mutex_lock(&g_lock);
+    if (f->data == NULL) /* evicted */
+        goto out;
+    if (off >= t->scanned || t->nblock == 0)
+        lines_scan_blocks(f, t, MIN(HAS_FLAG(CPP_FILE_FLAGS(f), CPP_FILE_PIPE) ?
+                                    f->visible : f->size + 1,
+                                    off + CPP_FILE_LINE_SCAN));
+    off = MIN(off, t->scanned);
+
+    at = off - off % CPP_FILE_LINE_BLOCK;
+    line = (uint)t->block[at / CPP_FILE_LINE_BLOCK] + 1;
+    if (t->atline != 0 && t->at >= at && t->at <= off)
+        at = t->at, line = t->atline;
+    line += (uint)lines_count(f->data + at, f->data + off);
+    t->at = off, t->atline = line;
+out:
+    if (g_shared)
+        pthread_mutex_unlock(&g_lock);
+    return line;
+}
+
+/* Line of `loc`, 1 for a buffer and 0 for CPP_LOC_NONE or if it's unknown.
+ * Nothing counts lines while lexing, a file's newlines are found the first
+ * time one of its lines is asked for, only up to CPP_FILE_LINE_SCAN past
+ * that location, so a diagnostic or __LINE__ near the start of a big file
+ * doesn't scan all of it.  Lines asked for one after the other, e.g. by
+ * -T, are found from the last one without a search.  Once the files are
+ * shared, the first thread to ask scans all of the file instead, so the
+ * table doesn't change anymore while others search it.  A mapped file or
+ * a pipe has its newlines counted from the start of a block instead, see
+ * lines_find_block(). */
+uint cpp_loc_line(cpp_loc loc)
+{
+    uint r = LOC_RANGE(loc);
+    const cpp_file *f;
+    line_table *t;
+    size_t off, end;
+    uint lo, hi, mid, hint;
+
+    if (r >= CPP_FILE_MAX_USED)
+        return 1;
+    if (r == 0 || r >= (uint)__atomic_load_n(&g_file_count, __ATOMIC_ACQUIRE))
+        return 0;
+
+    f = &g_files[r];
+    t = &g_lines[r];
+    off = LOC_OFFSET(loc);
+    if (LINE_BLOCKS(f))
+        return lines_find_block(f, t, off);
+    if (off >= __atomic_load_n(&t->scanned, __ATOMIC_ACQUIRE)) {
+        if (f->data == NULL) /* evicted without its lines */
+            return 0;
+        /* a pipe only has its visible lines, a file its added '\n' */
+        end = HAS_FLAG(CPP_FILE_FLAGS(f), CPP_FILE_PIPE) ? f->visible
+                                                        : f->size + 1;
+        if (g_shared) {
+            pthread_mutex_lock(&g_lock);
+            lines_scan(t, f->data, end);
+            pthread_mutex_unlock(&g_lock);
+        } else {
+            lines_scan(t, f->data, MIN(end, off + CPP_FILE_LINE_SCAN));
+        }
+    }
+
+    /* the line is `i + 1` if nl[i - 1] < off <= nl[i] */
+    lo = hint = __atomic_load_n(&t->hint, __ATOMIC_RELAXED);
+    if (lo < t->n && t->nl[lo] < off)
+        lo++;
+    if ((lo > 0 && t->nl[lo - 1] >= off) || (lo < t->n && t->nl[lo] < off)) {
+        lo = 0, hi = t->n;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (t->nl[mid] < off)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    if (lo != hint)
+        __atomic_store_n(&t->hint, lo, __ATOMIC_RELAXED);
+    return lo + 1;
+}
@@ -9,6 +9,11 @@
 #define TOMBSTONE       ((unsigned int)-1)
 #define LOAD_FACTOR(_0) ((unsigned int)((double)((_0) * 0.75)))
 
+static int __is_member(string_ref m)
+{
+    return m != 0 && m != TOMBSTONE;
+}
+
 static unsigned int pow2_roundup(unsigned int x)
 {
     x--;
@@ -64,7 +69,7 @@ static void __try_resize(hset_t *set)
     mask = new_capacity - 1;
 
     for (i = 0; i < old_capacity; i++) {
-        if (old_members[i] != 0 && old_members[i] != TOMBSTONE) {
+        if (__is_member(old_members[i])) {
             j = string_ref_hash(old_members[i]) & mask;
             while (new_members[j] != 0)
                 j = (j + 1) & mask;
@@ -150,8 +155,10 @@ void hset_union(hset_t *dst, hset_t *src)
 {
     unsigned int i;
 
-    for (i = 0; i < src->capacity; i++)
-        hset_set(dst, src->members[i]);
+    for (i = 0; i < src->capacity; i++) {
+        if (__is_member(src->members[i]))
+            hset_set(dst, src->members[i]);
+    }
 }
 
 void hset_union_copy(hset_t *dst, hset_t *src0, hset_t *src1)
@@ -169,8 +176,10 @@ void hset_union_copy(hset_t *dst, hset_t *src0, hset_t *src1)
 
     hset_copy(dst, s);
 
-    for (i = 0; i < d->capacity; i++)
-        hset_set(dst, d->members[i]);
+    for (i = 0; i < d->capacity; i++) {
+        if (__is_member(d->members[i]))
+            hset_set(dst, d->members[i]);
+    }
 }
 
 void hset_intersection(hset_t *dst, hset_t *src)
@@ -179,7 +188,7 @@ void hset_intersection(hset_t *dst, hset_t *src)
 
     for (i = 0; i < dst->capacity; i++) {
         string_ref m = dst->members[i];
-        if (m && !hset_find(src, m))
+        if (__is_member(m) && !hset_find(src, m))
             hset_remove(dst, m);
     }
 }
@@ -201,7 +210,7 @@ void hset_intersection_copy(hset_t *dst, hset_t *src0, hset_t *src1)
 
     for (i = 0; i < s->capacity; i++) {
         string_ref m = s->members[i];
-        if (m && hset_find(d, m))
+        if (__is_member(m) && hset_find(d, m))
             hset_set(dst, m);
     }
 }
@@ -1,10 +1,14 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "hash_table.h"
 
-#define TOMBSTONE ((void *)-1)
+#define MIGRATE_STEP 32 /* slots of `old` moved by an insertion or removal */
 
 static unsigned int pow2_roundup(unsigned int x)
 {
@@ -18,144 +22,260 @@ static unsigned int pow2_roundup(unsigned int x)
     return x;
 }
 
-void hash_table_setup(ht_t *ht, unsigned int capacity)
+static unsigned char __h2(uint64_t hash)
 {
-    ht_entry_t *entries;
+    return (unsigned char)(hash >> 57);
+}
 
-    capacity = pow2_roundup(capacity);
-    entries = calloc(capacity, sizeof(*entries));
-    assert(entries != NULL);
+/* Bit i is set if ctrl[i] == c, for the HT_GROUP bytes at `ctrl` */
+static unsigned int __match(const unsigned char *ctrl, unsigned char c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    __m128i eq = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)c));
+    return (unsigned int)_mm_movemask_epi8(eq);
+#else
+    unsigned int i, bits = 0;
 
-    ht->entries = entries;
-    ht->count = 0;
+    for (i = 0; i < HT_GROUP; i++)
+        bits |= (unsigned int)(ctrl[i] == c) << i;
+    return bits;
+#endif
+}
+
+static void *(*g_alloc)(size_t) = malloc;
+static void (*g_release)(void *) = free;
+
+void hash_table_allocator(void *(*alloc)(size_t), void (*release)(void *))
+{
+    g_alloc = alloc != NULL ? alloc : malloc;
+    g_release = release != NULL ? release : free;
+}
+
+static void __slots_new(ht_slots_t *s, unsigned int capacity)
+{
+    s->ctrl = g_alloc(capacity + HT_GROUP - 1);
+    s->keys = g_alloc(capacity * sizeof(string_ref));
+    s->vals = g_alloc(capacity * sizeof(void *));
+    assert(s->ctrl != NULL && s->keys != NULL && s->vals != NULL);
+    memset(s->ctrl, HT_EMPTY, capacity + HT_GROUP - 1);
+    s->capacity = capacity;
+}
+
+static void __slots_free(ht_slots_t *s)
+{
+    g_release(s->ctrl);
+    g_release(s->keys);
+    g_release(s->vals);
+    memset(s, 0, sizeof(*s));
+}
+
+/* The first HT_GROUP - 1 bytes are repeated after the last one, so a group
+ * can be loaded from any slot without wrapping around */
+static void __set_ctrl(ht_slots_t *s, unsigned int i, unsigned char c)
+{
+    s->ctrl[i] = c;
+    if (i < HT_GROUP - 1)
+        s->ctrl[s->capacity + i] = c;
+}
+
+static int __find(const ht_slots_t *s, string_ref key, uint64_t hash)
+{
+    unsigned int pos, bits, idx, mask = s->capacity - 1;
+    unsigned char h2 = __h2(hash);
+
+    pos = hash & mask;
+    while (1) {
+        bits = __match(s->ctrl + pos, h2);
+        while (bits != 0) {
+            idx = (pos + (unsigned int)__builtin_ctz(bits)) & mask;
+            if (s->keys[idx] == key)
+                return (int)idx;
+            bits &= bits - 1;
+        }
+        if (__match(s->ctrl + pos, HT_EMPTY) != 0)
+            return -1;
+        pos = (pos + HT_GROUP) & mask;
+    }
+}
+
+static void __put(ht_slots_t *s, string_ref key, void *val, uint64_t hash)
+{
+    unsigned int pos, bits, idx, mask = s->capacity - 1;
+
+    pos = hash & mask;
+    while ((bits = __match(s->ctrl + pos, HT_EMPTY)) == 0)
+        pos = (pos + HT_GROUP) & mask;
+
+    idx = (pos + (unsigned int)__builtin_ctz(bits)) & mask;
+    __set_ctrl(s, idx, __h2(hash));
+    s->keys[idx] = key;
+    s->vals[idx] = val;
+}
+
+/* Backward shift: the entries following `i` up to the next empty slot move
+ * back into the hole if it's not before their home slot */
+static void __erase(ht_slots_t *s, unsigned int i)
+{
+    unsigned int j = i, home, mask = s->capacity - 1;
+
+    while (1) {
+        j = (j + 1) & mask;
+        if (s->ctrl[j] == HT_EMPTY)
+            break;
+        home = string_ref_hash(s->keys[j]) & mask;
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            __set_ctrl(s, i, s->ctrl[j]);
+            s->keys[i] = s->keys[j];
+            s->vals[i] = s->vals[j];
+            i = j;
+        }
+    }
+    __set_ctrl(s, i, HT_EMPTY);
+}
+
+/* Move `n` slots of `old` into `cur`.  A moved slot stays full as HT_MOVED
+ * to keep the probe sequences of `old` unbroken, it never matches a key. */
+static void __migrate(ht_t *ht, unsigned int n)
+{
+    unsigned int i;
+    ht_slots_t *old = &ht->old;
+
+    while (n-- > 0 && ht->moved < old->capacity) {
+        i = ht->moved++;
+        if (old->ctrl[i] < HT_EMPTY) {
+            __put(&ht->cur, old->keys[i], old->vals[i],
+                  string_ref_hash(old->keys[i]));
+            __set_ctrl(old, i, HT_MOVED);
+        }
+    }
+
+    if (ht->moved == old->capacity)
+        __slots_free(old);
+}
+
+void hash_table_setup(ht_t *ht, unsigned int capacity)
+{
+    capacity = pow2_roundup(capacity < HT_GROUP ? HT_GROUP : capacity);
+
+    memset(ht, 0, sizeof(*ht));
+    __slots_new(&ht->cur, capacity);
     ht->capacity = capacity;
     ht->load_factor = (unsigned int)((double)capacity * 0.80);
 }
 
+void hash_table_incremental(ht_t *ht, unsigned char enable)
+{
+    ht->incremental = enable;
+}
+
 void hash_table_cleanup(ht_t *ht)
 {
-    free(ht->entries);
+    __slots_free(&ht->cur);
+    __slots_free(&ht->old);
     memset(ht, 0, sizeof(*ht));
 }
 
 void hash_table_cleanup_with_free(ht_t *ht, void (*free_func)(void *))
 {
     unsigned int i;
-    ht_entry_t *entries = ht->entries;
-
-    for (i = 0; i < ht->capacity; i++) {
-        if (entries[i].key != 0 && entries[i].val != TOMBSTONE) {
-            free_func(entries[i].val);
-            entries[i].key = 0;
-            entries[i].val = NULL;
-            entries[i].hash = 0;
-        }
+
+    for (i = 0; i < ht->cur.capacity; i++) {
+        if (ht->cur.ctrl[i] < HT_EMPTY)
+            free_func(ht->cur.vals[i]);
+    }
+    for (i = 0; i < ht->old.capacity; i++) {
+        if (ht->old.ctrl[i] < HT_EMPTY)
+            free_func(ht->old.vals[i]);
     }
 
-    free(entries);
-    ht->entries = NULL;
+    hash_table_cleanup(ht);
 }
 
 void hash_table_clear(ht_t *ht)
 {
+    __slots_free(&ht->old);
     ht->count = 0;
-    memset(ht->entries, 0, ht->capacity * sizeof(ht->entries[0]));
+    memset(ht->cur.ctrl, HT_EMPTY, ht->cur.capacity + HT_GROUP - 1);
 }
 
 static void __try_resize(ht_t *ht)
 {
-    ht_entry_t *old_entries, *entries;
-    unsigned int i, idx, old_capacity, capacity, mask;
+    unsigned int i;
+    ht_slots_t old;
 
     if (ht->count < ht->load_factor)
         return;
 
-    capacity = ht->capacity * 2;
-    entries = calloc(capacity, sizeof(*entries));
-    assert(entries != NULL);
-
-    old_entries = ht->entries;
-    old_capacity = ht->capacity;
-    mask = capacity - 1;
-
-    for (i = 0; i < old_capacity; i++) {
-        ht_entry_t *old_ent = &old_entries[i];
-        if (old_ent->key == 0 || old_ent->val == TOMBSTONE)
-            continue;
-        idx = old_ent->hash & mask;
-        while (entries[idx].key != 0)
-            idx = (idx + 1) & mask;
-        entries[idx] = *old_ent;
-    }
-
-    free(old_entries);
-    ht->entries = entries;
-    ht->capacity = capacity;
-    ht->load_factor = (unsigned int)((double)capacity * 0.80);
-}
+    if (ht->old.capacity != 0)
+        __migrate(ht, UINT_MAX);
 
-static ht_entry_t *__do_lookup(ht_t *ht, string_ref key, uint64_t hash,
-                               unsigned int *i)
-{
-    unsigned int idx, mask;
+    old = ht->cur;
+    __slots_new(&ht->cur, ht->capacity * 2);
+    ht->capacity = ht->cur.capacity;
+    ht->load_factor = (unsigned int)((double)ht->capacity * 0.80);
 
-    mask = ht->capacity - 1;
-    idx = hash & mask;
+    if (ht->incremental) {
+        ht->old = old;
+        ht->moved = 0;
+        return;
+    }
 
-    while (ht->entries[idx].key != 0 && ht->entries[idx].val != TOMBSTONE) {
-        if (ht->entries[idx].key == key && ht->entries[idx].hash == hash) {
-            if (i) *i = idx;
-            return &ht->entries[idx];
-        }
-        idx = (idx + 1) & mask;
+    for (i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] < HT_EMPTY)
+            __put(&ht->cur, old.keys[i], old.vals[i],
+                  string_ref_hash(old.keys[i]));
     }
-    return NULL;
+    __slots_free(&old);
 }
 
 void *hash_table_insert(ht_t *ht, string_ref key, void *val)
 {
-    uint64_t hash;
-    unsigned int idx, mask;
-    ht_entry_t *ent_at, ent;
+    int i;
+    void *old_val;
+    uint64_t hash = string_ref_hash(key);
 
-    hash = string_ref_hash(key);
-    ent_at = __do_lookup(ht, key, hash, NULL);
+    if (ht->old.capacity != 0)
+        __migrate(ht, MIGRATE_STEP);
 
-    if (ent_at != NULL) {
-        void *old_val = ent_at->val;
-        ent_at->val = val;
+    i = __find(&ht->cur, key, hash);
+    if (i >= 0) {
+        old_val = ht->cur.vals[i];
+        ht->cur.vals[i] = val;
         return old_val;
     }
 
-    __try_resize(ht);
-
-    ent.key = key;
-    ent.val = val;
-    ent.hash = hash;
-
-    mask = ht->capacity - 1;
-    idx = hash & mask;
-    ent_at = &ht->entries[idx];
-
-    while (ent_at->key != 0 && ent_at->val != TOMBSTONE) {
-        idx = (idx + 1) & mask;
-        ent_at = &ht->entries[idx];
+    if (ht->old.capacity != 0 && (i = __find(&ht->old, key, hash)) >= 0) {
+        old_val = ht->old.vals[i];
+        __set_ctrl(&ht->old, (unsigned int)i, HT_MOVED);
+        __put(&ht->cur, key, val, hash);
+        return old_val;
     }
 
-    *ent_at = ent;
+    __try_resize(ht);
+    __put(&ht->cur, key, val, hash);
     ht->count++;
     return NULL;
 }
 
 void *hash_table_remove(ht_t *ht, string_ref key)
 {
+    int i;
     void *ret_val = NULL;
     uint64_t hash = string_ref_hash(key);
-    ht_entry_t *ent = __do_lookup(ht, key, hash, NULL);
 
-    if (ent != NULL) {
-        ret_val = ent->val;
-        ent->val = TOMBSTONE;
+    if (ht->old.capacity != 0)
+        __migrate(ht, MIGRATE_STEP);
+
+    i = __find(&ht->cur, key, hash);
+    if (i >= 0) {
+        ret_val = ht->cur.vals[i];
+        __erase(&ht->cur, (unsigned int)i);
+        ht->count--;
+    } else if (ht->old.capacity != 0 &&
+               (i = __find(&ht->old, key, hash)) >= 0) {
+        ret_val = ht->old.vals[i];
+        __set_ctrl(&ht->old, (unsigned int)i, HT_MOVED);
         ht->count--;
     }
     return ret_val;
@@ -163,7 +283,13 @@ void *hash_table_remove(ht_t *ht, string_ref key)
 
 void *hash_table_lookup(ht_t *ht, string_ref key)
 {
+    int i;
     uint64_t hash = string_ref_hash(key);
-    ht_entry_t *ent = __do_lookup(ht, key, hash, NULL);
-    return ent ? ent->val : NULL;
+
+    i = __find(&ht->cur, key, hash);
+    if (i >= 0)
+        return ht->cur.vals[i];
+    if (ht->old.capacity != 0 && (i = __find(&ht->old, key, hash)) >= 0)
+        return ht->old.vals[i];
+    return NULL;
 }
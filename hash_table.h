@@ -3,20 +3,38 @@
 
 #include "string_pool.h"
 
+/* Open addressing with a control byte per slot (Swiss table style): the 7
+ * top bits of the hash of a full slot, or HT_EMPTY.  16 control bytes are
+ * probed at once, and the key is only read when its byte matches.
+ * Probing is linear from the home slot, so removal shifts the following
+ * entries back instead of leaving a tombstone. */
+#define HT_GROUP 16
+#define HT_EMPTY 0x80
+#define HT_MOVED 0xfe /* only in `old`, see hash_table_incremental() */
+
 typedef struct {
-    string_ref key;
-    void *val; // hash table don't own the value
-    uint64_t hash;
-} ht_entry_t;
+    unsigned char *ctrl; // capacity + HT_GROUP - 1, the first bytes repeat
+    string_ref *keys;
+    void **vals; // hash table don't own the value
+    unsigned int capacity;
+} ht_slots_t;
 
 typedef struct {
-    ht_entry_t *entries;
+    ht_slots_t cur;
+    ht_slots_t old; // being moved into `cur`, see hash_table_incremental()
+    unsigned int moved; // slots of `old` already moved
     unsigned int count;
     unsigned int capacity;
     unsigned int load_factor;
+    unsigned char incremental;
 } ht_t;
 
+// where the slots come from, malloc() and free() by default
+void hash_table_allocator(void *(*alloc)(size_t), void (*release)(void *));
 void hash_table_setup(ht_t *, unsigned int);
+// grow by moving a few slots on each insertion or removal instead of all
+// at once, for latency-sensitive users
+void hash_table_incremental(ht_t *, unsigned char);
 void hash_table_clear(ht_t *);
 void hash_table_cleanup(ht_t *);
 // since value is not owned by the hash table, this function exists
@@ -29,4 +47,20 @@ void *hash_table_insert(ht_t *, string_ref, void *);
 void *hash_table_remove(ht_t *, string_ref);
 void *hash_table_lookup(ht_t *, string_ref);
 
+// typed wrappers, e.g. HT_TYPED(macro_table, cpp_macro) gives
+// cpp_macro *macro_table_lookup(ht_t *, string_ref) and so on
+#define HT_TYPED(name, T)                                               \
+    static inline T *name##_insert(ht_t *ht, string_ref key, T *val)   \
+    {                                                                   \
+        return (T *)hash_table_insert(ht, key, val);                    \
+    }                                                                   \
+    static inline T *name##_remove(ht_t *ht, string_ref key)           \
+    {                                                                   \
+        return (T *)hash_table_remove(ht, key);                         \
+    }                                                                   \
+    static inline T *name##_lookup(ht_t *ht, string_ref key)           \
+    {                                                                   \
+        return (T *)hash_table_lookup(ht, key);                         \
+    }
+
 #endif
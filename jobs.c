@@ -0,0 +1,247 @@
+#include "cpp.h"
+#include <pthread.h>
+
+/* Translation units preprocessed at the same time, see cpp_jobs_run().
+ *
+ * Each worker has a context of its own, forked from the one the options went
+ * into, and the files it reads are shared with the others.  A worker starts
+ * with a contiguous block of the units, once it's done with it, it takes the
+ * second half of what's left to the worker that has the most.  What a unit
+ * prints is kept in memory until the units before it are written, so the
+ * output is that of one unit after another. */
+
+typedef struct {
+    pthread_mutex_t lock;
+    int lo, hi; /* units not started, taken from `lo`, stolen from `hi` */
+    pthread_t thread;
+    uchar started;
+} job_worker;
+
+typedef struct {
+    char *out, *err; /* open_memstream() */
+    size_t nout, nerr;
+    int ret, errnum;
+    uchar done;
+} job_result;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;
+static job_worker g_worker[CPP_JOBS_MAX];
+static int g_nworker;
+static job_result *g_result;
+static cpp_context *g_root;
+static cpp_job_fn g_run;
+static void *g_arg;
+static int g_stop_at; /* units after it aren't run anymore */
+
+static void stop_at(int i)
+{
+    int cur = __atomic_load_n(&g_stop_at, __ATOMIC_RELAXED);
+
+    while (i < cur && !__atomic_compare_exchange_n(&g_stop_at, &cur, i, 1,
+                                                   __ATOMIC_RELAXED,
+                                                   __ATOMIC_RELAXED))
+        ;
+}
+
+/* Half of what's left to the worker that has the most, into `w` */
+static int job_steal(job_worker *w)
+{
+    int k, n, best, most, lo, hi;
+    job_worker *v;
+
+    while (1) {
+        best = -1, most = 0;
+        for (k = 0; k < g_nworker; k++) { /* a guess, checked below */
+            v = &g_worker[k];
+            n = __atomic_load_n(&v->hi, __ATOMIC_RELAXED) -
+                __atomic_load_n(&v->lo, __ATOMIC_RELAXED);
+            if (v != w && n > most)
+                best = k, most = n;
+        }
+        if (best < 0)
+            return 0;
+
+        v = &g_worker[best];
+        pthread_mutex_lock(&v->lock);
+        n = v->hi - v->lo;
+        lo = v->lo + n / 2, hi = v->hi;
+        if (n > 0)
+            __atomic_store_n(&v->hi, lo, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&v->lock);
+        if (n > 0)
+            break;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    __atomic_store_n(&w->lo, lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->hi, hi, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+/* The next unit for `w`, -1 if there's none left anywhere */
+static int job_next(job_worker *w)
+{
+    int i = -1;
+
+    do {
+        pthread_mutex_lock(&w->lock);
+        if (w->lo < w->hi) {
+            i = w->lo;
+            __atomic_store_n(&w->lo, i + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&w->lock);
+    } while (i < 0 && job_steal(w));
+    return i;
+}
+
+/* `g_run` for unit `i`, a fatal cpp_error() fails the unit rather than the
+ * process, with what it printed so far, as if it had exited */
+static int job_unit(cpp_context *ctx, int i, FILE *out, FILE *err)
+{
+    int ret;
+    jmp_buf jb;
+
+    if (setjmp(jb) != 0) {
+        cpp_error_catch(NULL);
+        return 1;
+    }
+    cpp_error_catch(&jb);
+    ret = g_run(ctx, i, out, err, g_arg);
+    cpp_error_catch(NULL);
+    return ret;
+}
+
+static void *worker(void *arg)
+{
+    int i;
+    FILE *out, *err;
+    job_result *r;
+    cpp_context ctx;
+    uchar fresh = 1;
+    job_worker *w = arg;
+
+    cpp_context_fork(&ctx, g_root);
+    while ((i = job_next(w)) >= 0) {
+        r = &g_result[i];
+        if (i <= __atomic_load_n(&g_stop_at, __ATOMIC_RELAXED)) {
+            if (!fresh)
+                cpp_context_reset(&ctx);
+            fresh = 0;
+            out = open_memstream(&r->out, &r->nout);
+            err = open_memstream(&r->err, &r->nerr);
+            if (out != NULL && err != NULL) {
+                ctx.err = err;
+                r->ret = job_unit(&ctx, i, out, err);
+                ctx.err = NULL;
+            } else {
+                r->ret = -1;
+                r->errnum = errno;
+            }
+            if (out != NULL)
+                fclose(out);
+            if (err != NULL)
+                fclose(err);
+            if (r->ret != 0)
+                stop_at(i);
+        }
+
+        pthread_mutex_lock(&g_lock);
+        r->done = 1;
+        pthread_cond_broadcast(&g_done);
+        pthread_mutex_unlock(&g_lock);
+    }
+    cpp_context_cleanup(&ctx);
+    return NULL;
+}
+
+/* Call `run` for the units [0, n) with `njob` threads, each with a context
+ * forked from `root`.  `run` prints into `out` what goes to the `out` given
+ * here, and into `err` what goes to stderr, they're written in the order of
+ * the units.  It stops after a unit for which `run` returns nonzero, and
+ * returns 1 then, 0 if all went well, -1 with errno if it couldn't write or
+ * start a thread.  A fatal cpp_error() in a unit is caught, the unit fails
+ * as if `run` returned 1. */
+int cpp_jobs_run(cpp_context *root, int njob, int n, cpp_job_fn run,
+                 void *arg, FILE *out)
+{
+    int i, k, e, ret = 0, errnum = 0, started = 0;
+    job_result *r;
+    job_worker *w;
+
+    if (n <= 0)
+        return 0;
+    njob = MAX(1, MIN(MIN(njob, CPP_JOBS_MAX), n));
+
+    g_result = cpp_mem_calloc(CPP_MEM_SCRATCH, (size_t)n, sizeof(job_result));
+    g_root = root;
+    g_run = run;
+    g_arg = arg;
+    g_stop_at = n;
+    g_nworker = njob;
+    cpp_file_share();
+
+    for (k = 0; k < njob; k++) {
+        w = &g_worker[k];
+        pthread_mutex_init(&w->lock, NULL);
+        w->lo = (int)((long)n * k / njob);
+        w->hi = (int)((long)n * (k + 1) / njob);
+    }
+    /* the units of a thread that didn't start are stolen by the others */
+    for (k = 0; k < njob; k++) {
+        w = &g_worker[k];
+        e = pthread_create(&w->thread, NULL, worker, w);
+        w->started = e == 0;
+        if (w->started)
+            started++;
+        else
+            errnum = e;
+    }
+    if (started == 0) {
+        ret = -1;
+        goto done;
+    }
+
+    for (i = 0; i < n; i++) {
+        r = &g_result[i];
+        pthread_mutex_lock(&g_lock);
+        while (!r->done)
+            pthread_cond_wait(&g_done, &g_lock);
+        pthread_mutex_unlock(&g_lock);
+
+        if (r->ret < 0) {
+            errnum = r->errnum;
+            ret = -1;
+        } else if (fwrite(r->out, 1, r->nout, out) != r->nout ||
+                   fwrite(r->err, 1, r->nerr, stderr) != r->nerr) {
+            errnum = errno;
+            ret = -1;
+        } else if (r->ret != 0) {
+            ret = 1;
+        }
+        free(r->out);
+        free(r->err);
+        r->out = r->err = NULL;
+        if (ret != 0) {
+            stop_at(i);
+            break;
+        }
+    }
+
+    for (k = 0; k < njob; k++)
+        if (g_worker[k].started)
+            pthread_join(g_worker[k].thread, NULL);
+    for (; i < n; i++) { /* those after a failed unit */
+        free(g_result[i].out);
+        free(g_result[i].err);
+    }
+
+done:
+    for (k = 0; k < njob; k++)
+        pthread_mutex_destroy(&g_worker[k].lock);
+    cpp_mem_free(g_result);
+    g_result = NULL;
+    errno = errnum;
+    return ret;
+}
@@ -1,56 +1,85 @@
 #include "cpp.h"
+#include <setjmp.h>
 
 /* handle complicated "\\\n" */
 #define CHECK_ESCNL(_s, _t) do {                                \
         if (unlikely(*(_s)->p == '\\' && (_s)->p[1] == '\n')) { \
-            (_s)->p += 2; (_s)->lineno++;                       \
+            (_s)->p += 2;                                       \
             (_t)->flags |= CPP_TOKEN_ESCNL;                     \
         }                                                       \
     } while (0)
 
+/* location of `_p`, lines are only counted when asked, see cpp_loc_line() */
+#define LOC(_s, _p) (likely((_s)->at == CPP_LOC_NONE) ?         \
+        (_s)->file->loc + (cpp_loc)((_p) - (_s)->file->data) : (_s)->at)
+
 
 /* ------------------------------------------------------------------------- */
 
-static cpp_context *g_context;
-static cpp_buffer g_lexbuf;
+static _Thread_local cpp_context *t_context; /* of the thread lexing */
+static _Thread_local jmp_buf *t_pretok; /* in cpp_lex_raw() */
+static _Thread_local uchar t_keep; /* in cpp_lex_pretokenize() */
 
 void cpp_lex_setup(cpp_context *ctx)
 {
-    g_context = ctx;
-    cpp_buffer_setup(&g_lexbuf, 16384);
+    t_context = ctx;
 }
 
 void cpp_lex_cleanup(cpp_context *ctx)
 {
     (void)ctx;
-    cpp_buffer_cleanup(&g_lexbuf);
 }
 
 /* ------------------------------------------------------------------------- */
 
+static void cpp_lex_error(cpp_stream *s, const char *fmt, ...);
+
+/* The stream reached the '\0' that ends what arrived so far from a pipe,
+ * wait for more. */
+static int cpp_lex_refill(cpp_stream *s)
+{
+    int r;
+    cpp_file *f = s->file;
+
+    if (likely(!HAS_FLAG(CPP_FILE_FLAGS(f), CPP_FILE_PIPE)) ||
+        s->p != f->data + f->visible)
+        return 0;
+
+    r = cpp_file_refill(f);
+    if (r < 0)
+        cpp_lex_error(s, "input from pipe is larger than %lu bytes",
+                      CPP_FILE_PIPE_MAX);
+    return r;
+}
+
 static void cpp_lex_error(cpp_stream *s, const char *fmt, ...)
 {
     va_list ap;
+    FILE *fp;
+    if (t_pretok != NULL) /* it's reported when the file is lexed for real */
+        longjmp(*t_pretok, 1);
+    fp = cpp_error_file(t_context);
     va_start(ap, fmt);
-    fprintf(stderr, "\x1b[1;29m%s:%u:\x1b[0m ", s->fname, s->lineno);
-    fprintf(stderr, "\x1b[1;31merror:\x1b[0m ");
-    vfprintf(stderr, fmt, ap);
-    fputc('\n', stderr);
+    fprintf(fp, "\x1b[1;29m%s:%u:\x1b[0m ", s->fname,
+            cpp_loc_line(LOC(s, s->p)));
+    fprintf(fp, "\x1b[1;31merror:\x1b[0m ");
+    vfprintf(fp, fmt, ap);
+    fputc('\n', fp);
     va_end(ap);
-    cpp_context_cleanup(g_context);
-    exit(1);
+    cpp_error_exit(t_context);
 }
 
 static void cpp_lex_comment(cpp_stream *s, tkchar kind)
 {
-    uint start = s->lineno;
+    int maybe_done = 0;
+    const uchar *start = s->p;
     s->p++;
 
+again:
     if (kind == '/') {
         while (*s->p) {
             if (*s->p == '\\' && s->p[1] == '\n') {
                 s->p += 2;
-                s->lineno++;
                 continue;
             }
             if (*s->p == '\n')
@@ -58,33 +87,67 @@ static void cpp_lex_comment(cpp_stream *s, tkchar kind)
             s->p++;
         }
     } else {
-        int maybe_done = 0;
         while (*s->p) {
             if (*s->p == '\\' && s->p[1] == '\n') {
                 s->p += 2;
-                s->lineno++;
                 continue;
             }
             if (*s->p == '/' && maybe_done) {
                 s->p++;
                 return;
             }
-            maybe_done = 0;
-            if (*s->p == '\n')
-                s->lineno++;
-            else if (*s->p == '*')
-                maybe_done = 1;
+            if (unlikely(*s->p == '\n' && s->wlimit != NULL &&
+                         s->p >= s->wlimit)) /* a comment may be long */
+                s->wlimit = cpp_file_slide(s->file, s->p);
+            maybe_done = *s->p == '*';
             s->p++;
         }
     }
 
-    s->lineno = start;
+    if (cpp_lex_refill(s))
+        goto again;
+
+    s->p = start;
     cpp_lex_error(s, "unterminated comment");
 }
 
+/* A <header> is lexed differently than the tokens of a pretokenized stream,
+ * so lex from right after the '<' until the end of line, see cpp_lex_resync().
+ */
+static void cpp_lex_unpretok(cpp_stream *s)
+{
+    const cpp_token *lt = s->tok - 1;
+
+    s->p = lt->p.ptr + 1;
+    s->flags = 0;
+    s->resync = s->tok;
+    s->tok = NULL;
+}
+
+/* Back to the pretokenized stream after the newline `tk`, unless the
+ * <header> changed how the lines are split, e.g. it had a comment in it. */
+static void cpp_lex_resync(cpp_stream *s, const cpp_token *tk)
+{
+    cpp_token *t;
+    cpp_loc loc = tk->loc - s->file->loc; /* as pretokenized */
+
+    for (t = s->resync; t->kind != TK_eof && t->loc <= loc; t++) {
+        if (t->kind == '\n' && t->loc == loc) {
+            s->tok = t + 1;
+            break;
+        }
+    }
+    s->resync = NULL;
+}
+
 void cpp_lex_string(cpp_stream *s, cpp_token *tk, tkchar endq)
 {
-    tk->lineno = s->lineno;
+    if (unlikely(s->tok != NULL))
+        cpp_lex_unpretok(s);
+    else if (unlikely(s->piped))
+        cpp_pipeline_detach(s);
+
+    tk->loc = LOC(s, s->p);
     tk->p.ptr = s->p;
 
     if (endq == '"' || endq == '\'')
@@ -129,7 +192,7 @@ void cpp_lex_string(cpp_stream *s, cpp_token *tk, tkchar endq)
 
 static void cpp_lex_punct(cpp_stream *s, cpp_token *tk)
 {
-    tk->lineno = s->lineno;
+    tk->loc = LOC(s, s->p);
     tk->p.ptr = s->p;
     tk->kind = *s->p;
     s->p++;
@@ -231,35 +294,71 @@ static void cpp_lex_punct(cpp_stream *s, cpp_token *tk)
         tk->length = (uint)(s->p - tk->p.ptr);
     } else {
         /* restore line */
-        s->p = tk->p.ptr; s->lineno = tk->lineno; s->p++;
+        s->p = tk->p.ptr + 1;
         tk->length = 1; tk->kind = *(tk->p.ptr);
     }
 }
 
-static void cpp_lex_ident(cpp_stream *s, cpp_token *tk)
+/* Intern the spelling of the identifier at tk->p.ptr, without its "\\\n".
+ * The pool is thread-safe, so it's also done on the worker threads.
+ * Those of system headers, and all of them in pretokens as they're kept from
+ * one translation unit to the next, go to the base layer of the pool, see
+ * string_pool_overlay_begin().  A string the translation unit has in the
+ * overlay already stays its own: pretokens then give up. */
+static void cpp_lex_intern(cpp_stream *s, cpp_token *tk)
 {
-    const uchar *p = cpp_buffer_append_ch(&g_lexbuf, *s->p);
+    char buf[256], *spell = buf;
+    const char *p = (const char *)tk->p.ptr;
+    uint i, n = tk->length;
+    string_ref ref;
+    uchar base = t_keep || HAS_FLAG(CPP_FILE_FLAGS(s->file), CPP_FILE_SYSTEM);
+
+    if (unlikely(HAS_FLAG(tk->flags, CPP_TOKEN_ESCNL))) {
+        if (tk->length > sizeof(buf)) {
+            spell = cpp_mem_alloc(CPP_MEM_SCRATCH, tk->length);
+        }
+        for (i = n = 0; i < tk->length; i++) {
+            if (tk->p.ptr[i] == '\\' && tk->p.ptr[i + 1] == '\n')
+                i++;
+            else
+                spell[n++] = (char)tk->p.ptr[i];
+        }
+        p = spell;
+    }
+
+    ref = base ? string_ref_newlen_base(p, n) : string_ref_newlen(p, n);
+    if (ref == 0 && !t_keep)
+        ref = string_ref_newlen(p, n);
+    if (spell != buf)
+        cpp_mem_free(spell);
+    if (ref == 0) /* see cpp_lex_raw() */
+        longjmp(*t_pretok, 1);
 
-    tk->lineno = s->lineno;
+    tk->p.ref = ref;
+    tk->length = string_ref_len(ref);
+}
+
+static void cpp_lex_ident(cpp_stream *s, cpp_token *tk)
+{
+    tk->p.ptr = s->p;
+    tk->loc = LOC(s, s->p);
     s->p++;
 
     while (*s->p != 0) {
         CHECK_ESCNL(s, tk);
         if (!(isalnum(*s->p) || *s->p == '_'))
             break;
-        cpp_buffer_append_ch(&g_lexbuf, *s->p);
         s->p++;
     }
 
-    tk->p.ref = string_ref_newlen((const char *)p, g_lexbuf.len);
-    tk->length = string_ref_len(tk->p.ref);
-    cpp_buffer_clear(&g_lexbuf);
+    tk->length = (uint)(s->p - tk->p.ptr);
+    cpp_lex_intern(s, tk);
 }
 
 static void cpp_lex_number(cpp_stream *s, cpp_token *tk)
 {
     tk->p.ptr = s->p;
-    tk->lineno = s->lineno;
+    tk->loc = LOC(s, s->p);
 
     while (*s->p) {
         CHECK_ESCNL(s, tk);
@@ -287,6 +386,18 @@ static void cpp_lex_number(cpp_stream *s, cpp_token *tk)
     tk->length = (uint)(s->p - tk->p.ptr);
 }
 
+/* Next token of a pretokenized stream */
+static void cpp_lex_pretok(cpp_stream *s, cpp_token *tk)
+{
+    cpp_token *t = s->tok;
+
+    *tk = *t;
+    tk->fileno = s->file->no;
+    tk->loc += s->file->loc;
+    if (t->kind != TK_eof)
+        s->tok++;
+}
+
 void cpp_lex_scan(cpp_stream *s, cpp_token *tk)
 {
     const uchar *p;
@@ -294,14 +405,24 @@ void cpp_lex_scan(cpp_stream *s, cpp_token *tk)
     if (unlikely(s == NULL))
         return;
 
+    if (s->tok != NULL) {
+        cpp_lex_pretok(s, tk);
+        return;
+    }
+    if (s->piped && cpp_pipeline_next(s, tk))
+        return;
+
     tk->flags = s->flags;
     s->flags = 0;
     tk->fileno = s->file->no;
+    if (unlikely(s->wlimit != NULL && s->p >= s->wlimit))
+        s->wlimit = cpp_file_slide(s->file, s->p);
 
+again:
     while (*s->p) {
         /* line continuation */
         if (*s->p == '\\' && s->p[1] == '\n') {
-            s->p += 2; s->lineno++;
+            s->p += 2;
             continue;
         }
 
@@ -312,7 +433,6 @@ void cpp_lex_scan(cpp_stream *s, cpp_token *tk)
             if (*s->p == '\\' && s->p[1] == '\n') {
                 do {
                     s->p += 2;
-                    s->lineno++;
                 } while (*s->p == '\\' && s->p[1] == '\n');
             }
             if (*s->p == '/' || *s->p == '*') {
@@ -327,10 +447,14 @@ void cpp_lex_scan(cpp_stream *s, cpp_token *tk)
 
         /* newline */
         if (*s->p == '\n') {
-            s->p++; tk->lineno = s->lineno++;
+            tk->loc = LOC(s, s->p); s->p++;
             s->flags = tk->flags | CPP_TOKEN_BOL;
             s->flags &= ~CPP_TOKEN_SPACE;
             tk->kind = '\n'; tk->length = 0;
+            if (unlikely(s->resync != NULL))
+                cpp_lex_resync(s, tk);
+            else if (unlikely(s->piped))
+                cpp_pipeline_resync(s, tk);
             return;
         }
 
@@ -382,8 +506,79 @@ void cpp_lex_scan(cpp_stream *s, cpp_token *tk)
         return;
     }
 
-    tk->lineno = s->lineno;
+    if (unlikely(cpp_lex_refill(s)))
+        goto again;
+
+    tk->loc = LOC(s, s->p);
     tk->kind = TK_eof;
     tk->length = 0;
     tk->p.ptr = s->p;
 }
+
+/* Lex `s` to the end without reporting errors or touching any global but the
+ * (thread-safe) string pool, for a worker thread.
+ * Each token goes to `emit`, which can stop it by returning non-zero.
+ * Returns 0 after TK_eof, 1 if stopped, -1 if there is a lexing error, then
+ * `s` is back at the start of the bad token so it can be lexed as usual. */
+int cpp_lex_raw(cpp_stream *s, int (*emit)(void *, const cpp_token *),
+                void *arg)
+{
+    jmp_buf env;
+    cpp_token tk;
+    volatile cpp_stream saved = *s;
+
+    if (setjmp(env) != 0) {
+        t_pretok = NULL;
+        s->p = saved.p;
+        s->flags = saved.flags;
+        return -1;
+    }
+
+    t_pretok = &env;
+    do {
+        saved.p = s->p;
+        saved.flags = s->flags;
+        cpp_lex_scan(s, &tk);
+        if (emit(arg, &tk) != 0) {
+            t_pretok = NULL;
+            return 1;
+        }
+    } while (tk.kind != TK_eof);
+    t_pretok = NULL;
+
+    return 0;
+}
+
+static int pretokenize_emit(void *arg, const cpp_token *tk)
+{
+    cpp_token_array_append(arg, tk);
+    return 0;
+}
+
+/* Lex all of `data` into `ts`, ending with TK_eof, see cpp_lex_raw().
+ * `flags` are the cpp_file flags it will have.
+ * Returns -1 if there is a lexing error, or an identifier the translation
+ * unit has in the pool's overlay, the file is then lexed as usual. */
+int cpp_lex_pretokenize(const uchar *data, uchar flags, cpp_token_array *ts)
+{
+    cpp_file file = {0};
+    cpp_stream s = {0};
+
+    file.flags = flags;
+    file.data = (uchar *)data; /* and loc 0, so locations are offsets */
+    s.flags = CPP_TOKEN_BOL | CPP_TOKEN_BOF;
+    s.at = CPP_LOC_NONE;
+    s.fname = s.ppfname = "";
+    s.p = data;
+    s.file = &file;
+
+    t_keep = 1;
+    if (cpp_lex_raw(&s, pretokenize_emit, ts) != 0) {
+        t_keep = 0;
+        cpp_token_array_cleanup(ts);
+        return -1;
+    }
+    t_keep = 0;
+
+    return 0;
+}
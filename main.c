@@ -3,12 +3,48 @@
 static void usage(int exit_code)
 {
     puts("Usage:");
-    puts("  cpp [-EPT] [-D MACRO=VAL] [-I DIR] [-o OUT_FILE] [-U MACRO] FILE");
+    puts("  cpp [-BEPT] [-D MACRO=VAL] [-I DIR] [-j N] [-o OUT_FILE] [-U MACRO] [-f OPT] FILE...");
+    puts("");
+    puts("FILE may be '-' or a FIFO, it's preprocessed while it's being written.");
+    puts("Several FILEs are preprocessed one after another, each with the macros");
+    puts("of the options only, and their output follows in that order.  The files");
+    puts("they #include are read once for all (not with -B).");
     puts("");
     puts("Options:");
+    puts("  -B              Preprocess into a binary token stream, see binary.c");
     puts("  -D MACRO=VAL    Define MACRO to VAL (or 1 if VAL omitted)");
     puts("  -E              Preprocess only");
+    puts("  -fprefetch[=N]  Read #include-d files ahead with N threads");
+    puts("  -finclude-trace=FILE");
+    puts("                  Prefetch what FILE lists, then record this run's");
+    puts("                  #include-s into it (implies -fprefetch)");
+    puts("  -fevict-headers Free each header once it's done, so the memory");
+    puts("                  used follows the #include depth (no -fpipeline)");
+    puts("  -fmem-report    Print the memory used by each subsystem at exit,");
+    puts("                  and after each FILE if there are several");
+    puts("  -fpipeline      Lex, preprocess and print on separate threads");
+    puts("  -fserver=SOCK   Stay up and preprocess what's asked for on the Unix");
+    puts("                  socket SOCK, with the files read kept from one");
+    puts("                  request to the next until they change.  -D and -U");
+    puts("                  apply to each request, -I and -f to all of them");
+    puts("  -fconnect=SOCK  Have the -fserver at SOCK do the rest of the command");
+    puts("                  line, which may only have -D, -E, -o, -P, -T, -U");
+    puts("                  and FILEs");
+    puts("  -fstream-input  Lex input files through a sliding mmap() window");
+    puts("  -ftime-report[=FILE]");
+    puts("                  Print where the time went, by phase, and hardware");
+    puts("                  counters at exit, as JSON into FILE if it's given");
+    puts("  -ftime-trace=FILE");
+    puts("                  Write the time spent in each #include-d file into");
+    puts("                  FILE, in Chrome trace-event format, with the");
+    puts("                  include graph");
+    puts("  -fstring-pool=FILE");
+    puts("                  Start with the identifiers saved in FILE, then save");
+    puts("                  them with the ones of this run's <headers> into it");
     puts("  -I DIR          Append DIR to the include search path");
+    puts("  -j N            Preprocess N FILEs at the same time, the output");
+    puts("                  stays in order (no -fevict-headers, -fpipeline");
+    puts("                  or -ftime-trace)");
     puts("  -P              Disable linemarker output in -E mode");
     puts("  -U MACRO        Undefine MACRO");
     puts("  -T              Dump tokens");
@@ -16,24 +52,284 @@ static void usage(int exit_code)
     exit(exit_code);
 }
 
+/* What's done with each FILE, by main(), by a cpp_jobs_run() worker or for
+ * a request to -fserver */
+typedef struct {
+    uchar opt_B, opt_E, opt_T, mem_report;
+    int ndef, nin;
+    struct { uchar undef; const char *arg; } *def; /* again for each FILE */
+    char **in;
+    char **path; /* of each FILE if it's not `in`, see serve() */
+} unit_opts;
+
+static void replay_defs(cpp_context *ctx, const unit_opts *o)
+{
+    int i;
+
+    for (i = 0; i < o->ndef; i++) {
+        if (o->def[i].undef)
+            cpp_macro_undefine(ctx, o->def[i].arg);
+        else
+            cpp_macro_define(ctx, o->def[i].arg);
+    }
+}
+
+/* FILE `i` into `fp`, returns 1 if it can't be opened */
+static int preprocess(cpp_context *ctx, const unit_opts *o, int i, FILE *fp,
+                      FILE *err)
+{
+    cpp_file *f = NULL;
+    cpp_token tk;
+    size_t ntoken;
+    cpp_mem_stats st;
+    const char *in = o->in[i];
+
+    if (o->path != NULL) { /* read by a request before, if it didn't change */
+        f = cpp_file_find(string_ref_new_keep(o->path[i]));
+        if (f != NULL && f->name != string_ref_new_keep(in))
+            f = NULL;
+        if (f == NULL)
+            f = cpp_file_open(o->path[i], in);
+    } else {
+        f = cpp_file_open(in, strcmp(in, "-") ? in : "<stdin>");
+    }
+    if (f == NULL) {
+        fprintf(err, "unable to open '%s': %s\n", in, strerror(errno));
+        return 1;
+    }
+
+    if (o->opt_T) {
+        cpp_run(ctx, f);
+        cpp_dump_token(ctx, fp);
+    } else if (o->opt_E) {
+        cpp_print(ctx, f, fp);
+    } else if (o->opt_B) {
+        cpp_print_binary(ctx, f, fp);
+    } else { /* tokens are counted as they come, with TK_eof */
+        ntoken = 0;
+        cpp_start(ctx, f);
+        if (cpp_pipeline_produce(ctx))
+            while (cpp_pipeline_pull(&tk))
+                ntoken++;
+        else
+            while (cpp_next_token(ctx, &tk))
+                ntoken++;
+        if (o->nin > 1)
+            fprintf(fp, "%s: ", in);
+        fprintf(fp, "total tokens: %zu\n", ntoken + 1);
+    }
+    if (o->mem_report && o->nin > 1) { /* the run's is printed at exit */
+        cpp_mem_unit_stat(ctx, &st);
+        fprintf(err, "%s: ", in);
+        cpp_mem_report(err, &st);
+    }
+    return 0;
+}
+
+/* The identifiers of the unit that's done go, see string_pool_overlay_begin().
+ * Nothing of it may be used anymore but what cpp_context_reset() frees. */
+static void unit_done(void)
+{
+    string_pool_overlay_drop();
+    string_pool_overlay_begin();
+}
+
+static int preprocess_job(cpp_context *ctx, int i, FILE *fp, FILE *err,
+                          void *arg)
+{
+    replay_defs(ctx, arg); /* a forked or reset context has none */
+    return preprocess(ctx, arg, i, fp, err);
+}
+
+/* `name` as seen from `cwd` into a new string */
+static char *path_from(const char *cwd, const char *name)
+{
+    char *path;
+    size_t len = strlen(cwd) + strlen(name) + 2;
+
+    if (name[0] == '/')
+        return strdup(name);
+    path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/%s", cwd, name);
+    return path;
+}
+
+/* The FILEs of a request, a fatal error ends it rather than the server */
+static int serve_units(cpp_context *ctx, const unit_opts *o,
+                       const unit_opts *base, FILE *fp, FILE *err)
+{
+    jmp_buf jb;
+    volatile int i, ret = 0;
+
+    if (setjmp(jb) != 0) {
+        cpp_error_catch(NULL);
+        unit_done();
+        return 1;
+    }
+    cpp_error_catch(&jb);
+    for (i = 0; ret == 0 && i < o->nin; i++) {
+        cpp_context_reset(ctx);
+        replay_defs(ctx, base);
+        replay_defs(ctx, o);
+        ret = preprocess(ctx, o, i, fp, err);
+        unit_done();
+    }
+    cpp_error_catch(NULL);
+    return ret;
+}
+
+/* A request to -fserver, `arg` has the server's -D and -U.  A FILE is read
+ * again only if it changed, so it's known by its full path. */
+static int serve(cpp_context *ctx, int argc, char **argv, const char *cwd,
+                 FILE *out, FILE *err, void *arg)
+{
+    int i, opt, ret = 0;
+    unit_opts o = {0};
+    char *outpath = NULL;
+    FILE *fp = out;
+
+    o.def = calloc((size_t)argc, sizeof(*o.def));
+    o.path = calloc((size_t)argc, sizeof(char *));
+    assert(o.def && o.path);
+
+    optind = 0; /* glibc's getopt() starts over, with what it permuted */
+    while (ret == 0 && (opt = getopt(argc, argv, ":D:EPTU:o:")) != EOF) {
+        switch (opt) {
+        case 'D':
+        case 'U':
+            o.def[o.ndef].undef = opt == 'U';
+            o.def[o.ndef++].arg = optarg;
+            break;
+        case 'E':
+            o.opt_E = 1;
+            break;
+        case 'P':
+            break;
+        case 'T':
+            o.opt_T = 1;
+            break;
+        case 'o':
+            free(outpath);
+            outpath = path_from(cwd, optarg);
+            assert(outpath);
+            break;
+        default:
+            fprintf(err, "error: '%s' isn't for a request to the server\n",
+                    argv[optind - 1]);
+            ret = 1;
+            break;
+        }
+    }
+
+    o.nin = argc - optind;
+    o.in = argv + optind;
+    if (ret == 0 && o.nin == 0) {
+        fputs("error: no FILE\n", err);
+        ret = 1;
+    }
+    for (i = 0; ret == 0 && i < o.nin; i++) {
+        if (strcmp(o.in[i], "-") == 0) {
+            fputs("error: '-' isn't for a request to the server\n", err);
+            ret = 1;
+        } else {
+            o.path[i] = path_from(cwd, o.in[i]);
+            assert(o.path[i]);
+        }
+    }
+    if (ret == 0 && outpath != NULL && (o.opt_E || o.opt_T)) {
+        fp = fopen(outpath, "w+");
+        if (fp == NULL) {
+            fprintf(err, "unable to open '%s': %s\n", outpath,
+                    strerror(errno));
+            ret = 1;
+        }
+    }
+
+    if (ret == 0) /* the token count goes to `out`, even with -o */
+        ret = serve_units(ctx, &o, arg, o.opt_E || o.opt_T ? fp : out, err);
+
+    if (fp != out && fp != NULL)
+        fclose(fp);
+    for (i = 0; i < o.nin; i++)
+        free(o.path[i]);
+    free(o.path);
+    free(o.def);
+    free(outpath);
+    return ret;
+}
+
+/* -fconnect=SOCK (or -f connect=SOCK) in `argv`, which is taken out of it */
+static const char *connect_opt(int *argc, char **argv)
+{
+    int i, n;
+    const char *sock = NULL;
+
+    for (i = 1; i < *argc && sock == NULL; i++) {
+        n = 0;
+        if (strncmp(argv[i], "-fconnect=", 10) == 0)
+            sock = argv[i] + 10, n = 1;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < *argc &&
+                 strncmp(argv[i + 1], "connect=", 8) == 0)
+            sock = argv[i + 1] + 8, n = 2;
+    }
+    if (sock != NULL) {
+        i--;
+        memmove(&argv[i], &argv[i + n], (size_t)(*argc - i - n + 1) *
+                                        sizeof(char *));
+        *argc -= n;
+    }
+    return sock;
+}
+
 int main(int argc, char **argv)
 {
-    int opt;
+    int i, opt, ret = 0;
     FILE *fp;
     cpp_context ctx;
-    uchar opt_E, opt_T;
-    const char *in, *out = NULL;
+    cpp_mem_stats st;
+    unit_opts o = {0};
+    int prefetch = 0, jobs = 1;
+    const char *serial = NULL; /* an option that -j doesn't go with */
+    const char *out = NULL, *trace = NULL, *pool = NULL, *server = NULL;
+
+    /* A client does nothing else, it's meant to start fast */
+    if ((server = connect_opt(&argc, argv)) != NULL) {
+        ret = cpp_server_request(server, argc, argv);
+        if (ret < 0)
+            fprintf(stderr, "error: unable to ask '%s': %s\n", server,
+                    strerror(errno));
+        return ret < 0 ? 1 : ret;
+    }
+
+    /* The pool must be loaded before anything is interned */
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-fstring-pool=", 14) == 0)
+            pool = argv[i] + 14;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc &&
+                 strncmp(argv[i + 1], "string-pool=", 12) == 0)
+            pool = argv[i + 1] + 12;
+    }
+    if (pool != NULL && string_pool_load(pool) != 0 && errno != ENOENT)
+        fprintf(stderr, "warning: unable to load '%s': %s\n", pool,
+                strerror(errno));
 
-    opt_E = opt_T = 0;
     cpp_context_setup(&ctx);
+    o.def = calloc((size_t)argc, sizeof(*o.def));
+    assert(o.def);
 
-    while ((opt = getopt(argc, argv, ":D:EI:PTU:o:")) != EOF) {
+    while ((opt = getopt(argc, argv, ":BD:EI:PTU:f:j:o:")) != EOF) {
         switch (opt) {
+        case 'B':
+            o.opt_B = 1;
+            break;
         case 'D':
             cpp_macro_define(&ctx, optarg);
+            o.def[o.ndef].undef = 0;
+            o.def[o.ndef++].arg = optarg;
             break;
         case 'E':
-            opt_E = 1;
+            o.opt_E = 1;
             break;
         case 'I':
             cpp_search_path_append(&ctx, optarg);
@@ -42,14 +338,65 @@ int main(int argc, char **argv)
             break;
         case 'U':
             cpp_macro_undefine(&ctx, optarg);
+            o.def[o.ndef].undef = 1;
+            o.def[o.ndef++].arg = optarg;
             break;
         case 'T':
-            opt_T = 1;
+            o.opt_T = 1;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "error: invalid -j '%s'\n", optarg);
+                free((char *)out);
+                free(o.def);
+                cpp_context_cleanup(&ctx);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "stream-input") == 0) {
+                cpp_file_stream(1);
+            } else if (strcmp(optarg, "pipeline") == 0) {
+                cpp_pipeline_enable(1);
+                serial = "-fpipeline";
+            } else if (strcmp(optarg, "prefetch") == 0) {
+                prefetch = CPP_PREFETCH_THREAD;
+            } else if (strncmp(optarg, "prefetch=", 9) == 0) {
+                prefetch = atoi(optarg + 9);
+            } else if (strncmp(optarg, "include-trace=", 14) == 0) {
+                trace = optarg + 14;
+            } else if (strcmp(optarg, "evict-headers") == 0) {
+                ctx.flags |= CPP_CONTEXT_EVICT;
+                serial = "-fevict-headers";
+            } else if (strcmp(optarg, "mem-report") == 0) {
+                o.mem_report = 1;
+            } else if (strcmp(optarg, "time-report") == 0) {
+                cpp_timer_setup(NULL);
+            } else if (strncmp(optarg, "time-report=", 12) == 0) {
+                cpp_timer_setup(optarg + 12);
+            } else if (strncmp(optarg, "time-trace=", 11) == 0) {
+                if (cpp_time_trace_setup(optarg + 11) != 0)
+                    fprintf(stderr, "warning: unable to open '%s': %s\n",
+                            optarg + 11, strerror(errno));
+                serial = "-ftime-trace";
+            } else if (strncmp(optarg, "server=", 7) == 0) {
+                server = optarg + 7;
+            } else if (strncmp(optarg, "string-pool=", 12) == 0) {
+                /* already loaded */
+            } else {
+                fprintf(stderr, "error: unknown option '-f%s'\n", optarg);
+                free((char *)out);
+                free(o.def);
+                cpp_context_cleanup(&ctx);
+                return 1;
+            }
             break;
         case 'o':
             if (out != NULL) {
                 fputs("error: -o is already specified\n", stderr);
                 free((char *)out);
+                free(o.def);
                 cpp_context_cleanup(&ctx);
                 return 1;
             }
@@ -65,10 +412,46 @@ int main(int argc, char **argv)
 
     argc -= optind;
     argv += optind;
+    o.nin = argc;
+    o.in = argv;
+
+    if (server != NULL) {
+        if (argc > 0 || o.opt_B || o.opt_E || o.opt_T || out != NULL)
+            serial = "FILE, -B, -E, -T or -o, they're a request's";
+        else if (jobs > 1)
+            serial = "-j";
+        else if (prefetch > 0 || trace != NULL)
+            serial = "-fprefetch";
+        else if (serial != NULL && strcmp(serial, "-fevict-headers") == 0)
+            serial = NULL;
+        if (serial != NULL) {
+            fprintf(stderr, "error: -fserver doesn't go with %s\n", serial);
+            ret = 1;
+        } else {
+            string_pool_overlay_begin();
+            ret = cpp_server_run(&ctx, server, serve, &o);
+            if (ret < 0)
+                fprintf(stderr, "error: unable to serve on '%s': %s\n",
+                        server, strerror(errno));
+        }
+        free((char *)out);
+        free(o.def);
+        cpp_context_cleanup(&ctx);
+        return ret != 0;
+    }
 
     if (argc == 0) {
         cpp_context_cleanup(&ctx);
         usage(1);
+    } else if ((argc > 1 && o.opt_B) || (jobs > 1 && serial != NULL)) {
+        if (o.opt_B)
+            fputs("error: -B takes a single FILE\n", stderr);
+        else
+            fprintf(stderr, "error: -j doesn't go with %s\n", serial);
+        free((char *)out);
+        free(o.def);
+        cpp_context_cleanup(&ctx);
+        return 1;
     }
 
     if (out != NULL) {
@@ -76,6 +459,7 @@ int main(int argc, char **argv)
         if (fp == NULL) {
             fprintf(stderr, "unable to open '%s': %s\n", out, strerror(errno));
             free((char *)out);
+            free(o.def);
             cpp_context_cleanup(&ctx);
             return 1;
         }
@@ -83,33 +467,58 @@ int main(int argc, char **argv)
         fp = stdout;
     }
 
-    in = argv[0];
+    /* the identifiers of FILE (not of its <headers>) are dropped with it,
+     * but with -j not before every unit in flight is done */
+    string_pool_overlay_begin();
 
-    cpp_file *f = cpp_file_open(in, in);
-    if (f == NULL) {
-        fprintf(stderr, "unable to open '%s': %s\n", in, strerror(errno));
-        if (out != NULL) {
-            fclose(fp);
-            free((char *)out);
-        }
-        cpp_context_cleanup(&ctx);
-        return 1;
-    }
+    if (trace != NULL || prefetch > 0)
+        cpp_prefetch_setup(prefetch > 0 ? prefetch : CPP_PREFETCH_THREAD,
+                           trace);
 
-    if (opt_T) {
-        cpp_run(&ctx, f);
-        cpp_dump_token(&ctx, fp);
-    } else if (opt_E) {
-        cpp_print(&ctx, f, fp);
+    /* the token count goes to stdout, even with -o */
+    if (jobs > 1 && argc > 1) {
+        ret = cpp_jobs_run(&ctx, jobs, argc, preprocess_job, &o,
+                           o.opt_E || o.opt_T ? fp : stdout);
+        if (ret < 0)
+            fprintf(stderr, "error: -j: %s\n", strerror(errno));
+        unit_done();
     } else {
-        cpp_run(&ctx, f);
-        printf("total tokens: %u\n", ctx.ts.n);
+        for (i = 0; i < argc && ret == 0; i++) {
+            if (i > 0) { /* what was read is still there */
+                cpp_context_reset(&ctx);
+                replay_defs(&ctx, &o);
+            }
+            ret = preprocess(&ctx, &o, i, o.opt_E || o.opt_T || o.opt_B ?
+                                          fp : stdout, stderr);
+            unit_done();
+        }
     }
 
+    free(o.def);
     if (out != NULL) {
         fclose(fp);
         free((char *)out);
     }
+    if (ret != 0) {
+        cpp_context_cleanup(&ctx);
+        return 1;
+    }
+
+    cpp_timer_report();
+    cpp_time_trace_finish();
+    if (o.mem_report) {
+        cpp_mem_stat(&ctx, &st);
+        cpp_mem_report(stderr, &st);
+    }
+
+    if (pool != NULL) {
+        /* no thread may intern while it's saved */
+        cpp_pipeline_cleanup();
+        cpp_prefetch_cleanup();
+        if (string_pool_save(pool) != 0)
+            fprintf(stderr, "warning: unable to save '%s': %s\n", pool,
+                    strerror(errno));
+    }
 
     cpp_context_cleanup(&ctx);
 }
@@ -0,0 +1,305 @@
+#include "cpp.h"
+
+/* Memory accounting, -fmem-report.
+ *
+ * Every heap allocation of the preprocessor goes through cpp_mem_alloc()
+ * and friends with the subsystem it's for, and is counted there.  A block
+ * starts with a header that keeps its size and subsystem, so it's freed
+ * without them and cpp_mem_free() works on anything cpp_mem_*() gave.
+ *
+ * The blocks come from the cpp_allocator of a context, malloc() by default,
+ * see cpp_context_setup2().  It sees the subsystem of each block and may
+ * refuse it (return NULL) to enforce a budget, which is then a fatal error.
+ * A forked context has the allocator of its root, it must be thread-safe.
+ *
+ * A thread allocates for the cpp_mem it's in, see cpp_mem_enter(): the one
+ * of the context it set up, or the one it was started for (prefetch.c
+ * workers, the pipeline threads).  What a forked context allocates counts
+ * for its root too, so the root has the numbers of the whole run and each
+ * fork those of its units.  A block freed by another context than the one
+ * that allocated it counts for the one that frees it.
+ *
+ * Counting is per thread, a thread adds to the counters once it's off by
+ * more than CPP_MEM_SLACK, so the numbers of the other threads may be
+ * behind by that much.  Atomics on each allocation were too slow for
+ * macro expansion, which allocates and frees a lot of small blocks.
+ *
+ * What isn't on the heap is only counted: mapped files and the bytes used
+ * in cpp_context::buf with cpp_mem_account(), the string pool has its own
+ * numbers, see string_pool_stat(). */
+
+typedef union {
+    struct {
+        size_t size; /* without the header */
+        uchar kind;
+    } h;
+    max_align_t align;
+} mem_header;
+
+static void *default_alloc(void *arg, size_t size, uchar kind);
+static void *default_resize(void *arg, void *p, size_t old, size_t size,
+                            uchar kind);
+static void default_release(void *arg, void *p, size_t size, uchar kind);
+
+static const cpp_allocator g_default = {
+    default_alloc, default_resize, default_release, NULL
+};
+/* for what's allocated out of any context, e.g. before the first one */
+static cpp_mem g_unowned = { .allocator = &g_default };
+static _Thread_local cpp_mem *t_mem; /* &g_unowned if NULL */
+static _Thread_local ssize_t t_delta[CPP_MEM_MAX]; /* not in t_mem yet */
+static _Thread_local size_t t_count[CPP_MEM_MAX];
+
+static const char *const g_kind_name[CPP_MEM_MAX] = {
+    "file", "pool", "macro", "token", "table", "scratch"
+};
+
+static void *default_alloc(void *arg, size_t size, uchar kind)
+{
+    (void)arg; (void)kind;
+    return malloc(size);
+}
+
+static void *default_resize(void *arg, void *p, size_t old, size_t size,
+                            uchar kind)
+{
+    (void)arg; (void)old; (void)kind;
+    return realloc(p, size);
+}
+
+static void default_release(void *arg, void *p, size_t size, uchar kind)
+{
+    (void)arg; (void)size; (void)kind;
+    free(p);
+}
+
+/* `m` counts what a context and its forks allocate, with `a` (NULL for
+ * malloc()), or with the allocator of `parent` for a fork.  The calling
+ * thread allocates for it from now on. */
+void cpp_mem_setup(cpp_mem *m, const cpp_allocator *a, cpp_mem *parent)
+{
+    memset(m, 0, sizeof(*m));
+    m->parent = parent;
+    if (parent != NULL)
+        m->allocator = parent->allocator;
+    else
+        m->allocator = a != NULL ? a : &g_default;
+    cpp_mem_enter(m);
+}
+
+/* The calling thread leaves `m` (if it's in it) for its parent */
+void cpp_mem_cleanup(cpp_mem *m)
+{
+    if (t_mem == m)
+        cpp_mem_enter(m->parent);
+}
+
+static void mem_flush(uchar kind)
+{
+    size_t cur, peak;
+    ssize_t delta = t_delta[kind];
+    size_t count = t_count[kind];
+    cpp_mem *m;
+
+    t_delta[kind] = 0;
+    t_count[kind] = 0;
+    for (m = t_mem != NULL ? t_mem : &g_unowned; m != NULL; m = m->parent) {
+        __atomic_fetch_add(&m->count[kind], count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m->unit_count[kind], count, __ATOMIC_RELAXED);
+        cur = __atomic_add_fetch(&m->current[kind], (size_t)delta,
+                                 __ATOMIC_RELAXED);
+        if (delta <= 0)
+            continue;
+        peak = __atomic_load_n(&m->peak[kind], __ATOMIC_RELAXED);
+        while (cur > peak &&
+               !__atomic_compare_exchange_n(&m->peak[kind], &peak, cur, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+        peak = __atomic_load_n(&m->unit_peak[kind], __ATOMIC_RELAXED);
+        while (cur > peak &&
+               !__atomic_compare_exchange_n(&m->unit_peak[kind], &peak, cur,
+                                            1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+/* Allocate for `m` from now on on this thread, NULL for none, e.g. before
+ * the thread exits.  What it counted so far goes to the one it was in. */
+void cpp_mem_enter(cpp_mem *m)
+{
+    int i;
+
+    for (i = 0; i < CPP_MEM_MAX; i++)
+        mem_flush((uchar)i);
+    t_mem = m;
+}
+
+/* What the calling thread is in, for a thread it starts */
+cpp_mem *cpp_mem_current(void)
+{
+    return t_mem;
+}
+
+void cpp_mem_account(uchar kind, ssize_t delta)
+{
+    ssize_t d = t_delta[kind] += delta;
+
+    if (unlikely(d > CPP_MEM_SLACK || d < -CPP_MEM_SLACK))
+        mem_flush(kind);
+}
+
+static void mem_fail(uchar kind, size_t size)
+{
+    cpp_error(NULL, NULL, "unable to allocate %zu bytes for %s", size,
+              g_kind_name[kind]);
+}
+
+static const cpp_allocator *mem_allocator(void)
+{
+    return t_mem != NULL ? t_mem->allocator : &g_default;
+}
+
+void *cpp_mem_alloc(uchar kind, size_t size)
+{
+    mem_header *h;
+    const cpp_allocator *a = mem_allocator();
+
+    if (likely(a == &g_default))
+        h = malloc(sizeof(*h) + size);
+    else
+        h = a->alloc(a->arg, sizeof(*h) + size, kind);
+    if (unlikely(h == NULL))
+        mem_fail(kind, size);
+    h->h.size = size;
+    h->h.kind = kind;
+    t_count[kind]++;
+    cpp_mem_account(kind, (ssize_t)size);
+    return h + 1;
+}
+
+void *cpp_mem_calloc(uchar kind, size_t n, size_t size)
+{
+    void *p = cpp_mem_alloc(kind, n * size);
+    memset(p, 0, n * size);
+    return p;
+}
+
+/* Like realloc(), `p` may be NULL, it keeps its subsystem otherwise */
+void *cpp_mem_realloc(uchar kind, void *p, size_t size)
+{
+    size_t old;
+    mem_header *h;
+    const cpp_allocator *a = mem_allocator();
+
+    if (p == NULL)
+        return cpp_mem_alloc(kind, size);
+
+    h = (mem_header *)p - 1;
+    old = h->h.size;
+    kind = h->h.kind;
+    h = a->resize(a->arg, h, sizeof(*h) + old, sizeof(*h) + size, kind);
+    if (unlikely(h == NULL))
+        mem_fail(kind, size);
+    h->h.size = size;
+    cpp_mem_account(kind, (ssize_t)size - (ssize_t)old);
+    return h + 1;
+}
+
+char *cpp_mem_strdup(uchar kind, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(cpp_mem_alloc(kind, len), s, len);
+}
+
+void cpp_mem_free(void *p)
+{
+    mem_header *h;
+    const cpp_allocator *a = mem_allocator();
+
+    if (p == NULL)
+        return;
+    h = (mem_header *)p - 1;
+    cpp_mem_account(h->h.kind, -(ssize_t)h->h.size);
+    if (likely(a == &g_default))
+        free(h);
+    else
+        a->release(a->arg, h, sizeof(*h) + h->h.size, h->h.kind);
+}
+
+static void mem_stat(const cpp_context *ctx, cpp_mem_stats *st, uchar unit)
+{
+    int i;
+    string_pool_stats ps;
+    const cpp_mem *m = &ctx->mem;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < CPP_MEM_MAX; i++) {
+        if (t_mem == m)
+            mem_flush((uchar)i);
+        st->current[i] = __atomic_load_n(&m->current[i], __ATOMIC_RELAXED);
+        st->peak[i] = __atomic_load_n(unit ? &m->unit_peak[i] : &m->peak[i],
+                                      __ATOMIC_RELAXED);
+        st->count[i] = __atomic_load_n(unit ? &m->unit_count[i]
+                                            : &m->count[i], __ATOMIC_RELAXED);
+    }
+
+    /* shared by the forks, it's the root's */
+    if (m->parent == NULL) {
+        string_pool_stat(&ps);
+        st->current[CPP_MEM_POOL] = ps.base_bytes + ps.overlay_bytes;
+        st->peak[CPP_MEM_POOL] = ps.base_bytes + MAX(ps.overlay_bytes,
+                                                     ps.overlay_peak);
+        st->count[CPP_MEM_POOL] = ps.base_count + ps.overlay_count;
+    }
+
+    for (i = 0; i < CPP_MEM_MAX; i++) {
+        st->total += st->current[i];
+        st->total_peak += st->peak[i]; /* not at once, an upper bound */
+    }
+}
+
+/* What `ctx` and its forks use, and did since it was set up */
+void cpp_mem_stat(const cpp_context *ctx, cpp_mem_stats *st)
+{
+    mem_stat(ctx, st, 0);
+}
+
+/* The same, since the translation unit of `ctx` started, see
+ * cpp_mem_unit_reset() */
+void cpp_mem_unit_stat(const cpp_context *ctx, cpp_mem_stats *st)
+{
+    mem_stat(ctx, st, 1);
+}
+
+/* Count the peaks and the allocations of another translation unit, from
+ * what `ctx` uses now */
+void cpp_mem_unit_reset(cpp_context *ctx)
+{
+    int i;
+    cpp_mem *m = &ctx->mem;
+
+    for (i = 0; i < CPP_MEM_MAX; i++) {
+        if (t_mem == m)
+            mem_flush((uchar)i);
+        __atomic_store_n(&m->unit_peak[i],
+                         __atomic_load_n(&m->current[i], __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&m->unit_count[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void cpp_mem_report(FILE *fp, const cpp_mem_stats *st)
+{
+    int i;
+
+    fputs("Memory report:\n", fp);
+    fprintf(fp, "  %-10s %12s %12s %12s\n", "subsystem", "current KiB",
+            "peak KiB", "allocations");
+    for (i = 0; i < CPP_MEM_MAX; i++)
+        fprintf(fp, "  %-10s %12.1f %12.1f %12zu\n", g_kind_name[i],
+                st->current[i] / 1024.0, st->peak[i] / 1024.0, st->count[i]);
+    fprintf(fp, "  %-10s %12.1f %12.1f\n", "total", st->total / 1024.0,
+            st->total_peak / 1024.0);
+}
@@ -0,0 +1,243 @@
+#include "cpp.h"
+
+/* Output of -E.
+ *
+ * Most of the output is the source as it was, less comments, runs of
+ * spaces and macro invocations.  So a run of tokens whose output is the
+ * very bytes of the file they come from is written straight from
+ * cpp_file::data with writev(), only what's in between is formatted, into
+ * `buf`.  The run goes on as long as the next token and what separates it
+ * from the previous one are the next bytes of the file.  That's checked on
+ * the bytes themselves, so an identifier (spelled from the string pool) or
+ * whatever a macro expanded to continues it too when it's the same.
+ *
+ * File data lives until cpp_file_cleanup(), but that of a pipe changes at
+ * its end while it's read, it's copied.  Short runs are copied as well, an
+ * iovec costs more than a few bytes. */
+
+static void output_write(cpp_output *out)
+{
+    int i = 0;
+    ssize_t n;
+    struct iovec *iov = out->iov;
+
+    if (out->fd < 0) { /* e.g. fmemopen() */
+        for (; i < out->niov; i++)
+            if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, out->fp) !=
+                iov[i].iov_len && out->err == 0)
+                out->err = errno != 0 ? errno : EIO;
+        out->niov = 0;
+        return;
+    }
+
+    while (i < out->niov && out->err == 0) {
+        n = writev(out->fd, iov + i, out->niov - i);
+        if (n < 0) {
+            if (errno != EINTR)
+                out->err = errno;
+            continue;
+        }
+        for (; i < out->niov && (size_t)n >= iov[i].iov_len; i++)
+            n -= (ssize_t)iov[i].iov_len;
+        if (i < out->niov) {
+            iov[i].iov_base = (uchar *)iov[i].iov_base + n;
+            iov[i].iov_len -= (size_t)n;
+        }
+    }
+    out->niov = 0;
+}
+
+static void output_iov(cpp_output *out, const void *p, size_t len)
+{
+    out->iov[out->niov].iov_base = (void *)p;
+    out->iov[out->niov++].iov_len = len;
+}
+
+/* Write what's queued, but the run of a file being extended */
+static void output_flush(cpp_output *out)
+{
+    if (out->used > out->mark) {
+        if (out->niov == CPP_OUTPUT_IOV)
+            output_write(out);
+        output_iov(out, out->buf + out->mark, out->used - out->mark);
+    }
+    output_write(out);
+    out->used = out->mark = 0;
+}
+
+static void output_copy(cpp_output *out, const uchar *p, size_t len)
+{
+    if (unlikely(len > CPP_OUTPUT_BUF)) { /* written before `p` goes away */
+        output_flush(out);
+        output_iov(out, p, len);
+        output_write(out);
+        return;
+    }
+
+    if (out->used + len > CPP_OUTPUT_BUF)
+        output_flush(out);
+    memcpy(out->buf + out->used, p, len);
+    out->used += len;
+}
+
+static void output_close(cpp_output *out)
+{
+    const uchar *run = out->run;
+    size_t len = (size_t)(out->end - run);
+
+    out->run = NULL;
+    if (len < CPP_OUTPUT_RUN) {
+        output_copy(out, run, len);
+        return;
+    }
+
+    if (out->niov + 2 > CPP_OUTPUT_IOV)
+        output_flush(out);
+    if (out->used > out->mark) {
+        output_iov(out, out->buf + out->mark, out->used - out->mark);
+        out->mark = out->used;
+    }
+    output_iov(out, run, len);
+}
+
+/* What goes before `tk`: a newline, a space, returns how many bytes */
+static uint output_sep(cpp_output *out, const cpp_token *tk, uchar *sep)
+{
+    uint n = 0;
+
+    if (AT_BOL(tk) && !out->first)
+        sep[n++] = '\n';
+    if (PREV_SPACE(tk))
+        sep[n++] = ' ';
+    out->first = 0;
+    return n;
+}
+
+/* `src` if `p` may be in the file of `tk`, not formatted */
+static void output_put(cpp_output *out, const cpp_token *tk, const uchar *p,
+                       uint len, uchar src)
+{
+    uint nsep;
+    uchar sep[2];
+    const uchar *end = out->end;
+    cpp_file *file;
+
+    nsep = output_sep(out, tk, sep);
+    if (out->run != NULL) {
+        if ((size_t)(out->limit - end) >= nsep + len &&
+            memcmp(end, sep, nsep) == 0 &&
+            (p == end + nsep || memcmp(end + nsep, p, len) == 0)) {
+            out->end = end + nsep + len;
+            return;
+        }
+        output_close(out);
+    }
+
+    if (src && (file = cpp_file_no(tk->fileno)) != NULL &&
+        !HAS_FLAG(file->flags, CPP_FILE_PIPE) &&
+        p >= file->data && p + len <= file->data + file->size) {
+        if ((size_t)(p - file->data) >= nsep &&
+            memcmp(p - nsep, sep, nsep) == 0) {
+            out->run = p - nsep;
+        } else {
+            output_copy(out, sep, nsep);
+            out->run = p;
+        }
+        out->end = p + len;
+        out->limit = file->data + file->size;
+        return;
+    }
+
+    output_copy(out, sep, nsep);
+    output_copy(out, p, len);
+}
+
+/* A token with "\\\n" in it, spliced right into `buf` */
+static void output_splice(cpp_output *out, const cpp_token *tk)
+{
+    uint nsep;
+    uchar sep[2], *buf;
+
+    nsep = output_sep(out, tk, sep);
+    if (out->run != NULL)
+        output_close(out);
+    output_copy(out, sep, nsep);
+
+    if (unlikely(tk->length > CPP_OUTPUT_BUF)) {
+        buf = cpp_mem_alloc(CPP_MEM_SCRATCH, tk->length);
+        output_copy(out, buf, cpp_token_splice(tk, buf, tk->length));
+        cpp_mem_free(buf);
+        return;
+    }
+
+    if (out->used + tk->length > CPP_OUTPUT_BUF)
+        output_flush(out);
+    out->used += cpp_token_splice(tk, out->buf + out->used, tk->length);
+}
+
+/* ---- interface ---------------------------------------------------------- */
+
+/* Anything already in `fp` is flushed, then it's written to with writev() */
+void cpp_output_setup(cpp_output *out, FILE *fp)
+{
+    fflush(fp);
+    out->fp = fp;
+    out->fd = fileno(fp);
+    out->first = 1;
+    out->err = 0;
+    out->niov = 0;
+    out->used = out->mark = 0;
+    out->run = out->end = out->limit = NULL;
+    out->buf = cpp_mem_alloc(CPP_MEM_SCRATCH, CPP_OUTPUT_BUF);
+}
+
+void cpp_output_cleanup(cpp_output *out)
+{
+    cpp_mem_free(out->buf);
+    out->buf = NULL;
+}
+
+void cpp_output_token(cpp_output *out, const cpp_token *tk)
+{
+    if (tk->kind == TK_identifier)
+        output_put(out, tk, (const uchar *)string_ref_ptr(tk->p.ref),
+                   string_ref_len(tk->p.ref), 0);
+    else if (tk->kind < 128)
+        output_put(out, tk, tk->p.ptr, 1, 1);
+    else if (unlikely(HAS_FLAG(tk->flags, CPP_TOKEN_ESCNL)))
+        output_splice(out, tk);
+    else
+        output_put(out, tk, tk->p.ptr, tk->length, 1);
+}
+
+/* `tk` spelled as `p`, which must outlive the next cpp_output_flush() */
+void cpp_output_spelled(cpp_output *out, const cpp_token *tk, const uchar *p,
+                        uint len)
+{
+    output_put(out, tk, p, len, 0);
+}
+
+/* Write everything so far, before what it points to goes away.
+ * Returns -1 with errno if a write failed, now or before. */
+int cpp_output_flush(cpp_output *out)
+{
+    if (out->run != NULL)
+        output_close(out);
+    output_flush(out);
+
+    if (out->err != 0) {
+        errno = out->err;
+        return -1;
+    }
+    return 0;
+}
+
+/* The last line is ended, then like cpp_output_flush() */
+int cpp_output_finish(cpp_output *out)
+{
+    if (out->run != NULL)
+        output_close(out);
+    if (!out->first)
+        output_copy(out, (const uchar *)"\n", 1);
+    return cpp_output_flush(out);
+}
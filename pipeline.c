@@ -0,0 +1,507 @@
+#include "cpp.h"
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* Pipelined mode, -fpipeline.
+ *
+ * A lexer thread lexes the main file into `g_in`, the main thread handles
+ * the directives and expands macros, and with cpp_print() an output thread
+ * prints what the main thread puts into `g_out`.  Both are bounded
+ * single-producer single-consumer rings.  A side only sleeps (on a futex)
+ * when the ring is empty or full, and is only woken up once there is a batch
+ * of work again, so the threads don't ping-pong even on a single core.
+ *
+ * Instead of an output thread, a thread of its own may preprocess into
+ * `g_out` for the caller to pull from, see cpp_pipeline_produce().
+ *
+ * Lexing depends on the directives in one place only, a <header> name.  The
+ * main thread lexes that line itself, see cpp_pipeline_detach(), and finds
+ * its place in `g_in` again after the newline, see cpp_pipeline_resync().
+ * If it can't, it asks the lexer thread through the back-channel to restart
+ * right there, and drops everything up to the PL_MARK that answers it.
+ * Skipped groups are lexed like the rest, so they need nothing. */
+
+enum {
+    PL_TOKEN, /* `tk` */
+    PL_MARK, /* the lexer thread restarted for request `epoch` */
+    PL_LIVE, /* lexing error, the main thread lexes from `tk` on */
+    PL_END, /* end of output */
+    PL_ABORT /* end of output, after an error */
+};
+
+typedef struct {
+    cpp_token tk;
+    uchar what;
+    uint epoch;
+} pl_rec;
+
+typedef struct {
+    _Alignas(64) uint head; /* next to pop, only written by the consumer */
+    _Alignas(64) uint tail; /* next to push, only written by the producer */
+    _Alignas(64) uint psleep, csleep;
+    uint mask;
+    pl_rec *slot;
+} pl_ring;
+
+enum { PL_RING, PL_DETACHED, PL_OFF };
+
+static uchar g_enabled;
+static pl_ring g_in, g_out;
+static pthread_t g_lexer, g_printer, g_producer;
+static uchar g_lexing, g_printing, g_producing;
+
+/* lexer thread */
+static cpp_stream g_ls;
+
+/* back-channel, written by the main thread before bumping `g_req` */
+static uint g_req;
+static uchar g_stop;
+static const uchar *g_req_p;
+static uchar g_req_flags;
+
+/* main thread */
+static uchar g_state = PL_OFF;
+static cpp_token g_last; /* last from `g_in`, for cpp_pipeline_detach() */
+
+/* output thread */
+static cpp_output g_output;
+
+/* producer thread */
+static cpp_context *g_ctx;
+static uchar g_halt; /* the main thread pulls no more */
+
+/* ---- rings -------------------------------------------------------------- */
+
+static void futex_wait(uint *addr, uint val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void ring_setup(pl_ring *r)
+{
+    r->head = r->tail = r->psleep = r->csleep = 0;
+    r->mask = CPP_PIPELINE_RING - 1;
+    r->slot = cpp_mem_alloc(CPP_MEM_TOKEN, CPP_PIPELINE_RING * sizeof(pl_rec));
+}
+
+static void ring_cleanup(pl_ring *r)
+{
+    cpp_mem_free(r->slot);
+    r->slot = NULL;
+}
+
+/* Slot to fill, or NULL if `*req` isn't `seen` anymore while waiting for
+ * room, so a request never waits for a full ring. */
+static pl_rec *ring_reserve(pl_ring *r, uint *req, uint seen)
+{
+    uint h, spin = 0;
+
+    while (r->tail - (h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) >
+           r->mask) {
+        if (req != NULL && __atomic_load_n(req, __ATOMIC_ACQUIRE) != seen)
+            return NULL;
+        if (++spin < CPP_PIPELINE_SPIN)
+            continue;
+        __atomic_store_n(&r->psleep, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == h)
+            futex_wait(&r->head, h);
+        __atomic_store_n(&r->psleep, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return &r->slot[r->tail & r->mask];
+}
+
+/* Publish the reserved slot.  The consumer is woken up after a batch, or
+ * right away with `flush` when nothing may follow for a while. */
+static void ring_commit(pl_ring *r, uchar flush)
+{
+    uint t = r->tail + 1;
+
+    __atomic_store_n(&r->tail, t, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->csleep, __ATOMIC_SEQ_CST) &&
+        (flush || t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >=
+                  CPP_PIPELINE_BATCH) &&
+        __atomic_exchange_n(&r->csleep, 0, __ATOMIC_SEQ_CST))
+        futex_wake(&r->tail);
+}
+
+static pl_rec *ring_peek(pl_ring *r)
+{
+    uint t, spin = 0;
+
+    while ((t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == r->head) {
+        if (++spin < CPP_PIPELINE_SPIN)
+            continue;
+        __atomic_store_n(&r->csleep, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == t)
+            futex_wait(&r->tail, t);
+        __atomic_store_n(&r->csleep, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return &r->slot[r->head & r->mask];
+}
+
+/* Free the peeked slot, the producer is woken up once half the ring is free */
+static void ring_release(pl_ring *r)
+{
+    uint h = r->head + 1;
+
+    __atomic_store_n(&r->head, h, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->psleep, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - h <= r->mask / 2 &&
+        __atomic_exchange_n(&r->psleep, 0, __ATOMIC_SEQ_CST))
+        futex_wake(&r->head);
+}
+
+/* ---- threads ------------------------------------------------------------ */
+
+static int lexer_emit(void *arg, const cpp_token *tk)
+{
+    uint seen = *(uint *)arg;
+    pl_rec *rec;
+
+    if (__atomic_load_n(&g_req, __ATOMIC_ACQUIRE) != seen)
+        return 1;
+    rec = ring_reserve(&g_in, &g_req, seen);
+    if (rec == NULL)
+        return 1;
+    rec->tk = *tk;
+    rec->what = PL_TOKEN;
+    ring_commit(&g_in, tk->kind == TK_eof);
+    return 0;
+}
+
+static void *lexer(void *arg)
+{
+    uint seen = 0;
+    pl_rec *rec;
+
+    cpp_mem_enter(arg);
+    while (1) {
+        if (cpp_lex_raw(&g_ls, lexer_emit, &seen) < 0) {
+            rec = ring_reserve(&g_in, &g_req, seen);
+            if (rec != NULL) {
+                rec->tk.p.ptr = g_ls.p;
+                rec->tk.flags = g_ls.flags;
+                rec->what = PL_LIVE;
+                ring_commit(&g_in, 1);
+            }
+        }
+
+        /* After TK_eof, an error or a request, wait for the next request */
+        do {
+            while (__atomic_load_n(&g_req, __ATOMIC_ACQUIRE) == seen)
+                futex_wait(&g_req, seen);
+            seen = __atomic_load_n(&g_req, __ATOMIC_ACQUIRE);
+            if (g_stop) {
+                cpp_mem_enter(NULL);
+                return NULL;
+            }
+
+            g_ls.p = g_req_p;
+            g_ls.flags = g_req_flags;
+            rec = ring_reserve(&g_in, &g_req, seen);
+        } while (rec == NULL);
+
+        rec->epoch = seen;
+        rec->what = PL_MARK;
+        ring_commit(&g_in, 1);
+    }
+}
+
+static void *printer(void *arg)
+{
+    pl_rec *rec;
+    const cpp_token *tk;
+
+    cpp_mem_enter(arg);
+    while (1) {
+        rec = ring_peek(&g_out);
+        tk = &rec->tk;
+        if (rec->what != PL_TOKEN) {
+            if (rec->what == PL_END)
+                cpp_output_finish(&g_output);
+            else
+                cpp_output_flush(&g_output);
+            ring_release(&g_out);
+            break;
+        }
+
+        if (tk->kind == TK_identifier) /* spelled by cpp_pipeline_print() */
+            cpp_output_spelled(&g_output, tk, tk->p.ptr, tk->length);
+        else
+            cpp_output_token(&g_output, tk);
+        ring_release(&g_out);
+    }
+
+    cpp_mem_enter(NULL);
+    return NULL;
+}
+
+static void *producer(void *arg)
+{
+    pl_rec *rec;
+    cpp_token tk;
+
+    cpp_mem_enter(&g_ctx->mem);
+    (void)arg;
+    do {
+        if (__atomic_load_n(&g_halt, __ATOMIC_ACQUIRE))
+            tk.kind = TK_eof;
+        else
+            cpp_next_token(g_ctx, &tk);
+        rec = ring_reserve(&g_out, NULL, 0);
+        rec->tk = tk;
+        rec->what = tk.kind == TK_eof ? PL_END : PL_TOKEN;
+        ring_commit(&g_out, tk.kind == TK_eof);
+    } while (tk.kind != TK_eof);
+
+    cpp_mem_enter(NULL);
+    return NULL;
+}
+
+/* ---- interface ---------------------------------------------------------- */
+
+void cpp_pipeline_enable(uchar enable)
+{
+    g_enabled = enable;
+}
+
+/* Let the lexer thread lex the main file `s`.  A pipe is left alone, the
+ * main thread may still read the stream itself. */
+void cpp_pipeline_lex(cpp_stream *s)
+{
+    if (!g_enabled || g_lexing || HAS_FLAG(s->file->flags, CPP_FILE_PIPE))
+        return;
+
+    ring_setup(&g_in);
+    g_ls = *s;
+    g_ls.wlimit = NULL; /* cpp_file_slide() is for the main thread */
+    g_ls.tok = g_ls.resync = NULL;
+    g_ls.prev = NULL;
+    g_ls.cond = NULL;
+    g_req = 0;
+    g_stop = 0;
+
+    if (pthread_create(&g_lexer, NULL, lexer, cpp_mem_current()) != 0) {
+        ring_cleanup(&g_in);
+        return;
+    }
+
+    g_lexing = 1;
+    g_state = PL_RING;
+    s->piped = 1;
+}
+
+/* Called by cpp_lex_scan(), returns 0 if `s` must be lexed as usual */
+int cpp_pipeline_next(cpp_stream *s, cpp_token *tk)
+{
+    pl_rec *rec;
+
+    if (g_state != PL_RING)
+        return 0;
+
+    rec = ring_peek(&g_in);
+    if (rec->what == PL_LIVE) { /* the main thread reports the error */
+        s->p = rec->tk.p.ptr;
+        s->flags = rec->tk.flags;
+        g_state = PL_OFF;
+        ring_release(&g_in);
+        return 0;
+    }
+
+    *tk = rec->tk;
+    if (tk->kind != TK_eof)
+        ring_release(&g_in);
+
+    g_last = *tk;
+    return 1;
+}
+
+/* A <header> follows the '<' that was taken last, lex it on this thread */
+void cpp_pipeline_detach(cpp_stream *s)
+{
+    if (g_state != PL_RING)
+        return;
+
+    s->p = g_last.p.ptr + 1;
+    s->flags = 0;
+    g_state = PL_DETACHED;
+}
+
+/* The main thread lexed the newline `tk` itself, go back to `g_in` at the
+ * same newline, or make the lexer thread restart after it. */
+void cpp_pipeline_resync(cpp_stream *s, const cpp_token *tk)
+{
+    uint epoch;
+    uchar done;
+    pl_rec *rec;
+
+    if (g_state != PL_DETACHED)
+        return;
+
+    g_state = PL_RING;
+    while (1) {
+        rec = ring_peek(&g_in);
+        if (rec->what != PL_TOKEN || rec->tk.kind == TK_eof ||
+            rec->tk.loc > tk->loc)
+            break;
+        done = rec->tk.kind == '\n' && rec->tk.loc == tk->loc;
+        ring_release(&g_in);
+        if (done)
+            return;
+    }
+
+    g_req_p = s->p;
+    g_req_flags = s->flags;
+    epoch = __atomic_add_fetch(&g_req, 1, __ATOMIC_RELEASE);
+    futex_wake(&g_req);
+
+    while (1) {
+        rec = ring_peek(&g_in);
+        done = rec->what == PL_MARK && rec->epoch == epoch;
+        ring_release(&g_in);
+        if (done)
+            break;
+    }
+}
+
+/* Start the output thread, returns 0 if not in pipelined mode */
+int cpp_pipeline_output(FILE *fp)
+{
+    if (!g_enabled || g_printing)
+        return 0;
+
+    ring_setup(&g_out);
+    cpp_output_setup(&g_output, fp);
+    if (pthread_create(&g_printer, NULL, printer, cpp_mem_current()) != 0) {
+        cpp_output_cleanup(&g_output);
+        ring_cleanup(&g_out);
+        return 0;
+    }
+
+    g_printing = 1;
+    return 1;
+}
+
+/* Queue `tk` for the output thread, TK_eof ends the output */
+void cpp_pipeline_print(const cpp_token *tk)
+{
+    pl_rec *rec = ring_reserve(&g_out, NULL, 0);
+
+    rec->tk = *tk;
+    rec->what = tk->kind == TK_eof ? PL_END : PL_TOKEN;
+    /* The string pool never moves, see __buffer_setup() */
+    if (tk->kind == TK_identifier)
+        rec->tk.p.ptr = (const uchar *)string_ref_ptr(tk->p.ref);
+    ring_commit(&g_out, tk->kind == TK_eof);
+}
+
+/* Wait for the output thread, after cpp_pipeline_print() got TK_eof.
+ * Returns -1 with errno if it failed to write. */
+int cpp_pipeline_finish(void)
+{
+    int err;
+
+    if (!g_printing)
+        return 0;
+
+    pthread_join(g_printer, NULL);
+    ring_cleanup(&g_out);
+    g_printing = 0;
+    err = g_output.err;
+    cpp_output_cleanup(&g_output);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Preprocess what cpp_start() began on a thread of its own, the tokens
+ * are taken with cpp_pipeline_pull().  Returns 0 if not in pipelined mode,
+ * then cpp_next_token() is for the caller to call. */
+int cpp_pipeline_produce(cpp_context *ctx)
+{
+    /* a token pulled from the ring may point into an evicted header */
+    if (!g_enabled || g_producing || g_printing ||
+        HAS_FLAG(ctx->flags, CPP_CONTEXT_EVICT))
+        return 0;
+
+    ring_setup(&g_out);
+    g_ctx = ctx;
+    g_halt = 0;
+    if (pthread_create(&g_producer, NULL, producer, NULL) != 0) {
+        ring_cleanup(&g_out);
+        return 0;
+    }
+
+    g_producing = 1;
+    return 1;
+}
+
+/* Like cpp_next_token(), from the thread of cpp_pipeline_produce() */
+int cpp_pipeline_pull(cpp_token *tk)
+{
+    pl_rec *rec;
+    uchar what;
+
+    if (!g_producing) {
+        memset(tk, 0, sizeof(*tk));
+        tk->kind = TK_eof;
+        return 0;
+    }
+
+    rec = ring_peek(&g_out);
+    *tk = rec->tk;
+    what = rec->what;
+    ring_release(&g_out);
+    if (what == PL_TOKEN)
+        return 1;
+
+    pthread_join(g_producer, NULL);
+    ring_cleanup(&g_out);
+    g_producing = 0;
+    return 0;
+}
+
+void cpp_pipeline_cleanup(void)
+{
+    pl_rec *rec;
+    cpp_token tk;
+
+    /* Unless it's the producer thread with an error, it has to stop */
+    if (g_producing && !pthread_equal(g_producer, pthread_self())) {
+        __atomic_store_n(&g_halt, 1, __ATOMIC_RELEASE);
+        while (cpp_pipeline_pull(&tk))
+            ;
+    }
+
+    if (g_printing) { /* an error, print what was done so far */
+        rec = ring_reserve(&g_out, NULL, 0);
+        rec->what = PL_ABORT;
+        ring_commit(&g_out, 1);
+        cpp_pipeline_finish();
+    }
+
+    if (g_lexing) {
+        g_stop = 1;
+        __atomic_add_fetch(&g_req, 1, __ATOMIC_RELEASE);
+        futex_wake(&g_req);
+        /* make room in case it waits for it, then it sees the request */
+        if (__atomic_load_n(&g_in.tail, __ATOMIC_ACQUIRE) != g_in.head)
+            ring_release(&g_in);
+        futex_wake(&g_in.head);
+        pthread_join(g_lexer, NULL);
+        ring_cleanup(&g_in);
+        g_lexing = 0;
+    }
+
+    g_state = PL_OFF;
+}
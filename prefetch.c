@@ -0,0 +1,720 @@
+#include "cpp.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Speculative #include prefetch.
+ *
+ * Workers resolve and read headers before do_include() asks for them.  Jobs
+ * come from a cheap scan of the #include lines of every loaded file and from
+ * an include trace recorded by a previous run.  The scan doesn't know about
+ * conditionals or macros, so it's only a guess, a wrong guess costs a read.
+ *
+ * A job is keyed by "dir\tname" ("\tname" for <name>), the same string is a
+ * line of the trace file.  Paths are interned by the main thread when it takes
+ * them, see cpp_prefetch_take(), identifiers already are by the workers. */
+
+enum { PF_QUEUED, PF_RUNNING, PF_DONE };
+
+typedef struct pf_entry {
+    struct pf_entry *next; /* hash chain */
+    struct pf_entry *qnext; /* g_queue */
+    struct pf_entry *tnext; /* g_trace, in order of first #include */
+    uint hash;
+    uchar state, traced;
+    char *key;
+    const char *name; /* points into key */
+    char *cwd; /* NULL for <name> */
+    cpp_prefetched pf;
+} pf_entry;
+
+typedef struct pf_scan {
+    struct pf_scan *next;
+    const uchar *data;
+    char *dir;
+} pf_scan;
+
+typedef struct pf_path {
+    struct pf_path *next;
+    uint hash;
+    char path[];
+} pf_path;
+
+typedef struct {
+    int fd;
+    uint *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} pf_ring;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;
+static pthread_t g_thread[CPP_PREFETCH_MAX_THREAD];
+static int g_nthread;
+static uchar g_stop;
+
+static pf_entry *g_table[CPP_PREFETCH_BUCKET];
+static pf_path *g_loaded[CPP_PREFETCH_BUCKET];
+static pf_entry *g_queue, **g_queue_tail = &g_queue;
+static pf_scan *g_scan, **g_scan_tail = &g_scan;
+static pf_scan *g_scanning; /* taken by a worker, linked by `next` */
+static pf_entry *g_trace, **g_trace_tail = &g_trace;
+static char *g_trace_path;
+static size_t g_nentry, g_bytes;
+
+static uint hash_str(const char *s)
+{
+    uint h = 2166136261u;
+    while (*s)
+        h = (h ^ (uchar)*s++) * 16777619u;
+    return h;
+}
+
+/* ---- io_uring ----------------------------------------------------------- */
+
+static void ring_cleanup(pf_ring *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_size);
+    if (r->fd >= 0)
+        close(r->fd);
+}
+
+static int ring_setup(pf_ring *r, uint entries)
+{
+    struct io_uring_params p;
+    uchar *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                     r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+        r->sqes == MAP_FAILED) {
+        ring_cleanup(r);
+        return -1;
+    }
+
+    sq = r->sq_ptr, cq = r->cq_ptr;
+    r->sq_head = (uint *)(sq + p.sq_off.head);
+    r->sq_tail = (uint *)(sq + p.sq_off.tail);
+    r->sq_mask = (uint *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (uint *)(sq + p.sq_off.array);
+    r->cq_head = (uint *)(cq + p.cq_off.head);
+    r->cq_tail = (uint *)(cq + p.cq_off.tail);
+    r->cq_mask = (uint *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static uint ring_reap(pf_ring *r, int *res)
+{
+    uint head, n = 0;
+    struct io_uring_cqe *cqe;
+
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        res[cqe->user_data] = cqe->res;
+        head++, n++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Submit ops[0..n) and wait for all of them, res[i] gets the result of the
+ * i-th, -ECANCELED if it wasn't run.  Returns -1 if some weren't: the ring
+ * is left empty either way, so the next batch doesn't see these. */
+static int ring_run(pf_ring *r, struct io_uring_sqe *ops, uint n, int *res)
+{
+    long ret;
+    uint i, idx, tail, done = 0, todo = n;
+
+    tail = *r->sq_tail;
+    for (i = 0; i < n; i++) {
+        idx = (tail + i) & *r->sq_mask;
+        r->sqes[idx] = ops[i];
+        r->sqes[idx].user_data = i;
+        r->sq_array[idx] = idx;
+        res[i] = -ECANCELED;
+    }
+    __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    while (done < n) {
+        ret = syscall(__NR_io_uring_enter, r->fd, todo, n - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                break;
+            continue;
+        }
+        todo -= MIN(todo, (uint)ret);
+        done += ring_reap(r, res);
+    }
+    if (done == n)
+        return 0;
+
+    /* Take back what the kernel hasn't consumed, and wait for what it has:
+     * the reads may still land in the buffers the caller will free */
+    __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    todo = n - (*r->sq_tail - tail);
+    while (done < n - todo) {
+        ret = syscall(__NR_io_uring_enter, r->fd, 0, n - todo - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            sched_yield();
+        done += ring_reap(r, res);
+    }
+    return -1;
+}
+
+/* ---- jobs --------------------------------------------------------------- */
+
+static pf_entry *entry_lookup(const char *key, uint h)
+{
+    pf_entry *e;
+
+    for (e = g_table[h % CPP_PREFETCH_BUCKET]; e != NULL; e = e->next) {
+        if (e->hash == h && strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* Must be called with g_lock held, returns NULL if there are too many */
+static pf_entry *entry_new(const char *key, uint h, size_t dirlen)
+{
+    pf_entry *e;
+
+    if (g_nentry == CPP_PREFETCH_MAX_ENTRY)
+        return NULL;
+
+    e = cpp_mem_calloc(CPP_MEM_FILE, 1, sizeof(pf_entry));
+    e->hash = h;
+    e->key = cpp_mem_strdup(CPP_MEM_FILE, key);
+    e->name = e->key + dirlen + 1;
+    if (dirlen > 0) {
+        e->cwd = memcpy(cpp_mem_alloc(CPP_MEM_FILE, dirlen + 1), key, dirlen);
+        e->cwd[dirlen] = '\0';
+    }
+    e->next = g_table[h % CPP_PREFETCH_BUCKET];
+    g_table[h % CPP_PREFETCH_BUCKET] = e;
+    g_nentry++;
+    return e;
+}
+
+static void enqueue(const char *cwd, const char *name, size_t len)
+{
+    uint h;
+    size_t dirlen = cwd != NULL ? strlen(cwd) : 0;
+    char key[2 * PATH_MAX + 2];
+    pf_entry *e;
+
+    if (dirlen + len + 2 > sizeof(key))
+        return;
+    if (cwd != NULL)
+        memcpy(key, cwd, dirlen);
+    key[dirlen] = '\t';
+    memcpy(key + dirlen + 1, name, len);
+    key[dirlen + 1 + len] = 0;
+    h = hash_str(key);
+
+    pthread_mutex_lock(&g_lock);
+    if (entry_lookup(key, h) == NULL) {
+        e = entry_new(key, h, dirlen);
+        if (e != NULL) {
+            e->state = PF_QUEUED;
+            *g_queue_tail = e;
+            g_queue_tail = &e->qnext;
+            pthread_cond_signal(&g_work);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* Queue what the #include lines of `p` name.  Conditionals, comments and
+ * macros are ignored, it's only a guess. */
+static void scan_includes(const uchar *p, const char *dir)
+{
+    uchar end;
+    const uchar *q;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#') {
+            p++;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (strncmp((const char *)p, "include", 7) == 0) {
+                p += 7;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (*p == '"' || *p == '<') {
+                    end = *p == '"' ? '"' : '>';
+                    q = ++p;
+                    while (*p && *p != end && *p != '\n')
+                        p++;
+                    if (*p == end && p > q && p - q <= PATH_MAX)
+                        enqueue(end == '"' ? dir : NULL, (const char *)q,
+                                (size_t)(p - q));
+                }
+            }
+        }
+        p = (const uchar *)strchr((const char *)p, '\n');
+        if (p == NULL)
+            break;
+        p++;
+    }
+}
+
+/* Must be called with g_lock held.  Returns 1 if `path` should be read, so
+ * two names for the same file, or too much data, don't get read twice. */
+static int claim_path(const char *path, size_t size)
+{
+    uint h = hash_str(path);
+    size_t len = strlen(path);
+    pf_path *lp;
+
+    for (lp = g_loaded[h % CPP_PREFETCH_BUCKET]; lp != NULL; lp = lp->next) {
+        if (lp->hash == h && strcmp(lp->path, path) == 0)
+            return 0;
+    }
+    if (g_bytes + size > CPP_PREFETCH_MAX_BYTES)
+        return 0;
+
+    lp = cpp_mem_alloc(CPP_MEM_FILE, sizeof(pf_path) + len + 1);
+    lp->hash = h;
+    memcpy(lp->path, path, len + 1);
+    lp->next = g_loaded[h % CPP_PREFETCH_BUCKET];
+    g_loaded[h % CPP_PREFETCH_BUCKET] = lp;
+    g_bytes += size;
+    return 1;
+}
+
+/* Finish what io_uring left undone, `fd` is -1 if it wasn't even opened */
+static int read_sync(pf_entry *e, int fd, size_t off)
+{
+    ssize_t n;
+    int ret = 0;
+
+    if (fd < 0) {
+        fd = open(e->pf.path, O_RDONLY);
+        if (fd < 0)
+            return -1;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    while (off < e->pf.size) {
+        n = pread(fd, e->pf.data + off, e->pf.size - off, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = n < 0 ? -1 : 0;
+            break;
+        }
+        off += (size_t)n;
+    }
+
+    e->pf.size = off;
+    close(fd);
+    return ret;
+}
+
+static void entry_done(pf_entry *e)
+{
+    pthread_mutex_lock(&g_lock);
+    e->state = PF_DONE;
+    pthread_cond_broadcast(&g_done);
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* Resolve and read the files of `batch`, through `r` if there is a ring.
+ * Then scan them for more work, and pretokenize them if `lex`, before they
+ * are done and can be taken (and freed). */
+static void load_batch(pf_ring *r, pf_entry **batch, uint n, uchar lex)
+{
+    uint i, m;
+    cpp_token_array ts;
+    pf_entry *e;
+    const char *sl;
+    char buf[PATH_MAX + 1];
+    uchar want[CPP_PREFETCH_BATCH];
+    int fd[CPP_PREFETCH_BATCH], res[CPP_PREFETCH_BATCH];
+    uint idx[CPP_PREFETCH_BATCH];
+    struct io_uring_sqe ops[CPP_PREFETCH_BATCH];
+
+    for (i = 0; i < n; i++) {
+        e = batch[i];
+        if (cpp_include_resolve(e->name, e->cwd, buf, &e->pf.sb) != 0) {
+            e->pf.err = errno;
+            continue;
+        }
+        e->pf.path = cpp_mem_strdup(CPP_MEM_FILE, buf);
+        e->pf.size = (size_t)e->pf.sb.st_size;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    for (i = 0; i < n; i++) {
+        e = batch[i];
+        want[i] = e->pf.path != NULL && S_ISREG(e->pf.sb.st_mode) &&
+                  e->pf.size <= CPP_FILE_MAX_SIZE &&
+                  claim_path(e->pf.path, e->pf.size);
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    /* Same layout as file_read() gives */
+    for (m = 0, i = 0; i < n; i++) {
+        fd[i] = -1;
+        if (!want[i]) {
+            entry_done(batch[i]);
+            continue;
+        }
+        e = batch[i];
+        e->pf.data = cpp_mem_alloc(CPP_MEM_FILE, ALIGN(e->pf.size + 4, 8));
+        idx[m++] = i;
+    }
+
+    if (r != NULL && m > 0) {
+        memset(ops, 0, sizeof(ops[0]) * m);
+        for (i = 0; i < m; i++) {
+            ops[i].opcode = IORING_OP_OPENAT;
+            ops[i].fd = AT_FDCWD;
+            ops[i].addr = (uintptr_t)batch[idx[i]]->pf.path;
+            ops[i].open_flags = O_RDONLY;
+        }
+        ring_run(r, ops, m, res); /* what did run is used, or closed */
+        for (i = 0; i < m; i++)
+            fd[idx[i]] = res[i] >= 0 ? res[i] : -1;
+
+        memset(ops, 0, sizeof(ops[0]) * m);
+        for (i = 0; i < m; i++) {
+            e = batch[idx[i]];
+            if (fd[idx[i]] < 0 || e->pf.size == 0) {
+                ops[i].opcode = IORING_OP_NOP;
+                continue;
+            }
+            ops[i].opcode = IORING_OP_READ;
+            ops[i].fd = fd[idx[i]];
+            ops[i].addr = (uintptr_t)e->pf.data;
+            ops[i].len = (uint)e->pf.size;
+        }
+        ring_run(r, ops, m, res); /* a short or failed read is redone */
+    } else {
+        for (i = 0; i < m; i++)
+            res[i] = 0;
+    }
+
+    for (i = 0; i < m; i++) {
+        e = batch[idx[i]];
+        if (read_sync(e, fd[idx[i]], res[i] > 0 ? (size_t)res[i] : 0) != 0) {
+            cpp_mem_free(e->pf.data);
+            e->pf.data = NULL; /* cpp_file_open2() will tell what's wrong */
+            entry_done(e);
+            continue;
+        }
+
+        /* What file_new() does, so the tokens are the same */
+        if (e->pf.size > 0 && e->pf.data[e->pf.size - 1] != '\n') {
+            e->pf.data[e->pf.size] = '\n';
+            e->pf.data[e->pf.size + 1] = 0;
+        } else {
+            e->pf.data[e->pf.size] = 0;
+        }
+
+        sl = strrchr(e->pf.path, '/');
+        if (sl != NULL) {
+            snprintf(buf, sizeof(buf), "%.*s", (int)(sl - e->pf.path),
+                     e->pf.path);
+            scan_includes(e->pf.data, buf);
+        } else {
+            scan_includes(e->pf.data, ".");
+        }
+
+        if (lex) {
+            cpp_token_array_setup(&ts, e->pf.size / 4 + 16);
+            if (cpp_lex_pretokenize(e->pf.data,
+                                    e->cwd == NULL ? CPP_FILE_SYSTEM : 0,
+                                    &ts) == 0)
+                e->pf.tokens = ts.tokens;
+        }
+        entry_done(e);
+    }
+}
+
+static void *worker(void *arg)
+{
+    uint n;
+    pf_ring ring, *r = NULL;
+    pf_scan *s, **p;
+    pf_entry *e, *batch[CPP_PREFETCH_BATCH];
+
+    cpp_mem_enter(arg); /* that of cpp_prefetch_setup() */
+    if (ring_setup(&ring, CPP_PREFETCH_BATCH) == 0)
+        r = &ring;
+
+    pthread_mutex_lock(&g_lock);
+    while (!g_stop) {
+        for (n = 0; g_queue != NULL && n < CPP_PREFETCH_BATCH; ) {
+            e = g_queue;
+            g_queue = e->qnext;
+            if (g_queue == NULL)
+                g_queue_tail = &g_queue;
+            if (e->state == PF_QUEUED) { /* else taken by the main thread */
+                e->state = PF_RUNNING;
+                batch[n++] = e;
+            }
+        }
+
+        if (n > 0) {
+            pthread_mutex_unlock(&g_lock);
+            load_batch(r, batch, n, 1);
+            pthread_mutex_lock(&g_lock);
+        } else if (g_scan != NULL) {
+            s = g_scan;
+            g_scan = s->next;
+            if (g_scan == NULL)
+                g_scan_tail = &g_scan;
+            s->next = g_scanning;
+            g_scanning = s;
+            pthread_mutex_unlock(&g_lock);
+            scan_includes(s->data, s->dir);
+            pthread_mutex_lock(&g_lock);
+            for (p = &g_scanning; *p != s; p = &(*p)->next)
+                ;
+            *p = s->next;
+            pthread_cond_broadcast(&g_done); /* see cpp_prefetch_forget() */
+            cpp_mem_free(s->dir);
+            cpp_mem_free(s);
+        } else {
+            pthread_cond_wait(&g_work, &g_lock);
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    if (r != NULL)
+        ring_cleanup(r);
+    cpp_mem_enter(NULL);
+    return NULL;
+}
+
+/* ---- interface ---------------------------------------------------------- */
+
+/* Start `nthread` workers.  The #include search path must be complete.
+ * If `trace` exists, its lines are queued first, it's rewritten by
+ * cpp_prefetch_cleanup(). */
+void cpp_prefetch_setup(int nthread, const char *trace)
+{
+    FILE *fp;
+    char *tab, line[2 * PATH_MAX + 2];
+    size_t len;
+
+    if (trace != NULL) {
+        g_trace_path = cpp_mem_strdup(CPP_MEM_FILE, trace);
+        fp = fopen(trace, "r");
+        if (fp != NULL) {
+            while (fgets(line, sizeof(line), fp) != NULL) {
+                len = strlen(line);
+                if (len > 0 && line[len - 1] == '\n')
+                    line[--len] = 0;
+                tab = strchr(line, '\t');
+                if (tab == NULL || tab[1] == 0)
+                    continue;
+                *tab = 0;
+                enqueue(tab == line ? NULL : line, tab + 1, strlen(tab + 1));
+            }
+            fclose(fp);
+        }
+    }
+
+    nthread = MIN(nthread, CPP_PREFETCH_MAX_THREAD);
+    for (g_nthread = 0; g_nthread < nthread; g_nthread++) {
+        if (pthread_create(&g_thread[g_nthread], NULL, worker,
+                           cpp_mem_current()) != 0)
+            break;
+    }
+}
+
+/* Let the workers scan `file` for #include lines */
+void cpp_prefetch_scan(cpp_file *file)
+{
+    pf_scan *s;
+
+    if (g_nthread == 0 ||
+        HAS_FLAG(CPP_FILE_FLAGS(file), CPP_FILE_MAPPED | CPP_FILE_PIPE))
+        return;
+
+    s = cpp_mem_alloc(CPP_MEM_FILE, sizeof(pf_scan));
+    s->next = NULL;
+    s->data = file->data;
+    s->dir = cpp_mem_strdup(CPP_MEM_FILE, string_ref_ptr(file->dirpath));
+
+    pthread_mutex_lock(&g_lock);
+    *g_scan_tail = s;
+    g_scan_tail = &s->next;
+    pthread_cond_signal(&g_work);
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* `data` is about to be freed, drop its scan if it didn't start, else wait
+ * until it's done */
+void cpp_prefetch_forget(const uchar *data)
+{
+    pf_scan *s, **p;
+
+    if (g_nthread == 0)
+        return;
+
+    pthread_mutex_lock(&g_lock);
+    for (p = &g_scan; (s = *p) != NULL; ) {
+        if (s->data == data) {
+            *p = s->next;
+            cpp_mem_free(s->dir);
+            cpp_mem_free(s);
+        } else {
+            p = &s->next;
+        }
+    }
+    g_scan_tail = p;
+
+    for (s = g_scanning; s != NULL; ) {
+        if (s->data == data) {
+            pthread_cond_wait(&g_done, &g_lock);
+            s = g_scanning;
+        } else {
+            s = s->next;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* Resolve and read #include "name" (<name> if `cwd` is NULL).  Returns 0 if
+ * prefetching is off, else fills `pf`, whose data then belongs to the caller.
+ * A job that no worker started yet is done right here. */
+int cpp_prefetch_take(const char *name, const char *cwd, cpp_prefetched *pf)
+{
+    uint h;
+    size_t dirlen = cwd != NULL ? strlen(cwd) : 0;
+    char key[2 * PATH_MAX + 2];
+    pf_entry *e;
+
+    if (g_nthread == 0)
+        return 0;
+
+    snprintf(key, sizeof(key), "%s\t%s", cwd != NULL ? cwd : "", name);
+    h = hash_str(key);
+
+    pthread_mutex_lock(&g_lock);
+    e = entry_lookup(key, h);
+    if (e == NULL) {
+        e = entry_new(key, h, dirlen);
+        if (e == NULL) {
+            pthread_mutex_unlock(&g_lock);
+            return 0;
+        }
+        e->state = PF_QUEUED;
+    }
+
+    if (e->state == PF_QUEUED) {
+        e->state = PF_RUNNING;
+        pthread_mutex_unlock(&g_lock);
+        load_batch(NULL, &e, 1, 0);
+        pthread_mutex_lock(&g_lock);
+    }
+    while (e->state != PF_DONE)
+        pthread_cond_wait(&g_done, &g_lock);
+
+    *pf = e->pf;
+    if (e->pf.data != NULL) {
+        g_bytes -= e->pf.size;
+        e->pf.data = NULL;
+        e->pf.tokens = NULL;
+    }
+    if (!e->traced) {
+        e->traced = 1;
+        *g_trace_tail = e;
+        g_trace_tail = &e->tnext;
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    return 1;
+}
+
+void cpp_prefetch_cleanup(void)
+{
+    int i;
+    FILE *fp;
+    pf_entry *e;
+    pf_scan *s;
+    pf_path *lp;
+
+    if (g_nthread == 0 && g_trace_path == NULL)
+        return;
+
+    pthread_mutex_lock(&g_lock);
+    g_stop = 1;
+    pthread_cond_broadcast(&g_work);
+    pthread_mutex_unlock(&g_lock);
+    for (i = 0; i < g_nthread; i++)
+        pthread_join(g_thread[i], NULL);
+    g_nthread = 0;
+
+    if (g_trace_path != NULL) {
+        fp = fopen(g_trace_path, "w");
+        if (fp != NULL) {
+            for (e = g_trace; e != NULL; e = e->tnext)
+                fprintf(fp, "%s\n", e->key);
+            fclose(fp);
+        }
+        cpp_mem_free(g_trace_path);
+        g_trace_path = NULL;
+    }
+
+    for (i = 0; i < CPP_PREFETCH_BUCKET; i++) {
+        while ((e = g_table[i]) != NULL) {
+            g_table[i] = e->next;
+            cpp_mem_free((char *)e->pf.path);
+            cpp_mem_free(e->pf.data);
+            cpp_mem_free(e->pf.tokens);
+            cpp_mem_free(e->cwd);
+            cpp_mem_free(e->key);
+            cpp_mem_free(e);
+        }
+        while ((lp = g_loaded[i]) != NULL) {
+            g_loaded[i] = lp->next;
+            cpp_mem_free(lp);
+        }
+    }
+    while ((s = g_scan) != NULL) {
+        g_scan = s->next;
+        cpp_mem_free(s->dir);
+        cpp_mem_free(s);
+    }
+
+    g_queue = NULL, g_queue_tail = &g_queue;
+    g_scan = NULL, g_scan_tail = &g_scan;
+    g_trace = NULL, g_trace_tail = &g_trace;
+    g_nentry = g_bytes = 0;
+    g_stop = 0;
+}
@@ -0,0 +1,502 @@
+#include "cpp.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Resident preprocessing server, see cpp_server_run().
+ *
+ * A client sends its argv and cwd on a Unix socket, with its stdout and
+ * stderr as SCM_RIGHTS so the output goes straight to them, and gets the exit
+ * status back.  A request is "len (4 bytes) cwd\0argv[0]\0argv[1]\0...", the
+ * answer is 1 byte.
+ *
+ * Between requests the context is only reset, so what's read stays for the
+ * next one: the files, their pretokens and lines, and where each #include
+ * led.  The directories of the files read and those of the search path are
+ * watched with inotify, a file that changed is forgotten before the next
+ * request, and so is where each #include led once a file appears or goes
+ * away, see cpp_file_forget(). */
+
+#define SERVER_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |   \
+                       IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |            \
+                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* A watched directory, the same one may be several cpp_file::dirpath */
+typedef struct {
+    int wd;
+    string_ref dir;
+} srv_watch;
+
+static int g_inotify = -1;
+static srv_watch *g_watch;
+static int g_nwatch, g_watch_cap;
+static uchar g_watched[CPP_FILE_MAX_USED]; /* by cpp_file::no */
+static volatile sig_atomic_t g_quit;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    g_quit = 1;
+}
+
+/* ---- inotify ------------------------------------------------------------ */
+
+/* Its slot is for another file from now on, see cpp_file_forget() */
+static void forget(cpp_file *f)
+{
+    if (f != NULL)
+        g_watched[f->no] = 0;
+    cpp_file_forget(f);
+}
+
+/* Watch `dir` if it isn't yet, returns -1 with errno if it can't be */
+static int watch_dir(string_ref dir)
+{
+    int i, wd;
+
+    for (i = 0; i < g_nwatch && g_watch[i].dir != dir; i++)
+        ;
+    if (i < g_nwatch)
+        return 0;
+    wd = inotify_add_watch(g_inotify, string_ref_ptr(dir), SERVER_EVENTS);
+    if (wd < 0)
+        return -1;
+    if (g_nwatch == g_watch_cap) {
+        g_watch_cap = g_watch_cap != 0 ? g_watch_cap * 2 : 64;
+        g_watch = cpp_mem_realloc(CPP_MEM_SCRATCH, g_watch,
+                                  g_watch_cap * sizeof(srv_watch));
+    }
+    g_watch[g_nwatch].wd = wd;
+    g_watch[g_nwatch++].dir = dir;
+    return 0;
+}
+
+/* Watch the search path, where a header that appears may take an #include
+ * from another directory, and the directories of the files read by the last
+ * request.  A file that can't be watched, or that changed before it was, is
+ * forgotten right away, and so is where each #include led if a directory
+ * of the search path can't be watched. */
+static void watch_files(void)
+{
+    int i, no;
+    cpp_file *f;
+    const char *dir;
+    struct stat sb;
+
+    for (i = 0; (dir = cpp_search_path(i)) != NULL; i++)
+        if (watch_dir(string_ref_new_keep(dir)) != 0)
+            forget(NULL);
+
+    for (no = 1; (f = cpp_file_no((ushort)no)) != NULL; no++) {
+        if (g_watched[no] || HAS_FLAG(f->flags, CPP_FILE_PIPE) ||
+            HAS_FLAG(f->flags, CPP_FILE_FORGOTTEN))
+            continue;
+        g_watched[no] = 1;
+
+        if (watch_dir(f->dirpath) != 0 ||
+            stat(string_ref_ptr(f->path), &sb) != 0 || !cpp_file_same(f, &sb))
+            forget(f);
+    }
+}
+
+/* Forget the files in `dir`, all of them if it's 0 */
+static void forget_dir(string_ref dir)
+{
+    int no;
+    cpp_file *f;
+
+    for (no = 1; (f = cpp_file_no((ushort)no)) != NULL; no++)
+        if (!HAS_FLAG(f->flags, CPP_FILE_PIPE) &&
+            (dir == 0 || f->dirpath == dir))
+            forget(f);
+    forget(NULL);
+}
+
+/* `name` changed, appeared or went away in `dir`: it's forgotten if it was
+ * read, and where each #include led is, in any case.  Its path is only looked
+ * up, so it goes with the overlay if it's new. */
+static void forget_path(string_ref dir, const char *name)
+{
+    cpp_file *f = NULL;
+    char path[PATH_MAX + 1];
+    const char *d = string_ref_ptr(dir);
+
+    if (snprintf(path, sizeof(path), "%s/%s", d, name) < (int)sizeof(path))
+        f = cpp_file_find(string_ref_new(path));
+    if (f == NULL && strcmp(d, ".") == 0) /* see file_new() */
+        f = cpp_file_find(string_ref_new(name));
+    forget(f);
+}
+
+/* Apply what inotify has to tell, without waiting */
+static void read_events(void)
+{
+    int i, j;
+    ssize_t n;
+    const struct inotify_event *ev;
+    _Alignas(struct inotify_event) char buf[8192];
+
+    while ((n = read(g_inotify, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i += (int)(sizeof(*ev) + ev->len)) {
+            ev = (const struct inotify_event *)(buf + i);
+            if (HAS_FLAG(ev->mask, IN_Q_OVERFLOW)) {
+                forget_dir(0);
+                continue;
+            }
+            for (j = 0; j < g_nwatch; j++) {
+                if (g_watch[j].wd != ev->wd)
+                    continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                    forget_dir(g_watch[j].dir);
+                else if (ev->len > 0)
+                    forget_path(g_watch[j].dir, ev->name);
+            }
+            if (HAS_FLAG(ev->mask, IN_IGNORED)) { /* the watch is gone */
+                for (j = 0; j < g_nwatch; )
+                    if (g_watch[j].wd == ev->wd)
+                        g_watch[j] = g_watch[--g_nwatch];
+                    else
+                        j++;
+            }
+        }
+    }
+}
+
+/* ---- requests ----------------------------------------------------------- */
+
+/* Wait until `fd` is ready for `events` or the cpp_timer_now() `deadline`
+ * passes (0 for none), -1 with ETIMEDOUT then */
+static int wait_fd(int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    uint64_t now;
+    int n;
+
+    if (deadline == 0)
+        return 0;
+    do {
+        now = cpp_timer_now();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        n = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+    } while (n == 0 || (n < 0 && errno == EINTR));
+    return n < 0 ? -1 : 0;
+}
+
+static int read_full(int fd, void *buf, size_t size, uint64_t deadline)
+{
+    ssize_t n;
+    size_t off = 0;
+
+    while (off < size) {
+        if (wait_fd(fd, POLLIN, deadline) != 0)
+            return -1;
+        n = read(fd, (char *)buf + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = ECONNRESET;
+        if (n <= 0)
+            return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size, uint64_t deadline)
+{
+    ssize_t n;
+    size_t off = 0;
+
+    while (off < size) {
+        if (wait_fd(fd, POLLOUT, deadline) != 0)
+            return -1;
+        n = write(fd, (const char *)buf + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+/* Receive the length of a request with the client's stdout and stderr */
+static int recv_header(int conn, uint32_t *len, int fds[2], uint64_t deadline)
+{
+    ssize_t n;
+    struct iovec iov = { len, sizeof(*len) };
+    struct msghdr msg = {0};
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } u;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    do {
+        if (wait_fd(conn, POLLIN, deadline) != 0)
+            return -1;
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)sizeof(*len))
+        return -1;
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET ||
+        cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), 2 * sizeof(int));
+    return 0;
+}
+
+static void serve_one(cpp_context *ctx, int conn, cpp_serve_fn serve,
+                      void *arg)
+{
+    int argc = 0, fds[2] = {-1, -1};
+    uint32_t i, len;
+    uchar status = 1;
+    char *buf = NULL, **argv = NULL;
+    FILE *out = NULL, *err = NULL;
+    /* a client that stalls doesn't hold up the ones behind it */
+    uint64_t deadline = cpp_timer_now() + CPP_SERVER_TIMEOUT * 1000000ULL;
+
+    if (recv_header(conn, &len, fds, deadline) != 0 || len == 0 ||
+        len > CPP_SERVER_MAX_REQUEST)
+        goto done;
+    buf = cpp_mem_alloc(CPP_MEM_SCRATCH, len + 1);
+    if (read_full(conn, buf, len, deadline) != 0)
+        goto done;
+    buf[len] = 0;
+
+    argv = cpp_mem_calloc(CPP_MEM_SCRATCH, CPP_SERVER_MAX_ARGS + 1,
+                          sizeof(char *));
+    for (i = (uint32_t)strlen(buf) + 1; i < len; ) { /* after the cwd */
+        if (argc == CPP_SERVER_MAX_ARGS)
+            goto done;
+        argv[argc++] = buf + i;
+        i += (uint32_t)strlen(buf + i) + 1;
+    }
+    if (argc == 0)
+        goto done;
+
+    out = fdopen(fds[0], "w");
+    err = fdopen(fds[1], "w");
+    if (out == NULL || err == NULL)
+        goto done;
+    fds[0] = fds[1] = -1;
+
+    read_events();
+    ctx->err = err;
+    status = serve(ctx, argc, argv, buf, out, err, arg) != 0;
+    ctx->err = NULL;
+    watch_files();
+
+done:
+    if (out != NULL)
+        fclose(out);
+    else if (fds[0] >= 0)
+        close(fds[0]);
+    if (err != NULL)
+        fclose(err);
+    else if (fds[1] >= 0)
+        close(fds[1]);
+    write_full(conn, &status, 1,
+               cpp_timer_now() + CPP_SERVER_TIMEOUT * 1000000ULL);
+    cpp_mem_free(argv);
+    cpp_mem_free(buf);
+}
+
+/* The path of a Unix socket into `addr`, returns -1 with errno if it's too
+ * long */
+static int socket_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Bind `fd` to `addr`, in place of a socket left by a server that's gone */
+static int socket_bind(int fd, const struct sockaddr_un *addr)
+{
+    int probe, alive;
+
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+        return 0;
+    if (errno != EADDRINUSE)
+        return -1;
+
+    probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0)
+        return -1;
+    alive = connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) == 0
+            || errno != ECONNREFUSED;
+    close(probe);
+    if (alive) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (unlink(addr->sun_path) != 0)
+        return -1;
+    return bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+/* Serve the requests that come at `path` with `serve`, one after another on
+ * `ctx`, until SIGINT or SIGTERM.  `serve` gets the client's argv, cwd and
+ * output, returns its exit status, and leaves `ctx` to be reset.  Returns 0,
+ * or -1 with errno if it couldn't start. */
+int cpp_server_run(cpp_context *ctx, const char *path, cpp_serve_fn serve,
+                   void *arg)
+{
+    int fd, conn, saved;
+    struct sockaddr_un addr;
+    struct pollfd pfd[2];
+    struct sigaction sa;
+
+    if (socket_addr(path, &addr) != 0)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (socket_bind(fd, &addr) != 0) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if (listen(fd, CPP_SERVER_BACKLOG) != 0)
+        goto fail;
+    g_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_inotify < 0)
+        goto fail;
+    watch_files(); /* the search path, before an #include may look in it */
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART; /* only poll() is cut short */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); /* a client that's gone is an output error */
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_inotify;
+    pfd[1].events = POLLIN;
+    while (!g_quit) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents & POLLIN)
+            read_events();
+        if (pfd[0].revents & POLLIN) {
+            conn = accept(fd, NULL, NULL);
+            if (conn < 0)
+                continue;
+            serve_one(ctx, conn, serve, arg);
+            close(conn);
+        }
+    }
+
+    close(g_inotify);
+    g_inotify = -1;
+    cpp_mem_free(g_watch);
+    g_watch = NULL;
+    g_nwatch = g_watch_cap = 0;
+    close(fd);
+    unlink(path);
+    return 0;
+
+fail:
+    saved = errno;
+    close(fd);
+    unlink(path);
+    errno = saved;
+    return -1;
+}
+
+/* Send `argv` with the current directory, stdout and stderr to the server at
+ * `path`, returns the exit status it answers, -1 with errno if there's no
+ * answer. */
+int cpp_server_request(const char *path, int argc, char **argv)
+{
+    int i, fd, fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    size_t len, n;
+    uint32_t len32;
+    uchar status;
+    char *buf, cwd[PATH_MAX + 1];
+    struct sockaddr_un addr;
+    struct iovec iov;
+    struct msghdr msg = {0};
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } u;
+
+    if (socket_addr(path, &addr) != 0 || getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+
+    len = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (len > CPP_SERVER_MAX_REQUEST || argc > CPP_SERVER_MAX_ARGS) {
+        errno = E2BIG;
+        return -1;
+    }
+    buf = cpp_mem_alloc(CPP_MEM_SCRATCH, len);
+    n = strlen(cwd) + 1;
+    memcpy(buf, cwd, n);
+    for (i = 0; i < argc; i++) {
+        memcpy(buf + n, argv[i], strlen(argv[i]) + 1);
+        n += strlen(argv[i]) + 1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        goto fail;
+
+    len32 = (uint32_t)len;
+    iov.iov_base = &len32;
+    iov.iov_len = sizeof(len32);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, 2 * sizeof(int));
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(fd, &msg, 0) != (ssize_t)sizeof(len32) ||
+        write_full(fd, buf, len, 0) != 0 || read_full(fd, &status, 1, 0) != 0)
+        goto fail;
+
+    close(fd);
+    cpp_mem_free(buf);
+    return status;
+
+fail:
+    i = errno;
+    if (fd >= 0)
+        close(fd);
+    cpp_mem_free(buf);
+    errno = i;
+    return -1;
+}
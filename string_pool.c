@@ -3,15 +3,40 @@
  *
  *  The implementation is very simple, each string_ref is actually an index to
  *  the `struct pool_array`, where index 0 is reserved for empty string.
- *  Its struct data, which is `struct string_off` stores information about a
- *  string_ref. The information needed are just the offset to the `struct
- *  pool_buffer` and the string length. Therefore, when one request a length
- *  of a string_ref, its time complexity is O(1).
+ *  It stores information about a string_ref in two side arrays: the offset
+ *  to the `struct pool_buffer` (or the string itself when it's short) and
+ *  the string length. Therefore, when one request a length of a string_ref,
+ *  its time complexity is O(1).
  *
  *  Insertion is a bit costly, but that's expected. We're trading off insertion
  *  with lookup since in compiler, lookup is the most used operation to find
  *  duplicated identifier.
  *
+ *  The pool can be used by several threads at once.  The set is sharded by
+ *  hash, a lookup that hits (the common case) takes no lock, and only an
+ *  insertion takes the lock of its shard.  Neither the array nor the buffer
+ *  ever moves, so reading a string_ref never synchronizes.
+ *
+ *  Keywords, directives, builtins and a few common identifiers are seeded at
+ *  build time (see string_pool_seed.def), with fixed string_ref values.
+ *  They're copied in at setup without hashing, and found by a perfect hash.
+ *
+ *  There are two layers.  The base one lives until string_pool_cleanup(),
+ *  it has the seeds and what's interned while no overlay is open, or with
+ *  string_ref_newlen_base() (the identifiers of system headers) and
+ *  string_ref_newlen_keep() (what outlives a translation unit: paths, the
+ *  pretokens of headers).  Between string_pool_overlay_begin() and
+ *  string_pool_overlay_drop(), the other strings go to the overlay, with
+ *  STRING_REF_OVERLAY set in their string_ref.  Dropping it forgets all of
+ *  them at once, so a process that preprocesses one file after another
+ *  doesn't keep the local identifiers of every one.
+ *
+ *  A string is found in one layer only, the base is searched first.  Those
+ *  two never give a string_ref of the overlay: string_ref_newlen_base()
+ *  rejects a string that's there, string_ref_newlen_keep() promotes it (see
+ *  __promote()), as what's interned for the translation unit keeps its
+ *  string_ref there until the drop.
+ *
  *  Despite the name, string pool is only used for identifier, it's not for
  *  string literal, because it can be large. This is true for C, as string
  *  literals can be adjacent and they need to be concatenated after
@@ -31,7 +56,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "string_pool.h"
 #define XXH_INLINE_ALL
 #include "xxhash.h"
@@ -55,38 +84,83 @@
     } while (0)
 
 /* ... */
-#define DEFAULT_POOL_CAPA   512u
-#define DEFAULT_ARRAY_CAPA  512u
-#define DEFAULT_BUFFER_SIZE (1u << 18) /* 256KiB */
+#define POOL_SHARD_BITS     6u
+#define POOL_SHARDS         (1u << POOL_SHARD_BITS)
+#define POOL_BASE           0u
+#define POOL_OVERLAY        1u
+#define POOL_LAYERS         2u
+#define POOL_SPIN           64u
+#define DEFAULT_POOL_CAPA   64u /* per shard */
+#define DEFAULT_ARRAY_CAPA  (1u << 26) /* 64M strings of address space */
+#define DEFAULT_BUFFER_SIZE (1u << 31) /* 2GiB of address space */
+#define INLINE_MAX          3u /* longest string kept in its pool_array::str */
+#define LONG_LEN            255u /* pool_array::len of a long string */
+#define POOL_SLOT           (sizeof(uint32_t) + sizeof(uint8_t))
 
 /* The pool table.
  * Used to implement Set data structure to find duplicated string efficiently.
- * string_ref of 0 is never stored here.
+ * A slot is a string_ref in `data` and 8 bits of its hash in `tag`, both in
+ * one mapping.  A probe only reads the string when the tag matches, so it
+ * rarely leaves the table.
+ * An empty slot is 0, string_ref of 0 is never stored here.
+ * A slot is written once, its tag before its string_ref, so a table can be
+ * probed without the lock of its shard.  When it grows, the pages of the
+ * old one are given back but its address range is kept until
+ * string_pool_cleanup(): a reader still probing it reads empty slots,
+ * misses, and looks again in the new table.
  */
 struct pool_table {
-    string_ref *data;
+    struct pool_table *prev; /* retired */
+    uint32_t mask;
+    uint32_t *data; /* mmap()-ed, POOL_SLOT bytes per slot */
+    uint8_t *tag; /* after `data` */
+};
+
+struct pool_set {
+    struct pool_table *table;
     uint32_t count;
-    uint32_t capacity;
     uint32_t load_factor;
 };
 
-/* This is what a `string_ref` points to. */
-struct string_off {
-    uint32_t offset; /* Offset in pool_buffer::data */
-    uint32_t length; /* The length (excluding '\0') */
-    uint64_t hash; /* The hash */
+/* A string of the overlay copied to the base, see __promote() */
+struct pool_promoted {
+    string_ref from; /* in the overlay */
+    string_ref to; /* in the base, only found there once the overlay drops */
 };
 
-/* We store the information of each string_ref in an array for O(1) access.
- * There's no need to traverse the array. */
+/* The set is split in shards by the top bits of the hash, each one with its
+ * own lock for insertion.  The lock is shared by both layers, so a string
+ * can't be inserted in both at once. */
+struct pool_shard {
+    _Alignas(64) struct pool_set set[POOL_LAYERS];
+    struct pool_promoted *promoted;
+    uint32_t npromoted, promoted_cap;
+    int lock;
+};
+
+/* What a `string_ref` points to, in two arrays indexed by the string_ref.
+ * A string of up to INLINE_MAX bytes is stored in its `str`, followed by
+ * '\0'.  A longer one is in pool_buffer, `str` is its offset.  A string of
+ * LONG_LEN bytes or more has its length in the 4 bytes before it.
+ * Like the buffer, both are reserved once and never move.
+ */
 struct pool_array {
-    struct string_off *data;
+    uint32_t *str;
+    uint8_t *len;
     uint32_t count;
     uint32_t capacity;
 };
 
+/* The strings of string_pool_seed.def, generated by string_pool_gen.c */
+#include "build/string_pool_seed.h"
+
+_Static_assert(SEED_COUNT == SR_SEED_COUNT, "string_pool_seed.h is stale");
+_Static_assert(INLINE_MAX == SEED_INLINE_MAX, "string_pool_seed.h is stale");
+
 /* A giant mmap()-ed dynamic buffer to store the strings, contiguously.
  * Each string is guaranteed to be '\0'-terminated.
+ * It's reserved once and backed lazily, so it never moves: a pointer from
+ * string_ref_ptr() stays valid, even on another thread.
  */
 struct pool_buffer {
     char *data;
@@ -94,67 +168,131 @@ struct pool_buffer {
     uint32_t capacity;
 };
 
-static struct pool_table g_pool;
-static struct pool_array g_array;
-static struct pool_buffer g_buffer;
+/* string_ref_ptr() and string_ref_len() are plain reads: a string_ref is
+ * published by the release store of its slot (or by whatever hands it to
+ * another thread), after its pool_array entry and bytes are written.
+ * string_pool_setup(), string_pool_cleanup() and the overlay functions are
+ * not thread-safe. */
+static struct pool_shard g_pool[POOL_SHARDS];
+static struct pool_array g_array[POOL_LAYERS];
+static struct pool_buffer g_buffer[POOL_LAYERS];
+static int g_overlay; /* open */
+static uint32_t g_drops;
+static size_t g_overlay_peak;
 
-static void __buffer_setup(void)
+static void *__reserve(size_t size)
 {
-    g_buffer.data = mmap(NULL,
-                    DEFAULT_BUFFER_SIZE,
-                    PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANON,
-                    -1, 0);
-    err_if(g_buffer.data == MAP_FAILED, "unable to allocate string pool: %s",
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    err_if(p == MAP_FAILED, "unable to allocate string pool: %s",
            strerror(errno));
-    g_buffer.count = 1; // 0 is reserved for empty string
-    g_buffer.capacity = DEFAULT_BUFFER_SIZE;
+    return p;
+}
+
+/* The seeded strings are copied as they are, they're found by
+ * __seed_lookup() and never stored in the shards. */
+static void __buffer_setup(void)
+{
+    unsigned int l;
+
+    for (l = 0; l < POOL_LAYERS; l++) {
+        g_buffer[l].data = __reserve(DEFAULT_BUFFER_SIZE);
+        g_buffer[l].capacity = DEFAULT_BUFFER_SIZE;
+        g_array[l].str = __reserve(DEFAULT_ARRAY_CAPA * sizeof(uint32_t));
+        g_array[l].len = __reserve(DEFAULT_ARRAY_CAPA * sizeof(uint8_t));
+        g_array[l].capacity = DEFAULT_ARRAY_CAPA;
+    }
+
+    memcpy(g_buffer[POOL_BASE].data, g_seed_buffer, sizeof(g_seed_buffer));
+    g_buffer[POOL_BASE].count = sizeof(g_seed_buffer);
+    memcpy(g_array[POOL_BASE].str, g_seed_str, sizeof(g_seed_str));
+    memcpy(g_array[POOL_BASE].len, g_seed_len, sizeof(g_seed_len));
+    g_array[POOL_BASE].count = SEED_COUNT;
 }
 
 static void __buffer_cleanup(void)
 {
-    if (g_buffer.data != NULL)
-        munmap(g_buffer.data, g_buffer.capacity);
+    unsigned int l;
+
+    for (l = 0; l < POOL_LAYERS; l++) {
+        if (g_buffer[l].data != NULL)
+            munmap(g_buffer[l].data, g_buffer[l].capacity);
+        if (g_array[l].str != NULL)
+            munmap(g_array[l].str, g_array[l].capacity * sizeof(uint32_t));
+        if (g_array[l].len != NULL)
+            munmap(g_array[l].len, g_array[l].capacity * sizeof(uint8_t));
+    }
 }
 
-static string_ref __buffer_new(const char *str, unsigned int __size)
+static inline unsigned int __layer(string_ref r)
 {
-    char *buffer;
-    string_ref id = 0;
-    unsigned int prev_size, size, capacity;
+    return r >> 31;
+}
 
-    buffer = g_buffer.data;
-    prev_size = g_buffer.count;
-    capacity = g_buffer.capacity;
-    size = prev_size + __size + 1;
+static inline uint32_t __index(string_ref r)
+{
+    return r & ~STRING_REF_OVERLAY;
+}
 
-    if (size >= capacity) {
-        capacity *= 2;
-        buffer = mremap(g_buffer.data, g_buffer.capacity, capacity, MREMAP_MAYMOVE);
-        err_if(g_buffer.data == MAP_FAILED, "unable to allocate string pool: %s",
-               strerror(errno));
-        g_buffer.data = buffer;
-        g_buffer.capacity = capacity;
-    }
+static inline const char *__ptr(string_ref r)
+{
+    const struct pool_array *a = &g_array[__layer(r)];
+    uint32_t i = __index(r);
 
-    memcpy(buffer + prev_size, str, __size);
-    g_buffer.count = size;
+    if (a->len[i] <= INLINE_MAX)
+        return (const char *)&a->str[i];
+    return g_buffer[__layer(r)].data + a->str[i];
+}
 
-    if (g_array.count >= g_array.capacity) {
-        capacity = g_array.capacity * 2;
-        g_array.data = realloc(g_array.data, capacity * sizeof(struct string_off));
-        err_if(g_array.data == NULL, "unable to allocate string pool: %s",
-               strerror(errno));
-        memset(&g_array.data[g_array.count],
-                0,
-               (capacity - g_array.capacity) * sizeof(unsigned int));
-        g_array.capacity = capacity;
+static inline uint32_t __len(string_ref r)
+{
+    const struct pool_array *a = &g_array[__layer(r)];
+    uint32_t i = __index(r), len = a->len[i];
+
+    if (unlikely(len == LONG_LEN))
+        memcpy(&len, g_buffer[__layer(r)].data + a->str[i] - sizeof(len),
+               sizeof(len));
+    return len;
+}
+
+static inline int __valid(string_ref r)
+{
+    return __index(r) < g_array[__layer(r)].capacity;
+}
+
+/* Called with the lock of the shard held, only the bump of both counters
+ * is shared with the other shards. */
+static string_ref __buffer_new(unsigned int layer, const char *str,
+                               unsigned int __size)
+{
+    string_ref id;
+    uint32_t offset, size = __size + 1, prefix = 0;
+    struct pool_array *a = &g_array[layer];
+    struct pool_buffer *b = &g_buffer[layer];
+
+    id = __atomic_fetch_add(&a->count, 1, __ATOMIC_RELAXED);
+    err_if(id >= a->capacity, "string pool is full (%u strings)",
+           a->capacity);
+
+    if (__size <= INLINE_MAX) {
+        a->str[id] = 0;
+        memcpy(&a->str[id], str, __size);
+        a->len[id] = (uint8_t)__size;
+        return layer == POOL_OVERLAY ? id | STRING_REF_OVERLAY : id;
     }
 
-    id = g_array.count++;
-    g_array.data[id].offset = prev_size;
-    g_array.data[id].length = __size;
-    return id;
+    if (__size >= LONG_LEN)
+        prefix = sizeof(uint32_t);
+    offset = __atomic_fetch_add(&b->count, size + prefix, __ATOMIC_RELAXED);
+    err_if((uint64_t)offset + size + prefix >= b->capacity,
+           "string pool is full (%u bytes)", b->capacity);
+    if (prefix != 0)
+        memcpy(b->data + offset, &__size, prefix);
+    memcpy(b->data + offset + prefix, str, __size);
+
+    a->str[id] = offset + prefix;
+    a->len[id] = (uint8_t)(__size < LONG_LEN ? __size : LONG_LEN);
+    return layer == POOL_OVERLAY ? id | STRING_REF_OVERLAY : id;
 }
 
 static uint64_t __do_hash(const char *data, unsigned int len)
@@ -162,16 +300,41 @@ static uint64_t __do_hash(const char *data, unsigned int len)
     return XXH3_64bits(data, len);
 }
 
-static string_ref __lookup(const char *s0, uint64_t hash, unsigned int len)
+static struct pool_shard *__shard(uint64_t hash)
+{
+    return &g_pool[hash >> (64 - POOL_SHARD_BITS)];
+}
+
+/* The tag of a slot, from bits independent of the shard and of the index in
+ * any table smaller than 4G slots */
+static uint8_t __tag(uint64_t hash)
+{
+    return (uint8_t)(hash >> 32);
+}
+
+/* The perfect hash of the seeded strings, one probe */
+static string_ref __seed_lookup(const char *s0, uint64_t hash,
+                                unsigned int len)
 {
-    const char *ptr;
-    string_ref s, *strings = g_pool.data;
-    unsigned int idx, mask = g_pool.capacity - 1;
+    string_ref s = g_seed_table[(hash >> SEED_SHIFT) & SEED_MASK];
+
+    if (s != 0 && g_seed_len[s] == len && !memcmp(__ptr(s), s0, len))
+        return s;
+    return 0;
+}
+
+/* Probe without the lock, a miss may be stale */
+static string_ref __lookup(struct pool_table *t, const char *s0,
+                           uint64_t hash, unsigned int len)
+{
+    uint8_t tag = __tag(hash);
+    string_ref s;
+    unsigned int idx, mask = t->mask;
 
     idx = hash & mask;
-    while ((s = strings[idx]) != 0) {
-        ptr = g_buffer.data + g_array.data[s].offset;
-        if (g_array.data[s].length == len && !memcmp(ptr, s0, len))
+    while ((s = __atomic_load_n(&t->data[idx], __ATOMIC_ACQUIRE)) != 0) {
+        if (t->tag[idx] == tag && __len(s) == len &&
+            !memcmp(__ptr(s), s0, len))
             return s;
         idx = (idx + 1) & mask;
     }
@@ -179,103 +342,632 @@ static string_ref __lookup(const char *s0, uint64_t hash, unsigned int len)
     return 0;
 }
 
-static void __try_resize(void)
+static struct pool_table *__table_new(unsigned int capacity)
+{
+    struct pool_table *t;
+
+    t = calloc(1, sizeof(*t));
+    err_if(t == NULL, "unable to allocate string pool: %s", strerror(errno));
+    t->data = __reserve(capacity * POOL_SLOT);
+    t->tag = (uint8_t *)(t->data + capacity);
+    t->mask = capacity - 1;
+    return t;
+}
+
+static void __table_free(struct pool_table *t)
+{
+    munmap(t->data, (t->mask + 1) * POOL_SLOT);
+    free(t);
+}
+
+static void __lock(struct pool_shard *sh)
+{
+    unsigned int spin = 0;
+
+    while (__atomic_exchange_n(&sh->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(&sh->lock, __ATOMIC_RELAXED) != 0) {
+            if (++spin >= POOL_SPIN) { /* the owner may be preempted */
+                sched_yield();
+                spin = 0;
+            }
+        }
+    }
+}
+
+static void __unlock(struct pool_shard *sh)
 {
-    string_ref *new_pool, *old_pool;
-    unsigned int new_capacity, old_capacity, i, idx, mask;
+    __atomic_store_n(&sh->lock, 0, __ATOMIC_RELEASE);
+}
 
-    if (likely(g_pool.count < g_pool.load_factor))
+/* The slots only keep part of the hash, the index in the new table comes
+ * from hashing the string again */
+static void __try_resize(struct pool_set *set)
+{
+    struct pool_table *new_pool, *old_pool;
+    unsigned int new_capacity, i, idx, mask;
+
+    if (likely(set->count < set->load_factor))
         return;
 
-    new_capacity = g_pool.capacity * 2;
+    old_pool = set->table;
+    new_capacity = (old_pool->mask + 1) * 2;
     mask = new_capacity - 1;
-    new_pool = calloc(new_capacity, sizeof(string_ref));
-    err_if(new_pool == NULL, "unable to allocate string pool: %s",
-           strerror(errno));
+    new_pool = __table_new(new_capacity);
 
-    old_pool = g_pool.data;
-    old_capacity = g_pool.capacity;
-
-    for (i = 0; i < old_capacity; i++) {
-        string_ref s = old_pool[i];
+    for (i = 0; i <= old_pool->mask; i++) {
+        string_ref s = old_pool->data[i];
         if (s != 0) {
-            idx = g_array.data[s].hash & mask;
-            while (new_pool[idx] != 0)
+            idx = __do_hash(__ptr(s), __len(s)) & mask;
+            while (new_pool->data[idx] != 0)
                 idx = (idx + 1) & mask;
-            new_pool[idx] = s;
+            new_pool->data[idx] = s;
+            new_pool->tag[idx] = old_pool->tag[i];
         }
     }
 
-    free(old_pool);
-    g_pool.data = new_pool;
-    g_pool.capacity = new_capacity;
-    g_pool.load_factor = (unsigned int)((double)new_capacity * 0.80);
+    new_pool->prev = old_pool;
+    __atomic_store_n(&set->table, new_pool, __ATOMIC_RELEASE);
+    madvise(old_pool->data, (old_pool->mask + 1) * POOL_SLOT, MADV_DONTNEED);
+    set->load_factor = (unsigned int)((double)new_capacity * 0.80);
+}
+
+/* Called with the lock of the shard held */
+static void __insert(struct pool_set *set, string_ref str, uint64_t hash)
+{
+    uint32_t idx, mask;
+    struct pool_table *t;
+
+    __try_resize(set);
+    t = set->table;
+    mask = t->mask;
+    idx = hash & mask;
+    while (t->data[idx] != 0)
+        idx = (idx + 1) & mask;
+    t->tag[idx] = __tag(hash);
+    __atomic_store_n(&t->data[idx], str, __ATOMIC_RELEASE);
+    set->count++;
+}
+
+static void __set_setup(struct pool_set *set, struct pool_table *t)
+{
+    set->table = t;
+    set->count = 0;
+    set->load_factor = (unsigned int)((double)(t->mask + 1) * 0.80);
 }
 
 void string_pool_setup(void)
 {
-    __buffer_setup();
+    unsigned int i, l;
 
-    g_pool.data = calloc(DEFAULT_POOL_CAPA, sizeof(string_ref));
-    err_if(g_pool.data == NULL, "unable to allocate string pool: %s",
-           strerror(errno));
-    g_pool.capacity = DEFAULT_POOL_CAPA;
-    g_pool.load_factor = (unsigned int)((double)(DEFAULT_POOL_CAPA * 0.80));
+    if (g_array[POOL_BASE].str != NULL) /* e.g. done by string_pool_load() */
+        return;
 
-    g_array.data = calloc(DEFAULT_ARRAY_CAPA, sizeof(struct string_off));
-    err_if(g_array.data == NULL, "unable to allocate string pool: %s",
-           strerror(errno));
-    g_array.count = 1; // 0 is reserved for empty string
-    g_array.capacity = DEFAULT_ARRAY_CAPA;
+    __buffer_setup();
+
+    for (i = 0; i < POOL_SHARDS; i++) {
+        for (l = 0; l < POOL_LAYERS; l++)
+            __set_setup(&g_pool[i].set[l], __table_new(DEFAULT_POOL_CAPA));
+        g_pool[i].lock = 0;
+    }
 }
 
 void string_pool_cleanup(void)
 {
-    __buffer_cleanup();
+    unsigned int i, l;
+    struct pool_table *t, *prev;
 
-    free(g_pool.data);
-    memset(&g_pool, 0, sizeof(g_pool));
+    __buffer_cleanup();
+    memset(g_buffer, 0, sizeof(g_buffer));
+    memset(g_array, 0, sizeof(g_array));
 
-    free(g_array.data);
-    memset(&g_array, 0, sizeof(g_array));
+    for (i = 0; i < POOL_SHARDS; i++) {
+        for (l = 0; l < POOL_LAYERS; l++) {
+            for (t = g_pool[i].set[l].table; t != NULL; t = prev) {
+                prev = t->prev;
+                __table_free(t);
+            }
+        }
+        free(g_pool[i].promoted);
+    }
+    memset(g_pool, 0, sizeof(g_pool));
+    g_overlay = 0;
+    g_drops = 0;
+    g_overlay_peak = 0;
 }
 
 uint32_t string_pool_count(void)
 {
-    return g_pool.count;
+    return __atomic_load_n(&g_array[POOL_BASE].count, __ATOMIC_RELAXED) - 1 +
+           __atomic_load_n(&g_array[POOL_OVERLAY].count, __ATOMIC_RELAXED);
 }
 
-string_ref string_ref_newlen(const char *s, unsigned int len)
+/* From now on, the strings that aren't in the base go to the overlay.
+ * Nothing happens if it's already open. */
+void string_pool_overlay_begin(void)
+{
+    if (unlikely(g_array[POOL_BASE].str == NULL))
+        string_pool_setup();
+    g_overlay = 1;
+}
+
+static size_t __round_page(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Bytes used by `layer`: its array entries, its strings and the tables of
+ * the shards that aren't empty */
+static size_t __layer_bytes(unsigned int layer)
+{
+    unsigned int i;
+    size_t size;
+    const struct pool_set *set;
+
+    size = (size_t)g_array[layer].count * (sizeof(uint32_t) + sizeof(uint8_t)) +
+           g_buffer[layer].count;
+    for (i = 0; i < POOL_SHARDS; i++) {
+        set = &g_pool[i].set[layer];
+        if (set->count != 0)
+            size += (set->table->mask + 1) * POOL_SLOT;
+    }
+    return size;
+}
+
+/* Forget every string of the overlay, their string_ref become dangling.
+ * Only the pages it touched are given back, its strings aren't visited.
+ * The tables keep their size, the next overlay likely needs as much.
+ * Nothing may use a string_ref of the overlay meanwhile, but the other
+ * threads may still intern with string_ref_newlen_base(), as prefetch.c's
+ * workers do: a table it retired stays until string_pool_cleanup(). */
+void string_pool_overlay_drop(void)
+{
+    unsigned int i, j;
+    size_t size;
+    string_ref to;
+    struct pool_shard *sh;
+    struct pool_set *set;
+    struct pool_array *a = &g_array[POOL_OVERLAY];
+    struct pool_buffer *b = &g_buffer[POOL_OVERLAY];
+
+    if (a->str == NULL)
+        return;
+
+    size = __layer_bytes(POOL_OVERLAY);
+    if (size > g_overlay_peak)
+        g_overlay_peak = size;
+
+    for (i = 0; i < POOL_SHARDS; i++) {
+        sh = &g_pool[i];
+        __lock(sh);
+        for (j = 0; j < sh->npromoted; j++) { /* now they're the ones found */
+            to = sh->promoted[j].to;
+            __insert(&sh->set[POOL_BASE], to, __do_hash(__ptr(to), __len(to)));
+        }
+        sh->npromoted = 0;
+
+        set = &sh->set[POOL_OVERLAY];
+        if (set->count != 0)
+            madvise(set->table->data, (set->table->mask + 1) * POOL_SLOT,
+                    MADV_DONTNEED);
+        set->count = 0;
+        __unlock(sh);
+    }
+
+    madvise(a->str, __round_page(a->count * sizeof(uint32_t)), MADV_DONTNEED);
+    madvise(a->len, __round_page(a->count * sizeof(uint8_t)), MADV_DONTNEED);
+    madvise(b->data, __round_page(b->count), MADV_DONTNEED);
+    a->count = 0;
+    b->count = 0;
+
+    g_overlay = 0;
+    g_drops++;
+}
+
+void string_pool_stat(string_pool_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (g_array[POOL_BASE].str == NULL)
+        return;
+
+    st->base_count = g_array[POOL_BASE].count - 1;
+    st->overlay_count = g_array[POOL_OVERLAY].count;
+    st->base_bytes = __layer_bytes(POOL_BASE);
+    st->overlay_bytes = __layer_bytes(POOL_OVERLAY);
+    st->overlay_peak = g_overlay_peak;
+    st->drops = g_drops;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#define POOL_FILE_MAGIC     "cppspool"
+#define POOL_FILE_VERSION   3u
+#define POOL_ALIGN(x, a)    (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+/* The header of a file from string_pool_save(), followed by the sections it
+ * points to, each one at a page-aligned offset so it can be mmap()-ed as it
+ * is.  Everything is an index or an offset, nothing depends on where the
+ * pool lives, and the string_ref values are the same once loaded. */
+struct pool_file {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t seed_hash; /* the seeds must be the ones of this build */
+    uint64_t size; /* of the whole file */
+    uint64_t checksum; /* see __checksum() */
+    uint32_t array_count;
+    uint32_t buffer_count;
+    uint64_t str_off;
+    uint64_t len_off;
+    uint64_t buffer_off;
+    struct {
+        uint64_t off;
+        uint32_t capacity;
+        uint32_t count;
+    } shard[POOL_SHARDS];
+};
+
+static uint64_t __seed_hash(void)
+{
+    uint64_t h = XXH3_64bits(g_seed_buffer, sizeof(g_seed_buffer));
+    h = XXH3_64bits_withSeed(g_seed_str, sizeof(g_seed_str), h);
+    h = XXH3_64bits_withSeed(g_seed_len, sizeof(g_seed_len), h);
+    return h ^ (POOL_SHARDS << 8 | INLINE_MAX);
+}
+
+/* XXH3 of the header (without its checksum) and of what it points to, read
+ * from the base layer */
+static uint64_t __checksum(const struct pool_file *hdr)
+{
+    unsigned int i;
+    struct pool_file h = *hdr;
+    XXH3_state_t st;
+    const struct pool_table *t;
+
+    h.checksum = 0;
+    XXH3_64bits_reset(&st);
+    XXH3_64bits_update(&st, &h, sizeof(h));
+    XXH3_64bits_update(&st, g_array[POOL_BASE].str,
+                       hdr->array_count * sizeof(uint32_t));
+    XXH3_64bits_update(&st, g_array[POOL_BASE].len, hdr->array_count);
+    XXH3_64bits_update(&st, g_buffer[POOL_BASE].data, hdr->buffer_count);
+    for (i = 0; i < POOL_SHARDS; i++) {
+        t = g_pool[i].set[POOL_BASE].table;
+        XXH3_64bits_update(&st, t->data, (size_t)hdr->shard[i].capacity *
+                                         POOL_SLOT);
+    }
+    return XXH3_64bits_digest(&st);
+}
+
+static int __write_at(int fd, const void *data, size_t size, uint64_t off)
+{
+    ssize_t n;
+    const char *p = data;
+
+    while (size > 0) {
+        n = pwrite(fd, p, size, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n, off += (uint64_t)n, size -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Write the base layer of the pool to `path`, through a temporary file next
+ * to it renamed over it, so a process that has it mapped keeps the old one.
+ * No other thread may intern meanwhile.  Returns 0 on success, -1 and errno otherwise. */
+int string_pool_save(const char *path)
+{
+    int fd, err = 0, saved_errno;
+    unsigned int i;
+    char *tmp;
+    uint64_t off;
+    struct pool_file hdr;
+    struct pool_table *t;
+    struct pool_array *a = &g_array[POOL_BASE];
+    struct pool_buffer *b = &g_buffer[POOL_BASE];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (unlikely(a->str == NULL))
+        string_pool_setup();
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, POOL_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = POOL_FILE_VERSION;
+    hdr.page_size = (uint32_t)page;
+    hdr.seed_hash = __seed_hash();
+    hdr.array_count = a->count;
+    hdr.buffer_count = b->count;
+
+    off = POOL_ALIGN(sizeof(hdr), page);
+    hdr.str_off = off;
+    off += POOL_ALIGN((uint64_t)a->count * sizeof(uint32_t), page);
+    hdr.len_off = off;
+    off += POOL_ALIGN((uint64_t)a->count * sizeof(uint8_t), page);
+    hdr.buffer_off = off;
+    off += POOL_ALIGN(b->count, page);
+    for (i = 0; i < POOL_SHARDS; i++) {
+        t = g_pool[i].set[POOL_BASE].table;
+        hdr.shard[i].off = off;
+        hdr.shard[i].capacity = t->mask + 1;
+        hdr.shard[i].count = g_pool[i].set[POOL_BASE].count;
+        off += POOL_ALIGN((uint64_t)(t->mask + 1) * POOL_SLOT, page);
+    }
+    hdr.size = off;
+    hdr.checksum = __checksum(&hdr);
+
+    tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (tmp == NULL)
+        return -1;
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+
+    err = fchmod(fd, 0644) != 0 ||
+          __write_at(fd, &hdr, sizeof(hdr), 0) ||
+          __write_at(fd, a->str, a->count * sizeof(uint32_t), hdr.str_off) ||
+          __write_at(fd, a->len, a->count * sizeof(uint8_t), hdr.len_off) ||
+          __write_at(fd, b->data, b->count, hdr.buffer_off);
+    for (i = 0; i < POOL_SHARDS && !err; i++) {
+        t = g_pool[i].set[POOL_BASE].table;
+        err = __write_at(fd, t->data, (t->mask + 1) * POOL_SLOT,
+                         hdr.shard[i].off);
+    }
+    if (!err) /* the last section is padded too */
+        err = ftruncate(fd, (off_t)hdr.size) != 0;
+
+    saved_errno = errno;
+    if (close(fd) != 0 && !err)
+        err = 1, saved_errno = errno;
+    if (!err && rename(tmp, path) != 0)
+        err = 1, saved_errno = errno;
+    if (err)
+        unlink(tmp);
+    free(tmp);
+    errno = saved_errno;
+    return err ? -1 : 0;
+}
+
+/* Map `size` bytes of `fd` at `off` over the start of a reserved range.
+ * Private, so it's extended (and written) copy-on-write. */
+static int __map_over(void *at, uint64_t size, int fd, uint64_t off)
+{
+    if (size == 0)
+        return 0;
+    return mmap(at, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, (off_t)off) == MAP_FAILED ? -1 : 0;
+}
+
+static int __file_valid(const struct pool_file *hdr, uint64_t size,
+                        size_t page)
+{
+    unsigned int i;
+    uint64_t cap;
+
+    if (memcmp(hdr->magic, POOL_FILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != POOL_FILE_VERSION || hdr->page_size != page ||
+        hdr->seed_hash != __seed_hash() || hdr->size != size ||
+        hdr->array_count < SEED_COUNT ||
+        hdr->array_count >= DEFAULT_ARRAY_CAPA ||
+        hdr->buffer_count < sizeof(g_seed_buffer) ||
+        hdr->buffer_count >= DEFAULT_BUFFER_SIZE)
+        return 0;
+
+    if (hdr->str_off % page || hdr->len_off % page || hdr->buffer_off % page ||
+        hdr->str_off + (uint64_t)hdr->array_count * sizeof(uint32_t) > size ||
+        hdr->len_off + hdr->array_count > size ||
+        hdr->buffer_off + hdr->buffer_count > size)
+        return 0;
+
+    for (i = 0; i < POOL_SHARDS; i++) {
+        cap = hdr->shard[i].capacity;
+        if (cap < DEFAULT_POOL_CAPA || (cap & (cap - 1)) != 0 ||
+            hdr->shard[i].count >= cap || hdr->shard[i].off % page ||
+            hdr->shard[i].off + cap * POOL_SLOT > size)
+            return 0;
+    }
+    return 1;
+}
+
+/* Replace the pool by the one saved in `path`, with the same string_ref
+ * values, as its base layer.  Nothing is parsed or inserted, the file is
+ * mapped, then checked against the checksum it was saved with.
+ * It must be called before anything is interned, or those string_ref are
+ * lost.
+ * Returns 0 on success, -1 and errno otherwise: the pool is left as it was,
+ * or empty if the file couldn't be mapped. */
+int string_pool_load(const char *path)
+{
+    int fd, saved_errno;
+    unsigned int i, cap;
+    struct stat sb;
+    struct pool_file hdr;
+    struct pool_table *t;
+    struct pool_array *a;
+    struct pool_buffer *b;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &sb) != 0)
+        goto fail;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        !__file_valid(&hdr, (uint64_t)sb.st_size, page)) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    string_pool_cleanup();
+    __buffer_setup();
+    a = &g_array[POOL_BASE];
+    b = &g_buffer[POOL_BASE];
+    if (__map_over(a->str, (uint64_t)hdr.array_count * sizeof(uint32_t),
+                   fd, hdr.str_off) != 0 ||
+        __map_over(a->len, hdr.array_count, fd, hdr.len_off) != 0 ||
+        __map_over(b->data, hdr.buffer_count, fd, hdr.buffer_off) != 0)
+        goto fail_setup;
+    a->count = hdr.array_count;
+    b->count = hdr.buffer_count;
+
+    for (i = 0; i < POOL_SHARDS; i++) {
+        cap = hdr.shard[i].capacity;
+        t = calloc(1, sizeof(*t));
+        err_if(t == NULL, "unable to allocate string pool: %s",
+               strerror(errno));
+        t->data = mmap(NULL, cap * POOL_SLOT, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, (off_t)hdr.shard[i].off);
+        t->mask = cap - 1;
+        g_pool[i].set[POOL_BASE].table = t;
+        if (t->data == MAP_FAILED) {
+            t->data = NULL;
+            goto fail_setup;
+        }
+        t->tag = (uint8_t *)(t->data + cap);
+        __set_setup(&g_pool[i].set[POOL_BASE], t);
+        g_pool[i].set[POOL_BASE].count = hdr.shard[i].count;
+        __set_setup(&g_pool[i].set[POOL_OVERLAY],
+                    __table_new(DEFAULT_POOL_CAPA));
+        g_pool[i].lock = 0;
+    }
+    if (__checksum(&hdr) != hdr.checksum) {
+        errno = EINVAL;
+        goto fail_setup;
+    }
+
+    close(fd);
+    return 0;
+
+fail_setup:
+    saved_errno = errno;
+    for (i = 0; i < POOL_SHARDS; i++) {
+        t = g_pool[i].set[POOL_BASE].table;
+        if (t != NULL && t->data == NULL) {
+            free(t);
+            g_pool[i].set[POOL_BASE].table = NULL;
+        }
+    }
+    string_pool_cleanup();
+    string_pool_setup();
+    errno = saved_errno;
+fail:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+/* Called with the lock of the shard held, `from` is `s` in the overlay.
+ * Its copy in the base isn't in the base's set until the overlay is dropped:
+ * until then, string_ref_newlen() keeps giving `from`, what the translation
+ * unit compared with so far, and only string_ref_newlen_keep() the copy. */
+static string_ref __promote(struct pool_shard *sh, string_ref from,
+                            const char *s, unsigned int len)
+{
+    uint32_t i;
+    struct pool_promoted *p;
+
+    for (i = 0; i < sh->npromoted; i++)
+        if (sh->promoted[i].from == from)
+            return sh->promoted[i].to;
+
+    if (sh->npromoted == sh->promoted_cap) {
+        sh->promoted_cap = sh->promoted_cap != 0 ? 2 * sh->promoted_cap : 8;
+        p = realloc(sh->promoted, sh->promoted_cap * sizeof(*p));
+        err_if(p == NULL, "unable to allocate string pool: %s",
+               strerror(errno));
+        sh->promoted = p;
+    }
+    p = &sh->promoted[sh->npromoted++];
+    p->from = from;
+    p->to = __buffer_new(POOL_BASE, s, len);
+    return p->to;
+}
+
+/* What __intern() does with a string of the overlay, and where it puts a new
+ * one */
+#define INTERN_ANY  0u /* gives it, a new one goes to the open layer */
+#define INTERN_BASE 1u /* rejects it, a new one goes to the base */
+#define INTERN_KEEP 2u /* promotes it, a new one goes to the base */
+
+/* Find `s` in either layer, or insert it, as `mode` says */
+static string_ref __intern(unsigned int mode, const char *s, unsigned int len)
 {
     uint64_t hash;
     string_ref str;
-    uint32_t idx, mask;
+    unsigned int layer;
+    struct pool_shard *sh;
+    struct pool_set *set;
 
-    if (unlikely(g_pool.data == NULL))
+    if (unlikely(g_array[POOL_BASE].str == NULL))
         string_pool_setup();
 
     if (len == 0)
         return 0;
 
     hash = __do_hash(s, len);
-    str = __lookup(s, hash, len);
+    str = __seed_lookup(s, hash, len);
     if (str != 0)
         return str;
 
-    __try_resize();
+    /* without an overlay open, its set is empty */
+    layer = mode == INTERN_ANY && g_overlay ? POOL_OVERLAY : POOL_BASE;
+    sh = __shard(hash);
+    set = sh->set;
+    str = __lookup(__atomic_load_n(&set[POOL_BASE].table, __ATOMIC_ACQUIRE),
+                   s, hash, len);
+    if (likely(str != 0))
+        return str;
+    str = __lookup(__atomic_load_n(&set[POOL_OVERLAY].table, __ATOMIC_ACQUIRE),
+                   s, hash, len);
+    if (str != 0 && mode != INTERN_KEEP)
+        return mode == INTERN_ANY ? str : 0;
 
-    mask = g_pool.capacity - 1;
-    idx = hash & mask;
+    __lock(sh);
+    /* inserted meanwhile? */
+    str = __lookup(set[POOL_BASE].table, s, hash, len);
+    if (str == 0) {
+        str = __lookup(set[POOL_OVERLAY].table, s, hash, len);
+        if (str != 0 && mode == INTERN_BASE)
+            str = 0;
+        else if (str != 0 && mode == INTERN_KEEP)
+            str = __promote(sh, str, s, len);
+        else if (str == 0) {
+            str = __buffer_new(layer, s, len);
+            __insert(&set[layer], str, hash);
+        }
+    }
+    __unlock(sh);
 
-    while (g_pool.data[idx] != 0)
-        idx = (idx + 1) & mask;
+    return str;
+}
 
-    str = __buffer_new(s, len);
-    g_array.data[str].hash = hash;
-    g_pool.data[idx] = str;
-    g_pool.count++;
+string_ref string_ref_newlen(const char *s, unsigned int len)
+{
+    return __intern(INTERN_ANY, s, len);
+}
 
-    return str;
+/* Like string_ref_newlen(), but a new string goes to the base layer even if
+ * an overlay is open.  Returns 0 if it's in the overlay already: there, it's
+ * what the translation unit compares with, and it goes with the overlay. */
+string_ref string_ref_newlen_base(const char *s, unsigned int len)
+{
+    return __intern(INTERN_BASE, s, len);
+}
+
+/* Like string_ref_newlen_base(), for a string_ref that's kept after the
+ * overlay is dropped, so it's never one of the overlay: a string that's
+ * there is promoted, see __promote(). */
+string_ref string_ref_newlen_keep(const char *s, unsigned int len)
+{
+    return __intern(INTERN_KEEP, s, len);
 }
 
 string_ref string_ref_new(const char *s)
@@ -283,6 +975,11 @@ string_ref string_ref_new(const char *s)
     return string_ref_newlen(s, strlen(s));
 }
 
+string_ref string_ref_new_keep(const char *s)
+{
+    return string_ref_newlen_keep(s, strlen(s));
+}
+
 string_ref string_ref_concat(string_ref r0, string_ref r1)
 {
     string_ref str;
@@ -290,14 +987,14 @@ string_ref string_ref_concat(string_ref r0, string_ref r1)
     char buf[8192] = {0}, *ptr;
     unsigned int len, len0, len1;
 
-    err_if(r0 >= g_array.capacity, "dangling string_ref (is 0x%08u)", r0);
-    err_if(r1 >= g_array.capacity, "dangling string_ref (is 0x%08u)", r1);
+    err_if(!__valid(r0), "dangling string_ref (is 0x%08u)", r0);
+    err_if(!__valid(r1), "dangling string_ref (is 0x%08u)", r1);
 
-    len0 = g_array.data[r0].length;
-    ptr0 = g_buffer.data + g_array.data[r0].offset;
+    len0 = __len(r0);
+    ptr0 = __ptr(r0);
 
-    len1 = g_array.data[r1].length;
-    ptr1 = g_buffer.data + g_array.data[r1].offset;
+    len1 = __len(r1);
+    ptr1 = __ptr(r1);
 
     len = len0 + len1;
     if (len + 1 < sizeof(buf)) {
@@ -318,18 +1015,22 @@ string_ref string_ref_concat(string_ref r0, string_ref r1)
 
 const char *string_ref_ptr(string_ref r0)
 {
-    err_if(r0 >= g_array.capacity, "0x%08u is not valid string_ref", r0);
-    return g_buffer.data + g_array.data[r0].offset;
+    err_if(!__valid(r0), "0x%08u is not valid string_ref", r0);
+    return __ptr(r0);
 }
 
 size_t string_ref_len(string_ref r0)
 {
-    err_if(r0 >= g_array.capacity, "0x%08u is not valid string_ref", r0);
-    return g_array.data[r0].length;
+    err_if(!__valid(r0), "0x%08u is not valid string_ref", r0);
+    return __len(r0);
 }
 
+/* A string_ref is unique per string, so its hash is a mix of the string_ref
+ * itself, for hash_table.c and hash_set.c.  Nothing is stored for it. */
 uint64_t string_ref_hash(string_ref r0)
 {
-    err_if(r0 >= g_array.capacity, "0x%08u is not valid string_ref", r0);
-    return g_array.data[r0].hash;
+    uint64_t h = (uint64_t)r0 * 0x9e3779b97f4a7c15ull;
+
+    err_if(!__valid(r0), "0x%08u is not valid string_ref", r0);
+    return h ^ (h >> 29);
 }
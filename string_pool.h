@@ -6,11 +6,44 @@
 
 typedef uint32_t string_ref;
 
+/* Set in the string_ref of a string of the overlay, see string_pool.c */
+#define STRING_REF_OVERLAY 0x80000000u
+
+/* Strings with a fixed string_ref, see string_pool_seed.def */
+enum {
+    SR_NONE,
+#define SEED(x) SR_##x,
+#define SEED_AS(x, s) SR_##x,
+#include "string_pool_seed.def"
+#undef SEED
+#undef SEED_AS
+    SR_SEED_COUNT
+};
+
+/* See string_pool_stat(), bytes are what the strings, their entries and
+ * their tables use */
+typedef struct {
+    uint32_t base_count;
+    uint32_t overlay_count;
+    size_t base_bytes;
+    size_t overlay_bytes;
+    size_t overlay_peak; /* largest overlay when it was dropped */
+    uint32_t drops;
+} string_pool_stats;
+
 void string_pool_setup(void);
 void string_pool_cleanup(void);
 uint32_t string_pool_count(void);
+void string_pool_overlay_begin(void);
+void string_pool_overlay_drop(void);
+void string_pool_stat(string_pool_stats *);
+int string_pool_save(const char *);
+int string_pool_load(const char *);
 string_ref string_ref_new(const char *);
 string_ref string_ref_newlen(const char *, unsigned int);
+string_ref string_ref_newlen_base(const char *, unsigned int);
+string_ref string_ref_newlen_keep(const char *, unsigned int);
+string_ref string_ref_new_keep(const char *);
 string_ref string_ref_concat(string_ref, string_ref);
 const char *string_ref_ptr(string_ref);
 size_t string_ref_len(string_ref);
@@ -0,0 +1,121 @@
+/*
+ *  Build the image of the seeded string pool, see string_pool_seed.def.
+ *
+ *  The output is a header for string_pool.c only: the bytes of the strings
+ *  longer than SEED_INLINE_MAX, the `str` and `len` of each string_ref (see
+ *  `struct pool_array`), and a perfect hash table from the hash of a string
+ *  to its string_ref.  The table is
+ *  indexed by `(hash >> SEED_SHIFT) & SEED_MASK`, the generator tries every
+ *  shift and grows the table until no two strings share a slot.
+ *
+ *      ./string_pool_gen > string_pool_seed.h
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+static const char *g_seed[] = {
+    "", /* 0 is reserved for empty string */
+#define SEED(x) #x,
+#define SEED_AS(x, s) s,
+#include "string_pool_seed.def"
+#undef SEED
+#undef SEED_AS
+};
+
+#define SEED_COUNT (sizeof(g_seed) / sizeof(g_seed[0]))
+#define SEED_INLINE_MAX 3u /* must be INLINE_MAX of string_pool.c */
+
+static uint64_t g_hash[SEED_COUNT];
+
+static int try_shift(unsigned int shift, unsigned int mask, uint16_t *table)
+{
+    unsigned int i, idx;
+
+    memset(table, 0, (mask + 1) * sizeof(*table));
+    for (i = 1; i < SEED_COUNT; i++) {
+        idx = (unsigned int)(g_hash[i] >> shift) & mask;
+        if (table[idx] != 0)
+            return 0;
+        table[idx] = (uint16_t)i;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    uint16_t *table = NULL;
+    unsigned int i, j, offset, shift = 0, capacity;
+
+    for (i = 1; i < SEED_COUNT; i++)
+        g_hash[i] = XXH3_64bits(g_seed[i], strlen(g_seed[i]));
+
+    for (capacity = 2; capacity < SEED_COUNT * 2; capacity *= 2)
+        ;
+    for (; capacity <= 65536; capacity *= 2) {
+        table = realloc(table, capacity * sizeof(*table));
+        if (table == NULL) {
+            perror("string_pool_gen");
+            return 1;
+        }
+        for (shift = 0; shift <= 64 - 16; shift++) {
+            if (try_shift(shift, capacity - 1, table))
+                goto found;
+        }
+    }
+    fputs("string_pool_gen: no perfect hash found\n", stderr);
+    return 1;
+
+found:
+    printf("/* Generated by string_pool_gen.c from string_pool_seed.def */\n\n");
+    printf("#define SEED_COUNT %uu\n", (unsigned int)SEED_COUNT);
+    printf("#define SEED_INLINE_MAX %uu\n", SEED_INLINE_MAX);
+    printf("#define SEED_SHIFT %uu\n", shift);
+    printf("#define SEED_MASK  %uu\n\n", capacity - 1);
+
+    printf("static const char g_seed_buffer[] =\n    \"\\0\"");
+    for (i = 1; i < SEED_COUNT; i++) {
+        if (strlen(g_seed[i]) > SEED_INLINE_MAX)
+            printf("\n    \"%s\\0\"", g_seed[i]);
+    }
+    printf(";\n\n");
+
+    printf("static const uint32_t g_seed_str[SEED_COUNT] = {\n");
+    printf("    0,\n");
+    for (i = 1, offset = 1; i < SEED_COUNT; i++) {
+        unsigned int len = (unsigned int)strlen(g_seed[i]);
+        uint32_t str = 0;
+        if (len <= SEED_INLINE_MAX) {
+            memcpy(&str, g_seed[i], len);
+        } else {
+            str = offset;
+            offset += len + 1;
+        }
+        printf("    0x%08x, /* %s */\n", str, g_seed[i]);
+    }
+    printf("};\n\n");
+
+    printf("static const uint8_t g_seed_len[SEED_COUNT] = {");
+    for (i = 0; i < SEED_COUNT; i += 8) {
+        printf("\n   ");
+        for (j = i; j < i + 8 && j < SEED_COUNT; j++)
+            printf(" %u,", (unsigned int)strlen(g_seed[j]));
+    }
+    printf("\n};\n\n");
+
+    printf("static const uint16_t g_seed_table[SEED_MASK + 1] = {");
+    for (i = 0; i <= capacity - 1; i += 8) {
+        printf("\n   ");
+        for (j = i; j < i + 8 && j < capacity; j++)
+            printf(" %u,", table[j]);
+    }
+    printf("\n};\n");
+
+    free(table);
+    return 0;
+}
@@ -0,0 +1,123 @@
+//! make build/string_pool_seed.h
+//! gcc -O2 -pthread -I. binary.c buffer.c file.c string_pool.c hash_table.c mem.c cpp.c token.c lex.c output.c pipeline.c prefetch.c timer.c jobs.c server.c tests/binary/test_00.c -o test_binary
+//! ./test_binary
+
+#include "cpp.h"
+
+static const char g_header[] =
+    "#define STR(x) #x\n"
+    "#define CAT(a, b) a##b\n"
+    "static const char *h = STR(from the header);\n";
+
+static const char g_main[] =
+    "#include \"test_00.h\"\n"
+    "#define N 42\n"
+    "#define PAIR(x, y) { x, y }\n"
+    "int CAT(foo, bar)[] = PAIR(N, 0x1fUL);\n"
+    "\n"
+    "double d = 1.5e-3;\n"
+    "char c = '\\n', *s = \"a\" \"b\\\n"
+    "c\";\n"
+    "#line 100 \"renamed.c\"\n"
+    "if (d) return sizeof s;\n";
+
+static void write_file(const char *path, const char *s)
+{
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    assert(fputs(s, fp) >= 0);
+    assert(fclose(fp) == 0);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/cpp_binary_XXXXXX", path[PATH_MAX], out[PATH_MAX];
+    uint64_t i = 0;
+    uint32_t len;
+    uchar buf[256];
+    FILE *fp;
+    cpp_file *f;
+    cpp_token tk;
+    cpp_context ctx;
+    cpp_binary_view v;
+    const cpp_bin_token *bt;
+    const cpp_bin_ident *id;
+    const cpp_bin_line *l;
+    const cpp_file *lf;
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/test_00.h", dir);
+    write_file(path, g_header);
+    snprintf(path, sizeof(path), "%s/test_00.c", dir);
+    write_file(path, g_main);
+    snprintf(out, sizeof(out), "%s/test_00.bin", dir);
+
+    // what -B writes
+    cpp_context_setup(&ctx);
+    f = cpp_file_open(path, "test_00.c");
+    assert(f != NULL);
+    fp = fopen(out, "w");
+    assert(fp != NULL);
+    cpp_print_binary(&ctx, f, fp);
+    assert(fclose(fp) == 0);
+
+    // read back, token by token against the preprocessor again
+    assert(cpp_binary_map(out, &v) == 0);
+    cpp_context_reset(&ctx);
+    cpp_start(&ctx, f);
+    do {
+        cpp_next_token(&ctx, &tk);
+        assert(i < v.ntoken);
+        bt = &v.tokens[i];
+        assert(bt->kind == cpp_token_keyword(&tk));
+        assert(bt->flags == (uchar)tk.flags);
+
+        switch (tk.kind) {
+        case TK_identifier:
+            assert(bt->value < v.nident);
+            id = &v.idents[bt->value];
+            assert(id->length == string_ref_len(tk.p.ref));
+            assert(!strcmp(v.names + id->offset, string_ref_ptr(tk.p.ref)));
+            break;
+        case TK_integer_const:
+        case TK_float_const:
+        case TK_char_const:
+        case TK_string:
+        case TK_number:
+            memcpy(&len, v.heap + bt->value, sizeof(len));
+            assert(len == cpp_token_splice(&tk, buf, sizeof(buf)));
+            assert(!memcmp(v.heap + bt->value + sizeof(len), buf, len));
+            assert(v.heap[bt->value + sizeof(len) + len] == '\0');
+            break;
+        }
+
+        l = cpp_binary_line(&v, i);
+        assert(l != NULL && l->token <= i);
+        assert(l->fileno == tk.fileno && l->fileno < v.nfile);
+        assert(l->lineno == cpp_loc_line(tk.loc));
+        lf = cpp_file_no(tk.fileno);
+        assert(!strcmp(v.names + v.files[l->fileno].name,
+                       string_ref_ptr(lf->name)));
+        assert(!strcmp(v.names + v.files[l->fileno].path,
+                       string_ref_ptr(lf->path)));
+        i++;
+    } while (tk.kind != TK_eof);
+    assert(i == v.ntoken);
+
+    // the header comes first, the lines are the physical ones (not #line's)
+    assert(v.nline >= 2 && v.lines[0].fileno != f->no);
+    assert(v.lines[0].lineno == 3);
+    l = cpp_binary_line(&v, v.ntoken - 2); // the one before TK_eof
+    assert(l->fileno == f->no && l->lineno == 10);
+
+    cpp_binary_unmap(&v);
+    cpp_context_cleanup(&ctx);
+
+    unlink(out);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/test_00.h", dir);
+    unlink(path);
+    rmdir(dir);
+    printf("%llu tokens\n", (unsigned long long)i);
+    return 0;
+}
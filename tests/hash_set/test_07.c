@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string_pool.h>
+#include <hash_set.h>
+
+#define NKEY 4
+
+int main(void)
+{
+    hset_t a, b, c;
+    string_ref key[NKEY], r;
+    char buf[16];
+    int i, n = 0;
+
+    string_pool_setup();
+    hset_setup(&a, 16);
+    hset_setup(&b, 16);
+
+    // keys that all start probing at the same slot of `a`
+    for (i = 0; n < NKEY; i++) {
+        snprintf(buf, sizeof(buf), "k%d", i);
+        r = string_ref_new(buf);
+        if (n == 0 || (string_ref_hash(r) & (a.capacity - 1)) ==
+                      (string_ref_hash(key[0]) & (a.capacity - 1)))
+            key[n++] = r;
+    }
+    for (i = 0; i < NKEY; i++)
+        hset_set(&a, key[i]);
+    assert(a.count == NKEY);
+
+    // a tombstone in the middle of the run, the ones after it still found
+    hset_remove(&a, key[1]);
+    assert(a.count == NKEY - 1);
+    assert(hset_find(&a, key[0]));
+    assert(!hset_find(&a, key[1]));
+    assert(hset_find(&a, key[2]));
+    assert(hset_find(&a, key[3]));
+
+    // the set operations walk the slots, the tombstone isn't a member
+    hset_union(&b, &a);
+    assert(b.count == NKEY - 1);
+    assert(!hset_find(&b, key[1]));
+    for (i = 0; i < NKEY; i++)
+        assert(hset_find(&b, key[i]) == (i != 1));
+
+    hset_union_copy(&c, &a, &b);
+    assert(c.count == NKEY - 1);
+    assert(!hset_find(&c, key[1]));
+    hset_cleanup(&c);
+
+    hset_intersection_copy(&c, &a, &b);
+    assert(c.count == NKEY - 1);
+    assert(!hset_find(&c, key[1]));
+    hset_cleanup(&c);
+
+    hset_remove(&b, key[3]);
+    hset_intersection(&a, &b);
+    assert(a.count == NKEY - 2);
+    assert(hset_find(&a, key[0]) && hset_find(&a, key[2]));
+    assert(!hset_find(&a, key[1]) && !hset_find(&a, key[3]));
+
+    // growing leaves the tombstones behind
+    for (i = 0; a.capacity == 16; i++) {
+        snprintf(buf, sizeof(buf), "grow%d", i);
+        hset_set(&a, string_ref_new(buf));
+    }
+    assert(a.count == NKEY - 2 + (unsigned int)i);
+    assert(hset_find(&a, key[0]) && hset_find(&a, key[2]));
+    assert(!hset_find(&a, key[1]) && !hset_find(&a, key[3]));
+
+    // and a removed key can come back
+    hset_set(&a, key[1]);
+    assert(hset_find(&a, key[1]));
+    assert(a.count == NKEY - 1 + (unsigned int)i);
+
+    hset_cleanup(&b);
+    hset_cleanup(&a);
+    string_pool_cleanup();
+}
@@ -4,6 +4,20 @@
 #include <string_pool.h>
 
 #define L(s)  string_ref_newlen(s, sizeof(s) - 1)
+
+static void dump(const ht_t *ht)
+{
+    for (unsigned int i = 0; i < ht->cur.capacity; i++) {
+        if (ht->cur.ctrl[i] == HT_EMPTY)
+            continue;
+        const char *key = string_ref_ptr(ht->cur.keys[i]);
+        const unsigned int val = *(const unsigned int *)ht->cur.vals[i];
+        const uint64_t hash = string_ref_hash(ht->cur.keys[i]);
+        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, h2=0x%02x\n",
+                i, key, val, hash, ht->cur.ctrl[i]);
+    }
+}
+
 int main(void)
 {
     ht_t ht;
@@ -24,17 +38,7 @@ int main(void)
 
     assert(ht.count == 16);
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     for (int i = 0; i < 16; i++) {
         int len = snprintf(buf, sizeof(buf), "key_%02d", i);
@@ -50,17 +54,7 @@ int main(void)
 
     fprintf(stderr, "--------------- after removal key_01 --------------\n");
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     assert(hash_table_lookup(&ht, L("key_00")) != NULL);
     assert(hash_table_lookup(&ht, L("key_01")) == NULL);
@@ -70,34 +64,14 @@ int main(void)
 
     fprintf(stderr, "--------------- after reinsert key_01 --------------\n");
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     assert(hash_table_remove(&ht, L("key_13")) != NULL);
     assert(ht.count == 15);
 
     fprintf(stderr, "--------------- after removal key_13 --------------\n");
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     assert(hash_table_lookup(&ht, L("key_13")) == NULL);
 
@@ -112,34 +86,14 @@ int main(void)
 
     fprintf(stderr, "--------------- after insertion new 4 entries --------------\n");
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     assert(hash_table_remove(&ht, L("key_09")) != NULL);
     assert(ht.count == 18);
 
     fprintf(stderr, "--------------- after removal key_09 --------------\n");
 
-    for (unsigned int i = 0; i < ht.capacity; i++) {
-        ht_entry_t *ent = &ht.entries[i];
-        if (ent->key == 0)
-            continue;
-        const char *key = string_ref_ptr(ent->key);
-        const unsigned int val = *(const unsigned int *)ent->val;
-        const uint64_t hash = ent->hash;
-        const uint16_t psl = ent->psl;
-        fprintf(stderr, "entry %02u: key=%s, val=%u, hash=0x%014lx, psl=%u\n",
-                i, key, val, hash, psl);
-    }
+    dump(&ht);
 
     assert(hash_table_lookup(&ht, L("key_09")) == NULL);
 
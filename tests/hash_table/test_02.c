@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <hash_table.h>
+#include <string_pool.h>
+
+#define N 5000
+
+// random insert/remove/lookup against a plain array, with and without
+// incremental resize; lookups after a removal must still find the entries
+// that probed past it
+static void run(unsigned char incremental)
+{
+    ht_t ht;
+    char buf[16];
+    string_ref keys[N];
+    unsigned int vals[N], *model[N] = {0}, count = 0;
+
+    hash_table_setup(&ht, 16);
+    hash_table_incremental(&ht, incremental);
+
+    for (int i = 0; i < N; i++) {
+        int len = snprintf(buf, sizeof(buf), "key_%d", i);
+        keys[i] = string_ref_newlen(buf, len);
+        vals[i] = (unsigned int)i;
+    }
+
+    srand(1234);
+    for (int step = 0; step < 200000; step++) {
+        int i = rand() % (step < 100000 ? N : N / 4);
+        switch (rand() % 3) {
+        case 0:
+            assert(hash_table_insert(&ht, keys[i], &vals[i]) == model[i]);
+            count += model[i] == NULL;
+            model[i] = &vals[i];
+            break;
+        case 1:
+            assert(hash_table_remove(&ht, keys[i]) == model[i]);
+            count -= model[i] != NULL;
+            model[i] = NULL;
+            break;
+        default:
+            assert(hash_table_lookup(&ht, keys[i]) == model[i]);
+            break;
+        }
+        assert(ht.count == count);
+    }
+
+    for (int i = 0; i < N; i++)
+        assert(hash_table_lookup(&ht, keys[i]) == model[i]);
+
+    hash_table_cleanup(&ht);
+}
+
+int main(void)
+{
+    string_pool_setup();
+    run(0);
+    run(1);
+    string_pool_cleanup();
+}
@@ -0,0 +1,63 @@
+//! gcc -O2 -pthread string_pool.c test_string_pool_6.c -I. -o test6
+//! ./test6 tests/string_pool/data/*.txt
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "string_pool.h"
+
+#define NTHREAD 4
+#define MAX_WORD 400000
+
+static char *words[MAX_WORD];
+static unsigned int lens[MAX_WORD];
+static string_ref refs[NTHREAD][MAX_WORD];
+static int nword;
+
+static void *intern(void *arg)
+{
+    string_ref *out = arg;
+
+    for (int i = 0; i < nword; i++)
+        out[i] = string_ref_newlen(words[i], lens[i]);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    char buffer[256];
+    pthread_t threads[NTHREAD];
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "r");
+        assert(file != NULL);
+        while (nword < MAX_WORD && fgets(buffer, 256, file)) {
+            lens[nword] = (unsigned int)strlen(buffer) - 1;
+            buffer[lens[nword]] = '\0';
+            words[nword++] = strdup(buffer);
+        }
+        fclose(file);
+    }
+
+    string_pool_setup();
+
+    for (int i = 0; i < NTHREAD; i++)
+        pthread_create(&threads[i], NULL, intern, refs[i]);
+    for (int i = 0; i < NTHREAD; i++)
+        pthread_join(threads[i], NULL);
+
+    // every thread got the same string_ref for the same string
+    for (int i = 0; i < nword; i++) {
+        for (int t = 1; t < NTHREAD; t++)
+            assert(refs[t][i] == refs[0][i]);
+        assert(string_ref_len(refs[0][i]) == lens[i]);
+        assert(!memcmp(string_ref_ptr(refs[0][i]), words[i], lens[i]));
+    }
+
+    printf("%u\n", string_pool_count());
+    string_pool_cleanup();
+    return 0;
+}
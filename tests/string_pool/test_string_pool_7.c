@@ -0,0 +1,111 @@
+//! gcc -O2 string_pool.c test_string_pool_7.c -I. -o test7
+//! ./test7 tests/string_pool/data/*.txt
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "string_pool.h"
+
+#define MAX_WORD 400000
+
+static char *words[MAX_WORD];
+static unsigned int lens[MAX_WORD];
+static string_ref refs[MAX_WORD];
+static int nword;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    char buffer[256], path[] = "/tmp/string_pool_XXXXXX";
+    double t0, t1;
+    uint32_t count;
+    string_ref r;
+    int fd;
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "r");
+        assert(file != NULL);
+        while (nword < MAX_WORD && fgets(buffer, 256, file)) {
+            lens[nword] = (unsigned int)strlen(buffer) - 1;
+            buffer[lens[nword]] = '\0';
+            words[nword++] = strdup(buffer);
+        }
+        fclose(file);
+    }
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    string_pool_setup();
+    t0 = now_us();
+    for (int i = 0; i < nword; i++)
+        refs[i] = string_ref_newlen(words[i], lens[i]);
+    t1 = now_us();
+    count = string_pool_count();
+    assert(string_pool_save(path) == 0);
+    string_pool_cleanup();
+    printf("interned %u strings in %.0fus\n", count, t1 - t0);
+
+    t0 = now_us();
+    assert(string_pool_load(path) == 0);
+    t1 = now_us();
+    printf("loaded in %.0fus\n", t1 - t0);
+
+    // same string_ref values, found without inserting anything
+    assert(string_pool_count() == count);
+    for (int i = 0; i < nword; i++) {
+        assert(string_ref_newlen(words[i], lens[i]) == refs[i]);
+        assert(string_ref_len(refs[i]) == lens[i]);
+        assert(!memcmp(string_ref_ptr(refs[i]), words[i], lens[i]));
+    }
+    assert(string_pool_count() == count);
+
+    // and it grows copy-on-write
+    r = string_ref_new("not_in_the_corpus_at_all");
+    assert(r == count + 1);
+    assert(!strcmp(string_ref_ptr(r), "not_in_the_corpus_at_all"));
+    assert(string_ref_new("not_in_the_corpus_at_all") == r);
+
+    // a byte flipped in the payload is caught by the checksum, and the
+    // pool is left empty rather than half loaded
+    assert(string_pool_save(path) == 0);
+    string_pool_cleanup();
+    fd = open(path, O_RDWR);
+    assert(fd != -1);
+    assert(pread(fd, buffer, 1, sysconf(_SC_PAGESIZE) + 5) == 1);
+    buffer[0] ^= 1;
+    assert(pwrite(fd, buffer, 1, sysconf(_SC_PAGESIZE) + 5) == 1);
+    assert(string_pool_load(path) == -1 && errno == EINVAL);
+    assert(string_pool_count() == SR_SEED_COUNT - 1);
+    r = string_ref_new("still_works");
+    assert(!strcmp(string_ref_ptr(r), "still_works"));
+
+    // so is a truncated one
+    assert(ftruncate(fd, lseek(fd, 0, SEEK_END) - 1) == 0);
+    close(fd);
+    assert(string_pool_load(path) == -1 && errno == EINVAL);
+
+    string_pool_cleanup();
+
+    // a pool of another build (or anything else) is rejected
+    fd = open(path, O_WRONLY);
+    assert(fd != -1 && write(fd, "garbage!", 8) == 8);
+    close(fd);
+    assert(string_pool_load(path) == -1 && errno == EINVAL);
+
+    unlink(path);
+    return 0;
+}
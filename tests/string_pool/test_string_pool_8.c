@@ -0,0 +1,111 @@
+//! gcc -O2 string_pool.c test_string_pool_8.c -I. -o test8
+//! ./test8 tests/string_pool/data/*.txt
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "string_pool.h"
+
+#define MAX_WORD 400000
+#define NTU      10000
+#define NHEADER  4000 /* identifiers from the headers, per TU */
+#define NLOCAL   2000 /* unique identifiers per TU */
+
+static char *words[MAX_WORD];
+static unsigned int lens[MAX_WORD];
+static string_ref refs[MAX_WORD];
+static string_ref locals[NLOCAL];
+static int nword;
+
+static size_t rss(void)
+{
+    long size, pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file != NULL) {
+        if (fscanf(file, "%ld %ld", &size, &pages) != 2)
+            pages = 0;
+        fclose(file);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    char buffer[256];
+    string_pool_stats st;
+    size_t rss0 = 0, local_bytes = 0;
+    unsigned int base_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "r");
+        assert(file != NULL);
+        while (nword < MAX_WORD && fgets(buffer, 256, file)) {
+            lens[nword] = (unsigned int)strlen(buffer) - 1;
+            buffer[lens[nword]] = '\0';
+            words[nword++] = strdup(buffer);
+        }
+        fclose(file);
+    }
+
+    if (nword > NHEADER)
+        nword = NHEADER;
+    string_pool_setup();
+
+    for (int tu = 0; tu < NTU; tu++) {
+        string_pool_overlay_begin();
+
+        // the identifiers of the headers, the same in every TU
+        for (int i = 0; i < nword; i++) {
+            string_ref r = string_ref_newlen_base(words[i], lens[i]);
+            assert(!(r & STRING_REF_OVERLAY));
+            assert(tu == 0 || r == refs[i]);
+            refs[i] = r;
+        }
+
+        // the ones of the TU itself, some of them also in the headers
+        for (int i = 0; i < NLOCAL; i++) {
+            int n = snprintf(buffer, sizeof(buffer), "tu%d_local_%d", tu, i);
+            locals[i] = string_ref_newlen(buffer, (unsigned int)n);
+            assert(locals[i] & STRING_REF_OVERLAY);
+            local_bytes += (size_t)n + 1;
+        }
+        for (int i = 0; i < nword; i += 97)
+            assert(string_ref_newlen(words[i], lens[i]) == refs[i]);
+        for (int i = 0; i < NLOCAL; i += 7) {
+            int n = snprintf(buffer, sizeof(buffer), "tu%d_local_%d", tu, i);
+            assert(string_ref_newlen(buffer, (unsigned int)n) == locals[i]);
+            // already in the overlay, the base rejects it
+            assert(string_ref_newlen_base(buffer, (unsigned int)n) == 0);
+            assert(!memcmp(string_ref_ptr(locals[i]), buffer, (size_t)n));
+        }
+
+        string_pool_overlay_drop();
+
+        string_pool_stat(&st);
+        assert(st.overlay_count == 0 && st.overlay_bytes == 0);
+        if (tu == 0) {
+            base_count = st.base_count;
+            rss0 = rss();
+        }
+        assert(st.base_count == base_count);
+
+        if ((tu + 1) % 1000 == 0)
+            printf("%5d TUs: base %u strings %zu bytes, overlay peak %zu "
+                   "bytes, rss %+zd KiB (%zu KiB of locals if kept)\n",
+                   tu + 1, st.base_count, st.base_bytes, st.overlay_peak,
+                   ((ssize_t)rss() - (ssize_t)rss0) / 1024, local_bytes / 1024);
+    }
+
+    // steady state: what a TU leaves behind is given back, kept it would be
+    // hundreds of MiB by now
+    assert(rss() < rss0 + (1u << 20));
+
+    string_pool_cleanup();
+    for (int i = 0; i < MAX_WORD && words[i] != NULL; i++)
+        free(words[i]);
+    return 0;
+}
@@ -0,0 +1,78 @@
+//! gcc -O2 string_pool.c test_string_pool_9.c -I. -o test9
+//! ./test9
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "string_pool.h"
+
+#define NTU 1000
+
+int main(void)
+{
+    char buffer[64];
+    string_pool_stats st;
+    string_ref o, b, k, r;
+
+    string_pool_setup();
+
+    for (int tu = 0; tu < NTU; tu++) {
+        int n = snprintf(buffer, sizeof(buffer), "inc%d", tu);
+
+        string_pool_overlay_begin();
+
+        // first seen by the TU, it goes to the overlay
+        o = string_ref_newlen(buffer, (unsigned int)n);
+        assert(o & STRING_REF_OVERLAY);
+
+        // to outlive the TU it's copied to the base, but the TU itself
+        // keeps seeing the overlay one
+        b = string_ref_newlen_keep(buffer, (unsigned int)n);
+        assert(!(b & STRING_REF_OVERLAY) && b != o);
+        assert(string_ref_newlen_keep(buffer, (unsigned int)n) == b);
+        assert(string_ref_newlen(buffer, (unsigned int)n) == o);
+        assert(string_ref_newlen_base(buffer, (unsigned int)n) == 0);
+
+        // a string of the base, interned while the overlay is open
+        k = string_ref_newlen_base("kept", 4);
+        assert(!(k & STRING_REF_OVERLAY));
+
+        // one that goes with the overlay
+        n = snprintf(buffer, sizeof(buffer), "tmp%d", tu);
+        r = string_ref_newlen(buffer, (unsigned int)n);
+        assert(r & STRING_REF_OVERLAY);
+
+        string_pool_overlay_drop();
+
+        string_pool_stat(&st);
+        assert(st.overlay_count == 0 && st.overlay_bytes == 0);
+
+        string_pool_overlay_begin();
+
+        // the promoted copy is the one found now, from any layer
+        n = snprintf(buffer, sizeof(buffer), "inc%d", tu);
+        assert(string_ref_newlen(buffer, (unsigned int)n) == b);
+        assert(string_ref_newlen_base(buffer, (unsigned int)n) == b);
+        assert(string_ref_newlen_keep(buffer, (unsigned int)n) == b);
+        assert(!strcmp(string_ref_ptr(b), buffer));
+        assert(string_ref_newlen("kept", 4) == k);
+        assert(!strcmp(string_ref_ptr(k), "kept"));
+
+        // the dropped one is interned again, from scratch
+        n = snprintf(buffer, sizeof(buffer), "tmp%d", tu);
+        r = string_ref_newlen(buffer, (unsigned int)n);
+        assert(r & STRING_REF_OVERLAY);
+        assert(!strcmp(string_ref_ptr(r), buffer));
+
+        string_pool_overlay_drop();
+    }
+
+    string_pool_stat(&st);
+    assert(st.overlay_count == 0);
+    printf("%u TUs: base %u strings, %u drops\n", NTU, st.base_count,
+           st.drops);
+
+    string_pool_cleanup();
+    return 0;
+}
@@ -0,0 +1,433 @@
+#include "cpp.h"
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Phase timers, -ftime-report.
+ *
+ * The time of a run is split between phases by switching the current one:
+ * cpp_timer_enter() charges what passed since the last switch to the phase
+ * that was running, makes `phase` current and gives back the previous one
+ * for cpp_timer_leave().  So nested phases only get their own time, e.g.
+ * the lexing of a skipped group is lexing, not #if.  Only the thread that
+ * called cpp_timer_setup() is timed, the pipeline and prefetch threads go
+ * through the same code but count for nothing.
+ *
+ * Ticks come from rdtsc where there is one, it's a few times cheaper than
+ * clock_gettime() and there's a switch per token, they are turned into
+ * nanoseconds against CLOCK_MONOTONIC over the whole run.
+ *
+ * Counters are for the whole run of the process, user space only.
+ *
+ * Time trace, -ftime-trace.
+ *
+ * A Chrome trace-event file (chrome://tracing, ui.perfetto.dev) with a B/E
+ * pair per file on the #include stack, so a slow header shows up with what
+ * it #include-s under it.  Resolving an #include is an X event before the
+ * B of the file, a file skipped thanks to its guard is an X event of its
+ * own.  Events are written as they come, the include graph (who includes
+ * whom, how many times, and per file totals) is added at the end. */
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES,
+       PERF_MAX };
+
+uchar cpp_timer_on;
+static _Thread_local uchar t_timed;
+static uchar g_phase = CPP_PHASE_OTHER;
+static uint64_t g_stamp;
+static uint64_t g_ticks[CPP_PHASE_MAX];
+static uint64_t g_count[CPP_PHASE_MAX];
+static uint64_t g_tick0, g_ns0;
+static const char *g_json; /* NULL if the report goes to stderr */
+static int g_perf_fd[PERF_MAX];
+static int g_perf_err[PERF_MAX];
+
+typedef struct {
+    uint key; /* parent << 16 | child, 0 is a free slot */
+    uint count, guarded;
+} tt_edge;
+
+typedef struct {
+    uint included, guarded;
+    uint64_t ns; /* inclusive */
+    size_t tokens, skipped;
+} tt_file;
+
+uchar cpp_time_trace_on;
+static FILE *g_trace;
+static uint64_t g_trace_t0;
+static uchar g_trace_first;
+static tt_edge *g_edge;
+static uint g_edge_cap, g_edge_count;
+static tt_file g_tt_file[CPP_FILE_MAX_USED];
+
+static const char *const g_phase_name[CPP_PHASE_MAX] = {
+    "lex", "directive", "include", "file", "macro", "cond", "output", "other"
+};
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} g_perf[PERF_MAX] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static inline uint64_t timer_tick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Nanoseconds of CLOCK_MONOTONIC */
+uint64_t cpp_timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void perf_open(void)
+{
+    int i;
+    struct perf_event_attr attr;
+
+    for (i = 0; i < PERF_MAX; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = g_perf[i].config;
+        attr.exclude_kernel = 1; /* allowed with perf_event_paranoid 2 */
+        attr.exclude_hv = 1;
+        g_perf_fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        g_perf_err[i] = g_perf_fd[i] == -1 ? errno : 0;
+    }
+}
+
+/* Enable the timers, the report goes to `json` if it's not NULL */
+void cpp_timer_setup(const char *json)
+{
+    g_json = json;
+    perf_open();
+    t_timed = 1;
+    g_phase = CPP_PHASE_OTHER;
+    g_ns0 = cpp_timer_now();
+    g_tick0 = g_stamp = timer_tick();
+    cpp_timer_on = 1;
+}
+
+uchar cpp_timer_enter(uchar phase)
+{
+    uint64_t now;
+    uchar prev = g_phase;
+
+    if (!t_timed)
+        return prev;
+    now = timer_tick();
+    g_ticks[prev] += now - g_stamp;
+    g_count[phase]++;
+    g_stamp = now;
+    g_phase = phase;
+    return prev;
+}
+
+void cpp_timer_leave(uchar phase)
+{
+    uint64_t now;
+
+    if (!t_timed)
+        return;
+    now = timer_tick();
+    g_ticks[g_phase] += now - g_stamp;
+    g_stamp = now;
+    g_phase = phase;
+}
+
+static void report_text(double scale, uint64_t total, uint64_t *value)
+{
+    int i;
+
+    fputs("Time report:\n", stderr);
+    fprintf(stderr, "  %-14s %10s %7s %12s\n", "phase", "ms", "%", "entries");
+    for (i = 0; i < CPP_PHASE_MAX; i++)
+        fprintf(stderr, "  %-14s %10.3f %6.1f%% %12lu\n", g_phase_name[i],
+                (double)g_ticks[i] * scale / 1e6,
+                total ? 100.0 * (double)g_ticks[i] / (double)total : 0.0,
+                (ulong)g_count[i]);
+    fprintf(stderr, "  %-14s %10.3f\n", "total", (double)total * scale / 1e6);
+
+    fputs("Counters:\n", stderr);
+    for (i = 0; i < PERF_MAX; i++) {
+        if (g_perf_fd[i] == -1)
+            fprintf(stderr, "  %-14s %10s (%s)\n", g_perf[i].name, "n/a",
+                    strerror(g_perf_err[i]));
+        else
+            fprintf(stderr, "  %-14s %10lu\n", g_perf[i].name,
+                    (ulong)value[i]);
+    }
+    if (g_perf_fd[PERF_CYCLES] != -1 && g_perf_fd[PERF_INSTRUCTIONS] != -1 &&
+        value[PERF_CYCLES] != 0)
+        fprintf(stderr, "  %-14s %10.2f\n", "ipc",
+                (double)value[PERF_INSTRUCTIONS] / (double)value[PERF_CYCLES]);
+}
+
+static void report_json(FILE *fp, double scale, uint64_t total,
+                        uint64_t *value)
+{
+    int i;
+
+    fputs("{\n  \"phases\": {\n", fp);
+    for (i = 0; i < CPP_PHASE_MAX; i++)
+        fprintf(fp, "    \"%s\": {\"ms\": %.3f, \"entries\": %lu}%s\n",
+                g_phase_name[i], (double)g_ticks[i] * scale / 1e6,
+                (ulong)g_count[i], i + 1 < CPP_PHASE_MAX ? "," : "");
+    fprintf(fp, "  },\n  \"total_ms\": %.3f,\n  \"counters\": {\n",
+            (double)total * scale / 1e6);
+    for (i = 0; i < PERF_MAX; i++) {
+        if (g_perf_fd[i] == -1)
+            fprintf(fp, "    \"%s\": null", g_perf[i].name);
+        else
+            fprintf(fp, "    \"%s\": %lu", g_perf[i].name, (ulong)value[i]);
+        fputs(i + 1 < PERF_MAX ? ",\n" : "\n", fp);
+    }
+    fputs("  }\n}\n", fp);
+}
+
+/* Print the report and disable the timers */
+void cpp_timer_report(void)
+{
+    int i;
+    FILE *fp;
+    double scale;
+    uint64_t now, ns, total = 0, value[PERF_MAX] = {0};
+
+    if (!cpp_timer_on)
+        return;
+
+    for (i = 0; i < PERF_MAX; i++) {
+        if (g_perf_fd[i] != -1 &&
+            read(g_perf_fd[i], &value[i], sizeof(value[i])) !=
+            sizeof(value[i])) {
+            g_perf_err[i] = errno;
+            close(g_perf_fd[i]);
+            g_perf_fd[i] = -1;
+        }
+    }
+
+    now = timer_tick();
+    ns = cpp_timer_now() - g_ns0;
+    g_ticks[g_phase] += now - g_stamp;
+    for (i = 0; i < CPP_PHASE_MAX; i++)
+        total += g_ticks[i];
+    scale = now > g_tick0 ? (double)ns / (double)(now - g_tick0) : 0;
+
+    if (g_json == NULL) {
+        report_text(scale, total, value);
+    } else if ((fp = fopen(g_json, "w")) != NULL) {
+        report_json(fp, scale, total, value);
+        fclose(fp);
+    } else {
+        fprintf(stderr, "warning: unable to open '%s': %s\n", g_json,
+                strerror(errno));
+    }
+
+    for (i = 0; i < PERF_MAX; i++) {
+        if (g_perf_fd[i] != -1)
+            close(g_perf_fd[i]);
+    }
+    cpp_timer_on = 0;
+    t_timed = 0;
+}
+
+/* ---- time trace --------------------------------------------------------- */
+
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((uchar)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Start an event, the caller writes its args and closes it */
+static void trace_event(const char *ph, const char *name, const char *suffix,
+                        uint64_t ts)
+{
+    fputs(g_trace_first ? "\n" : ",\n", g_trace);
+    g_trace_first = 0;
+    fprintf(g_trace, "{\"ph\": \"%s\", \"pid\": 1, \"tid\": 1, "
+            "\"ts\": %.3f, \"cat\": \"include\", \"name\": ", ph,
+            (double)(ts - g_trace_t0) / 1e3);
+    if (suffix != NULL) {
+        char buf[PATH_MAX + 32];
+        snprintf(buf, sizeof(buf), "%s%s", name, suffix);
+        json_string(g_trace, buf);
+    } else {
+        json_string(g_trace, name);
+    }
+}
+
+static tt_edge *edge_slot(uint key)
+{
+    uint i;
+
+    for (i = key * 2654435761u & (g_edge_cap - 1); g_edge[i].key != 0;
+         i = (i + 1) & (g_edge_cap - 1)) {
+        if (g_edge[i].key == key)
+            break;
+    }
+    return &g_edge[i];
+}
+
+static tt_edge *trace_edge(const cpp_file *parent, const cpp_file *file)
+{
+    uint i, old_cap = g_edge_cap;
+    uint key = (uint)(parent->no + 1) << 16 | file->no;
+    tt_edge *e, *old = g_edge;
+
+    if (2 * (g_edge_count + 1) > g_edge_cap) {
+        g_edge_cap = g_edge_cap ? 2 * g_edge_cap : 256;
+        g_edge = cpp_mem_calloc(CPP_MEM_SCRATCH, g_edge_cap, sizeof(tt_edge));
+        for (i = 0; i < old_cap; i++) {
+            if (old[i].key != 0)
+                *edge_slot(old[i].key) = old[i];
+        }
+        cpp_mem_free(old);
+    }
+
+    e = edge_slot(key);
+    if (e->key == 0) {
+        e->key = key;
+        g_edge_count++;
+    }
+    return e;
+}
+
+/* Enable the time trace into `path`, returns -1 with errno if it can't */
+int cpp_time_trace_setup(const char *path)
+{
+    g_trace = fopen(path, "w");
+    if (g_trace == NULL)
+        return -1;
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", g_trace);
+    g_trace_first = 1;
+    g_trace_t0 = cpp_timer_now();
+    cpp_time_trace_on = 1;
+    return 0;
+}
+
+/* `file` is pushed by `parent` (NULL for the main file) whose #include
+ * started at `since` (0 if unknown), returns the time of the push */
+uint64_t cpp_time_trace_begin(const cpp_file *file, const cpp_file *parent,
+                              uint64_t since)
+{
+    uint64_t now = cpp_timer_now();
+    const char *name = string_ref_ptr(file->name);
+
+    if (since != 0) {
+        trace_event("X", name, " (resolve)", since);
+        fprintf(g_trace, ", \"dur\": %.3f}", (double)(now - since) / 1e3);
+    }
+    trace_event("B", name, NULL, now);
+    fputs(", \"args\": {\"path\": ", g_trace);
+    json_string(g_trace, string_ref_ptr(file->path));
+    fprintf(g_trace, ", \"bytes\": %zu, \"resolve_us\": %.3f}}",
+            file->size, since ? (double)(now - since) / 1e3 : 0.0);
+
+    g_tt_file[file->no].included++;
+    if (parent != NULL)
+        trace_edge(parent, file)->count++;
+    return now;
+}
+
+void cpp_time_trace_end(const cpp_file *file, uint64_t begin, size_t ntoken,
+                        size_t nskipped)
+{
+    uint64_t now = cpp_timer_now();
+    tt_file *f = &g_tt_file[file->no];
+
+    trace_event("E", string_ref_ptr(file->name), NULL, now);
+    fprintf(g_trace, ", \"args\": {\"tokens\": %zu, \"skipped\": %zu}}",
+            ntoken, nskipped);
+    f->ns += now - begin;
+    f->tokens += ntoken;
+    f->skipped += nskipped;
+}
+
+/* `file` isn't pushed again, its guard macro is defined */
+void cpp_time_trace_guard(const cpp_file *file, const cpp_file *parent,
+                          uint64_t since)
+{
+    uint64_t now = cpp_timer_now();
+    tt_edge *e = trace_edge(parent, file);
+
+    trace_event("X", string_ref_ptr(file->name), " (guarded)", since);
+    fprintf(g_trace, ", \"dur\": %.3f, \"args\": {\"guarded\": true}}",
+            (double)(now - since) / 1e3);
+    e->count++;
+    e->guarded++;
+    g_tt_file[file->no].guarded++;
+}
+
+/* Write the include graph and close the trace */
+void cpp_time_trace_finish(void)
+{
+    uint i, n;
+    uchar first = 1;
+    cpp_file *file;
+    tt_file *f;
+
+    if (!cpp_time_trace_on)
+        return;
+
+    fputs("\n],\n\"includeGraph\": {\"files\": [", g_trace);
+    for (n = 0; (file = cpp_file_no((ushort)n)) != NULL; n++) {
+        f = &g_tt_file[n];
+        if (f->included == 0 && f->guarded == 0)
+            continue;
+        fprintf(g_trace, "%s\n  {\"id\": %u, \"name\": ", first ? "" : ",",
+                n);
+        json_string(g_trace, string_ref_ptr(file->name));
+        fputs(", \"path\": ", g_trace);
+        json_string(g_trace, string_ref_ptr(file->path));
+        fprintf(g_trace, ", \"bytes\": %zu, \"included\": %u, "
+                "\"guarded\": %u, \"total_us\": %.3f, \"tokens\": %zu, "
+                "\"skipped\": %zu}", file->size, f->included, f->guarded,
+                (double)f->ns / 1e3, f->tokens, f->skipped);
+        first = 0;
+    }
+    fputs("\n], \"edges\": [", g_trace);
+    first = 1;
+    for (i = 0; i < g_edge_cap; i++) {
+        if (g_edge[i].key == 0)
+            continue;
+        fprintf(g_trace, "%s\n  {\"from\": %u, \"to\": %u, \"count\": %u, "
+                "\"guarded\": %u}", first ? "" : ",",
+                (g_edge[i].key >> 16) - 1, g_edge[i].key & 0xffff,
+                g_edge[i].count, g_edge[i].guarded);
+        first = 0;
+    }
+    fputs("\n]}}\n", g_trace);
+
+    fclose(g_trace);
+    g_trace = NULL;
+    cpp_mem_free(g_edge);
+    g_edge = NULL;
+    g_edge_cap = g_edge_count = 0;
+    cpp_time_trace_on = 0;
+}
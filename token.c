@@ -1,7 +1,10 @@
+#include "cpp.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include "cpp.h"
+
+_Static_assert(SR_if - SR_continue == TK_if - TK_continue,
+               "keywords of string_pool_seed.def and cpp.h differ");
 
 const char *cpp_token_kind(uchar kind)
 {
@@ -18,10 +21,23 @@ const char *cpp_token_kind(uchar kind)
         return "Character constant";
     else if (kind == TK_eof)
         return "End of file";
+    else if (kind >= TK_continue && kind <= TK_if)
+        return "Keyword";
     else
         return "???";
 }
 
+/* The keyword kind of a TK_identifier after preprocessing, or TK_identifier.
+ * Keywords are seeded in the string pool in the order of their kind. */
+uchar cpp_token_keyword(const cpp_token *tk)
+{
+    string_ref r = tk->p.ref;
+
+    if (tk->kind == TK_identifier && r >= SR_continue && r <= SR_if)
+        return (uchar)(TK_continue + (r - SR_continue));
+    return tk->kind;
+}
+
 uint cpp_token_splice(const cpp_token *tk, uchar *buf, uint bufsz)
 {
     const uchar *p;
@@ -113,10 +129,9 @@ void cpp_token_print(FILE *fp, const cpp_token *tk)
     fwrite(p, 1, len, fp);
 }
 
-void cpp_token_array_setup(cpp_token_array *ts, uint max)
+void cpp_token_array_setup(cpp_token_array *ts, size_t max)
 {
-    ts->tokens = malloc(max * sizeof(cpp_token));
-    assert(ts->tokens);
+    ts->tokens = cpp_mem_alloc(CPP_MEM_TOKEN, max * sizeof(cpp_token));
     ts->n = 0;
     ts->max = max;
 }
@@ -124,7 +139,7 @@ void cpp_token_array_setup(cpp_token_array *ts, uint max)
 void cpp_token_array_cleanup(cpp_token_array *ts)
 {
     if (ts != NULL && ts->tokens != NULL) {
-        free(ts->tokens); ts->tokens = NULL;
+        cpp_mem_free(ts->tokens); ts->tokens = NULL;
         ts->n = ts->max = 0;
     }
 }
@@ -136,7 +151,7 @@ void cpp_token_array_clear(cpp_token_array *ts)
 
 void cpp_token_array_move(cpp_token_array *dts, cpp_token_array *sts)
 {
-    uint i;
+    size_t i;
     for (i = 0; i < sts->n; i++)
         cpp_token_array_append(dts, &sts->tokens[i]);
     cpp_token_array_clear(sts);
@@ -148,8 +163,181 @@ void cpp_token_array_append(cpp_token_array *ts, const cpp_token *tk)
         ts->tokens[ts->n++] = *tk;
     } else {
         ts->max *= 2;
-        ts->tokens = realloc(ts->tokens, ts->max * sizeof(cpp_token));
-        assert(ts->tokens);
+        ts->tokens = cpp_mem_realloc(CPP_MEM_TOKEN, ts->tokens,
+                                     ts->max * sizeof(cpp_token));
         ts->tokens[ts->n++] = *tk;
     }
 }
+
+/* The chunk table is all that's copied to grow, a pointer per chunk */
+static void *chunk_add(void ***chunks, size_t *nchunk, size_t *maxchunk,
+                       size_t size, uchar kind)
+{
+    if (*nchunk == *maxchunk) {
+        *maxchunk = *maxchunk != 0 ? *maxchunk * 2 : 16;
+        *chunks = cpp_mem_realloc(kind, *chunks, *maxchunk * sizeof(void *));
+    }
+    return (*chunks)[(*nchunk)++] = cpp_mem_alloc(kind, size);
+}
+
+void cpp_spelling_heap_setup(cpp_spelling_heap *h, uchar kind)
+{
+    memset(h, 0, sizeof(*h));
+    h->kind = kind;
+}
+
+void cpp_spelling_heap_cleanup(cpp_spelling_heap *h)
+{
+    size_t i;
+
+    for (i = 0; i < h->nchunk; i++)
+        cpp_mem_free(h->chunks[i]);
+    cpp_mem_free(h->chunks);
+    cpp_spelling_heap_setup(h, h->kind);
+}
+
+/* `len` bytes at `p`, as they are, "\\\n" included, in `h` */
+const uchar *cpp_spelling_copy(cpp_spelling_heap *h, const uchar *p,
+                               uint len)
+{
+    uchar *dst;
+
+    if (h->nchunk == 0 || h->used + len > CPP_SPELLING_CHUNK) {
+        chunk_add((void ***)&h->chunks, &h->nchunk, &h->maxchunk,
+                  MAX(len, CPP_SPELLING_CHUNK), h->kind);
+        h->used = 0;
+    }
+    dst = h->chunks[h->nchunk - 1] + h->used;
+    h->used += len;
+    return memcpy(dst, p, len);
+}
+
+void cpp_token_store_setup(cpp_token_store *st)
+{
+    memset(st, 0, sizeof(*st));
+    cpp_spelling_heap_setup(&st->heap, CPP_MEM_TOKEN);
+}
+
+void cpp_token_store_cleanup(cpp_token_store *st)
+{
+    size_t i;
+
+    for (i = 0; i < st->nchunk; i++)
+        cpp_mem_free(st->chunks[i]);
+    for (i = 0; i < st->nspellchunk; i++)
+        cpp_mem_free(st->spells[i]);
+    for (i = 0; i < st->nlocchunk; i++)
+        cpp_mem_free(st->locs[i]);
+    cpp_mem_free(st->chunks);
+    cpp_mem_free(st->spells);
+    cpp_mem_free(st->locs);
+    cpp_spelling_heap_cleanup(&st->heap);
+    memset(st, 0, sizeof(*st));
+}
+
+/* Index of `loc` in `locs`, the tokens of an expansion share theirs */
+static uint32_t store_far(cpp_token_store *st, cpp_loc loc)
+{
+    size_t i = st->nloc % CPP_TOKEN_CHUNK;
+
+    if (st->nloc > 0 && st->locs[(st->nloc - 1) / CPP_TOKEN_CHUNK]
+                                [(st->nloc - 1) % CPP_TOKEN_CHUNK] == loc)
+        return (uint32_t)(st->nloc - 1);
+    if (i == 0)
+        chunk_add((void ***)&st->locs, &st->nlocchunk, &st->maxlocchunk,
+                  CPP_TOKEN_CHUNK * sizeof(cpp_loc), CPP_MEM_TOKEN);
+    st->locs[st->nloc / CPP_TOKEN_CHUNK][i] = loc;
+    return (uint32_t)st->nloc++;
+}
+
+/* A location is an offset in the token's file when it's there, which it
+ * isn't for an expansion.  A spelling is an offset in the token's file or
+ * in `buf`, else it's kept aside in `spells`, copied into `heap` if `copy`
+ * is set.  An identifier is its string_ref. */
+void cpp_token_store_append(cpp_token_store *st, const cpp_token *tk)
+{
+    size_t i = st->n % CPP_TOKEN_CHUNK;
+    cpp_loc off;
+    cpp_packed_token *pt;
+    cpp_spelling *sp;
+    const cpp_file *file;
+
+    if (i == 0)
+        chunk_add((void ***)&st->chunks, &st->nchunk, &st->maxchunk,
+                  CPP_TOKEN_CHUNK * sizeof(cpp_packed_token), CPP_MEM_TOKEN);
+    pt = &st->chunks[st->n / CPP_TOKEN_CHUNK][i];
+    st->n++;
+
+    pt->kind = tk->kind;
+    pt->flags = tk->flags;
+    pt->fileno = tk->fileno;
+    off = tk->loc - ((cpp_loc)tk->fileno << CPP_LOC_SHIFT);
+    if (likely(off <= UINT32_MAX)) {
+        pt->loc = (uint32_t)off;
+    } else {
+        pt->flags |= CPP_PACKED_FAR;
+        pt->loc = store_far(st, tk->loc);
+    }
+    pt->spelling = 0;
+    if (tk->kind == TK_identifier) {
+        pt->payload = tk->p.ref;
+        return;
+    }
+
+    pt->payload = tk->length;
+    /* with `copy`, only what's in `buf` lasts */
+    file = likely(!st->copy) ? cpp_file_no(tk->fileno) : NULL;
+    if (likely(file != NULL && file->data != NULL && tk->p.ptr >= file->data &&
+               tk->p.ptr <= file->data + file->visible &&
+               tk->p.ptr - file->data < UINT32_MAX)) {
+        pt->spelling = (uint32_t)(tk->p.ptr - file->data) + 1;
+        return;
+    }
+    if (tk->p.ptr >= st->buf && tk->p.ptr < st->buf + st->bufsize) {
+        pt->flags |= CPP_PACKED_BUF;
+        pt->spelling = (uint32_t)(tk->p.ptr - st->buf);
+        return;
+    }
+
+    i = st->nspell % CPP_TOKEN_CHUNK;
+    if (i == 0)
+        chunk_add((void ***)&st->spells, &st->nspellchunk,
+                  &st->maxspellchunk, CPP_TOKEN_CHUNK * sizeof(cpp_spelling),
+                  CPP_MEM_TOKEN);
+    sp = &st->spells[st->nspell / CPP_TOKEN_CHUNK][i];
+    sp->ptr = st->copy ? cpp_spelling_copy(&st->heap, tk->p.ptr, tk->length)
+                       : tk->p.ptr;
+    sp->length = tk->length;
+    pt->payload = (uint32_t)st->nspell++;
+}
+
+/* The `i`th token, as it was appended */
+void cpp_token_store_get(const cpp_token_store *st, size_t i, cpp_token *tk)
+{
+    const cpp_packed_token *pt;
+    const cpp_spelling *sp;
+
+    pt = &st->chunks[i / CPP_TOKEN_CHUNK][i % CPP_TOKEN_CHUNK];
+    tk->kind = pt->kind;
+    tk->flags = pt->flags & ~(CPP_PACKED_FAR | CPP_PACKED_BUF);
+    tk->fileno = pt->fileno;
+    if (unlikely(HAS_FLAG(pt->flags, CPP_PACKED_FAR)))
+        tk->loc = st->locs[pt->loc / CPP_TOKEN_CHUNK][pt->loc % CPP_TOKEN_CHUNK];
+    else
+        tk->loc = ((cpp_loc)pt->fileno << CPP_LOC_SHIFT) + pt->loc;
+    if (pt->kind == TK_identifier) {
+        tk->p.ref = pt->payload;
+        tk->length = (uint)string_ref_len(pt->payload);
+    } else if (HAS_FLAG(pt->flags, CPP_PACKED_BUF)) {
+        tk->p.ptr = st->buf + pt->spelling;
+        tk->length = pt->payload;
+    } else if (pt->spelling != 0) {
+        tk->p.ptr = cpp_file_no(pt->fileno)->data + pt->spelling - 1;
+        tk->length = pt->payload;
+    } else {
+        sp = &st->spells[pt->payload / CPP_TOKEN_CHUNK]
+                        [pt->payload % CPP_TOKEN_CHUNK];
+        tk->p.ptr = sp->ptr;
+        tk->length = sp->length;
+    }
+}